@@ -9,10 +9,15 @@
 #include <ngx_core.h>
 
 
+ngx_uint_t  ngx_cpu_features;
+
+
 #if (( __i386__ || __amd64__ ) && ( __GNUC__ || __INTEL_COMPILER ))
 
 
 static ngx_inline void ngx_cpuid(uint32_t i, uint32_t *buf);
+static ngx_inline uint32_t ngx_xgetbv(void);
+static void ngx_cpu_simd(uint32_t max, uint32_t *cpu);
 
 
 #if ( __i386__ )
@@ -31,6 +36,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
     "    mov    %%ebx, %%esi;  "
 
+    "    xor    %%ecx, %%ecx;  "
     "    cpuid;                "
     "    mov    %%eax, (%1);   "
     "    mov    %%ebx, 4(%1);  "
@@ -55,7 +61,7 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 
         "cpuid"
 
-    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i) );
+    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (i), "c" (0) );
 
     buf[0] = eax;
     buf[1] = ebx;
@@ -67,6 +73,58 @@ ngx_cpuid(uint32_t i, uint32_t *buf)
 #endif
 
 
+static ngx_inline uint32_t
+ngx_xgetbv(void)
+{
+    uint32_t  eax, edx;
+
+    /* the "xgetbv" instruction */
+
+    __asm__ (
+
+        ".byte 0x0f, 0x01, 0xd0"
+
+    : "=a" (eax), "=d" (edx) : "c" (0) );
+
+    return eax;
+}
+
+
+/* auto detect the SIMD extensions usable by the parsers */
+
+static void
+ngx_cpu_simd(uint32_t max, uint32_t *cpu)
+{
+    uint32_t  ext[4];
+
+    /* CPUID.1:ECX.SSE4_2[bit 20] */
+
+    if (cpu[3] & 0x00100000) {
+        ngx_cpu_features |= NGX_CPU_SSE42;
+    }
+
+    /*
+     * AVX2 also needs the OS to save the YMM registers:
+     * CPUID.1:ECX.OSXSAVE[bit 27], CPUID.1:ECX.AVX[bit 28],
+     * XCR0 bits 1 and 2, CPUID.(EAX=7,ECX=0):EBX.AVX2[bit 5]
+     */
+
+    if (max < 7 || (cpu[3] & 0x18000000) != 0x18000000) {
+        return;
+    }
+
+    if ((ngx_xgetbv() & 0x6) != 0x6) {
+        return;
+    }
+
+    ngx_cpuid(7, ext);
+
+    if (ext[1] & 0x20) {
+        ngx_cpu_features |= NGX_CPU_AVX2;
+    }
+}
+
+
 /* auto detect the L2 cache line size of modern and widespread CPUs */
 
 void
@@ -91,6 +149,8 @@ ngx_cpuinfo(void)
 
     ngx_cpuid(1, cpu);
 
+    ngx_cpu_simd(vbuf[0], cpu);
+
     if (ngx_strcmp(vendor, "GenuineIntel") == 0) {
 
         switch ((cpu[0] & 0xf00) >> 8) {
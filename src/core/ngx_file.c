@@ -14,19 +14,46 @@ ngx_atomic_t         *ngx_temp_number = &temp_number;
 ngx_atomic_int_t      ngx_random_number = 123456;
 
 
+#if (NGX_HAVE_O_TMPFILE)
+static ngx_int_t ngx_create_unnamed_temp_file(ngx_temp_file_t *tf);
+#endif
+
+
 ssize_t
 ngx_write_chain_to_temp_file(ngx_temp_file_t *tf, ngx_chain_t *chain)
 {
     ngx_int_t  rc;
 
     if (tf->file.fd == NGX_INVALID_FILE) {
-        rc = ngx_create_temp_file(&tf->file, tf->path, tf->pool,
-                                  tf->persistent, tf->clean, tf->access);
+
+        rc = NGX_DECLINED;
+
+#if (NGX_HAVE_O_TMPFILE)
+        if (tf->tmpfile_path) {
+            rc = ngx_create_unnamed_temp_file(tf);
+        }
+#endif
+
+        if (rc == NGX_DECLINED) {
+            rc = ngx_create_temp_file(&tf->file, tf->path, tf->pool,
+                                      tf->persistent, tf->clean, tf->access);
+        }
 
         if (rc == NGX_ERROR || rc == NGX_AGAIN) {
             return rc;
         }
 
+#if (NGX_HAVE_FALLOCATE)
+        if (tf->preallocate
+            && ngx_preallocate_file(tf->file.fd, tf->preallocate)
+               == NGX_FILE_ERROR)
+        {
+            ngx_log_debug2(NGX_LOG_DEBUG_CORE, tf->file.log, ngx_errno,
+                           ngx_preallocate_file_n " \"%V\" %O failed",
+                           &tf->file.name, tf->preallocate);
+        }
+#endif
+
         if (tf->log_level) {
             ngx_log_error(tf->log_level, tf->file.log, 0, "%s %V",
                           tf->warn, &tf->file.name);
@@ -115,6 +142,61 @@ ngx_create_temp_file(ngx_file_t *file, ngx_path_t *path, ngx_pool_t *pool,
 }
 
 
+#if (NGX_HAVE_O_TMPFILE)
+
+static ngx_int_t
+ngx_create_unnamed_temp_file(ngx_temp_file_t *tf)
+{
+    ngx_fd_t                  fd;
+    ngx_err_t                 err;
+    ngx_pool_cleanup_t       *cln;
+    ngx_pool_cleanup_file_t  *clnf;
+
+    fd = ngx_open_unnamed_tempfile(tf->tmpfile_path->name.data, tf->access);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, tf->file.log, 0,
+                   "unnamed temp fd:%d in \"%V\"",
+                   fd, &tf->tmpfile_path->name);
+
+    if (fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err == NGX_EISDIR || err == NGX_EOPNOTSUPP || err == NGX_EINVAL) {
+            /* the kernel or the file system do not support O_TMPFILE */
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, tf->file.log, err,
+                      ngx_open_unnamed_tempfile_n " \"%V\" failed",
+                      &tf->tmpfile_path->name);
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(tf->pool, sizeof(ngx_pool_cleanup_file_t));
+    if (cln == NULL) {
+        (void) ngx_close_file(fd);
+        return NGX_ERROR;
+    }
+
+    /* the file has no name, so closing it is enough to delete it */
+
+    cln->handler = ngx_pool_cleanup_file;
+    clnf = cln->data;
+
+    clnf->fd = fd;
+    clnf->name = tf->tmpfile_path->name.data;
+    clnf->log = tf->pool->log;
+
+    tf->file.fd = fd;
+    tf->file.name = tf->tmpfile_path->name;
+    tf->unnamed = 1;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 void
 ngx_create_hashed_filename(ngx_path_t *path, u_char *file, size_t len)
 {
@@ -271,6 +353,7 @@ ngx_conf_set_path_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     path->len = 0;
     path->manager = NULL;
     path->loader = NULL;
+    path->prefetch = NULL;
     path->conf_file = cf->conf_file->file.name.data;
     path->line = cf->conf_file->line;
 
@@ -332,6 +415,7 @@ ngx_conf_merge_path_value(ngx_conf_t *cf, ngx_path_t **path, ngx_path_t *prev,
 
     (*path)->manager = NULL;
     (*path)->loader = NULL;
+    (*path)->prefetch = NULL;
     (*path)->conf_file = NULL;
 
     if (ngx_add_path(cf, path) != NGX_OK) {
@@ -667,6 +751,122 @@ failed:
 }
 
 
+#if (NGX_HAVE_O_TMPFILE)
+
+ngx_int_t
+ngx_ext_link_file(ngx_fd_t fd, ngx_str_t *to, ngx_ext_rename_file_t *ext)
+{
+    u_char      *name;
+    ngx_err_t    err;
+    ngx_uint_t   tries;
+
+    err = 0;
+    name = to->data;
+
+    for (tries = 0; tries < 3; tries++) {
+
+        if (ngx_link_unnamed_file(fd, name) != NGX_FILE_ERROR) {
+            goto linked;
+        }
+
+        err = ngx_errno;
+
+        if (err == NGX_ENOPATH) {
+
+            if (!ext->create_path) {
+                break;
+            }
+
+            err = ngx_create_full_path(to->data,
+                                       ngx_dir_access(ext->path_access));
+
+            if (err) {
+                ngx_log_error(NGX_LOG_CRIT, ext->log, err,
+                              ngx_create_dir_n " \"%s\" failed", to->data);
+                goto failed;
+            }
+
+            continue;
+        }
+
+        if (err == NGX_EEXIST) {
+
+            /*
+             * unlike rename(), linkat() does not replace an existing file,
+             * so the file is linked under a temporary name in the same
+             * directory and then renamed over the existing one atomically
+             */
+
+            if (name == to->data) {
+                name = ngx_alloc(to->len + 1 + 10
+                                 + sizeof(NGX_EXT_LINK_SUFFIX), ext->log);
+                if (name == NULL) {
+                    return NGX_ERROR;
+                }
+
+                (void) ngx_sprintf(name, "%*s.%010uD" NGX_EXT_LINK_SUFFIX "%Z",
+                                   to->len, to->data,
+                                   (uint32_t) ngx_next_temp_number(0));
+
+            } else {
+                (void) ngx_sprintf(name, "%*s.%010uD" NGX_EXT_LINK_SUFFIX "%Z",
+                                   to->len, to->data,
+                                   (uint32_t) ngx_next_temp_number(1));
+            }
+
+            continue;
+        }
+
+        break;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, ext->log, err,
+                  ngx_link_unnamed_file_n " to \"%s\" failed", name);
+
+    goto failed;
+
+linked:
+
+    if (ext->time != -1
+        && ngx_set_file_time(name, fd, ext->time) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                      ngx_set_file_time_n " \"%s\" failed", name);
+        goto unlink;
+    }
+
+    if (name == to->data) {
+        return NGX_OK;
+    }
+
+    if (ngx_rename_file(name, to->data) != NGX_FILE_ERROR) {
+        ngx_free(name);
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                  ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                  name, to->data);
+
+unlink:
+
+    if (name != to->data && ngx_delete_file(name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ext->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
+
+failed:
+
+    if (name != to->data) {
+        ngx_free(name);
+    }
+
+    return NGX_ERROR;
+}
+
+#endif
+
+
 ngx_int_t
 ngx_copy_file(u_char *from, u_char *to, ngx_copy_file_t *cf)
 {
@@ -34,9 +34,13 @@ struct ngx_file_s {
 
 #define NGX_MAX_PATH_LEVEL  3
 
+/* the names a file is linked under before it replaces an existing one */
+#define NGX_EXT_LINK_SUFFIX  ".link"
+
 
 typedef time_t (*ngx_path_manager_pt) (void *data);
 typedef void (*ngx_path_loader_pt) (void *data);
+typedef ngx_msec_t (*ngx_path_prefetch_pt) (void *data);
 
 
 typedef struct {
@@ -46,6 +50,7 @@ typedef struct {
 
     ngx_path_manager_pt        manager;
     ngx_path_loader_pt         loader;
+    ngx_path_prefetch_pt       prefetch;
     void                      *data;
 
     u_char                    *conf_file;
@@ -68,9 +73,13 @@ typedef struct {
 
     ngx_uint_t                 access;
 
+    ngx_path_t                *tmpfile_path;
+    off_t                      preallocate;
+
     unsigned                   log_level:8;
     unsigned                   persistent:1;
     unsigned                   clean:1;
+    unsigned                   unnamed:1;
 } ngx_temp_file_t;
 
 
@@ -133,6 +142,10 @@ ngx_int_t ngx_add_path(ngx_conf_t *cf, ngx_path_t **slot);
 ngx_int_t ngx_create_paths(ngx_cycle_t *cycle, ngx_uid_t user);
 ngx_int_t ngx_ext_rename_file(ngx_str_t *src, ngx_str_t *to,
     ngx_ext_rename_file_t *ext);
+#if (NGX_HAVE_O_TMPFILE)
+ngx_int_t ngx_ext_link_file(ngx_fd_t fd, ngx_str_t *to,
+    ngx_ext_rename_file_t *ext);
+#endif
 ngx_int_t ngx_copy_file(u_char *from, u_char *to, ngx_copy_file_t *cf);
 ngx_int_t ngx_walk_tree(ngx_tree_ctx_t *ctx, ngx_str_t *tree);
 
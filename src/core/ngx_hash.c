@@ -9,6 +9,23 @@
 #include <ngx_core.h>
 
 
+static ngx_inline ngx_uint_t
+ngx_hash_perfect(ngx_uint_t key, uint32_t displ)
+{
+    uint32_t  h;
+
+    h = (uint32_t) (key ^ (key >> 16 >> 16)) + displ * 0x9e3779b9;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+
+    return h;
+}
+
+
 void *
 ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
 {
@@ -19,6 +36,27 @@ ngx_hash_find(ngx_hash_t *hash, ngx_uint_t key, u_char *name, size_t len)
     ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, 0, "hf:\"%*s\"", len, name);
 #endif
 
+    if (hash->displs) {
+
+        /* a minimal perfect hash, a single element to compare */
+
+        elt = hash->buckets[ngx_hash_perfect(key,
+                                             hash->displs[key % hash->ndispls])
+                            % hash->size];
+
+        if (len != (size_t) elt->len) {
+            return NULL;
+        }
+
+        for (i = 0; i < len; i++) {
+            if (name[i] != elt->name[i]) {
+                return NULL;
+            }
+        }
+
+        return elt->value;
+    }
+
     elt = hash->buckets[key % hash->size];
 
     if (elt == NULL) {
@@ -264,14 +302,218 @@ ngx_hash_find_combined(ngx_hash_combined_t *hash, ngx_uint_t key, u_char *name,
 #define NGX_HASH_ELT_SIZE(name)                                               \
     (sizeof(void *) + ngx_align((name)->key.len + 2, sizeof(void *)))
 
+/*
+ * The minimal perfect hash uses the "hash and displace" scheme:
+ * the keys are split into groups of about NGX_HASH_PERFECT_LOAD keys,
+ * and for each group, starting from the largest ones, a displacement is
+ * searched for which places all keys of the group into free slots.
+ *
+ * NGX_DECLINED is returned if no perfect hash is found, e.g., if different
+ * names have the same key, and the bucketed hash should be built instead.
+ */
+
+static ngx_int_t
+ngx_hash_perfect_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names,
+    ngx_uint_t nelts)
+{
+    u_char          *elts;
+    size_t           len;
+    uint32_t         d, *displs;
+    ngx_uint_t       i, j, k, n, g, max, size, ngroups, tries;
+    ngx_uint_t      *head, *next, *count, *taken;
+    ngx_hash_elt_t  *elt, **buckets;
+
+    ngroups = nelts / NGX_HASH_PERFECT_LOAD + 1;
+
+    head = ngx_alloc((2 * ngroups + 2 * nelts) * sizeof(ngx_uint_t),
+                     hinit->pool->log);
+    if (head == NULL) {
+        return NGX_ERROR;
+    }
+
+    count = head + ngroups;
+    next = count + ngroups;
+    taken = next + nelts;
+
+    for (g = 0; g < ngroups; g++) {
+        head[g] = nelts;
+        count[g] = 0;
+    }
+
+    size = 0;
+    len = 0;
+    max = 0;
+
+    for (n = 0; n < nelts; n++) {
+        if (names[n].key.data == NULL) {
+            continue;
+        }
+
+        g = names[n].key_hash % ngroups;
+
+        for (i = head[g]; i != nelts; i = next[i]) {
+            if (names[i].key_hash != names[n].key_hash) {
+                continue;
+            }
+
+            if (names[i].key.len != names[n].key.len
+                || ngx_strncasecmp(names[i].key.data, names[n].key.data,
+                                   names[n].key.len)
+                   != 0)
+            {
+                goto declined;
+            }
+
+            /* a duplicate name, the first one is found */
+
+            break;
+        }
+
+        if (i != nelts) {
+            continue;
+        }
+
+        next[n] = head[g];
+        head[g] = n;
+
+        count[g]++;
+        max = ngx_max(max, count[g]);
+
+        size++;
+        len += NGX_HASH_ELT_SIZE(&names[n]);
+    }
+
+    if (size == 0) {
+        goto declined;
+    }
+
+    displs = ngx_palloc(hinit->pool, ngroups * sizeof(uint32_t));
+    if (displs == NULL) {
+        goto failed;
+    }
+
+    for (i = 0; i < size; i++) {
+        taken[i] = nelts;
+    }
+
+    tries = 16 * size + 1024;
+
+    for ( /* void */ ; max; max--) {
+
+        for (g = 0; g < ngroups; g++) {
+
+            if (count[g] != max) {
+                continue;
+            }
+
+            for (d = 0; d < tries; d++) {
+
+                for (i = head[g]; i != nelts; i = next[i]) {
+                    k = ngx_hash_perfect(names[i].key_hash, d) % size;
+
+                    if (taken[k] != nelts) {
+                        break;
+                    }
+
+                    taken[k] = i;
+                }
+
+                if (i == nelts) {
+                    break;
+                }
+
+                /* roll back the slots taken with this displacement */
+
+                for (j = head[g]; j != i; j = next[j]) {
+                    k = ngx_hash_perfect(names[j].key_hash, d) % size;
+                    taken[k] = nelts;
+                }
+            }
+
+            if (d == tries) {
+                goto declined;
+            }
+
+            displs[g] = d;
+        }
+    }
+
+    if (hinit->hash == NULL) {
+        hinit->hash = ngx_pcalloc(hinit->pool, sizeof(ngx_hash_wildcard_t)
+                                             + size * sizeof(ngx_hash_elt_t *));
+        if (hinit->hash == NULL) {
+            goto failed;
+        }
+
+        buckets = (ngx_hash_elt_t **)
+                      ((u_char *) hinit->hash + sizeof(ngx_hash_wildcard_t));
+
+    } else {
+        buckets = ngx_palloc(hinit->pool, size * sizeof(ngx_hash_elt_t *));
+        if (buckets == NULL) {
+            goto failed;
+        }
+    }
+
+    elts = ngx_palloc(hinit->pool, len + ngx_cacheline_size);
+    if (elts == NULL) {
+        goto failed;
+    }
+
+    elts = ngx_align_ptr(elts, ngx_cacheline_size);
+
+    for (k = 0; k < size; k++) {
+        n = taken[k];
+
+        elt = (ngx_hash_elt_t *) elts;
+
+        elt->value = names[n].value;
+        elt->len = (u_short) names[n].key.len;
+
+        ngx_strlow(elt->name, names[n].key.data, names[n].key.len);
+
+        buckets[k] = elt;
+        elts += NGX_HASH_ELT_SIZE(&names[n]);
+    }
+
+    ngx_free(head);
+
+    hinit->hash->buckets = buckets;
+    hinit->hash->size = size;
+    hinit->hash->displs = displs;
+    hinit->hash->ndispls = ngroups;
+
+    return NGX_OK;
+
+declined:
+
+    ngx_free(head);
+
+    return NGX_DECLINED;
+
+failed:
+
+    ngx_free(head);
+
+    return NGX_ERROR;
+}
+
+
 ngx_int_t
 ngx_hash_init(ngx_hash_init_t *hinit, ngx_hash_key_t *names, ngx_uint_t nelts)
 {
     u_char          *elts;
     size_t           len;
     u_short         *test; // 该数组在不同位置表示不同含义
+    ngx_int_t        rc;
     ngx_uint_t       i, n, key, size, start, bucket_size;
     ngx_hash_elt_t  *elt, **buckets;
+
+    rc = ngx_hash_perfect_init(hinit, names, nelts);
+
+    if (rc != NGX_DECLINED) {
+        return rc;
+    }
 	//一个桶可以存储多个元素，桶使用的不是开链法
     for (n = 0; n < nelts; n++) {
 		// 每个元素占用空间小于桶元素空间大小
@@ -464,6 +706,8 @@ found:
 
     hinit->hash->buckets = buckets;
     hinit->hash->size = size;
+    hinit->hash->displs = NULL;
+    hinit->hash->ndispls = 0;
 
 #if 0
 
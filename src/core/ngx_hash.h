@@ -29,6 +29,10 @@ typedef struct {
 typedef struct {
     ngx_hash_elt_t  **buckets; // 桶数组
     ngx_uint_t        size; // 桶数量
+
+    /* the displacements of a minimal perfect hash, one per group */
+    uint32_t         *displs;
+    ngx_uint_t        ndispls;
 } ngx_hash_t;
 
 
@@ -102,6 +106,8 @@ typedef struct {
 #define NGX_HASH_LARGE_ASIZE      16384
 #define NGX_HASH_LARGE_HSIZE      10007
 
+#define NGX_HASH_PERFECT_LOAD     4
+
 #define NGX_HASH_WILDCARD_KEY     1
 #define NGX_HASH_READONLY_KEY     2
 
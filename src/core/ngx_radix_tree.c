@@ -10,6 +10,10 @@
 
 
 static void *ngx_radix_alloc(ngx_radix_tree_t *tree);
+static ngx_radix_compact_node_t *ngx_radix_compact(ngx_pool_t *pool,
+    ngx_radix_node_t *node, u_char *key, ngx_uint_t len);
+static uintptr_t ngx_radix_compact_find(ngx_radix_compact_node_t *node,
+    u_char *key);
 
 
 ngx_radix_tree_t *
@@ -263,6 +267,434 @@ ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key)
 }
 
 
+/*
+ * returns the value of the most specific prefix that covers
+ * the whole key/mask network, prefixes longer than mask are not looked at
+ */
+
+uintptr_t
+ngx_radix32tree_find_masked(ngx_radix_tree_t *tree, uint32_t key,
+    uint32_t mask)
+{
+    uint32_t           bit;
+    uintptr_t          value;
+    ngx_radix_node_t  *node;
+
+    bit = 0x80000000;
+    value = NGX_RADIX_NO_VALUE;
+    node = tree->root;
+
+    while (node) {
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            value = node->value;
+        }
+
+        if (!(bit & mask)) {
+            break;
+        }
+
+        if (key & bit) {
+            node = node->right;
+
+        } else {
+            node = node->left;
+        }
+
+        bit >>= 1;
+    }
+
+    return value;
+}
+
+
+ngx_radix_compact_node_t *
+ngx_radix_tree_compact(ngx_radix_tree_t *tree, ngx_pool_t *pool)
+{
+    u_char  key[16];
+
+    ngx_memzero(key, 16);
+
+    return ngx_radix_compact(pool, tree->root, key, 0);
+}
+
+
+static ngx_radix_compact_node_t *
+ngx_radix_compact(ngx_pool_t *pool, ngx_radix_node_t *node, u_char *key,
+    ngx_uint_t len)
+{
+    u_char                     bit;
+    ngx_uint_t                 n;
+    ngx_radix_compact_node_t  *cn;
+
+    /* the root is always kept */
+
+    while (len
+           && node->value == NGX_RADIX_NO_VALUE
+           && (node->right == NULL) != (node->left == NULL))
+    {
+        if (node->right) {
+            key[len / 8] |= 0x80 >> len % 8;
+            node = node->right;
+
+        } else {
+            key[len / 8] &= ~(0x80 >> len % 8);
+            node = node->left;
+        }
+
+        len++;
+    }
+
+    n = (len + 7) / 8;
+
+    cn = ngx_palloc(pool, offsetof(ngx_radix_compact_node_t, key) + n);
+    if (cn == NULL) {
+        return NULL;
+    }
+
+    cn->right = NULL;
+    cn->left = NULL;
+    cn->value = node->value;
+    cn->len = len;
+
+    ngx_memcpy(cn->key, key, n);
+
+    if (len % 8) {
+        cn->key[n - 1] &= (u_char) (0xff << (8 - len % 8));
+    }
+
+    bit = 0x80 >> len % 8;
+
+    if (node->right) {
+        key[len / 8] |= bit;
+
+        cn->right = ngx_radix_compact(pool, node->right, key, len + 1);
+        if (cn->right == NULL) {
+            return NULL;
+        }
+    }
+
+    if (node->left) {
+        key[len / 8] &= ~bit;
+
+        cn->left = ngx_radix_compact(pool, node->left, key, len + 1);
+        if (cn->left == NULL) {
+            return NULL;
+        }
+    }
+
+    return cn;
+}
+
+
+uintptr_t
+ngx_radix32compact_find(ngx_radix_compact_node_t *node, uint32_t key)
+{
+    u_char  k[4];
+
+    k[0] = (u_char) (key >> 24);
+    k[1] = (u_char) (key >> 16);
+    k[2] = (u_char) (key >> 8);
+    k[3] = (u_char) key;
+
+    return ngx_radix_compact_find(node, k);
+}
+
+
+static uintptr_t
+ngx_radix_compact_find(ngx_radix_compact_node_t *node, u_char *key)
+{
+    u_char      mask;
+    uintptr_t   value;
+    ngx_uint_t  n, b;
+
+    value = NGX_RADIX_NO_VALUE;
+
+    while (node) {
+        n = node->len / 8;
+        b = node->len % 8;
+
+        if (ngx_memcmp(node->key, key, n) != 0) {
+            break;
+        }
+
+        if (b) {
+            mask = (u_char) (0xff << (8 - b));
+
+            if ((node->key[n] ^ key[n]) & mask) {
+                break;
+            }
+        }
+
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            value = node->value;
+        }
+
+        if (node->right == NULL && node->left == NULL) {
+            break;
+        }
+
+        if (key[n] & (0x80 >> b)) {
+            node = node->right;
+
+        } else {
+            node = node->left;
+        }
+    }
+
+    return value;
+}
+
+
+#if (NGX_HAVE_INET6)
+
+ngx_int_t
+ngx_radix128tree_insert(ngx_radix_tree_t *tree, u_char *key, u_char *mask,
+    uintptr_t value)
+{
+    u_char             bit;
+    ngx_uint_t         i;
+    ngx_radix_node_t  *node, *next;
+
+    i = 0;
+    bit = 0x80;
+
+    node = tree->root;
+    next = tree->root;
+
+    while (bit & mask[i]) {
+        if (key[i] & bit) {
+            next = node->right;
+
+        } else {
+            next = node->left;
+        }
+
+        if (next == NULL) {
+            break;
+        }
+
+        bit >>= 1;
+        node = next;
+
+        if (bit == 0) {
+            if (++i == 16) {
+                break;
+            }
+
+            bit = 0x80;
+        }
+    }
+
+    if (next) {
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            return NGX_BUSY;
+        }
+
+        node->value = value;
+        return NGX_OK;
+    }
+
+    while (bit & mask[i]) {
+        next = ngx_radix_alloc(tree);
+        if (next == NULL) {
+            return NGX_ERROR;
+        }
+
+        next->right = NULL;
+        next->left = NULL;
+        next->parent = node;
+        next->value = NGX_RADIX_NO_VALUE;
+
+        if (key[i] & bit) {
+            node->right = next;
+
+        } else {
+            node->left = next;
+        }
+
+        bit >>= 1;
+        node = next;
+
+        if (bit == 0) {
+            if (++i == 16) {
+                break;
+            }
+
+            bit = 0x80;
+        }
+    }
+
+    node->value = value;
+
+    return NGX_OK;
+}
+
+
+ngx_int_t
+ngx_radix128tree_delete(ngx_radix_tree_t *tree, u_char *key, u_char *mask)
+{
+    u_char             bit;
+    ngx_uint_t         i;
+    ngx_radix_node_t  *node;
+
+    i = 0;
+    bit = 0x80;
+    node = tree->root;
+
+    while (node && (bit & mask[i])) {
+        if (key[i] & bit) {
+            node = node->right;
+
+        } else {
+            node = node->left;
+        }
+
+        bit >>= 1;
+
+        if (bit == 0) {
+            if (++i == 16) {
+                break;
+            }
+
+            bit = 0x80;
+        }
+    }
+
+    if (node == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (node->right || node->left) {
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            node->value = NGX_RADIX_NO_VALUE;
+            return NGX_OK;
+        }
+
+        return NGX_ERROR;
+    }
+
+    for ( ;; ) {
+        if (node->parent->right == node) {
+            node->parent->right = NULL;
+
+        } else {
+            node->parent->left = NULL;
+        }
+
+        node->right = tree->free;
+        tree->free = node;
+
+        node = node->parent;
+
+        if (node->right || node->left) {
+            break;
+        }
+
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            break;
+        }
+
+        if (node->parent == NULL) {
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+uintptr_t
+ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key)
+{
+    u_char             bit;
+    uintptr_t          value;
+    ngx_uint_t         i;
+    ngx_radix_node_t  *node;
+
+    i = 0;
+    bit = 0x80;
+    value = NGX_RADIX_NO_VALUE;
+    node = tree->root;
+
+    while (node) {
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            value = node->value;
+        }
+
+        if (i == 16) {
+            break;
+        }
+
+        if (key[i] & bit) {
+            node = node->right;
+
+        } else {
+            node = node->left;
+        }
+
+        bit >>= 1;
+
+        if (bit == 0) {
+            i++;
+            bit = 0x80;
+        }
+    }
+
+    return value;
+}
+
+
+uintptr_t
+ngx_radix128tree_find_masked(ngx_radix_tree_t *tree, u_char *key,
+    u_char *mask)
+{
+    u_char             bit;
+    uintptr_t          value;
+    ngx_uint_t         i;
+    ngx_radix_node_t  *node;
+
+    i = 0;
+    bit = 0x80;
+    value = NGX_RADIX_NO_VALUE;
+    node = tree->root;
+
+    while (node) {
+        if (node->value != NGX_RADIX_NO_VALUE) {
+            value = node->value;
+        }
+
+        if (i == 16 || !(bit & mask[i])) {
+            break;
+        }
+
+        if (key[i] & bit) {
+            node = node->right;
+
+        } else {
+            node = node->left;
+        }
+
+        bit >>= 1;
+
+        if (bit == 0) {
+            i++;
+            bit = 0x80;
+        }
+    }
+
+    return value;
+}
+
+
+uintptr_t
+ngx_radix128compact_find(ngx_radix_compact_node_t *node, u_char *key)
+{
+    return ngx_radix_compact_find(node, key);
+}
+
+#endif
+
+
 static void *
 ngx_radix_alloc(ngx_radix_tree_t *tree)
 {
@@ -34,6 +34,23 @@ typedef struct {
 } ngx_radix_tree_t;
 
 
+/*
+ * a read-only path-compressed copy of a tree: the chains of nodes
+ * without a value and with a single child are collapsed, so a node
+ * keeps the whole prefix leading to it
+ */
+
+typedef struct ngx_radix_compact_node_s  ngx_radix_compact_node_t;
+
+struct ngx_radix_compact_node_s {
+    ngx_radix_compact_node_t  *right;
+    ngx_radix_compact_node_t  *left;
+    uintptr_t                  value;
+    ngx_uint_t                 len;
+    u_char                     key[1];
+};
+
+
 ngx_radix_tree_t *ngx_radix_tree_create(ngx_pool_t *pool,
     ngx_int_t preallocate);
 ngx_int_t ngx_radix32tree_insert(ngx_radix_tree_t *tree,
@@ -41,6 +58,25 @@ ngx_int_t ngx_radix32tree_insert(ngx_radix_tree_t *tree,
 ngx_int_t ngx_radix32tree_delete(ngx_radix_tree_t *tree,
     uint32_t key, uint32_t mask);
 uintptr_t ngx_radix32tree_find(ngx_radix_tree_t *tree, uint32_t key);
+uintptr_t ngx_radix32tree_find_masked(ngx_radix_tree_t *tree, uint32_t key,
+    uint32_t mask);
+
+ngx_radix_compact_node_t *ngx_radix_tree_compact(ngx_radix_tree_t *tree,
+    ngx_pool_t *pool);
+uintptr_t ngx_radix32compact_find(ngx_radix_compact_node_t *node,
+    uint32_t key);
+
+#if (NGX_HAVE_INET6)
+ngx_int_t ngx_radix128tree_insert(ngx_radix_tree_t *tree,
+    u_char *key, u_char *mask, uintptr_t value);
+ngx_int_t ngx_radix128tree_delete(ngx_radix_tree_t *tree,
+    u_char *key, u_char *mask);
+uintptr_t ngx_radix128tree_find(ngx_radix_tree_t *tree, u_char *key);
+uintptr_t ngx_radix128tree_find_masked(ngx_radix_tree_t *tree, u_char *key,
+    u_char *mask);
+uintptr_t ngx_radix128compact_find(ngx_radix_compact_node_t *node,
+    u_char *key);
+#endif
 
 
 #endif /* _NGX_RADIX_TREE_H_INCLUDED_ */
@@ -20,6 +20,8 @@ static void ngx_libc_cdecl ngx_regex_free(void *p);
 static void ngx_pcre_free_studies(void *data);
 #endif
 
+static ngx_int_t ngx_regex_multi_test(u_char *p);
+
 static ngx_int_t ngx_regex_module_init(ngx_cycle_t *cycle);
 
 static void *ngx_regex_create_conf(ngx_cycle_t *cycle);
@@ -241,6 +243,204 @@ ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log)
 }
 
 
+/*
+ * The patterns are combined into the single regex
+ *
+ *     \A(?:(?=(?s:.*?)(?:re0))(*MARK:0)|(?=(?s:.*?)(?:re1))(*MARK:1)|...)
+ *
+ * where each alternative succeeds if its pattern matches anywhere in
+ * the string, and the alternatives are tried in order, so the mark
+ * reports the first pattern in the configuration order that matches.
+ *
+ * NGX_DECLINED is returned if the patterns may not be combined, that is
+ * if they use backreferences, subroutine calls, verbs, or options
+ * other than caseless ones, or if the combined regex fails to compile.
+ */
+
+ngx_int_t
+ngx_regex_compile_multi(ngx_regex_compile_t *rc, ngx_regex_elt_t *elts,
+    ngx_uint_t n)
+{
+#ifdef PCRE_EXTRA_MARK
+
+    int             rv;
+    u_char         *p;
+    size_t          len;
+    ngx_uint_t      i;
+    unsigned long   options;
+
+    len = sizeof("\\A(?:)") - 1;
+
+    for (i = 0; i < n; i++) {
+
+        if (ngx_regex_multi_test(elts[i].name) != NGX_OK) {
+            return NGX_DECLINED;
+        }
+
+        rv = pcre_fullinfo(elts[i].regex->code, NULL, PCRE_INFO_OPTIONS,
+                           &options);
+
+        if (rv < 0 || (options & ~(PCRE_CASELESS|PCRE_ANCHORED))) {
+            return NGX_DECLINED;
+        }
+
+        len += sizeof("(?=(?s:.*?)(?i:))(*MARK:)|") - 1
+               + ngx_strlen(elts[i].name) + NGX_INT_T_LEN;
+    }
+
+    p = ngx_pnalloc(rc->pool, len + 1);
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+
+    rc->pattern.data = p;
+
+    p = ngx_cpymem(p, "\\A(?:", sizeof("\\A(?:") - 1);
+
+    for (i = 0; i < n; i++) {
+
+        if (i) {
+            *p++ = '|';
+        }
+
+        pcre_fullinfo(elts[i].regex->code, NULL, PCRE_INFO_OPTIONS, &options);
+
+        p = ngx_sprintf(p, "(?=(?s:.*?)(?%s:%s))(*MARK:%ui)",
+                        (options & PCRE_CASELESS) ? "i" : "", elts[i].name, i);
+    }
+
+    *p++ = ')';
+    *p = '\0';
+
+    rc->pattern.len = p - rc->pattern.data;
+    rc->options = 0;
+
+    if (ngx_regex_compile(rc) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+ngx_int_t
+ngx_regex_exec_multi(ngx_regex_t *re, ngx_str_t *s, ngx_log_t *log)
+{
+#ifdef PCRE_EXTRA_MARK
+
+    int           n;
+    u_char       *mark;
+    pcre_extra    extra;
+
+    if (re->extra) {
+        extra = *re->extra;
+
+    } else {
+        ngx_memzero(&extra, sizeof(pcre_extra));
+    }
+
+    mark = NULL;
+
+    extra.flags |= PCRE_EXTRA_MARK;
+    extra.mark = &mark;
+
+    n = pcre_exec(re->code, &extra, (const char *) s->data, s->len, 0, 0,
+                  NULL, 0);
+
+    if (n == NGX_REGEX_NO_MATCHED) {
+        return NGX_DECLINED;
+    }
+
+    if (n < 0 || mark == NULL) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_regex_exec_n " failed: %d on \"%V\" using \"%s\"",
+                      n, s, mark ? mark : (u_char *) "");
+        return NGX_ERROR;
+    }
+
+    n = ngx_atoi(mark, ngx_strlen(mark));
+
+    if (n == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, 0,
+                      ngx_regex_exec_n " returned invalid mark \"%s\" "
+                      "on \"%V\"", mark, s);
+    }
+
+    return n;
+
+#else
+
+    return NGX_DECLINED;
+
+#endif
+}
+
+
+static ngx_int_t
+ngx_regex_multi_test(u_char *p)
+{
+    u_char  ch;
+
+    for ( /* void */ ; *p; p++) {
+
+        if (*p == '\\') {
+            ch = *++p;
+
+            if ((ch >= '1' && ch <= '9') || ch == 'g' || ch == 'k') {
+                return NGX_DECLINED;
+            }
+
+            if (ch == '\0') {
+                return NGX_DECLINED;
+            }
+
+            continue;
+        }
+
+        if (*p != '(') {
+            continue;
+        }
+
+        if (p[1] == '*') {
+            return NGX_DECLINED;
+        }
+
+        if (p[1] != '?') {
+            continue;
+        }
+
+        p += 2;
+
+        if (*p == ':' || *p == '=' || *p == '!' || *p == '<' || *p == '>'
+            || *p == '|' || *p == '#')
+        {
+            p--;
+            continue;
+        }
+
+        /* option settings, only "i", "m", "s", and "U" are allowed */
+
+        while (*p == 'i' || *p == 'm' || *p == 's' || *p == 'U' || *p == '-') {
+            p++;
+        }
+
+        if (*p != ':' && *p != ')') {
+            return NGX_DECLINED;
+        }
+
+        p--;
+    }
+
+    return NGX_OK;
+}
+
+
 static void * ngx_libc_cdecl
 ngx_regex_malloc(size_t size)
 {
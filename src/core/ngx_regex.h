@@ -56,5 +56,9 @@ ngx_int_t ngx_regex_compile(ngx_regex_compile_t *rc);
 
 ngx_int_t ngx_regex_exec_array(ngx_array_t *a, ngx_str_t *s, ngx_log_t *log);
 
+ngx_int_t ngx_regex_compile_multi(ngx_regex_compile_t *rc,
+    ngx_regex_elt_t *elts, ngx_uint_t n);
+ngx_int_t ngx_regex_exec_multi(ngx_regex_t *re, ngx_str_t *s, ngx_log_t *log);
+
 
 #endif /* _NGX_REGEX_H_INCLUDED_ */
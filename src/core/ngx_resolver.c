@@ -8,6 +8,7 @@
 #include <ngx_config.h>
 #include <ngx_core.h>
 #include <ngx_event.h>
+#include <ngx_event_connect.h>
 
 
 #define NGX_RESOLVER_UDP_SIZE   4096
@@ -48,6 +49,52 @@ typedef struct {
 } ngx_resolver_an_t;
 
 
+/* a query resent over TCP after a truncated UDP answer */
+
+typedef struct {
+    ngx_queue_t              queue;
+    ngx_resolver_t          *resolver;
+    ngx_peer_connection_t    peer;
+    ngx_msec_t               timeout;
+
+    u_char                  *buf;
+    u_char                  *pos;
+    u_char                  *last;
+    u_char                  *end;
+
+    unsigned                 reading:1;
+    unsigned                 response:1;
+} ngx_resolver_tcp_t;
+
+
+typedef struct {
+    ngx_rbtree_t             rbtree;
+    ngx_rbtree_node_t        sentinel;
+    ngx_queue_t              queue;
+} ngx_resolver_cache_sh_t;
+
+
+typedef struct {
+    ngx_resolver_cache_sh_t *sh;
+    ngx_slab_pool_t         *shpool;
+} ngx_resolver_cache_t;
+
+
+/* an answer in the shared cache, the name is followed by the answer data */
+
+typedef struct {
+    ngx_rbtree_node_t        node;
+    ngx_queue_t              queue;
+    time_t                   valid;
+    u_short                  qtype;
+    u_short                  nlen;
+    u_short                  naddrs;
+    u_short                  cnlen;
+    u_short                  len;
+    u_char                   data[1];
+} ngx_resolver_cache_node_t;
+
+
 ngx_int_t ngx_udp_connect(ngx_udp_connection_t *uc);
 
 
@@ -68,13 +115,28 @@ static time_t ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree,
     ngx_queue_t *queue);
 static void ngx_resolver_read_response(ngx_event_t *rev);
 static void ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf,
-    size_t n);
+    size_t n, ngx_uint_t tcp);
 static void ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t n,
-    ngx_uint_t ident, ngx_uint_t code, ngx_uint_t nan, ngx_uint_t ans);
+    ngx_uint_t ident, ngx_uint_t code, ngx_uint_t type, ngx_uint_t nan,
+    ngx_uint_t ans);
+static void ngx_resolver_process_truncated(ngx_resolver_t *r, u_char *buf,
+    size_t n, ngx_uint_t ident, ngx_uint_t type);
+static ngx_int_t ngx_resolver_report_answer(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn, ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_resolver_resolve_srv_names(ngx_resolver_ctx_t *ctx,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_srv_names_handler(ngx_resolver_ctx_t *cctx);
+static void ngx_resolver_report_srv(ngx_resolver_ctx_t *ctx);
+static void ngx_resolver_srv_names_done(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_resolver_send_tcp_query(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_tcp_write(ngx_event_t *wev);
+static void ngx_resolver_tcp_read(ngx_event_t *rev);
+static void ngx_resolver_tcp_close(ngx_resolver_tcp_t *tcp);
 static void ngx_resolver_process_ptr(ngx_resolver_t *r, u_char *buf, size_t n,
     ngx_uint_t ident, ngx_uint_t code, ngx_uint_t nan);
 static ngx_resolver_node_t *ngx_resolver_lookup_name(ngx_resolver_t *r,
-    ngx_str_t *name, uint32_t hash);
+    ngx_str_t *name, uint32_t hash, ngx_uint_t type);
 static ngx_resolver_node_t *ngx_resolver_lookup_addr(ngx_resolver_t *r,
     in_addr_t addr);
 static void ngx_resolver_rbtree_insert_value(ngx_rbtree_node_t *temp,
@@ -91,17 +153,36 @@ static void *ngx_resolver_dup(ngx_resolver_t *r, void *src, size_t size);
 static in_addr_t *ngx_resolver_rotate(ngx_resolver_t *r, in_addr_t *src,
     ngx_uint_t n);
 static u_char *ngx_resolver_log_error(ngx_log_t *log, u_char *buf, size_t len);
+static size_t ngx_resolver_answer(ngx_resolver_node_t *rn, u_char **data);
+static ngx_int_t ngx_resolver_init_cache(ngx_shm_zone_t *shm_zone,
+    void *data);
+static void ngx_resolver_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_resolver_cache_node_t *ngx_resolver_cache_lookup_node(
+    ngx_resolver_cache_t *cache, ngx_resolver_node_t *rn);
+static ngx_int_t ngx_resolver_cache_lookup(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_cache_store(ngx_resolver_t *r,
+    ngx_resolver_node_t *rn);
+static void ngx_resolver_cache_expire(ngx_resolver_cache_t *cache,
+    ngx_uint_t n);
+
+
+static u_char  ngx_resolver_cache_tag;
 
 
 ngx_resolver_t *
 ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
 {
-    ngx_str_t              s;
+    u_char                *p;
+    ssize_t                size;
+    ngx_str_t              s, name;
     ngx_url_t              u;
     ngx_uint_t             i, j;
     ngx_resolver_t        *r;
     ngx_pool_cleanup_t    *cln;
     ngx_udp_connection_t  *uc;
+    ngx_resolver_cache_t  *cache;
 
     cln = ngx_pool_cleanup_add(cf->pool, 0);
     if (cln == NULL) {
@@ -134,6 +215,8 @@ ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
     ngx_queue_init(&r->name_expire_queue);
     ngx_queue_init(&r->addr_expire_queue);
 
+    ngx_queue_init(&r->tcp_connections);
+
     r->event->handler = ngx_resolver_resend_handler;
     r->event->data = r;
     r->event->log = &cf->cycle->new_log;
@@ -171,6 +254,81 @@ ngx_resolver_create(ngx_conf_t *cf, ngx_str_t *names, ngx_uint_t n)
             continue;
         }
 
+        if (ngx_strncmp(names[i].data, "ipv6=", 5) == 0) {
+
+            if (ngx_strcmp(&names[i].data[5], "on") == 0) {
+#if (NGX_HAVE_INET6)
+                r->ipv6 = 1;
+#else
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "\"ipv6=on\" requires IPv6 support");
+                return NULL;
+#endif
+
+            } else if (ngx_strcmp(&names[i].data[5], "off") == 0) {
+                r->ipv6 = 0;
+
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter: %V", &names[i]);
+                return NULL;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(names[i].data, "zone=", 5) == 0) {
+
+            name.data = names[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &names[i]);
+                return NULL;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = names[i].data + names[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (name.len == 0 || size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter: %V", &names[i]);
+                return NULL;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &names[i]);
+                return NULL;
+            }
+
+            r->shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                                &ngx_resolver_cache_tag);
+            if (r->shm_zone == NULL) {
+                return NULL;
+            }
+
+            /* the same zone may be shared by several resolvers */
+
+            if (r->shm_zone->data == NULL) {
+                cache = ngx_pcalloc(cf->pool, sizeof(ngx_resolver_cache_t));
+                if (cache == NULL) {
+                    return NULL;
+                }
+
+                r->shm_zone->init = ngx_resolver_init_cache;
+                r->shm_zone->data = cache;
+            }
+
+            continue;
+        }
+
         ngx_memzero(&u, sizeof(ngx_url_t));
 
         u.url = names[i];
@@ -210,6 +368,7 @@ ngx_resolver_cleanup(void *data)
     ngx_resolver_t  *r = data;
 
     ngx_uint_t             i;
+    ngx_queue_t           *q;
     ngx_udp_connection_t  *uc;
 
     if (r) {
@@ -220,6 +379,12 @@ ngx_resolver_cleanup(void *data)
 
         ngx_resolver_cleanup_tree(r, &r->addr_rbtree);
 
+        while (!ngx_queue_empty(&r->tcp_connections)) {
+            q = ngx_queue_head(&r->tcp_connections);
+            ngx_resolver_tcp_close(ngx_queue_data(q, ngx_resolver_tcp_t,
+                                                  queue));
+        }
+
         if (r->event) {
             ngx_free(r->event);
         }
@@ -367,11 +532,20 @@ ngx_resolve_name_done(ngx_resolver_ctx_t *ctx)
 
     /* lock name mutex */
 
+    if (ctx->nsrvs) {
+
+        /* the SRV answer has already been received */
+
+        ngx_resolver_srv_names_done(ctx);
+
+        goto done;
+    }
+
     if (ctx->state == NGX_AGAIN || ctx->state == NGX_RESOLVE_TIMEDOUT) {
 
         hash = ngx_crc32_short(ctx->name.data, ctx->name.len);
 
-        rn = ngx_resolver_lookup_name(r, &ctx->name, hash);
+        rn = ngx_resolver_lookup_name(r, &ctx->name, hash, ctx->type);
 
         if (rn) {
             p = &rn->waiting;
@@ -411,7 +585,7 @@ done:
 }
 
 
-/* NGX_RESOLVE_A only */
+/* NGX_RESOLVE_A, NGX_RESOLVE_AAAA and NGX_RESOLVE_SRV */
 
 static ngx_int_t
 ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
@@ -425,7 +599,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
 
     hash = ngx_crc32_short(ctx->name.data, ctx->name.len);
 
-    rn = ngx_resolver_lookup_name(r, &ctx->name, hash);
+    rn = ngx_resolver_lookup_name(r, &ctx->name, hash, ctx->type);
 
     if (rn) {
 
@@ -441,6 +615,18 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
 
             naddrs = rn->naddrs;
 
+            if (naddrs && rn->qtype != NGX_RESOLVE_A) {
+
+                /* NGX_RESOLVE_AAAA or NGX_RESOLVE_SRV answer */
+
+                ctx->next = rn->waiting;
+                rn->waiting = NULL;
+
+                /* unlock name mutex */
+
+                return ngx_resolver_report_answer(r, rn, ctx);
+            }
+
             if (naddrs) {
 
                 /* NGX_RESOLVE_A answer */
@@ -467,6 +653,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
                     ctx->naddrs = naddrs;
                     ctx->addrs = (naddrs == 1) ? &ctx->addr : addrs;
                     ctx->addr = addr;
+                    ctx->valid = rn->valid;
                     next = ctx->next;
 
                     ctx->handler(ctx);
@@ -530,7 +717,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
             ngx_resolver_free_locked(r, rn->u.cname);
         }
 
-        if (rn->naddrs > 1) {
+        if (rn->naddrs > 1 || (rn->naddrs && rn->qtype != NGX_RESOLVE_A)) {
             ngx_resolver_free_locked(r, rn->u.addrs);
         }
 
@@ -551,11 +738,33 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
 
         rn->node.key = hash;
         rn->nlen = (u_short) ctx->name.len;
+        rn->qtype = (u_short) ctx->type;
         rn->query = NULL;
 
         ngx_rbtree_insert(&r->name_rbtree, &rn->node);
     }
 
+    if (r->shm_zone) {
+
+        /* another worker process may have resolved the name already */
+
+        rc = ngx_resolver_cache_lookup(r, rn);
+
+        if (rc == NGX_ERROR) {
+            goto failed;
+        }
+
+        if (rc == NGX_OK) {
+            rn->waiting = NULL;
+            rn->tcp = 0;
+            rn->expire = ngx_time() + r->expire;
+
+            ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+            return ngx_resolve_name_locked(r, ctx);
+        }
+    }
+
     rc = ngx_resolver_create_name_query(rn, ctx);
 
     if (rc == NGX_ERROR) {
@@ -605,6 +814,7 @@ ngx_resolve_name_locked(ngx_resolver_t *r, ngx_resolver_ctx_t *ctx)
     rn->naddrs = 0;
     rn->valid = 0;
     rn->waiting = ctx;
+    rn->tcp = 0;
 
     ctx->state = NGX_AGAIN;
 
@@ -734,6 +944,7 @@ ngx_resolve_addr(ngx_resolver_ctx_t *ctx)
     rn->nlen = 0;
     rn->valid = 0;
     rn->waiting = ctx;
+    rn->tcp = 0;
 
     /* unlock addr mutex */
 
@@ -980,7 +1191,12 @@ ngx_resolver_resend(ngx_resolver_t *r, ngx_rbtree_t *tree, ngx_queue_t *queue)
 
         if (rn->waiting) {
 
-            (void) ngx_resolver_send_query(r, rn);
+            if (rn->tcp) {
+                (void) ngx_resolver_send_tcp_query(r, rn);
+
+            } else {
+                (void) ngx_resolver_send_query(r, rn);
+            }
 
             rn->expire = now + r->resend_timeout;
 
@@ -1012,14 +1228,264 @@ ngx_resolver_read_response(ngx_event_t *rev)
             return;
         }
 
-        ngx_resolver_process_response(c->data, buf, n);
+        ngx_resolver_process_response(c->data, buf, n, 0);
 
     } while (rev->ready);
 }
 
 
+static ngx_int_t
+ngx_resolver_send_tcp_query(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    ngx_int_t              rc;
+    ngx_connection_t      *c;
+    ngx_resolver_tcp_t    *tcp;
+    ngx_udp_connection_t  *uc;
+
+    uc = r->udp_connections.elts;
+
+    uc = &uc[r->last_connection++];
+    if (r->last_connection == r->udp_connections.nelts) {
+        r->last_connection = 0;
+    }
+
+    tcp = ngx_resolver_calloc(r, sizeof(ngx_resolver_tcp_t));
+    if (tcp == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* the query is prefixed with its length */
+
+    tcp->buf = ngx_resolver_alloc(r, 2 + rn->qlen);
+    if (tcp->buf == NULL) {
+        ngx_resolver_free(r, tcp);
+        return NGX_ERROR;
+    }
+
+    tcp->buf[0] = (u_char) (rn->qlen >> 8);
+    tcp->buf[1] = (u_char) rn->qlen;
+    ngx_memcpy(&tcp->buf[2], rn->query, rn->qlen);
+
+    tcp->pos = tcp->buf;
+    tcp->last = tcp->buf + 2 + rn->qlen;
+    tcp->end = tcp->last;
+
+    tcp->resolver = r;
+
+    /* the query is sent only while it is awaited */
+
+    tcp->timeout = rn->waiting->timeout;
+
+    tcp->peer.sockaddr = uc->sockaddr;
+    tcp->peer.socklen = uc->socklen;
+    tcp->peer.name = &uc->server;
+    tcp->peer.get = ngx_event_get_peer;
+    tcp->peer.log = r->log;
+    tcp->peer.log_error = NGX_ERROR_ERR;
+
+    rc = ngx_event_connect_peer(&tcp->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        ngx_log_error(r->log_level, r->log, 0,
+                      "could not connect to resolver %V over TCP",
+                      &uc->server);
+
+        if (tcp->peer.connection) {
+            ngx_close_connection(tcp->peer.connection);
+        }
+
+        ngx_resolver_free(r, tcp->buf);
+        ngx_resolver_free(r, tcp);
+
+        return NGX_ERROR;
+    }
+
+    ngx_queue_insert_tail(&r->tcp_connections, &tcp->queue);
+
+    c = tcp->peer.connection;
+
+    c->data = tcp;
+    c->read->handler = ngx_resolver_tcp_read;
+    c->write->handler = ngx_resolver_tcp_write;
+
+    ngx_add_timer(c->write, tcp->timeout);
+
+    if (rc == NGX_OK) {
+        ngx_resolver_tcp_write(c->write);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_resolver_tcp_write(ngx_event_t *wev)
+{
+    ssize_t              n;
+    ngx_connection_t    *c;
+    ngx_resolver_tcp_t  *tcp;
+
+    c = wev->data;
+    tcp = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "resolver %V timed out", tcp->peer.name);
+        ngx_resolver_tcp_close(tcp);
+        return;
+    }
+
+    while (tcp->pos < tcp->last) {
+
+        n = ngx_send(c, tcp->pos, tcp->last - tcp->pos);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+                ngx_resolver_tcp_close(tcp);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_resolver_tcp_close(tcp);
+            return;
+        }
+
+        tcp->pos += n;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    /* the buffer is reused to read the length of the response */
+
+    tcp->pos = tcp->buf;
+    tcp->last = tcp->buf;
+    tcp->end = tcp->buf + 2;
+    tcp->reading = 1;
+
+    ngx_add_timer(c->read, tcp->timeout);
+
+    if (c->read->ready) {
+        ngx_resolver_tcp_read(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_resolver_tcp_close(tcp);
+    }
+}
+
+
+static void
+ngx_resolver_tcp_read(ngx_event_t *rev)
+{
+    size_t               size;
+    ssize_t              n;
+    ngx_resolver_t      *r;
+    ngx_connection_t    *c;
+    ngx_resolver_tcp_t  *tcp;
+
+    c = rev->data;
+    tcp = c->data;
+    r = tcp->resolver;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "resolver %V timed out", tcp->peer.name);
+        ngx_resolver_tcp_close(tcp);
+        return;
+    }
+
+    if (!tcp->reading) {
+        /* the query has not been sent yet */
+        return;
+    }
+
+    for ( ;; ) {
+
+        n = ngx_recv(c, tcp->last, tcp->end - tcp->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_resolver_tcp_close(tcp);
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            ngx_log_error(r->log_level, c->log, 0,
+                          "resolver %V closed TCP connection prematurely",
+                          tcp->peer.name);
+            ngx_resolver_tcp_close(tcp);
+            return;
+        }
+
+        tcp->last += n;
+
+        if (tcp->last < tcp->end) {
+            continue;
+        }
+
+        if (tcp->response) {
+            break;
+        }
+
+        size = (tcp->buf[0] << 8) + tcp->buf[1];
+
+        if (size < sizeof(ngx_resolver_query_t)) {
+            ngx_log_error(r->log_level, c->log, 0,
+                          "resolver %V sent short TCP response",
+                          tcp->peer.name);
+            ngx_resolver_tcp_close(tcp);
+            return;
+        }
+
+        ngx_resolver_free(r, tcp->buf);
+
+        tcp->buf = ngx_resolver_alloc(r, size);
+        if (tcp->buf == NULL) {
+            ngx_resolver_tcp_close(tcp);
+            return;
+        }
+
+        tcp->pos = tcp->buf;
+        tcp->last = tcp->buf;
+        tcp->end = tcp->buf + size;
+        tcp->response = 1;
+    }
+
+    ngx_resolver_process_response(r, tcp->buf, tcp->last - tcp->buf, 1);
+
+    ngx_resolver_tcp_close(tcp);
+}
+
+
+static void
+ngx_resolver_tcp_close(ngx_resolver_tcp_t *tcp)
+{
+    ngx_resolver_t  *r;
+
+    r = tcp->resolver;
+
+    ngx_queue_remove(&tcp->queue);
+
+    ngx_close_connection(tcp->peer.connection);
+
+    if (tcp->buf) {
+        ngx_resolver_free(r, tcp->buf);
+    }
+
+    ngx_resolver_free(r, tcp);
+}
+
+
 static void
-ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf, size_t n)
+ngx_resolver_process_response(ngx_resolver_t *r, u_char *buf, size_t n,
+    ngx_uint_t tcp)
 {
     char                  *err;
     size_t                 len;
@@ -1107,6 +1573,13 @@ found:
         goto done;
     }
 
+    if ((flags & 0x0200) && !tcp) {
+
+        /* the answers of a truncated response are incomplete */
+
+        nan = 0;
+    }
+
     if (i + sizeof(ngx_resolver_qs_t) + nan * (2 + sizeof(ngx_resolver_an_t))
         > (ngx_uint_t) n)
     {
@@ -1130,8 +1603,17 @@ found:
     switch (qtype) {
 
     case NGX_RESOLVE_A:
+#if (NGX_HAVE_INET6)
+    case NGX_RESOLVE_AAAA:
+#endif
+    case NGX_RESOLVE_SRV:
+
+        if ((flags & 0x0200) && !tcp) {
+            ngx_resolver_process_truncated(r, buf, n, ident, qtype);
+            break;
+        }
 
-        ngx_resolver_process_a(r, buf, n, ident, code, nan,
+        ngx_resolver_process_a(r, buf, n, ident, code, qtype, nan,
                                i + sizeof(ngx_resolver_qs_t));
 
         break;
@@ -1171,15 +1653,16 @@ dns_error:
 
 static void
 ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
-    ngx_uint_t ident, ngx_uint_t code, ngx_uint_t nan, ngx_uint_t ans)
+    ngx_uint_t ident, ngx_uint_t code, ngx_uint_t type, ngx_uint_t nan,
+    ngx_uint_t ans)
 {
     char                 *err;
-    u_char               *cname;
-    size_t                len;
+    u_char               *cname, *p;
+    size_t                len, size;
     int32_t               ttl;
     uint32_t              hash;
     in_addr_t             addr, *addrs;
-    ngx_str_t             name;
+    ngx_str_t             name, *targets;
     ngx_uint_t            qtype, qident, naddrs, a, i, n, start;
     ngx_resolver_an_t    *an;
     ngx_resolver_ctx_t   *ctx, *next;
@@ -1195,7 +1678,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
     /* lock name mutex */
 
-    rn = ngx_resolver_lookup_name(r, &name, hash);
+    rn = ngx_resolver_lookup_name(r, &name, hash, type);
 
     if (rn == NULL || rn->query == NULL) {
         ngx_log_error(r->log_level, r->log, 0,
@@ -1294,7 +1777,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
             ttl = 0;
         }
 
-        if (qtype == NGX_RESOLVE_A) {
+        if (qtype == type) {
 
             i += sizeof(ngx_resolver_an_t);
 
@@ -1302,8 +1785,18 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
                 goto short_response;
             }
 
-            addr = htonl((buf[i] << 24) + (buf[i + 1] << 16)
-                         + (buf[i + 2] << 8) + (buf[i + 3]));
+            if ((type == NGX_RESOLVE_A && len != 4)
+                || (type == NGX_RESOLVE_AAAA && len != 16)
+                || (type == NGX_RESOLVE_SRV && len < 7))
+            {
+                err = "invalid record length in dns response";
+                goto invalid;
+            }
+
+            if (type == NGX_RESOLVE_A) {
+                addr = htonl((buf[i] << 24) + (buf[i + 1] << 16)
+                             + (buf[i + 2] << 8) + (buf[i + 3]));
+            }
 
             naddrs++;
 
@@ -1326,20 +1819,25 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
                    "resolver naddrs:%ui cname:%p ttl:%d",
                    naddrs, cname, ttl);
 
-    if (naddrs) {
+    if (naddrs && type != NGX_RESOLVE_A) {
 
-        if (naddrs == 1) {
-            rn->u.addr = addr;
+        /*
+         * AAAA answers are kept as an array of addresses, SRV answers
+         * are packed as priority, weight, port, target length and target
+         */
 
-        } else {
+        targets = NULL;
+        size = naddrs * 16;
 
-            addrs = ngx_resolver_alloc(r, naddrs * sizeof(in_addr_t));
-            if (addrs == NULL) {
-                return;
+        if (type == NGX_RESOLVE_SRV) {
+            targets = ngx_resolver_calloc(r, naddrs * sizeof(ngx_str_t));
+            if (targets == NULL) {
+                goto servfail;
             }
 
             n = 0;
             i = ans;
+            size = 0;
 
             for (a = 0; a < nan; a++) {
 
@@ -1347,7 +1845,172 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
                     if (buf[i] & 0xc0) {
                         i += 2;
-                        goto ok;
+                        break;
+                    }
+
+                    if (buf[i] == 0) {
+                        i++;
+                        break;
+                    }
+
+                    i += 1 + buf[i];
+                }
+
+                an = (ngx_resolver_an_t *) &buf[i];
+
+                qtype = (an->type_hi << 8) + an->type_lo;
+                len = (an->len_hi << 8) + an->len_lo;
+
+                i += sizeof(ngx_resolver_an_t);
+
+                if (qtype == NGX_RESOLVE_SRV) {
+
+                    if (ngx_resolver_copy(r, &targets[n], buf, &buf[i + 6],
+                                          &buf[last])
+                        != NGX_OK)
+                    {
+                        goto answer_failed;
+                    }
+
+                    if (targets[n].len > 255) {
+                        ngx_resolver_free(r, targets[n].data);
+                        targets[n].len = 0;
+                        goto answer_failed;
+                    }
+
+                    size += 7 + targets[n].len;
+                    n++;
+                }
+
+                i += len;
+            }
+        }
+
+        p = ngx_resolver_alloc(r, size);
+        if (p == NULL) {
+            goto answer_failed;
+        }
+
+        rn->u.srvs = p;
+
+        n = 0;
+        i = ans;
+
+        for (a = 0; a < nan; a++) {
+
+            for ( ;; ) {
+
+                if (buf[i] & 0xc0) {
+                    i += 2;
+                    break;
+                }
+
+                if (buf[i] == 0) {
+                    i++;
+                    break;
+                }
+
+                i += 1 + buf[i];
+            }
+
+            an = (ngx_resolver_an_t *) &buf[i];
+
+            qtype = (an->type_hi << 8) + an->type_lo;
+            len = (an->len_hi << 8) + an->len_lo;
+
+            i += sizeof(ngx_resolver_an_t);
+
+            if (qtype == type) {
+
+                if (type == NGX_RESOLVE_SRV) {
+                    p = ngx_cpymem(p, &buf[i], 6);
+                    *p++ = (u_char) targets[n].len;
+                    p = ngx_cpymem(p, targets[n].data, targets[n].len);
+
+                } else {
+                    p = ngx_cpymem(p, &buf[i], 16);
+                }
+
+                n++;
+            }
+
+            i += len;
+        }
+
+        if (targets) {
+            for (n = 0; n < naddrs; n++) {
+                if (targets[n].len) {
+                    ngx_resolver_free(r, targets[n].data);
+                }
+            }
+
+            ngx_resolver_free(r, targets);
+        }
+
+        rn->naddrs = (u_short) naddrs;
+
+        ngx_queue_remove(&rn->queue);
+
+        rn->valid = ngx_time() + (r->valid ? r->valid : ttl);
+        rn->expire = ngx_time() + r->expire;
+
+        ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
+
+        ngx_resolver_free(r, rn->query);
+        rn->query = NULL;
+
+        if (r->shm_zone) {
+            ngx_resolver_cache_store(r, rn);
+        }
+
+        next = rn->waiting;
+        rn->waiting = NULL;
+
+        /* unlock name mutex */
+
+        if (next) {
+            (void) ngx_resolver_report_answer(r, rn, next);
+        }
+
+        return;
+
+    answer_failed:
+
+        if (targets) {
+            for (n = 0; n < naddrs; n++) {
+                if (targets[n].len) {
+                    ngx_resolver_free(r, targets[n].data);
+                }
+            }
+
+            ngx_resolver_free(r, targets);
+        }
+
+        goto servfail;
+    }
+
+    if (naddrs) {
+
+        if (naddrs == 1) {
+            rn->u.addr = addr;
+
+        } else {
+
+            addrs = ngx_resolver_alloc(r, naddrs * sizeof(in_addr_t));
+            if (addrs == NULL) {
+                goto servfail;
+            }
+
+            n = 0;
+            i = ans;
+
+            for (a = 0; a < nan; a++) {
+
+                for ( ;; ) {
+
+                    if (buf[i] & 0xc0) {
+                        i += 2;
+                        goto ok;
                     }
 
                     if (buf[i] == 0) {
@@ -1385,7 +2048,9 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
             addrs = ngx_resolver_dup(r, rn->u.addrs,
                                      naddrs * sizeof(in_addr_t));
             if (addrs == NULL) {
-                return;
+                ngx_resolver_free(r, rn->u.addrs);
+                rn->u.addrs = NULL;
+                goto servfail;
             }
         }
 
@@ -1398,6 +2063,10 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
 
+        if (r->shm_zone) {
+            ngx_resolver_cache_store(r, rn);
+        }
+
         next = rn->waiting;
         rn->waiting = NULL;
 
@@ -1409,6 +2078,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
              ctx->naddrs = naddrs;
              ctx->addrs = (naddrs == 1) ? &ctx->addr : addrs;
              ctx->addr = addr;
+             ctx->valid = rn->valid;
              next = ctx->next;
 
              ctx->handler(ctx);
@@ -1428,7 +2098,7 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
         /* CNAME only */
 
         if (ngx_resolver_copy(r, &name, buf, cname, &buf[last]) != NGX_OK) {
-            return;
+            goto servfail;
         }
 
         ngx_log_debug1(NGX_LOG_DEBUG_CORE, r->log, 0,
@@ -1444,6 +2114,10 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
 
         ngx_queue_insert_head(&r->name_expire_queue, &rn->queue);
 
+        if (r->shm_zone) {
+            ngx_resolver_cache_store(r, rn);
+        }
+
         ctx = rn->waiting;
         rn->waiting = NULL;
 
@@ -1460,10 +2134,31 @@ ngx_resolver_process_a(ngx_resolver_t *r, u_char *buf, size_t last,
     }
 
     ngx_log_error(r->log_level, r->log, 0,
-               "no A or CNAME types in DNS responses, unknown query type: %ui",
+               "no %s or CNAME types in DNS responses, unknown query type: %ui",
+               type == NGX_RESOLVE_A ? "A"
+                   : (type == NGX_RESOLVE_AAAA ? "AAAA" : "SRV"),
                qtype);
     return;
 
+servfail:
+
+    /* the answer could not be stored, the waiting requests fail */
+
+    next = rn->waiting;
+    rn->waiting = NULL;
+
+    /* unlock name mutex */
+
+    while (next) {
+         ctx = next;
+         ctx->state = NGX_RESOLVE_SERVFAIL;
+         next = ctx->next;
+
+         ctx->handler(ctx);
+    }
+
+    return;
+
 short_response:
 
     err = "short dns response";
@@ -1486,6 +2181,305 @@ failed:
 }
 
 
+static void
+ngx_resolver_process_truncated(ngx_resolver_t *r, u_char *buf, size_t n,
+    ngx_uint_t ident, ngx_uint_t type)
+{
+    uint32_t              hash;
+    ngx_str_t             name;
+    ngx_uint_t            qident;
+    ngx_resolver_node_t  *rn;
+
+    if (ngx_resolver_copy(r, &name, buf, &buf[12], &buf[n]) != NGX_OK) {
+        return;
+    }
+
+    hash = ngx_crc32_short(name.data, name.len);
+
+    /* lock name mutex */
+
+    rn = ngx_resolver_lookup_name(r, &name, hash, type);
+
+    if (rn == NULL || rn->query == NULL || rn->waiting == NULL || rn->tcp) {
+        goto done;
+    }
+
+    qident = (rn->query[0] << 8) + rn->query[1];
+
+    if (ident != qident) {
+        goto done;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, r->log, 0,
+                   "resolver truncated response for %V, retrying over TCP",
+                   &name);
+
+    rn->tcp = 1;
+
+    /* on failure the query is resent by the resend handler */
+
+    (void) ngx_resolver_send_tcp_query(r, rn);
+
+done:
+
+    /* unlock name mutex */
+
+    ngx_resolver_free(r, name.data);
+}
+
+
+static ngx_int_t
+ngx_resolver_report_answer(ngx_resolver_t *r, ngx_resolver_node_t *rn,
+    ngx_resolver_ctx_t *ctx)
+{
+    ngx_resolver_ctx_t  *next;
+#if (NGX_HAVE_INET6)
+    struct in6_addr     *addrs6;
+
+    if (rn->qtype == NGX_RESOLVE_AAAA) {
+
+        addrs6 = ngx_resolver_dup(r, rn->u.addrs6,
+                                  rn->naddrs * sizeof(struct in6_addr));
+        if (addrs6 == NULL) {
+
+            /* the waiting contexts are already detached from the node */
+
+            do {
+                ctx->state = NGX_RESOLVE_SERVFAIL;
+                next = ctx->next;
+
+                ctx->handler(ctx);
+
+                ctx = next;
+            } while (ctx);
+
+            return NGX_OK;
+        }
+
+        do {
+            ctx->state = NGX_OK;
+            ctx->naddrs = rn->naddrs;
+            ctx->addrs = NULL;
+            ctx->addrs6 = addrs6;
+            ctx->valid = rn->valid;
+            next = ctx->next;
+
+            ctx->handler(ctx);
+
+            ctx = next;
+        } while (ctx);
+
+        ngx_resolver_free(r, addrs6);
+
+        return NGX_OK;
+    }
+
+#endif
+
+    /* NGX_RESOLVE_SRV, the targets are resolved for each context */
+
+    do {
+        next = ctx->next;
+
+        if (ngx_resolver_resolve_srv_names(ctx, rn) != NGX_OK) {
+            ctx->state = NGX_ERROR;
+            ctx->handler(ctx);
+        }
+
+        ctx = next;
+    } while (ctx);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_resolver_resolve_srv_names(ngx_resolver_ctx_t *ctx,
+    ngx_resolver_node_t *rn)
+{
+    u_char                   *p, *name;
+    size_t                    len;
+    ngx_uint_t                i, n;
+    ngx_resolver_t           *r;
+    ngx_resolver_ctx_t       *cctx;
+    ngx_resolver_srv_name_t  *srvs;
+
+    r = ctx->resolver;
+    n = rn->naddrs;
+
+    /* the records and their targets in one allocation */
+
+    p = rn->u.srvs;
+    len = 0;
+
+    for (i = 0; i < n; i++) {
+        len += p[6];
+        p += 7 + p[6];
+    }
+
+    srvs = ngx_resolver_calloc(r, n * sizeof(ngx_resolver_srv_name_t) + len);
+    if (srvs == NULL) {
+        return NGX_ERROR;
+    }
+
+    name = (u_char *) &srvs[n];
+    p = rn->u.srvs;
+
+    for (i = 0; i < n; i++) {
+        srvs[i].priority = (u_short) ((p[0] << 8) + p[1]);
+        srvs[i].weight = (u_short) ((p[2] << 8) + p[3]);
+        srvs[i].port = (u_short) ((p[4] << 8) + p[5]);
+        srvs[i].name.len = p[6];
+        srvs[i].name.data = name;
+        srvs[i].state = NGX_AGAIN;
+
+        name = ngx_cpymem(name, &p[7], p[6]);
+        p += 7 + p[6];
+    }
+
+    ctx->state = NGX_AGAIN;
+    ctx->naddrs = 0;
+    ctx->valid = rn->valid;
+    ctx->srvs = srvs;
+    ctx->nsrvs = n;
+
+    /* the extra reference keeps the context until all targets are started */
+
+    ctx->count = n + 1;
+
+    for (i = 0; i < n; i++) {
+
+        if (srvs[i].name.len == 0) {
+
+            /* the "." target, the service is not available */
+
+            srvs[i].state = NGX_RESOLVE_NXDOMAIN;
+            ctx->count--;
+            continue;
+        }
+
+        cctx = ngx_resolve_start(r, NULL);
+        if (cctx == NULL) {
+            srvs[i].state = NGX_ERROR;
+            ctx->count--;
+            continue;
+        }
+
+        cctx->name = srvs[i].name;
+        cctx->type = NGX_RESOLVE_A;
+        cctx->handler = ngx_resolver_srv_names_handler;
+        cctx->data = ctx;
+        cctx->srvs = &srvs[i];
+        cctx->timeout = ctx->timeout;
+
+        srvs[i].ctx = cctx;
+
+        if (ngx_resolve_name(cctx) != NGX_OK) {
+            srvs[i].ctx = NULL;
+            srvs[i].state = NGX_ERROR;
+            ctx->count--;
+        }
+    }
+
+    if (--ctx->count == 0) {
+        ngx_resolver_report_srv(ctx);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_resolver_srv_names_handler(ngx_resolver_ctx_t *cctx)
+{
+    ngx_resolver_t           *r;
+    ngx_resolver_ctx_t       *ctx;
+    ngx_resolver_srv_name_t  *srv;
+
+    r = cctx->resolver;
+    ctx = cctx->data;
+    srv = cctx->srvs;
+
+    ctx->count--;
+
+    srv->ctx = NULL;
+    srv->state = cctx->state;
+
+    if (cctx->state == NGX_OK) {
+
+        srv->addrs = ngx_resolver_dup(r, cctx->addrs,
+                                      cctx->naddrs * sizeof(in_addr_t));
+        if (srv->addrs) {
+            srv->naddrs = cctx->naddrs;
+
+        } else {
+            srv->state = NGX_ERROR;
+        }
+
+        if (cctx->valid < ctx->valid) {
+            ctx->valid = cctx->valid;
+        }
+    }
+
+    ngx_resolve_name_done(cctx);
+
+    if (ctx->count == 0) {
+        ngx_resolver_report_srv(ctx);
+    }
+}
+
+
+static void
+ngx_resolver_report_srv(ngx_resolver_ctx_t *ctx)
+{
+    ngx_uint_t                i;
+    ngx_resolver_srv_name_t  *srvs;
+
+    srvs = ctx->srvs;
+
+    /* the answer is usable if at least one target has addresses */
+
+    ctx->state = srvs[0].state;
+
+    for (i = 0; i < ctx->nsrvs; i++) {
+        if (srvs[i].naddrs) {
+            ctx->state = NGX_OK;
+            break;
+        }
+    }
+
+    ctx->handler(ctx);
+}
+
+
+static void
+ngx_resolver_srv_names_done(ngx_resolver_ctx_t *ctx)
+{
+    ngx_uint_t                i;
+    ngx_resolver_t           *r;
+    ngx_resolver_srv_name_t  *srvs;
+
+    r = ctx->resolver;
+    srvs = ctx->srvs;
+
+    for (i = 0; i < ctx->nsrvs; i++) {
+
+        if (srvs[i].ctx) {
+            ngx_resolve_name_done(srvs[i].ctx);
+        }
+
+        if (srvs[i].addrs) {
+            ngx_resolver_free(r, srvs[i].addrs);
+        }
+    }
+
+    ngx_resolver_free(r, srvs);
+
+    ctx->srvs = NULL;
+    ctx->nsrvs = 0;
+}
+
+
 static void
 ngx_resolver_process_ptr(ngx_resolver_t *r, u_char *buf, size_t n,
     ngx_uint_t ident, ngx_uint_t code, ngx_uint_t nan)
@@ -1681,7 +2675,8 @@ failed:
 
 
 static ngx_resolver_node_t *
-ngx_resolver_lookup_name(ngx_resolver_t *r, ngx_str_t *name, uint32_t hash)
+ngx_resolver_lookup_name(ngx_resolver_t *r, ngx_str_t *name, uint32_t hash,
+    ngx_uint_t type)
 {
     ngx_int_t             rc;
     ngx_rbtree_node_t    *node, *sentinel;
@@ -1706,6 +2701,11 @@ ngx_resolver_lookup_name(ngx_resolver_t *r, ngx_str_t *name, uint32_t hash)
 
         rn = (ngx_resolver_node_t *) node;
 
+        if (type != rn->qtype) {
+            node = (type < rn->qtype) ? node->left : node->right;
+            continue;
+        }
+
         rc = ngx_memn2cmp(name->data, rn->name, name->len, rn->nlen);
 
         if (rc == 0) {
@@ -1774,8 +2774,14 @@ ngx_resolver_rbtree_insert_value(ngx_rbtree_node_t *temp,
             rn = (ngx_resolver_node_t *) node;
             rn_temp = (ngx_resolver_node_t *) temp;
 
-            p = (ngx_memn2cmp(rn->name, rn_temp->name, rn->nlen, rn_temp->nlen)
-                 < 0) ? &temp->left : &temp->right;
+            if (rn->qtype != rn_temp->qtype) {
+                p = (rn->qtype < rn_temp->qtype) ? &temp->left : &temp->right;
+
+            } else {
+                p = (ngx_memn2cmp(rn->name, rn_temp->name, rn->nlen,
+                                  rn_temp->nlen)
+                     < 0) ? &temp->left : &temp->right;
+            }
         }
 
         if (*p == sentinel) {
@@ -2061,7 +3067,7 @@ ngx_resolver_free_node(ngx_resolver_t *r, ngx_resolver_node_t *rn)
         ngx_resolver_free_locked(r, rn->u.cname);
     }
 
-    if (rn->naddrs > 1) {
+    if (rn->naddrs > 1 || (rn->naddrs && rn->qtype != NGX_RESOLVE_A)) {
         ngx_resolver_free_locked(r, rn->u.addrs);
     }
 
@@ -2162,6 +3168,353 @@ ngx_resolver_rotate(ngx_resolver_t *r, in_addr_t *src, ngx_uint_t n)
 }
 
 
+/* the answer data of a name node as it is kept in the shared cache */
+
+static size_t
+ngx_resolver_answer(ngx_resolver_node_t *rn, u_char **data)
+{
+    u_char      *p;
+    ngx_uint_t   i;
+
+    if (rn->cnlen) {
+        *data = rn->u.cname;
+        return rn->cnlen;
+    }
+
+    switch (rn->qtype) {
+
+    case NGX_RESOLVE_A:
+
+        if (rn->naddrs == 1) {
+            *data = (u_char *) &rn->u.addr;
+            return sizeof(in_addr_t);
+        }
+
+        *data = (u_char *) rn->u.addrs;
+        return rn->naddrs * sizeof(in_addr_t);
+
+#if (NGX_HAVE_INET6)
+    case NGX_RESOLVE_AAAA:
+
+        *data = (u_char *) rn->u.addrs6;
+        return rn->naddrs * sizeof(struct in6_addr);
+#endif
+
+    default: /* NGX_RESOLVE_SRV */
+
+        p = rn->u.srvs;
+
+        for (i = 0; i < rn->naddrs; i++) {
+            p += 7 + p[6];
+        }
+
+        *data = rn->u.srvs;
+        return p - rn->u.srvs;
+    }
+}
+
+
+static ngx_int_t
+ngx_resolver_init_cache(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_resolver_cache_t  *ocache = data;
+
+    ngx_resolver_cache_t  *cache;
+
+    cache = shm_zone->data;
+
+    if (ocache) {
+        cache->sh = ocache->sh;
+        cache->shpool = ocache->shpool;
+
+        return NGX_OK;
+    }
+
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_resolver_cache_sh_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    cache->shpool->data = cache->sh;
+
+    ngx_rbtree_init(&cache->sh->rbtree, &cache->sh->sentinel,
+                    ngx_resolver_cache_insert_value);
+
+    ngx_queue_init(&cache->sh->queue);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_resolver_cache_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t          **p;
+    ngx_resolver_cache_node_t   *cn, *cn_temp;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_resolver_cache_node_t *) node;
+            cn_temp = (ngx_resolver_cache_node_t *) temp;
+
+            if (cn->qtype != cn_temp->qtype) {
+                p = (cn->qtype < cn_temp->qtype) ? &temp->left : &temp->right;
+
+            } else {
+                p = (ngx_memn2cmp(cn->data, cn_temp->data, cn->nlen,
+                                  cn_temp->nlen)
+                     < 0) ? &temp->left : &temp->right;
+            }
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_resolver_cache_node_t *
+ngx_resolver_cache_lookup_node(ngx_resolver_cache_t *cache,
+    ngx_resolver_node_t *rn)
+{
+    ngx_int_t                   rc;
+    ngx_rbtree_node_t          *node, *sentinel;
+    ngx_resolver_cache_node_t  *cn;
+
+    node = cache->sh->rbtree.root;
+    sentinel = cache->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (rn->node.key < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (rn->node.key > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* rn->node.key == node->key */
+
+        cn = (ngx_resolver_cache_node_t *) node;
+
+        if (rn->qtype != cn->qtype) {
+            node = (rn->qtype < cn->qtype) ? node->left : node->right;
+            continue;
+        }
+
+        rc = ngx_memn2cmp(rn->name, cn->data, rn->nlen, cn->nlen);
+
+        if (rc == 0) {
+            return cn;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static ngx_int_t
+ngx_resolver_cache_lookup(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    void                       *p;
+    ngx_resolver_cache_t       *cache;
+    ngx_resolver_cache_node_t  *cn;
+
+    cache = r->shm_zone->data;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_resolver_cache_lookup_node(cache, rn);
+
+    if (cn == NULL) {
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    if (cn->valid < ngx_time()) {
+        ngx_queue_remove(&cn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+        ngx_slab_free_locked(cache->shpool, cn);
+
+        ngx_shmtx_unlock(&cache->shpool->mutex);
+        return NGX_DECLINED;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    p = NULL;
+
+    if (cn->cnlen || cn->qtype != NGX_RESOLVE_A || cn->naddrs > 1) {
+        p = ngx_resolver_dup(r, &cn->data[cn->nlen], cn->len);
+        if (p == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+            return NGX_ERROR;
+        }
+    }
+
+    if (p == NULL) {
+        ngx_memcpy(&rn->u.addr, &cn->data[cn->nlen], sizeof(in_addr_t));
+
+    } else if (cn->cnlen) {
+        rn->u.cname = p;
+
+    } else {
+        rn->u.srvs = p;
+    }
+
+    rn->naddrs = cn->naddrs;
+    rn->cnlen = cn->cnlen;
+    rn->valid = cn->valid;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_CORE, r->log, 0,
+                   "resolve shared \"%*s\"", (size_t) rn->nlen, rn->name);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_resolver_cache_store(ngx_resolver_t *r, ngx_resolver_node_t *rn)
+{
+    u_char                     *data;
+    size_t                      len, size;
+    ngx_resolver_cache_t       *cache;
+    ngx_resolver_cache_node_t  *cn;
+
+    if (rn->valid <= ngx_time()) {
+        return;
+    }
+
+    len = ngx_resolver_answer(rn, &data);
+
+    if (len > 65535) {
+        return;
+    }
+
+    cache = r->shm_zone->data;
+
+    size = offsetof(ngx_resolver_cache_node_t, data) + rn->nlen + len;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    cn = ngx_resolver_cache_lookup_node(cache, rn);
+
+    if (cn) {
+        ngx_queue_remove(&cn->queue);
+        ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+        ngx_slab_free_locked(cache->shpool, cn);
+    }
+
+    ngx_resolver_cache_expire(cache, 1);
+
+    cn = ngx_slab_alloc_locked(cache->shpool, size);
+
+    if (cn == NULL) {
+        ngx_resolver_cache_expire(cache, 0);
+
+        cn = ngx_slab_alloc_locked(cache->shpool, size);
+        if (cn == NULL) {
+            ngx_shmtx_unlock(&cache->shpool->mutex);
+
+            ngx_log_error(NGX_LOG_WARN, r->log, 0,
+                          "could not allocate node in resolver zone \"%V\"",
+                          &r->shm_zone->shm.name);
+            return;
+        }
+    }
+
+    cn->node.key = rn->node.key;
+    cn->valid = rn->valid;
+    cn->qtype = rn->qtype;
+    cn->nlen = rn->nlen;
+    cn->naddrs = rn->naddrs;
+    cn->cnlen = rn->cnlen;
+    cn->len = (u_short) len;
+
+    ngx_memcpy(ngx_cpymem(cn->data, rn->name, rn->nlen), data, len);
+
+    ngx_rbtree_insert(&cache->sh->rbtree, &cn->node);
+
+    ngx_queue_insert_head(&cache->sh->queue, &cn->queue);
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+
+static void
+ngx_resolver_cache_expire(ngx_resolver_cache_t *cache, ngx_uint_t n)
+{
+    time_t                      now;
+    ngx_queue_t                *q;
+    ngx_resolver_cache_node_t  *cn;
+
+    now = ngx_time();
+
+    /*
+     * n == 1 deletes one or two expired answers
+     * n == 0 deletes the least recently used answer by force
+     *        and one or two expired answers
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&cache->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&cache->sh->queue);
+
+        cn = ngx_queue_data(q, ngx_resolver_cache_node_t, queue);
+
+        if (n++ != 0 && cn->valid >= now) {
+            return;
+        }
+
+        ngx_queue_remove(q);
+
+        ngx_rbtree_delete(&cache->sh->rbtree, &cn->node);
+
+        ngx_slab_free_locked(cache->shpool, cn);
+    }
+}
+
+
 char *
 ngx_resolver_strerror(ngx_int_t err)
 {
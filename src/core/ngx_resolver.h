@@ -18,6 +18,8 @@
 #define NGX_RESOLVE_PTR       12
 #define NGX_RESOLVE_MX        15
 #define NGX_RESOLVE_TXT       16
+#define NGX_RESOLVE_AAAA      28
+#define NGX_RESOLVE_SRV       33
 #define NGX_RESOLVE_DNAME     39
 
 #define NGX_RESOLVE_FORMERR   1
@@ -47,15 +49,32 @@ typedef struct ngx_resolver_ctx_s  ngx_resolver_ctx_t;
 typedef void (*ngx_resolver_handler_pt)(ngx_resolver_ctx_t *ctx);
 
 
+/* an SRV record along with the addresses its target was resolved to */
+
+typedef struct {
+    ngx_str_t                 name;
+    u_short                   priority;
+    u_short                   weight;
+    u_short                   port;
+
+    ngx_resolver_ctx_t       *ctx;
+    ngx_int_t                 state;
+
+    ngx_uint_t                naddrs;
+    in_addr_t                *addrs;
+} ngx_resolver_srv_name_t;
+
+
 typedef struct {
     ngx_rbtree_node_t         node;
     ngx_queue_t               queue;
 
-    /* PTR: resolved name, A: name to resolve */
+    /* PTR: resolved name, A, AAAA, SRV: name to resolve */
     u_char                   *name;
 
     u_short                   nlen;
     u_short                   qlen;
+    u_short                   qtype;
 
     u_char                   *query;
 
@@ -63,6 +82,11 @@ typedef struct {
         in_addr_t             addr;
         in_addr_t            *addrs;
         u_char               *cname;
+#if (NGX_HAVE_INET6)
+        struct in6_addr      *addrs6;
+#endif
+        /* priority, weight, port, name length and name of each record */
+        u_char               *srvs;
     } u;
 
     u_short                   naddrs;
@@ -72,6 +96,9 @@ typedef struct {
     time_t                    valid;
 
     ngx_resolver_ctx_t       *waiting;
+
+    /* the UDP answer was truncated, the query is sent over TCP */
+    unsigned                  tcp:1;
 } ngx_resolver_node_t;
 
 
@@ -100,11 +127,18 @@ typedef struct {
     ngx_queue_t               name_expire_queue;
     ngx_queue_t               addr_expire_queue;
 
+    ngx_queue_t               tcp_connections;
+
+    /* answers shared by all worker processes */
+    ngx_shm_zone_t           *shm_zone;
+
     time_t                    resend_timeout;
     time_t                    expire;
     time_t                    valid;
 
     ngx_uint_t                log_level;
+
+    unsigned                  ipv6:1;
 } ngx_resolver_t;
 
 
@@ -123,6 +157,15 @@ struct ngx_resolver_ctx_s {
     ngx_uint_t                naddrs;
     in_addr_t                *addrs;
     in_addr_t                 addr;
+#if (NGX_HAVE_INET6)
+    struct in6_addr          *addrs6;
+#endif
+    time_t                    valid;
+
+    /* SRV: the records, or the parent's record in a target's context */
+    ngx_uint_t                nsrvs;
+    ngx_resolver_srv_name_t  *srvs;
+    ngx_uint_t                count;
 
     ngx_resolver_handler_pt   handler;
     void                     *data;
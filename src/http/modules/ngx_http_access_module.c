@@ -10,26 +10,16 @@
 #include <ngx_http.h>
 
 
-typedef struct {
-    in_addr_t         mask;
-    in_addr_t         addr;
-    ngx_uint_t        deny;      /* unsigned  deny:1; */
-} ngx_http_access_rule_t;
-
-#if (NGX_HAVE_INET6)
-
-typedef struct {
-    struct in6_addr   addr;
-    struct in6_addr   mask;
-    ngx_uint_t        deny;      /* unsigned  deny:1; */
-} ngx_http_access_rule6_t;
-
-#endif
+/*
+ * the rules are kept in radix trees with the "deny" flag as a value;
+ * a rule covered by an earlier one is never inserted, so the most
+ * specific prefix found is always the first rule that matches
+ */
 
 typedef struct {
-    ngx_array_t      *rules;     /* array of ngx_http_access_rule_t */
+    ngx_radix_tree_t  *rules;
 #if (NGX_HAVE_INET6)
-    ngx_array_t      *rules6;    /* array of ngx_http_access_rule6_t */
+    ngx_radix_tree_t  *rules6;
 #endif
 } ngx_http_access_loc_conf_t;
 
@@ -122,7 +112,8 @@ ngx_http_access_handler(ngx_http_request_t *r)
     case AF_INET:
         if (alcf->rules) {
             sin = (struct sockaddr_in *) r->connection->sockaddr;
-            return ngx_http_access_inet(r, alcf, sin->sin_addr.s_addr);
+            return ngx_http_access_inet(r, alcf,
+                                        ntohl(sin->sin_addr.s_addr));
         }
         break;
 
@@ -137,7 +128,7 @@ ngx_http_access_handler(ngx_http_request_t *r)
             addr += p[13] << 16;
             addr += p[14] << 8;
             addr += p[15];
-            return ngx_http_access_inet(r, alcf, htonl(addr));
+            return ngx_http_access_inet(r, alcf, addr);
         }
 
         if (alcf->rules6) {
@@ -155,22 +146,18 @@ static ngx_int_t
 ngx_http_access_inet(ngx_http_request_t *r, ngx_http_access_loc_conf_t *alcf,
     in_addr_t addr)
 {
-    ngx_uint_t               i;
-    ngx_http_access_rule_t  *rule;
+    uintptr_t  deny;
 
-    rule = alcf->rules->elts;
-    for (i = 0; i < alcf->rules->nelts; i++) {
+    deny = ngx_radix32tree_find(alcf->rules, addr);
 
-        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "access: %08XD %08XD %08XD",
-                       addr, rule[i].mask, rule[i].addr);
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "access: %08XD %i", addr, (ngx_int_t) deny);
 
-        if ((addr & rule[i].mask) == rule[i].addr) {
-            return ngx_http_access_found(r, rule[i].deny);
-        }
+    if (deny == NGX_RADIX_NO_VALUE) {
+        return NGX_DECLINED;
     }
 
-    return NGX_DECLINED;
+    return ngx_http_access_found(r, deny);
 }
 
 
@@ -180,42 +167,27 @@ static ngx_int_t
 ngx_http_access_inet6(ngx_http_request_t *r, ngx_http_access_loc_conf_t *alcf,
     u_char *p)
 {
-    ngx_uint_t                n;
-    ngx_uint_t                i;
-    ngx_http_access_rule6_t  *rule6;
+    uintptr_t  deny;
 
-    rule6 = alcf->rules6->elts;
-    for (i = 0; i < alcf->rules6->nelts; i++) {
+    deny = ngx_radix128tree_find(alcf->rules6, p);
 
 #if (NGX_DEBUG)
-        {
-        size_t  cl, ml, al;
-        u_char  ct[NGX_INET6_ADDRSTRLEN];
-        u_char  mt[NGX_INET6_ADDRSTRLEN];
-        u_char  at[NGX_INET6_ADDRSTRLEN];
+    {
+    size_t  cl;
+    u_char  ct[NGX_INET6_ADDRSTRLEN];
 
-        cl = ngx_inet6_ntop(p, ct, NGX_INET6_ADDRSTRLEN);
-        ml = ngx_inet6_ntop(rule6[i].mask.s6_addr, mt, NGX_INET6_ADDRSTRLEN);
-        al = ngx_inet6_ntop(rule6[i].addr.s6_addr, at, NGX_INET6_ADDRSTRLEN);
+    cl = ngx_inet6_ntop(p, ct, NGX_INET6_ADDRSTRLEN);
 
-        ngx_log_debug6(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "access: %*s %*s %*s", cl, ct, ml, mt, al, at);
-        }
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "access: %*s %i", cl, ct, (ngx_int_t) deny);
+    }
 #endif
 
-        for (n = 0; n < 16; n++) {
-            if ((p[n] & rule6[i].mask.s6_addr[n]) != rule6[i].addr.s6_addr[n]) {
-                goto next;
-            }
-        }
-
-        return ngx_http_access_found(r, rule6[i].deny);
-
-    next:
-        continue;
+    if (deny == NGX_RADIX_NO_VALUE) {
+        return NGX_DECLINED;
     }
 
-    return NGX_DECLINED;
+    return ngx_http_access_found(r, deny);
 }
 
 #endif
@@ -246,20 +218,18 @@ ngx_http_access_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_access_loc_conf_t *alcf = conf;
 
-    ngx_int_t                 rc;
-    ngx_uint_t                all;
-    ngx_str_t                *value;
-    ngx_cidr_t                cidr;
-    ngx_http_access_rule_t   *rule;
-#if (NGX_HAVE_INET6)
-    ngx_http_access_rule6_t  *rule6;
-#endif
+    uint32_t     addr, mask;
+    ngx_int_t    rc;
+    ngx_uint_t   all, deny;
+    ngx_str_t   *value;
+    ngx_cidr_t   cidr;
 
     ngx_memzero(&cidr, sizeof(ngx_cidr_t));
 
     value = cf->args->elts;
 
     all = (value[1].len == 3 && ngx_strcmp(value[1].data, "all") == 0);
+    deny = (value[0].data[0] == 'd') ? 1 : 0;
 
     if (!all) {
 
@@ -284,22 +254,26 @@ ngx_http_access_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     case 0: /* all */
 
         if (alcf->rules6 == NULL) {
-            alcf->rules6 = ngx_array_create(cf->pool, 4,
-                                            sizeof(ngx_http_access_rule6_t));
+            alcf->rules6 = ngx_radix_tree_create(cf->pool, 0);
             if (alcf->rules6 == NULL) {
                 return NGX_CONF_ERROR;
             }
         }
 
-        rule6 = ngx_array_push(alcf->rules6);
-        if (rule6 == NULL) {
-            return NGX_CONF_ERROR;
+        if (ngx_radix128tree_find_masked(alcf->rules6,
+                                         cidr.u.in6.addr.s6_addr,
+                                         cidr.u.in6.mask.s6_addr)
+            == NGX_RADIX_NO_VALUE)
+        {
+            if (ngx_radix128tree_insert(alcf->rules6,
+                                        cidr.u.in6.addr.s6_addr,
+                                        cidr.u.in6.mask.s6_addr, deny)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
         }
 
-        rule6->mask = cidr.u.in6.mask;
-        rule6->addr = cidr.u.in6.addr;
-        rule6->deny = (value[0].data[0] == 'd') ? 1 : 0;
-
         if (!all) {
             break;
         }
@@ -310,21 +284,26 @@ ngx_http_access_rule(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     default: /* AF_INET */
 
         if (alcf->rules == NULL) {
-            alcf->rules = ngx_array_create(cf->pool, 4,
-                                           sizeof(ngx_http_access_rule_t));
+            alcf->rules = ngx_radix_tree_create(cf->pool, 0);
             if (alcf->rules == NULL) {
                 return NGX_CONF_ERROR;
             }
         }
 
-        rule = ngx_array_push(alcf->rules);
-        if (rule == NULL) {
-            return NGX_CONF_ERROR;
-        }
+        addr = ntohl(cidr.u.in.addr);
+        mask = ntohl(cidr.u.in.mask);
+
+        /* a rule covered by an earlier one can never match */
 
-        rule->mask = cidr.u.in.mask;
-        rule->addr = cidr.u.in.addr;
-        rule->deny = (value[0].data[0] == 'd') ? 1 : 0;
+        if (ngx_radix32tree_find_masked(alcf->rules, addr, mask)
+            == NGX_RADIX_NO_VALUE)
+        {
+            if (ngx_radix32tree_insert(alcf->rules, addr, mask, deny)
+                != NGX_OK)
+            {
+                return NGX_CONF_ERROR;
+            }
+        }
     }
 
     return NGX_CONF_OK;
@@ -9,9 +9,11 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <ngx_crypt.h>
+#include <ngx_md5.h>
 
 
-#define NGX_HTTP_AUTH_BUF_SIZE  2048
+#define NGX_HTTP_AUTH_CACHE_SIZE  1024
+#define NGX_HTTP_AUTH_FILES_MAX   64
 
 
 typedef struct {
@@ -19,6 +21,55 @@ typedef struct {
 } ngx_http_auth_basic_ctx_t;
 
 
+typedef struct {
+    ngx_str_node_t            sn;            /* user name */
+    ngx_str_t                 passwd;        /* null-terminated */
+} ngx_http_auth_basic_user_t;
+
+
+/*
+ * a user file parsed once per worker and kept until its inode,
+ * mtime or size change; it is looked at no more than once a second,
+ * and no more than NGX_HTTP_AUTH_FILES_MAX recently used files are kept
+ */
+
+typedef struct {
+    ngx_queue_t               queue;
+    ngx_str_t                 name;
+
+    ngx_pool_t               *pool;
+    ngx_rbtree_t              rbtree;
+    ngx_rbtree_node_t         sentinel;
+
+    ngx_file_uniq_t           uniq;
+    time_t                    mtime;
+    off_t                     size;
+    time_t                    checked;
+
+    ngx_uint_t                version;
+} ngx_http_auth_basic_file_t;
+
+
+/* a successfully verified "Authorization" header, keyed by md5 and file */
+
+typedef struct {
+    ngx_rbtree_node_t         node;
+    ngx_queue_t               queue;
+    u_char                    md5[16];
+    ngx_http_auth_basic_file_t  *file;
+    ngx_uint_t                version;
+} ngx_http_auth_basic_cred_t;
+
+
+typedef struct {
+    ngx_rbtree_t              rbtree;
+    ngx_rbtree_node_t         sentinel;
+    ngx_queue_t               lru;
+    ngx_queue_t               free;
+    ngx_uint_t                count;
+} ngx_http_auth_basic_cache_t;
+
+
 typedef struct {
     ngx_str_t                 realm;
     ngx_http_complex_value_t  user_file;
@@ -30,7 +81,21 @@ static ngx_int_t ngx_http_auth_basic_crypt_handler(ngx_http_request_t *r,
     ngx_http_auth_basic_ctx_t *ctx, ngx_str_t *passwd, ngx_str_t *realm);
 static ngx_int_t ngx_http_auth_basic_set_realm(ngx_http_request_t *r,
     ngx_str_t *realm);
+static ngx_int_t ngx_http_auth_basic_open(ngx_http_request_t *r,
+    ngx_str_t *name, ngx_http_auth_basic_file_t **filep);
+static ngx_int_t ngx_http_auth_basic_read(ngx_http_request_t *r,
+    ngx_http_auth_basic_file_t *abf, ngx_fd_t fd);
+static ngx_http_auth_basic_cred_t *ngx_http_auth_basic_cache_lookup(
+    ngx_http_auth_basic_file_t *abf, u_char *md5);
+static void ngx_http_auth_basic_cache_add(ngx_http_auth_basic_file_t *abf,
+    u_char *md5);
+static void ngx_http_auth_basic_cache_purge(ngx_http_auth_basic_file_t *abf);
+static ngx_int_t ngx_http_auth_basic_cred_cmp(u_char *md5,
+    ngx_http_auth_basic_file_t *abf, ngx_http_auth_basic_cred_t *cred);
+static void ngx_http_auth_basic_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
 static void ngx_http_auth_basic_close(ngx_file_t *file);
+static ngx_int_t ngx_http_auth_basic_init_process(ngx_cycle_t *cycle);
 static void *ngx_http_auth_basic_create_loc_conf(ngx_conf_t *cf);
 static char *ngx_http_auth_basic_merge_loc_conf(ngx_conf_t *cf,
     void *parent, void *child);
@@ -86,7 +151,7 @@ ngx_module_t  ngx_http_auth_basic_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_auth_basic_init_process,      /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -95,25 +160,23 @@ ngx_module_t  ngx_http_auth_basic_module = {
 };
 
 
+static ngx_queue_t                  ngx_http_auth_basic_files;
+static ngx_uint_t                   ngx_http_auth_basic_nfiles;
+static ngx_http_auth_basic_cache_t  ngx_http_auth_basic_cache;
+
+
 static ngx_int_t
 ngx_http_auth_basic_handler(ngx_http_request_t *r)
 {
-    off_t                            offset;
-    ssize_t                          n;
-    ngx_fd_t                         fd;
+    u_char                           md5[16];
+    uint32_t                         hash;
     ngx_int_t                        rc;
-    ngx_err_t                        err;
+    ngx_md5_t                        md5ctx;
     ngx_str_t                        pwd, user_file;
-    ngx_uint_t                       i, level, login, left, passwd;
-    ngx_file_t                       file;
     ngx_http_auth_basic_ctx_t       *ctx;
+    ngx_http_auth_basic_file_t      *abf;
+    ngx_http_auth_basic_user_t      *user;
     ngx_http_auth_basic_loc_conf_t  *alcf;
-    u_char                           buf[NGX_HTTP_AUTH_BUF_SIZE];
-    enum {
-        sw_login,
-        sw_passwd,
-        sw_skip
-    } state;
 
     alcf = ngx_http_get_module_loc_conf(r, ngx_http_auth_basic_module);
 
@@ -146,7 +209,163 @@ ngx_http_auth_basic_handler(ngx_http_request_t *r)
         return NGX_ERROR;
     }
 
-    fd = ngx_open_file(user_file.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    rc = ngx_http_auth_basic_open(r, &user_file, &abf);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_md5_init(&md5ctx);
+    ngx_md5_update(&md5ctx, r->headers_in.authorization->value.data,
+                   r->headers_in.authorization->value.len);
+    ngx_md5_final(md5, &md5ctx);
+
+    if (ngx_http_auth_basic_cache_lookup(abf, md5)) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "user \"%V\" is cached", &r->headers_in.user);
+        return NGX_OK;
+    }
+
+    hash = ngx_crc32_short(r->headers_in.user.data, r->headers_in.user.len);
+
+    user = (ngx_http_auth_basic_user_t *)
+               ngx_str_rbtree_lookup(&abf->rbtree, &r->headers_in.user, hash);
+
+    if (user == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "user \"%V\" was not found in \"%V\"",
+                      &r->headers_in.user, &user_file);
+
+        return ngx_http_auth_basic_set_realm(r, &alcf->realm);
+    }
+
+    pwd = user->passwd;
+
+    rc = ngx_http_auth_basic_crypt_handler(r, NULL, &pwd, &alcf->realm);
+
+    if (rc == NGX_OK) {
+        ngx_http_auth_basic_cache_add(abf, md5);
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_auth_basic_crypt_handler(ngx_http_request_t *r,
+    ngx_http_auth_basic_ctx_t *ctx, ngx_str_t *passwd, ngx_str_t *realm)
+{
+    ngx_int_t   rc;
+    u_char     *encrypted;
+
+    rc = ngx_crypt(r->pool, r->headers_in.passwd.data, passwd->data,
+                   &encrypted);
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "rc: %d user: \"%V\" salt: \"%s\"",
+                   rc, &r->headers_in.user, passwd->data);
+
+    if (rc == NGX_OK) {
+        if (ngx_strcmp(encrypted, passwd->data) == 0) {
+            return NGX_OK;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "encrypted: \"%s\"", encrypted);
+
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "user \"%V\": password mismatch",
+                      &r->headers_in.user);
+
+        return ngx_http_auth_basic_set_realm(r, realm);
+    }
+
+    if (rc == NGX_ERROR) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* rc == NGX_AGAIN */
+
+    if (ctx == NULL) {
+        ctx = ngx_palloc(r->pool, sizeof(ngx_http_auth_basic_ctx_t));
+        if (ctx == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_http_set_ctx(r, ctx, ngx_http_auth_basic_module);
+
+        ctx->passwd.len = passwd->len;
+        passwd->len++;
+
+        ctx->passwd.data = ngx_pstrdup(r->pool, passwd);
+        if (ctx->passwd.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+    }
+
+    /* TODO: add mutex event */
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_auth_basic_set_realm(ngx_http_request_t *r, ngx_str_t *realm)
+{
+    r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers);
+    if (r->headers_out.www_authenticate == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    r->headers_out.www_authenticate->hash = 1;
+    ngx_str_set(&r->headers_out.www_authenticate->key, "WWW-Authenticate");
+    r->headers_out.www_authenticate->value = *realm;
+
+    return NGX_HTTP_UNAUTHORIZED;
+}
+
+static ngx_int_t
+ngx_http_auth_basic_open(ngx_http_request_t *r, ngx_str_t *name,
+    ngx_http_auth_basic_file_t **filep)
+{
+    ngx_fd_t                     fd;
+    ngx_int_t                    rc;
+    ngx_err_t                    err;
+    ngx_uint_t                   level;
+    ngx_queue_t                 *q;
+    ngx_file_t                   file;
+    ngx_file_info_t              fi;
+    ngx_http_auth_basic_file_t  *abf;
+
+    abf = NULL;
+
+    for (q = ngx_queue_head(&ngx_http_auth_basic_files);
+         q != ngx_queue_sentinel(&ngx_http_auth_basic_files);
+         q = ngx_queue_next(q))
+    {
+        abf = ngx_queue_data(q, ngx_http_auth_basic_file_t, queue);
+
+        if (abf->name.len == name->len
+            && ngx_strncmp(abf->name.data, name->data, name->len) == 0)
+        {
+            break;
+        }
+
+        abf = NULL;
+    }
+
+    if (abf) {
+        ngx_queue_remove(&abf->queue);
+        ngx_queue_insert_head(&ngx_http_auth_basic_files, &abf->queue);
+
+        if (abf->pool && abf->checked == ngx_time()) {
+            *filep = abf;
+            return NGX_OK;
+        }
+    }
+
+    fd = ngx_open_file(name->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
 
     if (fd == NGX_INVALID_FILE) {
         err = ngx_errno;
@@ -161,201 +380,428 @@ ngx_http_auth_basic_handler(ngx_http_request_t *r)
         }
 
         ngx_log_error(level, r->connection->log, err,
-                      ngx_open_file_n " \"%s\" failed", user_file.data);
+                      ngx_open_file_n " \"%s\" failed", name->data);
 
-        return rc;
+        if (abf == NULL) {
+            return rc;
+        }
+
+        goto failed;
     }
 
     ngx_memzero(&file, sizeof(ngx_file_t));
 
     file.fd = fd;
-    file.name = user_file;
+    file.name = *name;
     file.log = r->connection->log;
 
-    state = sw_login;
-    passwd = 0;
-    login = 0;
-    left = 0;
-    offset = 0;
+    if (abf == NULL) {
 
-    for ( ;; ) {
-        i = left;
+        if (ngx_http_auth_basic_nfiles == NGX_HTTP_AUTH_FILES_MAX) {
+            q = ngx_queue_last(&ngx_http_auth_basic_files);
+            abf = ngx_queue_data(q, ngx_http_auth_basic_file_t, queue);
 
-        n = ngx_read_file(&file, buf + left, NGX_HTTP_AUTH_BUF_SIZE - left,
-                          offset);
+            ngx_queue_remove(q);
+            ngx_http_auth_basic_nfiles--;
 
-        if (n == NGX_ERROR) {
+            ngx_http_auth_basic_cache_purge(abf);
+
+            if (abf->pool) {
+                ngx_destroy_pool(abf->pool);
+            }
+
+            ngx_free(abf);
+        }
+
+        abf = ngx_alloc(sizeof(ngx_http_auth_basic_file_t) + name->len,
+                        r->connection->log);
+        if (abf == NULL) {
             ngx_http_auth_basic_close(&file);
             return NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
+        ngx_memzero(abf, sizeof(ngx_http_auth_basic_file_t));
+
+        abf->name.len = name->len;
+        abf->name.data = (u_char *) abf + sizeof(ngx_http_auth_basic_file_t);
+        ngx_memcpy(abf->name.data, name->data, name->len);
+
+        ngx_queue_insert_head(&ngx_http_auth_basic_files, &abf->queue);
+        ngx_http_auth_basic_nfiles++;
+    }
+
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", name->data);
+
+        ngx_http_auth_basic_close(&file);
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        goto failed;
+    }
+
+    if (abf->pool
+        && abf->uniq == ngx_file_uniq(&fi)
+        && abf->mtime == ngx_file_mtime(&fi)
+        && abf->size == ngx_file_size(&fi))
+    {
+        ngx_http_auth_basic_close(&file);
+
+        abf->checked = ngx_time();
+
+        *filep = abf;
+        return NGX_OK;
+    }
+
+    abf->size = ngx_file_size(&fi);
+
+    rc = ngx_http_auth_basic_read(r, abf, fd);
+
+    ngx_http_auth_basic_close(&file);
+
+    if (rc != NGX_OK) {
+        goto failed;
+    }
+
+    abf->uniq = ngx_file_uniq(&fi);
+    abf->mtime = ngx_file_mtime(&fi);
+    abf->checked = ngx_time();
+
+    *filep = abf;
+    return NGX_OK;
+
+failed:
+
+    /* the users of a file that cannot be read are not trusted any longer */
+
+    if (abf->pool) {
+        ngx_destroy_pool(abf->pool);
+        abf->pool = NULL;
+        abf->version++;
+    }
+
+    return rc;
+}
+
+
+static ngx_int_t
+ngx_http_auth_basic_read(ngx_http_request_t *r,
+    ngx_http_auth_basic_file_t *abf, ngx_fd_t fd)
+{
+    off_t                        offset;
+    size_t                       size;
+    ssize_t                      n;
+    u_char                      *buf, *p, *end, *line, *last, *colon;
+    uint32_t                     hash;
+    ngx_str_t                    login;
+    ngx_file_t                   file;
+    ngx_pool_t                  *pool;
+    ngx_http_auth_basic_user_t  *user;
+
+    size = (size_t) abf->size;
+
+    buf = ngx_alloc(size + 1, r->connection->log);
+    if (buf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+
+    file.fd = fd;
+    file.name = abf->name;
+    file.log = r->connection->log;
+
+    for (offset = 0; offset < (off_t) size; offset += n) {
+        n = ngx_read_file(&file, buf + offset, size - (size_t) offset, offset);
+
+        if (n == NGX_ERROR) {
+            ngx_free(buf);
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
         if (n == 0) {
             break;
         }
+    }
 
-        for (i = left; i < left + n; i++) {
-            switch (state) {
+    /* the pool outlives the request, so it logs to the cycle log */
 
-            case sw_login:
-                if (login == 0) {
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        ngx_free(buf);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-                    if (buf[i] == '#' || buf[i] == CR) {
-                        state = sw_skip;
-                        break;
-                    }
+    if (abf->pool) {
+        ngx_destroy_pool(abf->pool);
+    }
 
-                    if (buf[i] == LF) {
-                        break;
-                    }
-                }
+    abf->pool = pool;
+    abf->version++;
 
-                if (buf[i] != r->headers_in.user.data[login]) {
-                    state = sw_skip;
-                    break;
-                }
+    ngx_rbtree_init(&abf->rbtree, &abf->sentinel,
+                    ngx_str_rbtree_insert_value);
 
-                if (login == r->headers_in.user.len) {
-                    state = sw_passwd;
-                    passwd = i + 1;
-                }
+    p = buf;
+    end = buf + offset;
 
-                login++;
+    while (p < end) {
+        line = p;
 
-                break;
+        last = ngx_strlchr(p, end, LF);
+        if (last == NULL) {
+            last = end;
+        }
 
-            case sw_passwd:
-                if (buf[i] == LF || buf[i] == CR || buf[i] == ':') {
-                    buf[i] = '\0';
+        p = last + 1;
 
-                    ngx_http_auth_basic_close(&file);
+        if (line == last || *line == '#' || *line == CR) {
+            continue;
+        }
 
-                    pwd.len = i - passwd;
-                    pwd.data = &buf[passwd];
+        colon = ngx_strlchr(line, last, ':');
+        if (colon == NULL) {
+            continue;
+        }
 
-                    return ngx_http_auth_basic_crypt_handler(r, NULL, &pwd,
-                                                             &alcf->realm);
-                }
+        login.len = colon - line;
+        login.data = line;
 
-                break;
+        hash = ngx_crc32_short(login.data, login.len);
 
-            case sw_skip:
-                if (buf[i] == LF) {
-                    state = sw_login;
-                    login = 0;
-                }
+        if (ngx_str_rbtree_lookup(&abf->rbtree, &login, hash)) {
+            continue;
+        }
 
+        for (colon++, line = colon; line < last; line++) {
+            if (*line == CR || *line == ':') {
                 break;
             }
         }
 
-        if (state == sw_passwd) {
-            left = left + n - passwd;
-            ngx_memmove(buf, &buf[passwd], left);
-            passwd = 0;
+        user = ngx_palloc(pool, sizeof(ngx_http_auth_basic_user_t));
+        if (user == NULL) {
+            goto failed;
+        }
 
-        } else {
-            left = 0;
+        user->sn.str.len = login.len;
+        user->sn.str.data = ngx_pnalloc(pool, login.len + (line - colon) + 1);
+        if (user->sn.str.data == NULL) {
+            goto failed;
         }
 
-        offset += n;
+        ngx_memcpy(user->sn.str.data, login.data, login.len);
+
+        user->passwd.len = line - colon;
+        user->passwd.data = user->sn.str.data + login.len;
+        ngx_cpystrn(user->passwd.data, colon, user->passwd.len + 1);
+
+        user->sn.node.key = hash;
+
+        ngx_rbtree_insert(&abf->rbtree, &user->sn.node);
     }
 
-    ngx_http_auth_basic_close(&file);
+    ngx_free(buf);
 
-    if (state == sw_passwd) {
-        pwd.len = i - passwd;
-        pwd.data = ngx_pnalloc(r->pool, pwd.len + 1);
-        if (pwd.data == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "auth basic file \"%V\" read, version %ui",
+                   &abf->name, abf->version);
 
-        ngx_cpystrn(pwd.data, &buf[passwd], pwd.len + 1);
+    return NGX_OK;
 
-        return ngx_http_auth_basic_crypt_handler(r, NULL, &pwd, &alcf->realm);
-    }
+failed:
 
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                  "user \"%V\" was not found in \"%V\"",
-                  &r->headers_in.user, &user_file);
+    ngx_free(buf);
 
-    return ngx_http_auth_basic_set_realm(r, &alcf->realm);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
 }
 
 
-static ngx_int_t
-ngx_http_auth_basic_crypt_handler(ngx_http_request_t *r,
-    ngx_http_auth_basic_ctx_t *ctx, ngx_str_t *passwd, ngx_str_t *realm)
+static ngx_http_auth_basic_cred_t *
+ngx_http_auth_basic_cache_lookup(ngx_http_auth_basic_file_t *abf, u_char *md5)
 {
-    ngx_int_t   rc;
-    u_char     *encrypted;
+    ngx_int_t                     rc;
+    ngx_rbtree_key_t              key;
+    ngx_rbtree_node_t            *node, *sentinel;
+    ngx_http_auth_basic_cred_t   *cred;
+    ngx_http_auth_basic_cache_t  *cache;
 
-    rc = ngx_crypt(r->pool, r->headers_in.passwd.data, passwd->data,
-                   &encrypted);
+    cache = &ngx_http_auth_basic_cache;
 
-    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "rc: %d user: \"%V\" salt: \"%s\"",
-                   rc, &r->headers_in.user, passwd->data);
+    ngx_memcpy((u_char *) &key, md5, sizeof(ngx_rbtree_key_t));
 
-    if (rc == NGX_OK) {
-        if (ngx_strcmp(encrypted, passwd->data) == 0) {
-            return NGX_OK;
+    node = cache->rbtree.root;
+    sentinel = cache->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (key < node->key) {
+            node = node->left;
+            continue;
         }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "encrypted: \"%s\"", encrypted);
+        if (key > node->key) {
+            node = node->right;
+            continue;
+        }
 
-        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                      "user \"%V\": password mismatch",
-                      &r->headers_in.user);
+        /* key == node->key */
 
-        return ngx_http_auth_basic_set_realm(r, realm);
-    }
+        cred = (ngx_http_auth_basic_cred_t *) node;
 
-    if (rc == NGX_ERROR) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
+        rc = ngx_http_auth_basic_cred_cmp(md5, abf, cred);
 
-    /* rc == NGX_AGAIN */
+        if (rc == 0) {
+            if (cred->version != abf->version) {
+                ngx_rbtree_delete(&cache->rbtree, &cred->node);
+                ngx_queue_remove(&cred->queue);
+                ngx_queue_insert_head(&cache->free, &cred->queue);
+                return NULL;
+            }
 
-    if (ctx == NULL) {
-        ctx = ngx_palloc(r->pool, sizeof(ngx_http_auth_basic_ctx_t));
-        if (ctx == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            ngx_queue_remove(&cred->queue);
+            ngx_queue_insert_head(&cache->lru, &cred->queue);
+
+            return cred;
         }
 
-        ngx_http_set_ctx(r, ctx, ngx_http_auth_basic_module);
+        node = (rc < 0) ? node->left : node->right;
+    }
 
-        ctx->passwd.len = passwd->len;
-        passwd->len++;
+    return NULL;
+}
 
-        ctx->passwd.data = ngx_pstrdup(r->pool, passwd);
-        if (ctx->passwd.data == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+static void
+ngx_http_auth_basic_cache_add(ngx_http_auth_basic_file_t *abf, u_char *md5)
+{
+    ngx_queue_t                  *q;
+    ngx_http_auth_basic_cred_t   *cred;
+    ngx_http_auth_basic_cache_t  *cache;
+
+    cache = &ngx_http_auth_basic_cache;
+
+    if (!ngx_queue_empty(&cache->free)) {
+        q = ngx_queue_head(&cache->free);
+        ngx_queue_remove(q);
+
+        cred = ngx_queue_data(q, ngx_http_auth_basic_cred_t, queue);
+
+    } else if (cache->count < NGX_HTTP_AUTH_CACHE_SIZE) {
+        cred = ngx_alloc(sizeof(ngx_http_auth_basic_cred_t), ngx_cycle->log);
+        if (cred == NULL) {
+            return;
         }
 
+        cache->count++;
+
+    } else {
+        q = ngx_queue_last(&cache->lru);
+        ngx_queue_remove(q);
+
+        cred = ngx_queue_data(q, ngx_http_auth_basic_cred_t, queue);
+
+        ngx_rbtree_delete(&cache->rbtree, &cred->node);
     }
 
-    /* TODO: add mutex event */
+    ngx_memcpy(cred->md5, md5, 16);
+    ngx_memcpy((u_char *) &cred->node.key, md5, sizeof(ngx_rbtree_key_t));
+    cred->file = abf;
+    cred->version = abf->version;
 
-    return rc;
+    ngx_rbtree_insert(&cache->rbtree, &cred->node);
+    ngx_queue_insert_head(&cache->lru, &cred->queue);
+}
+
+
+static void
+ngx_http_auth_basic_cache_purge(ngx_http_auth_basic_file_t *abf)
+{
+    ngx_queue_t                  *q, *next;
+    ngx_http_auth_basic_cred_t   *cred;
+    ngx_http_auth_basic_cache_t  *cache;
+
+    cache = &ngx_http_auth_basic_cache;
+
+    for (q = ngx_queue_head(&cache->lru);
+         q != ngx_queue_sentinel(&cache->lru);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        cred = ngx_queue_data(q, ngx_http_auth_basic_cred_t, queue);
+
+        if (cred->file != abf) {
+            continue;
+        }
+
+        ngx_rbtree_delete(&cache->rbtree, &cred->node);
+        ngx_queue_remove(q);
+        ngx_queue_insert_head(&cache->free, q);
+    }
 }
 
 
 static ngx_int_t
-ngx_http_auth_basic_set_realm(ngx_http_request_t *r, ngx_str_t *realm)
+ngx_http_auth_basic_cred_cmp(u_char *md5, ngx_http_auth_basic_file_t *abf,
+    ngx_http_auth_basic_cred_t *cred)
 {
-    r->headers_out.www_authenticate = ngx_list_push(&r->headers_out.headers);
-    if (r->headers_out.www_authenticate == NULL) {
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    ngx_int_t  rc;
+
+    rc = ngx_memcmp(md5, cred->md5, 16);
+
+    if (rc != 0) {
+        return rc;
     }
 
-    r->headers_out.www_authenticate->hash = 1;
-    ngx_str_set(&r->headers_out.www_authenticate->key, "WWW-Authenticate");
-    r->headers_out.www_authenticate->value = *realm;
+    if (abf == cred->file) {
+        return 0;
+    }
 
-    return NGX_HTTP_UNAUTHORIZED;
+    return ((uintptr_t) abf < (uintptr_t) cred->file) ? -1 : 1;
 }
 
+
+static void
+ngx_http_auth_basic_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t           **p;
+    ngx_http_auth_basic_cred_t   *cn, *ct;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            cn = (ngx_http_auth_basic_cred_t *) node;
+            ct = (ngx_http_auth_basic_cred_t *) temp;
+
+            p = (ngx_http_auth_basic_cred_cmp(cn->md5, cn->file, ct) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
 static void
 ngx_http_auth_basic_close(ngx_file_t *file)
 {
@@ -366,6 +812,22 @@ ngx_http_auth_basic_close(ngx_file_t *file)
 }
 
 
+static ngx_int_t
+ngx_http_auth_basic_init_process(ngx_cycle_t *cycle)
+{
+    ngx_queue_init(&ngx_http_auth_basic_files);
+
+    ngx_rbtree_init(&ngx_http_auth_basic_cache.rbtree,
+                    &ngx_http_auth_basic_cache.sentinel,
+                    ngx_http_auth_basic_rbtree_insert_value);
+
+    ngx_queue_init(&ngx_http_auth_basic_cache.lru);
+    ngx_queue_init(&ngx_http_auth_basic_cache.free);
+
+    return NGX_OK;
+}
+
+
 static void *
 ngx_http_auth_basic_create_loc_conf(ngx_conf_t *cf)
 {
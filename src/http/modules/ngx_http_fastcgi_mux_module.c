@@ -0,0 +1,1760 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * FastCGI request multiplexing: requests to a peer are interleaved
+ * as FastCGI request ids over a small number of shared connections.
+ *
+ * Each request is given a virtual connection whose recv/send methods
+ * exchange data with the shared one: outgoing records have their request
+ * id rewritten and are queued on the shared connection, incoming records
+ * are demultiplexed by id and handed to the request with the id set back
+ * to 1, so the FastCGI module sees an ordinary dedicated connection.
+ *
+ * A new shared connection is used only after the backend has confirmed
+ * FCGI_MPXS_CONNS in reply to FCGI_GET_VALUES; backends which do not are
+ * remembered and get a connection per request, the negotiation is retried
+ * after a backoff doubled on each failure.
+ *
+ * The shared connection is not read while the data buffered for any
+ * of its requests exceeds the high water mark, and requests wait while
+ * the data queued to the backend exceed it.
+ */
+
+
+#define NGX_HTTP_FASTCGI_MUX_BEGIN_REQUEST  1
+#define NGX_HTTP_FASTCGI_MUX_ABORT_REQUEST  2
+#define NGX_HTTP_FASTCGI_MUX_END_REQUEST    3
+#define NGX_HTTP_FASTCGI_MUX_STDOUT         6
+#define NGX_HTTP_FASTCGI_MUX_GET_VALUES     9
+#define NGX_HTTP_FASTCGI_MUX_VALUES_RESULT  10
+#define NGX_HTTP_FASTCGI_MUX_UNKNOWN_TYPE   11
+
+#define NGX_HTTP_FASTCGI_MUX_KEEP_CONN      1
+
+#define NGX_HTTP_FASTCGI_MUX_HEADER_LEN     8
+
+#define NGX_HTTP_FASTCGI_MUX_BUFFER_SIZE    16384
+#define NGX_HTTP_FASTCGI_MUX_CHUNK_SIZE     4096
+#define NGX_HTTP_FASTCGI_MUX_VALUES_SIZE    256
+#define NGX_HTTP_FASTCGI_MUX_HIGH_WATER     65536
+
+#define NGX_HTTP_FASTCGI_MUX_BACKOFF        60
+#define NGX_HTTP_FASTCGI_MUX_MAX_BACKOFF    3600
+
+
+typedef struct ngx_http_fastcgi_mux_conn_s    ngx_http_fastcgi_mux_conn_t;
+typedef struct ngx_http_fastcgi_mux_stream_s  ngx_http_fastcgi_mux_stream_t;
+
+
+typedef struct {
+    time_t                             expire;
+    time_t                             backoff;
+
+    socklen_t                          socklen;
+    u_char                             sockaddr[NGX_SOCKADDRLEN];
+} ngx_http_fastcgi_mux_addr_t;
+
+
+typedef struct {
+    ngx_uint_t                         connections;
+    ngx_uint_t                         requests;
+
+    ngx_queue_t                        conns;
+
+    /* ngx_http_fastcgi_mux_addr_t, backends without FCGI_MPXS_CONNS */
+    ngx_array_t                       *plain;
+    ngx_uint_t                         max_plain;
+
+    ngx_http_upstream_init_pt          original_init_upstream;
+    ngx_http_upstream_init_peer_pt     original_init_peer;
+
+} ngx_http_fastcgi_mux_srv_conf_t;
+
+
+struct ngx_http_fastcgi_mux_conn_s {
+    ngx_queue_t                        queue;
+    ngx_http_fastcgi_mux_srv_conf_t   *conf;
+
+    ngx_pool_t                        *pool;
+    ngx_peer_connection_t              peer;
+
+    socklen_t                          socklen;
+    u_char                             sockaddr[NGX_SOCKADDRLEN];
+
+    /* request ids in use, including aborted ones awaiting FCGI_END_REQUEST */
+    ngx_http_fastcgi_mux_stream_t    **streams;
+    ngx_uint_t                         nbusy;
+    ngx_uint_t                         nstreams;
+
+    ngx_chain_t                       *out;
+    ngx_chain_t                      **last_out;
+    size_t                             out_size;
+
+    /* requests whose data exceed the high water mark */
+    ngx_uint_t                         nblocked;
+
+    u_char                            *buffer;
+
+    /* the content of an incoming management record */
+    u_char                             values[NGX_HTTP_FASTCGI_MUX_VALUES_SIZE];
+    size_t                             values_len;
+
+    /* the state of an incoming record */
+    u_char                             header[NGX_HTTP_FASTCGI_MUX_HEADER_LEN];
+    ngx_uint_t                         header_len;
+    ngx_uint_t                         id;
+    size_t                             rest;
+    ngx_http_fastcgi_mux_stream_t     *stream;
+
+    unsigned                           connected:1;
+    unsigned                           multiplexed:1;
+    unsigned                           write_blocked:1;
+};
+
+
+struct ngx_http_fastcgi_mux_stream_s {
+    ngx_connection_t                   connection;
+    ngx_event_t                        read;
+    ngx_event_t                        write;
+
+    ngx_http_fastcgi_mux_conn_t       *mux;
+    ngx_uint_t                         id;
+
+    ngx_chain_t                       *in;
+    ngx_chain_t                       *last_in;
+    size_t                             size;
+
+    /* the state of an outgoing record */
+    ngx_uint_t                         out_header;
+    ngx_uint_t                         out_type;
+    size_t                             out_length;
+    size_t                             out_total;
+    size_t                             out_rest;
+
+    unsigned                           sent:1;
+    unsigned                           closed:1;
+    unsigned                           done:1;
+    unsigned                           error:1;
+    unsigned                           blocked:1;
+    unsigned                           write_blocked:1;
+};
+
+
+typedef struct {
+    ngx_http_fastcgi_mux_srv_conf_t   *conf;
+
+    ngx_http_request_t                *request;
+
+    void                              *data;
+
+    ngx_event_get_peer_pt              original_get_peer;
+    ngx_event_free_peer_pt             original_free_peer;
+
+    ngx_http_fastcgi_mux_stream_t     *stream;
+
+} ngx_http_fastcgi_mux_peer_data_t;
+
+
+static ngx_int_t ngx_http_fastcgi_mux_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us);
+static ngx_int_t ngx_http_fastcgi_mux_get_peer(ngx_peer_connection_t *pc,
+    void *data);
+static void ngx_http_fastcgi_mux_free_peer(ngx_peer_connection_t *pc,
+    void *data, ngx_uint_t state);
+
+static ngx_http_fastcgi_mux_conn_t *ngx_http_fastcgi_mux_connect(
+    ngx_http_fastcgi_mux_srv_conf_t *conf, ngx_peer_connection_t *pc,
+    ngx_msec_t timeout);
+static void ngx_http_fastcgi_mux_release(ngx_http_fastcgi_mux_stream_t *s);
+static void ngx_http_fastcgi_mux_read_handler(ngx_event_t *rev);
+static void ngx_http_fastcgi_mux_write_handler(ngx_event_t *wev);
+static ngx_int_t ngx_http_fastcgi_mux_route(ngx_http_fastcgi_mux_conn_t *mux,
+    u_char *p, u_char *last);
+static ngx_int_t ngx_http_fastcgi_mux_deliver(
+    ngx_http_fastcgi_mux_stream_t *s, u_char *p, size_t len);
+static ngx_int_t ngx_http_fastcgi_mux_values(ngx_http_fastcgi_mux_conn_t *mux);
+static void ngx_http_fastcgi_mux_plain(ngx_http_fastcgi_mux_conn_t *mux);
+static ngx_http_fastcgi_mux_addr_t *ngx_http_fastcgi_mux_find_plain(
+    ngx_http_fastcgi_mux_srv_conf_t *conf, u_char *sockaddr,
+    socklen_t socklen);
+static void ngx_http_fastcgi_mux_unblock(ngx_http_fastcgi_mux_stream_t *s);
+static void ngx_http_fastcgi_mux_wakeup(ngx_event_t *ev);
+static ngx_int_t ngx_http_fastcgi_mux_flush(ngx_http_fastcgi_mux_conn_t *mux);
+static void ngx_http_fastcgi_mux_error(ngx_http_fastcgi_mux_conn_t *mux);
+static void ngx_http_fastcgi_mux_close(ngx_http_fastcgi_mux_conn_t *mux);
+static ngx_chain_t *ngx_http_fastcgi_mux_alloc_chain(size_t size,
+    ngx_log_t *log);
+static void ngx_http_fastcgi_mux_free_chain(ngx_chain_t *cl);
+
+static ssize_t ngx_http_fastcgi_mux_recv(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ssize_t ngx_http_fastcgi_mux_recv_chain(ngx_connection_t *c,
+    ngx_chain_t *in);
+static ssize_t ngx_http_fastcgi_mux_send(ngx_connection_t *c, u_char *buf,
+    size_t size);
+static ngx_chain_t *ngx_http_fastcgi_mux_send_chain(ngx_connection_t *c,
+    ngx_chain_t *in, off_t limit);
+static void ngx_http_fastcgi_mux_patch(ngx_http_fastcgi_mux_stream_t *s,
+    u_char *p, u_char *last);
+
+static void *ngx_http_fastcgi_mux_create_conf(ngx_conf_t *cf);
+static char *ngx_http_fastcgi_mux(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+/* marks request ids aborted by nginx but not yet ended by the backend */
+static ngx_http_fastcgi_mux_stream_t  ngx_http_fastcgi_mux_draining;
+
+
+static ngx_command_t  ngx_http_fastcgi_mux_commands[] = {
+
+    { ngx_string("fastcgi_multiplex"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_fastcgi_mux,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_fastcgi_mux_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_fastcgi_mux_create_conf,      /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_fastcgi_mux_module = {
+    NGX_MODULE_V1,
+    &ngx_http_fastcgi_mux_module_ctx,      /* module context */
+    ngx_http_fastcgi_mux_commands,         /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_init(ngx_conf_t *cf, ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_uint_t                        i, n;
+    ngx_http_upstream_server_t       *server;
+    ngx_http_fastcgi_mux_srv_conf_t  *mcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                   "init fastcgi multiplex");
+
+    mcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_fastcgi_mux_module);
+
+    if (mcf->original_init_upstream(cf, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mcf->original_init_peer = us->peer.init;
+
+    us->peer.init = ngx_http_fastcgi_mux_init_peer;
+
+    ngx_queue_init(&mcf->conns);
+
+    /* a backend is remembered at most once */
+
+    n = 0;
+
+    if (us->servers) {
+        server = us->servers->elts;
+
+        for (i = 0; i < us->servers->nelts; i++) {
+            n += server[i].naddrs;
+        }
+    }
+
+    mcf->max_plain = n ? n : 1;
+
+    mcf->plain = ngx_array_create(cf->pool, mcf->max_plain,
+                                  sizeof(ngx_http_fastcgi_mux_addr_t));
+    if (mcf->plain == NULL) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_init_peer(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *us)
+{
+    ngx_http_fastcgi_mux_srv_conf_t   *mcf;
+    ngx_http_fastcgi_mux_peer_data_t  *mp;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "init fastcgi multiplex peer");
+
+    mcf = ngx_http_conf_upstream_srv_conf(us, ngx_http_fastcgi_mux_module);
+
+    mp = ngx_palloc(r->pool, sizeof(ngx_http_fastcgi_mux_peer_data_t));
+    if (mp == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (mcf->original_init_peer(r, us) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mp->conf = mcf;
+    mp->request = r;
+    mp->data = r->upstream->peer.data;
+    mp->original_get_peer = r->upstream->peer.get;
+    mp->original_free_peer = r->upstream->peer.free;
+    mp->stream = NULL;
+
+    r->upstream->peer.data = mp;
+    r->upstream->peer.get = ngx_http_fastcgi_mux_get_peer;
+    r->upstream->peer.free = ngx_http_fastcgi_mux_free_peer;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_get_peer(ngx_peer_connection_t *pc, void *data)
+{
+    ngx_http_fastcgi_mux_peer_data_t  *mp = data;
+
+    ngx_int_t                         rc;
+    ngx_uint_t                        i, n;
+    ngx_queue_t                      *q;
+    ngx_connection_t                 *c;
+    ngx_http_upstream_t              *u;
+    ngx_http_fastcgi_mux_addr_t      *addr;
+    ngx_http_fastcgi_mux_conn_t      *mux, *m;
+    ngx_http_fastcgi_mux_stream_t    *s;
+    ngx_http_fastcgi_mux_srv_conf_t  *conf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get fastcgi multiplex peer");
+
+    /* ask balancer */
+
+    rc = mp->original_get_peer(pc, mp->data);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    /*
+     * virtual connections are never added to the event method,
+     * so the shared connection must report every readiness change
+     */
+
+    if (!(ngx_event_flags & NGX_USE_CLEAR_EVENT)) {
+        return NGX_OK;
+    }
+
+    conf = mp->conf;
+
+    addr = ngx_http_fastcgi_mux_find_plain(conf, (u_char *) pc->sockaddr,
+                                           pc->socklen);
+
+    if (addr && addr->expire > ngx_time()) {
+        return NGX_OK;
+    }
+
+    /* find the least loaded shared connection to the peer */
+
+    mux = NULL;
+    n = 0;
+
+    for (q = ngx_queue_head(&conf->conns);
+         q != ngx_queue_sentinel(&conf->conns);
+         q = ngx_queue_next(q))
+    {
+        m = ngx_queue_data(q, ngx_http_fastcgi_mux_conn_t, queue);
+
+        if (ngx_memn2cmp((u_char *) m->sockaddr, (u_char *) pc->sockaddr,
+                         m->socklen, pc->socklen)
+            != 0)
+        {
+            continue;
+        }
+
+        n++;
+
+        if (!m->multiplexed || m->nbusy == conf->requests) {
+            continue;
+        }
+
+        if (mux == NULL || m->nstreams < mux->nstreams) {
+            mux = m;
+        }
+    }
+
+    if ((mux == NULL || mux->nstreams) && n < conf->connections) {
+        u = mp->request->upstream;
+
+        /* the connection is used once the backend confirms multiplexing */
+
+        (void) ngx_http_fastcgi_mux_connect(conf, pc,
+                                            u->conf->connect_timeout);
+    }
+
+    if (mux == NULL) {
+        /* fall back to a dedicated connection */
+        return NGX_OK;
+    }
+
+    for (i = 0; mux->streams[i]; i++) { /* void */ }
+
+    s = ngx_pcalloc(mp->request->pool, sizeof(ngx_http_fastcgi_mux_stream_t));
+    if (s == NULL) {
+        return NGX_ERROR;
+    }
+
+    s->mux = mux;
+    s->id = i + 1;
+
+    mux->streams[i] = s;
+    mux->nbusy++;
+    mux->nstreams++;
+
+    mux->peer.connection->idle = 0;
+
+    c = &s->connection;
+
+    c->read = &s->read;
+    c->write = &s->write;
+    c->read->data = c;
+    c->write->data = c;
+    c->write->write = 1;
+    c->read->index = NGX_INVALID_INDEX;
+    c->write->index = NGX_INVALID_INDEX;
+
+    /* the shared connection is already registered in the event method */
+
+    c->read->active = 1;
+    c->write->active = 1;
+    c->write->ready = !mux->write_blocked;
+
+    c->fd = mux->peer.connection->fd;
+    c->pool = mp->request->pool;
+    c->log = pc->log;
+    c->read->log = pc->log;
+    c->write->log = pc->log;
+
+    c->recv = ngx_http_fastcgi_mux_recv;
+    c->send = ngx_http_fastcgi_mux_send;
+    c->recv_chain = ngx_http_fastcgi_mux_recv_chain;
+    c->send_chain = ngx_http_fastcgi_mux_send_chain;
+
+    c->number = ngx_atomic_fetch_add(ngx_connection_counter, 1);
+
+    mp->stream = s;
+    pc->connection = c;
+
+    ngx_log_debug3(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "get fastcgi multiplex peer: using connection %p, "
+                   "id:%ui, requests:%ui",
+                   mux->peer.connection, s->id, mux->nstreams);
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_fastcgi_mux_free_peer(ngx_peer_connection_t *pc, void *data,
+    ngx_uint_t state)
+{
+    ngx_http_fastcgi_mux_peer_data_t  *mp = data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "free fastcgi multiplex peer");
+
+    if (mp->stream) {
+        ngx_http_fastcgi_mux_release(mp->stream);
+
+        mp->stream = NULL;
+        pc->connection = NULL;
+    }
+
+    mp->original_free_peer(pc, mp->data, state);
+}
+
+
+static ngx_http_fastcgi_mux_conn_t *
+ngx_http_fastcgi_mux_connect(ngx_http_fastcgi_mux_srv_conf_t *conf,
+    ngx_peer_connection_t *pc, ngx_msec_t timeout)
+{
+    u_char                       *p;
+    ngx_int_t                     rc;
+    ngx_pool_t                   *pool;
+    ngx_chain_t                  *cl;
+    ngx_connection_t             *c;
+    ngx_http_fastcgi_mux_conn_t  *mux;
+
+    static u_char  get_values[] = {
+        1, NGX_HTTP_FASTCGI_MUX_GET_VALUES, 0, 0, 0, 17, 0, 0,
+        15, 0, 'F', 'C', 'G', 'I', '_', 'M', 'P', 'X', 'S', '_',
+        'C', 'O', 'N', 'N', 'S'
+    };
+
+    pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    mux = ngx_pcalloc(pool, sizeof(ngx_http_fastcgi_mux_conn_t));
+    if (mux == NULL) {
+        goto failed;
+    }
+
+    mux->streams = ngx_pcalloc(pool, conf->requests
+                                     * sizeof(ngx_http_fastcgi_mux_stream_t *));
+    if (mux->streams == NULL) {
+        goto failed;
+    }
+
+    mux->buffer = ngx_palloc(pool, NGX_HTTP_FASTCGI_MUX_BUFFER_SIZE);
+    if (mux->buffer == NULL) {
+        goto failed;
+    }
+
+    mux->conf = conf;
+    mux->pool = pool;
+    mux->last_out = &mux->out;
+
+    mux->socklen = pc->socklen;
+    ngx_memcpy(mux->sockaddr, pc->sockaddr, pc->socklen);
+
+    mux->peer.sockaddr = (struct sockaddr *) mux->sockaddr;
+    mux->peer.socklen = mux->socklen;
+    mux->peer.name = pc->name;
+    mux->peer.get = ngx_event_get_peer;
+    mux->peer.log = ngx_cycle->log;
+    mux->peer.log_error = NGX_ERROR_ERR;
+
+    cl = ngx_http_fastcgi_mux_alloc_chain(sizeof(get_values), ngx_cycle->log);
+    if (cl == NULL) {
+        goto failed;
+    }
+
+    p = ngx_cpymem(cl->buf->last, get_values, sizeof(get_values));
+    cl->buf->last = p;
+
+    mux->out = cl;
+    mux->last_out = &cl->next;
+    mux->out_size = sizeof(get_values);
+
+    rc = ngx_event_connect_peer(&mux->peer);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        ngx_http_fastcgi_mux_free_chain(cl);
+        goto failed;
+    }
+
+    c = mux->peer.connection;
+
+    c->data = mux;
+    c->pool = pool;
+    c->sendfile = 0;
+
+    c->read->handler = ngx_http_fastcgi_mux_read_handler;
+    c->write->handler = ngx_http_fastcgi_mux_write_handler;
+
+    /* the backend has to reply to FCGI_GET_VALUES in time */
+
+    ngx_add_timer(c->read, timeout);
+
+    ngx_queue_insert_tail(&conf->conns, &mux->queue);
+
+    if (rc == NGX_OK) {
+        mux->connected = 1;
+
+        if (ngx_http_fastcgi_mux_flush(mux) != NGX_OK) {
+            ngx_http_fastcgi_mux_error(mux);
+            return NULL;
+        }
+
+    } else {
+        ngx_add_timer(c->write, timeout);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
+                   "fastcgi multiplex connection %p to %V",
+                   c, pc->name);
+
+    return mux;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NULL;
+}
+
+
+static void
+ngx_http_fastcgi_mux_release(ngx_http_fastcgi_mux_stream_t *s)
+{
+    u_char                        *p;
+    ngx_chain_t                   *cl, *ln;
+    ngx_connection_t              *c;
+    ngx_http_fastcgi_mux_conn_t   *mux;
+
+    c = &s->connection;
+
+    if (c->read->timer_set) {
+        ngx_del_timer(c->read);
+    }
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (c->read->prev) {
+        ngx_delete_posted_event(c->read);
+    }
+
+    if (c->write->prev) {
+        ngx_delete_posted_event(c->write);
+    }
+
+    for (cl = s->in; cl; cl = ln) {
+        ln = cl->next;
+        ngx_http_fastcgi_mux_free_chain(cl);
+    }
+
+    s->in = NULL;
+    s->last_in = NULL;
+    s->size = 0;
+
+    mux = s->mux;
+
+    if (mux == NULL) {
+        return;
+    }
+
+    if (s->blocked) {
+        ngx_http_fastcgi_mux_unblock(s);
+    }
+
+    s->mux = NULL;
+    mux->nstreams--;
+
+    if (s->done || !s->sent) {
+        mux->streams[s->id - 1] = NULL;
+        mux->nbusy--;
+
+    } else {
+
+        /* the id stays busy until the backend ends the request */
+
+        mux->streams[s->id - 1] = &ngx_http_fastcgi_mux_draining;
+
+        if (!s->closed) {
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                           "fastcgi multiplex abort request id:%ui", s->id);
+
+            cl = ngx_http_fastcgi_mux_alloc_chain(
+                                              NGX_HTTP_FASTCGI_MUX_HEADER_LEN,
+                                              ngx_cycle->log);
+            if (cl == NULL) {
+                ngx_http_fastcgi_mux_error(mux);
+                return;
+            }
+
+            p = cl->buf->last;
+
+            *p++ = 1;
+            *p++ = NGX_HTTP_FASTCGI_MUX_ABORT_REQUEST;
+            *p++ = (u_char) (s->id >> 8);
+            *p++ = (u_char) s->id;
+            *p++ = 0;
+            *p++ = 0;
+            *p++ = 0;
+            *p++ = 0;
+
+            cl->buf->last = p;
+
+            *mux->last_out = cl;
+            mux->last_out = &cl->next;
+            mux->out_size += NGX_HTTP_FASTCGI_MUX_HEADER_LEN;
+
+            if (ngx_http_fastcgi_mux_flush(mux) != NGX_OK) {
+                ngx_http_fastcgi_mux_error(mux);
+                return;
+            }
+        }
+    }
+
+    if (mux->nstreams == 0) {
+        mux->peer.connection->idle = 1;
+    }
+}
+
+
+static void
+ngx_http_fastcgi_mux_read_handler(ngx_event_t *rev)
+{
+    ssize_t                       n;
+    ngx_connection_t             *c;
+    ngx_http_fastcgi_mux_conn_t  *mux;
+
+    c = rev->data;
+    mux = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "fastcgi multiplex read handler");
+
+    if (c->close) {
+        ngx_http_fastcgi_mux_error(mux);
+        return;
+    }
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while negotiating "
+                      "multiplexed FastCGI connection");
+        ngx_http_fastcgi_mux_plain(mux);
+        ngx_http_fastcgi_mux_error(mux);
+        return;
+    }
+
+    for ( ;; ) {
+
+        if (mux->nblocked) {
+            /* the reading is resumed by ngx_http_fastcgi_mux_unblock() */
+            return;
+        }
+
+        n = c->recv(c, mux->buffer, NGX_HTTP_FASTCGI_MUX_BUFFER_SIZE);
+
+        if (n == NGX_AGAIN) {
+            break;
+        }
+
+        if (n == 0) {
+            if (mux->nstreams) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "upstream prematurely closed "
+                              "multiplexed FastCGI connection");
+            }
+
+            ngx_http_fastcgi_mux_error(mux);
+            return;
+        }
+
+        if (n == NGX_ERROR
+            || ngx_http_fastcgi_mux_route(mux, mux->buffer, mux->buffer + n)
+               != NGX_OK)
+        {
+            ngx_http_fastcgi_mux_error(mux);
+            return;
+        }
+
+        if (mux->nblocked) {
+            return;
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_http_fastcgi_mux_error(mux);
+    }
+}
+
+
+static void
+ngx_http_fastcgi_mux_write_handler(ngx_event_t *wev)
+{
+    int                           err;
+    socklen_t                     len;
+    ngx_connection_t             *c;
+    ngx_http_fastcgi_mux_conn_t  *mux;
+
+    c = wev->data;
+    mux = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "fastcgi multiplex write handler");
+
+    if (!mux->connected) {
+
+        if (wev->timedout) {
+            ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                          "upstream timed out while connecting "
+                          "multiplexed FastCGI connection");
+            ngx_http_fastcgi_mux_error(mux);
+            return;
+        }
+
+        err = 0;
+        len = sizeof(int);
+
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len)
+            == -1)
+        {
+            err = ngx_socket_errno;
+        }
+
+        if (err) {
+            (void) ngx_connection_error(c, err, "connect() failed");
+            ngx_http_fastcgi_mux_error(mux);
+            return;
+        }
+
+        if (wev->timer_set) {
+            ngx_del_timer(wev);
+        }
+
+        mux->connected = 1;
+    }
+
+    if (ngx_http_fastcgi_mux_flush(mux) != NGX_OK) {
+        ngx_http_fastcgi_mux_error(mux);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_route(ngx_http_fastcgi_mux_conn_t *mux, u_char *p,
+    u_char *last)
+{
+    size_t                          n, len;
+    ngx_int_t                       rc;
+    ngx_http_fastcgi_mux_stream_t  *s;
+
+    while (p < last) {
+
+        if (mux->header_len < NGX_HTTP_FASTCGI_MUX_HEADER_LEN) {
+
+            mux->header[mux->header_len++] = *p++;
+
+            if (mux->header_len < NGX_HTTP_FASTCGI_MUX_HEADER_LEN) {
+                continue;
+            }
+
+            mux->id = (mux->header[2] << 8) + mux->header[3];
+            mux->rest = (mux->header[4] << 8) + mux->header[5]
+                        + mux->header[6];
+
+            ngx_log_debug3(NGX_LOG_DEBUG_HTTP, mux->peer.connection->log, 0,
+                           "fastcgi multiplex record type:%d id:%ui len:%uz",
+                           mux->header[1], mux->id, mux->rest);
+
+            if (mux->id == 0) {
+
+                /* a management record */
+
+                mux->stream = NULL;
+                mux->values_len = 0;
+
+            } else if (!mux->multiplexed) {
+                ngx_log_error(NGX_LOG_ERR, mux->peer.connection->log, 0,
+                              "upstream sent FastCGI record with request id "
+                              "%ui before FCGI_GET_VALUES_RESULT", mux->id);
+                return NGX_ERROR;
+
+            } else if (mux->id > mux->conf->requests
+                       || mux->streams[mux->id - 1] == NULL)
+            {
+                ngx_log_error(NGX_LOG_ERR, mux->peer.connection->log, 0,
+                              "upstream sent FastCGI record "
+                              "with unknown request id %ui", mux->id);
+                return NGX_ERROR;
+
+            } else {
+                mux->stream = mux->streams[mux->id - 1];
+            }
+
+            s = mux->stream;
+
+            if (s && s != &ngx_http_fastcgi_mux_draining) {
+
+                if (mux->header[1] == NGX_HTTP_FASTCGI_MUX_STDOUT
+                    && mux->header[4] == 0 && mux->header[5] == 0)
+                {
+                    s->closed = 1;
+                }
+
+                mux->header[2] = 0;
+                mux->header[3] = 1;
+
+                rc = ngx_http_fastcgi_mux_deliver(s, mux->header,
+                                              NGX_HTTP_FASTCGI_MUX_HEADER_LEN);
+                if (rc != NGX_OK) {
+                    return NGX_ERROR;
+                }
+            }
+
+        } else {
+
+            n = ngx_min((size_t) (last - p), mux->rest);
+
+            s = mux->stream;
+
+            if (s && s != &ngx_http_fastcgi_mux_draining) {
+                if (ngx_http_fastcgi_mux_deliver(s, p, n) != NGX_OK) {
+                    return NGX_ERROR;
+                }
+
+            } else if (mux->id == 0) {
+                len = ngx_min(n, NGX_HTTP_FASTCGI_MUX_VALUES_SIZE
+                                 - mux->values_len);
+
+                ngx_memcpy(mux->values + mux->values_len, p, len);
+                mux->values_len += len;
+            }
+
+            p += n;
+            mux->rest -= n;
+        }
+
+        if (mux->rest) {
+            continue;
+        }
+
+        /* the record is complete */
+
+        if (mux->id == 0
+            && !mux->multiplexed
+            && (mux->header[1] == NGX_HTTP_FASTCGI_MUX_VALUES_RESULT
+                || mux->header[1] == NGX_HTTP_FASTCGI_MUX_UNKNOWN_TYPE))
+        {
+            if (ngx_http_fastcgi_mux_values(mux) != NGX_OK) {
+                return NGX_DECLINED;
+            }
+        }
+
+        s = mux->stream;
+
+        if (s && mux->header[1] == NGX_HTTP_FASTCGI_MUX_END_REQUEST) {
+
+            if (s == &ngx_http_fastcgi_mux_draining) {
+                mux->streams[mux->id - 1] = NULL;
+                mux->nbusy--;
+
+            } else {
+                s->done = 1;
+                s->read.ready = 1;
+                ngx_http_fastcgi_mux_wakeup(&s->read);
+            }
+        }
+
+        mux->header_len = 0;
+        mux->stream = NULL;
+    }
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_deliver(ngx_http_fastcgi_mux_stream_t *s, u_char *p,
+    size_t len)
+{
+    size_t        n;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    if (len == 0) {
+        return NGX_OK;
+    }
+
+    cl = s->last_in;
+
+    while (len) {
+
+        if (cl == NULL || cl->buf->last == cl->buf->end) {
+            cl = ngx_http_fastcgi_mux_alloc_chain(
+                     ngx_max(len, NGX_HTTP_FASTCGI_MUX_CHUNK_SIZE),
+                     s->connection.log);
+            if (cl == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (s->in == NULL) {
+                s->in = cl;
+
+            } else {
+                s->last_in->next = cl;
+            }
+
+            s->last_in = cl;
+        }
+
+        b = cl->buf;
+
+        n = ngx_min(len, (size_t) (b->end - b->last));
+
+        b->last = ngx_cpymem(b->last, p, n);
+
+        s->size += n;
+        p += n;
+        len -= n;
+    }
+
+    if (!s->blocked && s->size > NGX_HTTP_FASTCGI_MUX_HIGH_WATER) {
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                       "fastcgi multiplex id:%ui blocked, size:%uz",
+                       s->id, s->size);
+
+        s->blocked = 1;
+        s->mux->nblocked++;
+    }
+
+    s->read.ready = 1;
+    ngx_http_fastcgi_mux_wakeup(&s->read);
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_values(ngx_http_fastcgi_mux_conn_t *mux)
+{
+    u_char                       *p, *last;
+    size_t                        name_len, value_len;
+    ngx_http_fastcgi_mux_addr_t  *addr, *a;
+
+    if (mux->header[1] == NGX_HTTP_FASTCGI_MUX_UNKNOWN_TYPE) {
+        ngx_http_fastcgi_mux_plain(mux);
+        return NGX_DECLINED;
+    }
+
+    p = mux->values;
+    last = mux->values + mux->values_len;
+
+    while (p < last) {
+
+        name_len = *p++;
+
+        if (name_len & 0x80) {
+            if (last - p < 3) {
+                break;
+            }
+
+            name_len = ((name_len & 0x7f) << 24) + (p[0] << 16)
+                       + (p[1] << 8) + p[2];
+            p += 3;
+        }
+
+        if (p == last) {
+            break;
+        }
+
+        value_len = *p++;
+
+        if (value_len & 0x80) {
+            if (last - p < 3) {
+                break;
+            }
+
+            value_len = ((value_len & 0x7f) << 24) + (p[0] << 16)
+                        + (p[1] << 8) + p[2];
+            p += 3;
+        }
+
+        if ((size_t) (last - p) < name_len + value_len) {
+            break;
+        }
+
+        if (name_len == sizeof("FCGI_MPXS_CONNS") - 1
+            && ngx_strncmp(p, "FCGI_MPXS_CONNS", name_len) == 0
+            && value_len == 1 && p[name_len] == '1')
+        {
+            if (mux->peer.connection->read->timer_set) {
+                ngx_del_timer(mux->peer.connection->read);
+            }
+
+            mux->multiplexed = 1;
+
+            addr = ngx_http_fastcgi_mux_find_plain(mux->conf, mux->sockaddr,
+                                                   mux->socklen);
+            if (addr) {
+                a = mux->conf->plain->elts;
+                *addr = a[--mux->conf->plain->nelts];
+            }
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mux->peer.connection->log, 0,
+                           "fastcgi multiplex connection %p confirmed",
+                           mux->peer.connection);
+
+            return NGX_OK;
+        }
+
+        p += name_len + value_len;
+    }
+
+    ngx_http_fastcgi_mux_plain(mux);
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_fastcgi_mux_plain(ngx_http_fastcgi_mux_conn_t *mux)
+{
+    time_t                            now;
+    ngx_uint_t                        i;
+    ngx_http_fastcgi_mux_addr_t      *addr, *a;
+    ngx_http_fastcgi_mux_srv_conf_t  *conf;
+
+    conf = mux->conf;
+    now = ngx_time();
+
+    addr = ngx_http_fastcgi_mux_find_plain(conf, mux->sockaddr, mux->socklen);
+
+    if (addr) {
+        if (addr->expire > now) {
+            /* another connection has already failed */
+            return;
+        }
+
+        addr->backoff = ngx_min(addr->backoff * 2,
+                                NGX_HTTP_FASTCGI_MUX_MAX_BACKOFF);
+
+    } else {
+
+        if (conf->plain->nelts < conf->max_plain) {
+            addr = ngx_array_push(conf->plain);
+            if (addr == NULL) {
+                return;
+            }
+
+        } else {
+
+            /* replace the backend which is retried first */
+
+            a = conf->plain->elts;
+            addr = &a[0];
+
+            for (i = 1; i < conf->plain->nelts; i++) {
+                if (a[i].expire < addr->expire) {
+                    addr = &a[i];
+                }
+            }
+        }
+
+        addr->backoff = NGX_HTTP_FASTCGI_MUX_BACKOFF;
+        addr->socklen = mux->socklen;
+        ngx_memcpy(addr->sockaddr, mux->sockaddr, mux->socklen);
+    }
+
+    addr->expire = now + addr->backoff;
+
+    ngx_log_error(NGX_LOG_WARN, mux->peer.connection->log, 0,
+                  "upstream %V does not multiplex FastCGI connections, "
+                  "using a connection per request for %T seconds",
+                  mux->peer.name, addr->backoff);
+}
+
+
+static ngx_http_fastcgi_mux_addr_t *
+ngx_http_fastcgi_mux_find_plain(ngx_http_fastcgi_mux_srv_conf_t *conf,
+    u_char *sockaddr, socklen_t socklen)
+{
+    ngx_uint_t                    i;
+    ngx_http_fastcgi_mux_addr_t  *addr;
+
+    addr = conf->plain->elts;
+
+    for (i = 0; i < conf->plain->nelts; i++) {
+        if (ngx_memn2cmp(addr[i].sockaddr, sockaddr, addr[i].socklen, socklen)
+            == 0)
+        {
+            return &addr[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_fastcgi_mux_unblock(ngx_http_fastcgi_mux_stream_t *s)
+{
+    ngx_event_t                  *rev;
+    ngx_http_fastcgi_mux_conn_t  *mux;
+
+    mux = s->mux;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, s->connection.log, 0,
+                   "fastcgi multiplex id:%ui unblocked, size:%uz",
+                   s->id, s->size);
+
+    s->blocked = 0;
+
+    if (--mux->nblocked == 0) {
+        rev = mux->peer.connection->read;
+        ngx_post_event(rev, &ngx_posted_events);
+    }
+}
+
+
+static void
+ngx_http_fastcgi_mux_wakeup(ngx_event_t *ev)
+{
+    ngx_post_event(ev, &ngx_posted_events);
+}
+
+
+static ngx_int_t
+ngx_http_fastcgi_mux_flush(ngx_http_fastcgi_mux_conn_t *mux)
+{
+    ngx_uint_t                      i;
+    ngx_chain_t                    *cl;
+    ngx_connection_t               *c;
+    ngx_http_fastcgi_mux_stream_t  *s;
+
+    if (!mux->connected || mux->out == NULL) {
+        return NGX_OK;
+    }
+
+    c = mux->peer.connection;
+
+    if (c->send_chain(c, mux->out, 0) == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    while (mux->out && mux->out->buf->pos == mux->out->buf->last) {
+        cl = mux->out;
+        mux->out = cl->next;
+        mux->out_size -= cl->buf->last - cl->buf->start;
+        ngx_http_fastcgi_mux_free_chain(cl);
+    }
+
+    if (mux->out == NULL) {
+        mux->last_out = &mux->out;
+    }
+
+    if (mux->write_blocked
+        && mux->out_size < NGX_HTTP_FASTCGI_MUX_HIGH_WATER)
+    {
+        mux->write_blocked = 0;
+
+        for (i = 0; i < mux->conf->requests; i++) {
+            s = mux->streams[i];
+
+            if (s == NULL || s == &ngx_http_fastcgi_mux_draining
+                || !s->write_blocked)
+            {
+                continue;
+            }
+
+            s->write_blocked = 0;
+            s->write.ready = 1;
+            ngx_http_fastcgi_mux_wakeup(&s->write);
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_fastcgi_mux_error(ngx_http_fastcgi_mux_conn_t *mux)
+{
+    ngx_uint_t                      i;
+    ngx_http_fastcgi_mux_stream_t  *s;
+
+    /* fail all requests in progress, they are retried as usual */
+
+    for (i = 0; i < mux->conf->requests; i++) {
+        s = mux->streams[i];
+
+        if (s == NULL || s == &ngx_http_fastcgi_mux_draining) {
+            continue;
+        }
+
+        s->mux = NULL;
+        s->error = 1;
+        s->blocked = 0;
+
+        s->connection.fd = (ngx_socket_t) -1;
+
+        s->read.ready = 1;
+        s->write.ready = 1;
+
+        ngx_http_fastcgi_mux_wakeup(&s->read);
+        ngx_http_fastcgi_mux_wakeup(&s->write);
+    }
+
+    ngx_http_fastcgi_mux_close(mux);
+}
+
+
+static void
+ngx_http_fastcgi_mux_close(ngx_http_fastcgi_mux_conn_t *mux)
+{
+    ngx_chain_t  *cl, *ln;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, mux->peer.connection->log, 0,
+                   "close fastcgi multiplex connection %p",
+                   mux->peer.connection);
+
+    ngx_queue_remove(&mux->queue);
+
+    for (cl = mux->out; cl; cl = ln) {
+        ln = cl->next;
+        ngx_http_fastcgi_mux_free_chain(cl);
+    }
+
+    ngx_close_connection(mux->peer.connection);
+    ngx_destroy_pool(mux->pool);
+}
+
+
+static ngx_chain_t *
+ngx_http_fastcgi_mux_alloc_chain(size_t size, ngx_log_t *log)
+{
+    u_char       *p;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    /* the link, the buffer and the data are allocated as a single block */
+
+    p = ngx_alloc(sizeof(ngx_chain_t) + sizeof(ngx_buf_t) + size, log);
+    if (p == NULL) {
+        return NULL;
+    }
+
+    cl = (ngx_chain_t *) p;
+    b = (ngx_buf_t *) (p + sizeof(ngx_chain_t));
+
+    ngx_memzero(b, sizeof(ngx_buf_t));
+
+    b->start = p + sizeof(ngx_chain_t) + sizeof(ngx_buf_t);
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+
+    cl->buf = b;
+    cl->next = NULL;
+
+    return cl;
+}
+
+
+static void
+ngx_http_fastcgi_mux_free_chain(ngx_chain_t *cl)
+{
+    ngx_free(cl);
+}
+
+
+static ssize_t
+ngx_http_fastcgi_mux_recv(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_http_fastcgi_mux_stream_t  *s = (ngx_http_fastcgi_mux_stream_t *) c;
+
+    size_t        n, len;
+    ngx_buf_t    *b;
+    ngx_chain_t  *cl;
+
+    n = 0;
+
+    while (s->in && n < size) {
+        cl = s->in;
+        b = cl->buf;
+
+        len = ngx_min(size - n, (size_t) (b->last - b->pos));
+
+        ngx_memcpy(buf + n, b->pos, len);
+
+        b->pos += len;
+        n += len;
+
+        if (b->pos == b->last) {
+            s->in = cl->next;
+            ngx_http_fastcgi_mux_free_chain(cl);
+        }
+    }
+
+    if (s->in == NULL) {
+        s->last_in = NULL;
+    }
+
+    s->size -= n;
+
+    if (s->blocked && s->mux
+        && s->size < NGX_HTTP_FASTCGI_MUX_HIGH_WATER / 2)
+    {
+        ngx_http_fastcgi_mux_unblock(s);
+    }
+
+    if (n) {
+        if (s->in == NULL && !s->done && !s->error) {
+            c->read->ready = 0;
+        }
+
+        return n;
+    }
+
+    if (s->error) {
+        c->read->error = 1;
+        return NGX_ERROR;
+    }
+
+    if (s->done) {
+        c->read->eof = 1;
+        return 0;
+    }
+
+    c->read->ready = 0;
+
+    return NGX_AGAIN;
+}
+
+
+static ssize_t
+ngx_http_fastcgi_mux_recv_chain(ngx_connection_t *c, ngx_chain_t *in)
+{
+    ssize_t    n, size, total;
+    ngx_buf_t  *b;
+
+    total = 0;
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+        size = b->end - b->last;
+
+        if (size == 0) {
+            continue;
+        }
+
+        n = ngx_http_fastcgi_mux_recv(c, b->last, size);
+
+        if (n <= 0) {
+            return total ? total : n;
+        }
+
+        total += n;
+
+        if (n < size) {
+            break;
+        }
+    }
+
+    return total;
+}
+
+
+static ssize_t
+ngx_http_fastcgi_mux_send(ngx_connection_t *c, u_char *buf, size_t size)
+{
+    ngx_buf_t     b;
+    ngx_chain_t   out, *cl;
+
+    ngx_memzero(&b, sizeof(ngx_buf_t));
+
+    b.pos = buf;
+    b.last = buf + size;
+    b.temporary = 1;
+
+    out.buf = &b;
+    out.next = NULL;
+
+    cl = ngx_http_fastcgi_mux_send_chain(c, &out, 0);
+
+    if (cl == NGX_CHAIN_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (cl) {
+        return NGX_AGAIN;
+    }
+
+    return size;
+}
+
+
+static ngx_chain_t *
+ngx_http_fastcgi_mux_send_chain(ngx_connection_t *c, ngx_chain_t *in,
+    off_t limit)
+{
+    ngx_http_fastcgi_mux_stream_t  *s = (ngx_http_fastcgi_mux_stream_t *) c;
+
+    size_t                        size;
+    ngx_buf_t                    *b;
+    ngx_chain_t                  *cl;
+    ngx_http_fastcgi_mux_conn_t  *mux;
+
+    mux = s->mux;
+
+    if (mux == NULL || s->error) {
+        c->write->error = 1;
+        return NGX_CHAIN_ERROR;
+    }
+
+    /*
+     * the data are copied to the shared connection queue, the request
+     * waits only while the queue exceeds the high water mark
+     */
+
+again:
+
+    for ( /* void */ ; in; in = in->next) {
+        b = in->buf;
+
+        if (mux->out_size >= NGX_HTTP_FASTCGI_MUX_HIGH_WATER) {
+            break;
+        }
+
+        if (ngx_buf_special(b)) {
+            continue;
+        }
+
+        if (!ngx_buf_in_memory(b)) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, 0,
+                          "file buffers are not supported "
+                          "by multiplexed FastCGI connections");
+            return NGX_CHAIN_ERROR;
+        }
+
+        size = b->last - b->pos;
+
+        if (size == 0) {
+            continue;
+        }
+
+        cl = ngx_http_fastcgi_mux_alloc_chain(size, c->log);
+        if (cl == NULL) {
+            return NGX_CHAIN_ERROR;
+        }
+
+        cl->buf->last = ngx_cpymem(cl->buf->last, b->pos, size);
+
+        ngx_http_fastcgi_mux_patch(s, cl->buf->pos, cl->buf->last);
+
+        *mux->last_out = cl;
+        mux->last_out = &cl->next;
+        mux->out_size += size;
+
+        b->pos = b->last;
+
+        if (b->in_file) {
+            b->file_pos = b->file_last;
+        }
+
+        c->sent += size;
+        s->sent = 1;
+    }
+
+    if (ngx_http_fastcgi_mux_flush(mux) != NGX_OK) {
+        ngx_http_fastcgi_mux_error(mux);
+        return NGX_CHAIN_ERROR;
+    }
+
+    if (in) {
+        if (mux->out_size < NGX_HTTP_FASTCGI_MUX_HIGH_WATER) {
+            goto again;
+        }
+
+        c->write->ready = 0;
+        s->write_blocked = 1;
+        mux->write_blocked = 1;
+    }
+
+    return in;
+}
+
+
+static void
+ngx_http_fastcgi_mux_patch(ngx_http_fastcgi_mux_stream_t *s, u_char *p,
+    u_char *last)
+{
+    size_t  n, offset;
+
+    while (p < last) {
+
+        if (s->out_header < NGX_HTTP_FASTCGI_MUX_HEADER_LEN) {
+
+            switch (s->out_header) {
+
+            case 1:
+                s->out_type = *p;
+                break;
+
+            case 2:
+                *p = (u_char) (s->id >> 8);
+                break;
+
+            case 3:
+                *p = (u_char) s->id;
+                break;
+
+            case 4:
+                s->out_length = *p << 8;
+                break;
+
+            case 5:
+                s->out_length += *p;
+                s->out_rest = s->out_length;
+                break;
+
+            case 6:
+                s->out_rest += *p;
+                s->out_total = s->out_rest;
+                break;
+            }
+
+            p++;
+
+            if (++s->out_header == NGX_HTTP_FASTCGI_MUX_HEADER_LEN
+                && s->out_rest == 0)
+            {
+                s->out_header = 0;
+            }
+
+            continue;
+        }
+
+        /* FCGI_KEEP_CONN is set in the flags of FCGI_BEGIN_REQUEST */
+
+        if (s->out_type == NGX_HTTP_FASTCGI_MUX_BEGIN_REQUEST
+            && s->out_length > 2)
+        {
+            offset = s->out_total - s->out_rest;
+
+            if (offset <= 2 && offset + (last - p) > 2) {
+                p[2 - offset] |= NGX_HTTP_FASTCGI_MUX_KEEP_CONN;
+            }
+        }
+
+        n = ngx_min((size_t) (last - p), s->out_rest);
+
+        p += n;
+        s->out_rest -= n;
+
+        if (s->out_rest == 0) {
+            s->out_header = 0;
+        }
+    }
+}
+
+
+static void *
+ngx_http_fastcgi_mux_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_fastcgi_mux_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fastcgi_mux_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->original_init_upstream = NULL;
+     *     conf->original_init_peer = NULL;
+     */
+
+    conf->connections = 1;
+    conf->requests = 64;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_fastcgi_mux(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t     *uscf;
+    ngx_http_fastcgi_mux_srv_conf_t  *mcf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_uint_t   i;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    mcf = ngx_http_conf_upstream_srv_conf(uscf, ngx_http_fastcgi_mux_module);
+
+    if (mcf->original_init_upstream) {
+        return "is duplicate";
+    }
+
+    mcf->original_init_upstream = uscf->peer.init_upstream
+                                  ? uscf->peer.init_upstream
+                                  : ngx_http_upstream_init_round_robin;
+
+    uscf->peer.init_upstream = ngx_http_fastcgi_mux_init;
+
+    /* read options */
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\" in \"%V\" directive",
+                           &value[1], &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    mcf->connections = n;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "requests=", 9) == 0) {
+
+            s.len = value[i].len - 9;
+            s.data = &value[i].data[9];
+
+            n = ngx_atoi(s.data, s.len);
+
+            if (n == NGX_ERROR || n == 0 || n > 65535) {
+                goto invalid;
+            }
+
+            mcf->requests = n;
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
@@ -17,9 +17,15 @@ typedef struct {
 } ngx_http_geo_range_t;
 
 
+/*
+ * the ranges of a binary base are mapped read-only and shared by all
+ * workers, the pointers in it are offsets from the start of the mapping
+ */
+
 typedef struct {
     ngx_http_geo_range_t           **low;
     ngx_http_variable_value_t       *default_value;
+    u_char                          *base;
 } ngx_http_geo_high_ranges_t;
 
 
@@ -35,6 +41,9 @@ typedef struct {
     ngx_str_t                       *net;
     ngx_http_geo_high_ranges_t       high;
     ngx_radix_tree_t                *tree;
+#if (NGX_HAVE_INET6)
+    ngx_radix_tree_t                *tree6;
+#endif
     ngx_rbtree_t                     rbtree;
     ngx_rbtree_node_t                sentinel;
     ngx_array_t                     *proxies;
@@ -55,9 +64,17 @@ typedef struct {
 } ngx_http_geo_conf_ctx_t;
 
 
+typedef struct {
+    ngx_radix_compact_node_t        *tree;
+#if (NGX_HAVE_INET6)
+    ngx_radix_compact_node_t        *tree6;
+#endif
+} ngx_http_geo_trees_t;
+
+
 typedef struct {
     union {
-        ngx_radix_tree_t            *tree;
+        ngx_http_geo_trees_t         trees;
         ngx_http_geo_high_ranges_t   high;
     } u;
 
@@ -68,8 +85,9 @@ typedef struct {
 } ngx_http_geo_ctx_t;
 
 
-static in_addr_t ngx_http_geo_addr(ngx_http_request_t *r,
-    ngx_http_geo_ctx_t *ctx);
+static ngx_int_t ngx_http_geo_addr(ngx_http_request_t *r,
+    ngx_http_geo_ctx_t *ctx, ngx_addr_t *addr);
+static in_addr_t ngx_http_geo_inet_addr(ngx_addr_t *addr);
 static ngx_int_t ngx_http_geo_real_addr(ngx_http_request_t *r,
     ngx_http_geo_ctx_t *ctx, ngx_addr_t *addr);
 static char *ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
@@ -82,6 +100,11 @@ static ngx_uint_t ngx_http_geo_delete_range(ngx_conf_t *cf,
     ngx_http_geo_conf_ctx_t *ctx, in_addr_t start, in_addr_t end);
 static char *ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *value);
+static char *ngx_http_geo_cidr_add(ngx_conf_t *cf,
+    ngx_http_geo_conf_ctx_t *ctx, ngx_cidr_t *cidr, ngx_str_t *net,
+    ngx_http_variable_value_t *val);
+static char *ngx_http_geo_cidr_trees(ngx_conf_t *cf,
+    ngx_http_geo_conf_ctx_t *ctx, ngx_http_geo_trees_t *trees);
 static ngx_http_variable_value_t *ngx_http_geo_value(ngx_conf_t *cf,
     ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *value);
 static char *ngx_http_geo_add_proxy(ngx_conf_t *cf,
@@ -92,6 +115,7 @@ static char *ngx_http_geo_include(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *name);
 static ngx_int_t ngx_http_geo_include_binary_base(ngx_conf_t *cf,
     ngx_http_geo_conf_ctx_t *ctx, ngx_str_t *name);
+static void ngx_http_geo_unmap_binary_base(void *data);
 static void ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx);
 static u_char *ngx_http_geo_copy_values(u_char *base, u_char *p,
     ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
@@ -141,32 +165,76 @@ ngx_module_t  ngx_http_geo_module = {
 };
 
 
+/* the number of ranges in the only include to write the binary base */
+
+#define NGX_HTTP_GEO_BINARY_MIN_ENTRIES  100000
+
+
+/*
+ * the checksum covers the values and the index of the ranges only:
+ * the base is renamed in place after it is written, and the ranges
+ * themselves are paged in lazily as the lookups reach them
+ */
+
 typedef struct {
     u_char    GEORNG[6];
     u_char    version;
     u_char    ptr_size;
     uint32_t  endianness;
     uint32_t  crc32;
+    uint32_t  size;
+    uint32_t  ranges;
 } ngx_http_geo_header_t;
 
 
 static ngx_http_geo_header_t  ngx_http_geo_header = {
-    { 'G', 'E', 'O', 'R', 'N', 'G' }, 0, sizeof(void *), 0x12345678, 0
+    { 'G', 'E', 'O', 'R', 'N', 'G' }, 2, sizeof(void *), 0x12345678, 0, 0, 0
 };
 
 
-/* AF_INET only */
-
 static ngx_int_t
 ngx_http_geo_cidr_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     uintptr_t data)
 {
     ngx_http_geo_ctx_t *ctx = (ngx_http_geo_ctx_t *) data;
 
+    in_addr_t                   inaddr;
+    ngx_addr_t                  addr;
     ngx_http_variable_value_t  *vv;
+#if (NGX_HAVE_INET6)
+    struct in6_addr            *inaddr6;
+#endif
+
+    if (ngx_http_geo_addr(r, ctx, &addr) != NGX_OK) {
+        inaddr = INADDR_NONE;
+        goto inet;
+    }
+
+#if (NGX_HAVE_INET6)
+
+    if (addr.sockaddr->sa_family == AF_INET6) {
+        inaddr6 = &((struct sockaddr_in6 *) addr.sockaddr)->sin6_addr;
+
+        if (!IN6_IS_ADDR_V4MAPPED(inaddr6)) {
+            vv = (ngx_http_variable_value_t *)
+                     ngx_radix128compact_find(ctx->u.trees.tree6,
+                                              inaddr6->s6_addr);
+            goto done;
+        }
+    }
+
+#endif
+
+    inaddr = ngx_http_geo_inet_addr(&addr);
+
+inet:
 
     vv = (ngx_http_variable_value_t *)
-              ngx_radix32tree_find(ctx->u.tree, ngx_http_geo_addr(r, ctx));
+             ngx_radix32compact_find(ctx->u.trees.tree, inaddr);
+
+#if (NGX_HAVE_INET6)
+done:
+#endif
 
     *v = *vv;
 
@@ -183,22 +251,45 @@ ngx_http_geo_range_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 {
     ngx_http_geo_ctx_t *ctx = (ngx_http_geo_ctx_t *) data;
 
-    in_addr_t              addr;
-    ngx_uint_t             n;
-    ngx_http_geo_range_t  *range;
+    u_char                     *base;
+    in_addr_t                   inaddr;
+    ngx_uint_t                  n;
+    ngx_addr_t                  addr;
+    ngx_http_geo_range_t       *range;
+    ngx_http_variable_value_t  *vv;
 
     *v = *ctx->u.high.default_value;
 
-    addr = ngx_http_geo_addr(r, ctx);
+    if (ngx_http_geo_addr(r, ctx, &addr) == NGX_OK) {
+        inaddr = ngx_http_geo_inet_addr(&addr);
 
-    range = ctx->u.high.low[addr >> 16];
+    } else {
+        inaddr = INADDR_NONE;
+    }
+
+    base = ctx->u.high.base;
+
+    range = ctx->u.high.low[inaddr >> 16];
 
     if (range) {
-        n = addr & 0xffff;
+        if (base) {
+            range = (ngx_http_geo_range_t *) (base + (uintptr_t) range);
+        }
+
+        n = inaddr & 0xffff;
         do {
             if (n >= (ngx_uint_t) range->start && n <= (ngx_uint_t) range->end)
             {
-                *v = *range->value;
+                if (base) {
+                    vv = (ngx_http_variable_value_t *)
+                             (base + (uintptr_t) range->value);
+                    *v = *vv;
+                    v->data = base + (uintptr_t) vv->data;
+
+                } else {
+                    *v = *range->value;
+                }
+
                 break;
             }
         } while ((++range)->value);
@@ -211,33 +302,43 @@ ngx_http_geo_range_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 }
 
 
-static in_addr_t
-ngx_http_geo_addr(ngx_http_request_t *r, ngx_http_geo_ctx_t *ctx)
+static ngx_int_t
+ngx_http_geo_addr(ngx_http_request_t *r, ngx_http_geo_ctx_t *ctx,
+    ngx_addr_t *addr)
 {
-    ngx_addr_t           addr;
-    ngx_table_elt_t     *xfwd;
-    struct sockaddr_in  *sin;
+    ngx_table_elt_t  *xfwd;
 
-    if (ngx_http_geo_real_addr(r, ctx, &addr) != NGX_OK) {
-        return INADDR_NONE;
+    if (ngx_http_geo_real_addr(r, ctx, addr) != NGX_OK) {
+        return NGX_ERROR;
     }
 
     xfwd = r->headers_in.x_forwarded_for;
 
     if (xfwd != NULL && ctx->proxies != NULL) {
-        (void) ngx_http_get_forwarded_addr(r, &addr, xfwd->value.data,
+        (void) ngx_http_get_forwarded_addr(r, addr, xfwd->value.data,
                                            xfwd->value.len, ctx->proxies,
                                            ctx->proxy_recursive);
     }
 
+    return NGX_OK;
+}
+
+
+/* AF_INET and IPv4-mapped IPv6 addresses in host byte order */
+
+static in_addr_t
+ngx_http_geo_inet_addr(ngx_addr_t *addr)
+{
+    struct sockaddr_in  *sin;
+
 #if (NGX_HAVE_INET6)
 
-    if (addr.sockaddr->sa_family == AF_INET6) {
+    if (addr->sockaddr->sa_family == AF_INET6) {
         u_char           *p;
         in_addr_t         inaddr;
         struct in6_addr  *inaddr6;
 
-        inaddr6 = &((struct sockaddr_in6 *) addr.sockaddr)->sin6_addr;
+        inaddr6 = &((struct sockaddr_in6 *) addr->sockaddr)->sin6_addr;
 
         if (IN6_IS_ADDR_V4MAPPED(inaddr6)) {
             p = inaddr6->s6_addr;
@@ -253,11 +354,11 @@ ngx_http_geo_addr(ngx_http_request_t *r, ngx_http_geo_ctx_t *ctx)
 
 #endif
 
-    if (addr.sockaddr->sa_family != AF_INET) {
+    if (addr->sockaddr->sa_family != AF_INET) {
         return INADDR_NONE;
     }
 
-    sin = (struct sockaddr_in *) addr.sockaddr;
+    sin = (struct sockaddr_in *) addr->sockaddr;
     return ntohl(sin->sin_addr.s_addr);
 }
 
@@ -402,7 +503,7 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
             if (ctx.allow_binary_include
                 && !ctx.outside_entries
-                && ctx.entries > 100000
+                && ctx.entries > NGX_HTTP_GEO_BINARY_MIN_ENTRIES
                 && ctx.includes == 1)
             {
                 ngx_http_geo_create_binary_base(&ctx);
@@ -422,31 +523,18 @@ ngx_http_geo_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         ngx_destroy_pool(pool);
 
     } else {
-        if (ctx.tree == NULL) {
-            ctx.tree = ngx_radix_tree_create(cf->pool, -1);
-            if (ctx.tree == NULL) {
-                return NGX_CONF_ERROR;
-            }
+        if (rv == NGX_CONF_OK
+            && ngx_http_geo_cidr_trees(cf, &ctx, &geo->u.trees)
+               != NGX_CONF_OK)
+        {
+            rv = NGX_CONF_ERROR;
         }
 
-        geo->u.tree = ctx.tree;
-
         var->get_handler = ngx_http_geo_cidr_variable;
         var->data = (uintptr_t) geo;
 
         ngx_destroy_pool(ctx.temp_pool);
         ngx_destroy_pool(pool);
-
-        if (ngx_radix32tree_find(ctx.tree, 0) != NGX_RADIX_NO_VALUE) {
-            return rv;
-        }
-
-        if (ngx_radix32tree_insert(ctx.tree, 0, 0,
-                                   (uintptr_t) &ngx_http_variable_null_value)
-            == NGX_ERROR)
-        {
-            return NGX_CONF_ERROR;
-        }
     }
 
     return rv;
@@ -469,7 +557,12 @@ ngx_http_geo(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
 
         if (ngx_strcmp(value[0].data, "ranges") == 0) {
 
-            if (ctx->tree) {
+            if (ctx->tree
+#if (NGX_HAVE_INET6)
+                || ctx->tree6
+#endif
+               )
+            {
                 ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                                    "the \"ranges\" directive must be "
                                    "the first directive inside \"geo\" block");
@@ -907,59 +1000,89 @@ static char *
 ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *value)
 {
-    ngx_int_t                        rc, del;
-    ngx_str_t                       *net;
-    ngx_uint_t                       i;
-    ngx_cidr_t                       cidr;
-    ngx_http_variable_value_t       *val, *old;
+    char                       *rv;
+    ngx_int_t                   rc, del;
+    ngx_str_t                  *net;
+    ngx_cidr_t                  cidr;
+    ngx_http_variable_value_t  *val;
 
     if (ctx->tree == NULL) {
-        ctx->tree = ngx_radix_tree_create(ctx->pool, -1);
+        ctx->tree = ngx_radix_tree_create(ctx->temp_pool, -1);
         if (ctx->tree == NULL) {
             return NGX_CONF_ERROR;
         }
     }
 
-    if (ngx_strcmp(value[0].data, "default") == 0) {
-        /* cidr.family = AF_INET; */
-        cidr.u.in.addr = 0;
-        cidr.u.in.mask = 0;
-        net = &value[0];
-
-    } else {
-        if (ngx_strcmp(value[0].data, "delete") == 0) {
-            net = &value[1];
-            del = 1;
-
-        } else {
-            net = &value[0];
-            del = 0;
+#if (NGX_HAVE_INET6)
+    if (ctx->tree6 == NULL) {
+        ctx->tree6 = ngx_radix_tree_create(ctx->temp_pool, -1);
+        if (ctx->tree6 == NULL) {
+            return NGX_CONF_ERROR;
         }
+    }
+#endif
+
+    if (ngx_strcmp(value[0].data, "default") == 0) {
+        val = ngx_http_geo_value(cf, ctx, &value[1]);
 
-        if (ngx_http_geo_cidr_value(cf, net, &cidr) != NGX_OK) {
+        if (val == NULL) {
             return NGX_CONF_ERROR;
         }
 
-        if (cidr.family != AF_INET) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                               "\"geo\" supports IPv4 only");
-            return NGX_CONF_ERROR;
+        ngx_memzero(&cidr, sizeof(ngx_cidr_t));
+
+        cidr.family = AF_INET;
+
+        rv = ngx_http_geo_cidr_add(cf, ctx, &cidr, &value[0], val);
+
+        if (rv != NGX_CONF_OK) {
+            return rv;
         }
 
-        cidr.u.in.addr = ntohl(cidr.u.in.addr);
-        cidr.u.in.mask = ntohl(cidr.u.in.mask);
+#if (NGX_HAVE_INET6)
+        cidr.family = AF_INET6;
 
-        if (del) {
-            if (ngx_radix32tree_delete(ctx->tree, cidr.u.in.addr,
-                                       cidr.u.in.mask)
-                != NGX_OK)
-            {
-                ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
-                                   "no network \"%V\" to delete", net);
-            }
+        rv = ngx_http_geo_cidr_add(cf, ctx, &cidr, &value[0], val);
+#endif
 
-            return NGX_CONF_OK;
+        return rv;
+    }
+
+    if (ngx_strcmp(value[0].data, "delete") == 0) {
+        net = &value[1];
+        del = 1;
+
+    } else {
+        net = &value[0];
+        del = 0;
+    }
+
+    if (ngx_http_geo_cidr_value(cf, net, &cidr) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (del) {
+        switch (cidr.family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            rc = ngx_radix128tree_delete(ctx->tree6, cidr.u.in6.addr.s6_addr,
+                                         cidr.u.in6.mask.s6_addr);
+            break;
+#endif
+
+        default: /* AF_INET */
+            rc = ngx_radix32tree_delete(ctx->tree, ntohl(cidr.u.in.addr),
+                                        ntohl(cidr.u.in.mask));
+            break;
         }
+
+        if (rc != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                               "no network \"%V\" to delete", net);
+        }
+
+        return NGX_CONF_OK;
     }
 
     val = ngx_http_geo_value(cf, ctx, &value[1]);
@@ -968,9 +1091,40 @@ ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         return NGX_CONF_ERROR;
     }
 
+    return ngx_http_geo_cidr_add(cf, ctx, &cidr, net, val);
+}
+
+
+static char *
+ngx_http_geo_cidr_add(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
+    ngx_cidr_t *cidr, ngx_str_t *net, ngx_http_variable_value_t *val)
+{
+    ngx_int_t                   rc;
+    in_addr_t                   addr, mask;
+    ngx_uint_t                  i;
+    ngx_http_variable_value_t  *old;
+
+    addr = ntohl(cidr->u.in.addr);
+    mask = ntohl(cidr->u.in.mask);
+
     for (i = 2; i; i--) {
-        rc = ngx_radix32tree_insert(ctx->tree, cidr.u.in.addr, cidr.u.in.mask,
-                                    (uintptr_t) val);
+
+        switch (cidr->family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            rc = ngx_radix128tree_insert(ctx->tree6, cidr->u.in6.addr.s6_addr,
+                                         cidr->u.in6.mask.s6_addr,
+                                         (uintptr_t) val);
+            break;
+#endif
+
+        default: /* AF_INET */
+            rc = ngx_radix32tree_insert(ctx->tree, addr, mask,
+                                        (uintptr_t) val);
+            break;
+        }
+
         if (rc == NGX_OK) {
             return NGX_CONF_OK;
         }
@@ -981,14 +1135,35 @@ ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
 
         /* rc == NGX_BUSY */
 
-        old = (ngx_http_variable_value_t *)
-              ngx_radix32tree_find(ctx->tree, cidr.u.in.addr & cidr.u.in.mask);
+        switch (cidr->family) {
 
-        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            old = (ngx_http_variable_value_t *)
+                      ngx_radix128tree_find_masked(ctx->tree6,
+                                                   cidr->u.in6.addr.s6_addr,
+                                                   cidr->u.in6.mask.s6_addr);
+
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                "duplicate network \"%V\", value: \"%v\", old value: \"%v\"",
+                net, val, old);
+
+            rc = ngx_radix128tree_delete(ctx->tree6, cidr->u.in6.addr.s6_addr,
+                                         cidr->u.in6.mask.s6_addr);
+            break;
+#endif
+
+        default: /* AF_INET */
+            old = (ngx_http_variable_value_t *)
+                      ngx_radix32tree_find_masked(ctx->tree, addr, mask);
+
+            ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
                 "duplicate network \"%V\", value: \"%v\", old value: \"%v\"",
                 net, val, old);
 
-        rc = ngx_radix32tree_delete(ctx->tree, cidr.u.in.addr, cidr.u.in.mask);
+            rc = ngx_radix32tree_delete(ctx->tree, addr, mask);
+            break;
+        }
 
         if (rc == NGX_ERROR) {
             ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "invalid radix tree");
@@ -1000,6 +1175,69 @@ ngx_http_geo_cidr(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
 }
 
 
+/*
+ * the bit-per-node trees are built in the temporary pool, only
+ * their path-compressed copies are kept in the configuration
+ */
+
+static char *
+ngx_http_geo_cidr_trees(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
+    ngx_http_geo_trees_t *trees)
+{
+    uintptr_t  null;
+
+    null = (uintptr_t) &ngx_http_variable_null_value;
+
+    if (ctx->tree == NULL) {
+        ctx->tree = ngx_radix_tree_create(ctx->temp_pool, -1);
+        if (ctx->tree == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_radix32tree_find(ctx->tree, 0) == NGX_RADIX_NO_VALUE) {
+        if (ngx_radix32tree_insert(ctx->tree, 0, 0, null) == NGX_ERROR) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    trees->tree = ngx_radix_tree_compact(ctx->tree, cf->pool);
+    if (trees->tree == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_HAVE_INET6)
+    {
+    static u_char  zero[16];
+
+    if (ctx->tree6 == NULL) {
+        ctx->tree6 = ngx_radix_tree_create(ctx->temp_pool, -1);
+        if (ctx->tree6 == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (ngx_radix128tree_find_masked(ctx->tree6, zero, zero)
+        == NGX_RADIX_NO_VALUE)
+    {
+        if (ngx_radix128tree_insert(ctx->tree6, zero, zero, null)
+            == NGX_ERROR)
+        {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    trees->tree6 = ngx_radix_tree_compact(ctx->tree6, cf->pool);
+    if (trees->tree6 == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    }
+#endif
+
+    return NGX_CONF_OK;
+}
+
+
 static ngx_http_variable_value_t *
 ngx_http_geo_value(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *value)
@@ -1162,31 +1400,26 @@ static ngx_int_t
 ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
     ngx_str_t *name)
 {
-    u_char                     *base, ch;
-    time_t                      mtime;
-    size_t                      size, len;
-    ssize_t                     n;
-    uint32_t                    crc32;
-    ngx_err_t                   err;
-    ngx_int_t                   rc;
-    ngx_uint_t                  i;
-    ngx_file_t                  file;
-    ngx_file_info_t             fi;
-    ngx_http_geo_range_t       *range, **ranges;
-    ngx_http_geo_header_t      *header;
-    ngx_http_variable_value_t  *vv;
+    u_char                 *base, ch;
+    time_t                  mtime;
+    size_t                  size, index;
+    uint32_t                crc32;
+    ngx_int_t               rc;
+    ngx_file_info_t         fi;
+    ngx_pool_cleanup_t     *cln;
+    ngx_file_mapping_t     *fm;
+    ngx_http_geo_range_t  **ranges;
+    ngx_http_geo_header_t  *header;
+
+    fm = ngx_palloc(ctx->pool, sizeof(ngx_file_mapping_t));
+    if (fm == NULL) {
+        return NGX_ERROR;
+    }
 
-    ngx_memzero(&file, sizeof(ngx_file_t));
-    file.name = *name;
-    file.log = cf->log;
+    fm->name = name->data;
+    fm->log = cf->log;
 
-    file.fd = ngx_open_file(name->data, NGX_FILE_RDONLY, 0, 0);
-    if (file.fd == NGX_INVALID_FILE) {
-        err = ngx_errno;
-        if (err != NGX_ENOENT) {
-            ngx_conf_log_error(NGX_LOG_CRIT, cf, err,
-                               ngx_open_file_n " \"%s\" failed", name->data);
-        }
+    if (ngx_open_file_mapping(fm) != NGX_OK) {
         return NGX_DECLINED;
     }
 
@@ -1206,13 +1439,13 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto done;
     }
 
-    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR) {
+    if (ngx_fd_info(fm->fd, &fi) == NGX_FILE_ERROR) {
         ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
                            ngx_fd_info_n " \"%s\" failed", name->data);
         goto failed;
     }
 
-    size = (size_t) ngx_file_size(&fi);
+    size = fm->size;
     mtime = ngx_file_mtime(&fi);
 
     ch = name->data[name->len - 4];
@@ -1232,73 +1465,27 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto failed;
     }
 
-    base = ngx_palloc(ctx->pool, size);
-    if (base == NULL) {
-        goto failed;
-    }
-
-    n = ngx_read_file(&file, base, size, 0);
-
-    if (n == NGX_ERROR) {
-        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
-                           ngx_read_file_n " \"%s\" failed", name->data);
-        goto failed;
-    }
-
-    if ((size_t) n != size) {
-        ngx_conf_log_error(NGX_LOG_CRIT, cf, 0,
-            ngx_read_file_n " \"%s\" returned only %z bytes instead of %z",
-            name->data, n, size);
-        goto failed;
-    }
-
+    base = fm->addr;
     header = (ngx_http_geo_header_t *) base;
 
-    if (size < 16 || ngx_memcmp(&ngx_http_geo_header, header, 12) != 0) {
+    if (size < sizeof(ngx_http_geo_header_t)
+                + sizeof(ngx_http_variable_value_t)
+                + 0x10000 * sizeof(ngx_http_geo_range_t *)
+        || ngx_memcmp(&ngx_http_geo_header, header, 12) != 0
+        || header->size != size
+        || header->ranges < sizeof(ngx_http_geo_header_t)
+                            + sizeof(ngx_http_variable_value_t)
+        || header->ranges > size - 0x10000 * sizeof(ngx_http_geo_range_t *))
+    {
         ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
              "incompatible binary geo range base \"%s\"", name->data);
         goto failed;
     }
 
-    ngx_crc32_init(crc32);
-
-    vv = (ngx_http_variable_value_t *) (base + sizeof(ngx_http_geo_header_t));
-
-    while(vv->data) {
-        len = ngx_align(sizeof(ngx_http_variable_value_t) + vv->len,
-                        sizeof(void *));
-        ngx_crc32_update(&crc32, (u_char *) vv, len);
-        vv->data += (size_t) base;
-        vv = (ngx_http_variable_value_t *) ((u_char *) vv + len);
-    }
-    ngx_crc32_update(&crc32, (u_char *) vv, sizeof(ngx_http_variable_value_t));
-    vv++;
-
-    ranges = (ngx_http_geo_range_t **) vv;
-
-    for (i = 0; i < 0x10000; i++) {
-        ngx_crc32_update(&crc32, (u_char *) &ranges[i], sizeof(void *));
-        if (ranges[i]) {
-            ranges[i] = (ngx_http_geo_range_t *)
-                            ((u_char *) ranges[i] + (size_t) base);
-        }
-    }
-
-    range = (ngx_http_geo_range_t *) &ranges[0x10000];
-
-    while ((u_char *) range < base + size) {
-        while (range->value) {
-            ngx_crc32_update(&crc32, (u_char *) range,
-                             sizeof(ngx_http_geo_range_t));
-            range->value = (ngx_http_variable_value_t *)
-                               ((u_char *) range->value + (size_t) base);
-            range++;
-        }
-        ngx_crc32_update(&crc32, (u_char *) range, sizeof(void *));
-        range = (ngx_http_geo_range_t *) ((u_char *) range + sizeof(void *));
-    }
+    index = header->ranges + 0x10000 * sizeof(ngx_http_geo_range_t *);
 
-    ngx_crc32_final(crc32);
+    crc32 = ngx_crc32_long(base + sizeof(ngx_http_geo_header_t),
+                           index - sizeof(ngx_http_geo_header_t));
 
     if (crc32 != header->crc32) {
         ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
@@ -1306,15 +1493,26 @@ ngx_http_geo_include_binary_base(ngx_conf_t *cf, ngx_http_geo_conf_ctx_t *ctx,
         goto failed;
     }
 
+    ranges = (ngx_http_geo_range_t **) (base + header->ranges);
+
+    cln = ngx_pool_cleanup_add(ctx->pool, 0);
+    if (cln == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    cln->handler = ngx_http_geo_unmap_binary_base;
+    cln->data = fm;
+
     ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
                        "using binary geo range base \"%s\"", name->data);
 
     ctx->include_name = *name;
     ctx->binary_include = 1;
     ctx->high.low = ranges;
-    rc = NGX_OK;
+    ctx->high.base = base;
 
-    goto done;
+    return NGX_OK;
 
 failed:
 
@@ -1322,19 +1520,25 @@ failed:
 
 done:
 
-    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, cf->log, ngx_errno,
-                      ngx_close_file_n " \"%s\" failed", name->data);
-    }
+    ngx_close_file_mapping(fm);
 
     return rc;
 }
 
 
+static void
+ngx_http_geo_unmap_binary_base(void *data)
+{
+    ngx_file_mapping_t  *fm = data;
+
+    ngx_close_file_mapping(fm);
+}
+
+
 static void
 ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
 {
-    u_char                              *p;
+    u_char                              *p, *name;
     uint32_t                             hash;
     ngx_str_t                            s;
     ngx_uint_t                           i;
@@ -1343,20 +1547,34 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
     ngx_http_geo_header_t               *header;
     ngx_http_geo_variable_value_node_t  *gvvn;
 
-    fm.name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 5);
+    if (name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(name, "%V.bin%Z", &ctx->include_name);
+
+    /*
+     * the base is written under a temporary name and then renamed over
+     * the old one, as the old base may still be mapped by old workers
+     */
+
+    fm.name = ngx_pnalloc(ctx->temp_pool, ctx->include_name.len + 16);
     if (fm.name == NULL) {
         return;
     }
 
-    ngx_sprintf(fm.name, "%V.bin%Z", &ctx->include_name);
+    ngx_sprintf(fm.name, "%V.bin.%010uD%Z", &ctx->include_name,
+                (uint32_t) ngx_next_temp_number(0));
 
     fm.size = ctx->data_size;
     fm.log = ctx->pool->log;
 
     ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
-                  "creating binary geo range base \"%s\"", fm.name);
+                  "creating binary geo range base \"%s\"", name);
 
     if (ngx_create_file_mapping(&fm) != NGX_OK) {
+        (void) ngx_delete_file(fm.name);
         return;
     }
 
@@ -1401,11 +1619,23 @@ ngx_http_geo_create_binary_base(ngx_http_geo_conf_ctx_t *ctx)
     }
 
     header = fm.addr;
+    header->size = (uint32_t) fm.size;
+    header->ranges = (uint32_t) ((u_char *) ranges - (u_char *) fm.addr);
     header->crc32 = ngx_crc32_long((u_char *) fm.addr
                                        + sizeof(ngx_http_geo_header_t),
-                                   fm.size - sizeof(ngx_http_geo_header_t));
+                                   header->ranges
+                                   + 0x10000 * sizeof(ngx_http_geo_range_t *)
+                                   - sizeof(ngx_http_geo_header_t));
 
     ngx_close_file_mapping(&fm);
+
+    if (ngx_rename_file(fm.name, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      fm.name, name);
+
+        (void) ngx_delete_file(fm.name);
+    }
 }
 
 
@@ -0,0 +1,959 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+/*
+ * the connections with the same key draw from a shared token bucket,
+ * each connection is granted a fair share of the tokens available but
+ * not less than a page, so that many connections do not starve each other,
+ * the throttled writers of a worker wait in a queue of the zone and
+ * are woken up in order by a single timer instead of a timer per
+ * connection
+ */
+
+#define NGX_HTTP_LIMIT_BANDWIDTH_TICK  50
+
+
+typedef struct {
+    u_char                              color;
+    u_char                              dummy;
+    u_short                             len;
+    ngx_queue_t                         queue;
+    ngx_msec_t                          last;
+    off_t                               tokens;
+    ngx_uint_t                          conns;
+    u_char                              data[1];
+} ngx_http_limit_bandwidth_node_t;
+
+
+typedef struct {
+    ngx_rbtree_t                        rbtree;
+    ngx_rbtree_node_t                   sentinel;
+    ngx_queue_t                         queue;
+} ngx_http_limit_bandwidth_shctx_t;
+
+
+typedef struct {
+    ngx_http_limit_bandwidth_shctx_t   *sh;
+    ngx_slab_pool_t                    *shpool;
+    /* bytes per second */
+    off_t                               rate;
+    ngx_int_t                           index;
+    ngx_str_t                           var;
+    ngx_queue_t                         waiting;
+    ngx_event_t                         event;
+} ngx_http_limit_bandwidth_ctx_t;
+
+
+typedef struct {
+    ngx_http_request_t                 *request;
+    ngx_http_limit_bandwidth_ctx_t     *ctx;
+    ngx_http_limit_bandwidth_node_t    *node;
+    ngx_queue_t                         queue;
+    off_t                               granted;
+    /* the size the writer waits for */
+    off_t                               want;
+    /* the tokens taken for the writer when it was woken up */
+    off_t                               reserved;
+    unsigned                            waiting:1;
+} ngx_http_limit_bandwidth_request_t;
+
+
+typedef struct {
+    ngx_shm_zone_t                     *shm_zone;
+} ngx_http_limit_bandwidth_conf_t;
+
+
+static ngx_http_limit_bandwidth_request_t *ngx_http_limit_bandwidth_attach(
+    ngx_http_request_t *r, ngx_http_limit_bandwidth_conf_t *lbcf);
+static ngx_http_limit_bandwidth_node_t *ngx_http_limit_bandwidth_lookup(
+    ngx_http_limit_bandwidth_ctx_t *ctx, ngx_uint_t hash, u_char *data,
+    size_t len);
+static off_t ngx_http_limit_bandwidth_min(ngx_http_limit_bandwidth_ctx_t *ctx,
+    off_t want);
+static off_t ngx_http_limit_bandwidth_refill(
+    ngx_http_limit_bandwidth_ctx_t *ctx, ngx_http_limit_bandwidth_node_t *lb);
+static void ngx_http_limit_bandwidth_wait(
+    ngx_http_limit_bandwidth_request_t *lr, off_t want);
+static void ngx_http_limit_bandwidth_wake(ngx_event_t *ev);
+static void ngx_http_limit_bandwidth_cleanup(void *data);
+static void ngx_http_limit_bandwidth_expire(ngx_http_limit_bandwidth_ctx_t *ctx,
+    ngx_uint_t n);
+static void ngx_http_limit_bandwidth_rbtree_insert_value(
+    ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node,
+    ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_limit_bandwidth_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+
+static void *ngx_http_limit_bandwidth_create_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_bandwidth_merge_conf(ngx_conf_t *cf, void *parent,
+    void *child);
+static char *ngx_http_limit_bandwidth_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_limit_bandwidth(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+
+
+static ngx_command_t  ngx_http_limit_bandwidth_commands[] = {
+
+    { ngx_string("limit_bandwidth_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      ngx_http_limit_bandwidth_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("limit_bandwidth"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_bandwidth,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_limit_bandwidth_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    NULL,                                  /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_limit_bandwidth_create_conf,  /* create location configuration */
+    ngx_http_limit_bandwidth_merge_conf    /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_limit_bandwidth_module = {
+    NGX_MODULE_V1,
+    &ngx_http_limit_bandwidth_module_ctx,  /* module context */
+    ngx_http_limit_bandwidth_commands,     /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    NULL,                                  /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+ngx_int_t
+ngx_http_limit_bandwidth_acquire(ngx_http_request_t *r, off_t size,
+    off_t *limit)
+{
+    off_t                                want, min, share, tokens;
+    ngx_http_limit_bandwidth_ctx_t      *ctx;
+    ngx_http_limit_bandwidth_node_t     *lb;
+    ngx_http_limit_bandwidth_conf_t     *lbcf;
+    ngx_http_limit_bandwidth_request_t  *lr;
+
+    lbcf = ngx_http_get_module_loc_conf(r->main,
+                                        ngx_http_limit_bandwidth_module);
+
+    if (lbcf->shm_zone == NULL) {
+        return NGX_DECLINED;
+    }
+
+    lr = ngx_http_get_module_ctx(r->main, ngx_http_limit_bandwidth_module);
+
+    if (lr == NULL) {
+        lr = ngx_http_limit_bandwidth_attach(r, lbcf);
+        if (lr == NULL) {
+            return NGX_DECLINED;
+        }
+    }
+
+    lb = lr->node;
+
+    if (lb == NULL) {
+        return NGX_DECLINED;
+    }
+
+    want = size;
+
+    if (*limit && *limit < want) {
+        want = *limit;
+    }
+
+    if (want <= 0) {
+        return NGX_DECLINED;
+    }
+
+    ctx = lr->ctx;
+
+    min = ngx_http_limit_bandwidth_min(ctx, want);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    tokens = ngx_http_limit_bandwidth_refill(ctx, lb);
+
+    if (lr->reserved) {
+
+        /* the tokens taken for the writer when it was woken up */
+
+        tokens += lr->reserved;
+        lb->tokens = tokens;
+
+        min = ngx_min(min, lr->reserved);
+        lr->reserved = 0;
+    }
+
+    if (tokens < min) {
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "limit bandwidth wait, tokens:%O min:%O", tokens, min);
+
+        ngx_http_limit_bandwidth_wait(lr, want);
+
+        return NGX_AGAIN;
+    }
+
+    share = ngx_max(tokens / (off_t) lb->conns, min);
+
+    lr->granted = ngx_min(want, share);
+    lb->tokens -= lr->granted;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "limit bandwidth granted:%O", lr->granted);
+
+    *limit = lr->granted;
+
+    return NGX_OK;
+}
+
+
+void
+ngx_http_limit_bandwidth_release(ngx_http_request_t *r, off_t sent)
+{
+    off_t                                unused;
+    ngx_http_limit_bandwidth_ctx_t      *ctx;
+    ngx_http_limit_bandwidth_request_t  *lr;
+
+    lr = ngx_http_get_module_ctx(r->main, ngx_http_limit_bandwidth_module);
+
+    if (lr == NULL || lr->granted == 0) {
+        return;
+    }
+
+    unused = lr->granted - sent;
+    lr->granted = 0;
+
+    if (unused == 0) {
+        return;
+    }
+
+    /*
+     * return the tokens of the output the socket did not accept,
+     * or take the tokens of the output sent over the grant
+     */
+
+    ctx = lr->ctx;
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    lr->node->tokens += unused;
+
+    if (lr->node->tokens > ctx->rate) {
+        lr->node->tokens = ctx->rate;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static ngx_http_limit_bandwidth_request_t *
+ngx_http_limit_bandwidth_attach(ngx_http_request_t *r,
+    ngx_http_limit_bandwidth_conf_t *lbcf)
+{
+    size_t                               len;
+    uint32_t                             hash;
+    ngx_pool_cleanup_t                  *cln;
+    ngx_http_variable_value_t           *vv;
+    ngx_http_limit_bandwidth_ctx_t      *ctx;
+    ngx_http_limit_bandwidth_request_t  *lr;
+
+    lr = ngx_pcalloc(r->main->pool,
+                     sizeof(ngx_http_limit_bandwidth_request_t));
+    if (lr == NULL) {
+        return NULL;
+    }
+
+    ngx_http_set_ctx(r->main, lr, ngx_http_limit_bandwidth_module);
+
+    ctx = lbcf->shm_zone->data;
+
+    vv = ngx_http_get_indexed_variable(r->main, ctx->index);
+
+    if (vv == NULL || vv->not_found) {
+        return lr;
+    }
+
+    len = vv->len;
+
+    if (len == 0) {
+        return lr;
+    }
+
+    if (len > 65535) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "the value of the \"%V\" variable "
+                      "is more than 65535 bytes: \"%v\"",
+                      &ctx->var, vv);
+        return lr;
+    }
+
+    cln = ngx_pool_cleanup_add(r->main->pool, 0);
+    if (cln == NULL) {
+        return NULL;
+    }
+
+    hash = ngx_crc32_short(vv->data, len);
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    lr->node = ngx_http_limit_bandwidth_lookup(ctx, hash, vv->data, len);
+
+    if (lr->node) {
+        lr->node->conns++;
+    }
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+    if (lr->node == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "could not allocate node in limit_bandwidth zone \"%V\"",
+                      &lbcf->shm_zone->shm.name);
+        return lr;
+    }
+
+    lr->request = r->main;
+    lr->ctx = ctx;
+
+    cln->handler = ngx_http_limit_bandwidth_cleanup;
+    cln->data = lr;
+
+    return lr;
+}
+
+
+static ngx_http_limit_bandwidth_node_t *
+ngx_http_limit_bandwidth_lookup(ngx_http_limit_bandwidth_ctx_t *ctx,
+    ngx_uint_t hash, u_char *data, size_t len)
+{
+    size_t                            size;
+    ngx_int_t                         rc;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_http_limit_bandwidth_node_t  *lb;
+
+    node = ctx->sh->rbtree.root;
+    sentinel = ctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lb = (ngx_http_limit_bandwidth_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(data, lb->data, len, (size_t) lb->len);
+
+        if (rc == 0) {
+            ngx_queue_remove(&lb->queue);
+            ngx_queue_insert_head(&ctx->sh->queue, &lb->queue);
+
+            return lb;
+        }
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    size = offsetof(ngx_rbtree_node_t, color)
+           + offsetof(ngx_http_limit_bandwidth_node_t, data)
+           + len;
+
+    ngx_http_limit_bandwidth_expire(ctx, 1);
+
+    node = ngx_slab_alloc_locked(ctx->shpool, size);
+
+    if (node == NULL) {
+        ngx_http_limit_bandwidth_expire(ctx, 0);
+
+        node = ngx_slab_alloc_locked(ctx->shpool, size);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    node->key = hash;
+
+    lb = (ngx_http_limit_bandwidth_node_t *) &node->color;
+
+    lb->len = (u_short) len;
+    lb->conns = 0;
+
+    /* a new key starts with a full bucket */
+
+    lb->tokens = ctx->rate;
+    lb->last = ngx_current_msec;
+
+    ngx_memcpy(lb->data, data, len);
+
+    ngx_rbtree_insert(&ctx->sh->rbtree, node);
+
+    ngx_queue_insert_head(&ctx->sh->queue, &lb->queue);
+
+    return lb;
+}
+
+
+static off_t
+ngx_http_limit_bandwidth_min(ngx_http_limit_bandwidth_ctx_t *ctx, off_t want)
+{
+    off_t  min;
+
+    /* do not split the output into too small parts */
+
+    min = ngx_min(want, (off_t) ngx_pagesize);
+
+    return ngx_min(min, ctx->rate);
+}
+
+
+static off_t
+ngx_http_limit_bandwidth_refill(ngx_http_limit_bandwidth_ctx_t *ctx,
+    ngx_http_limit_bandwidth_node_t *lb)
+{
+    ngx_msec_t      now;
+    ngx_msec_int_t  ms;
+
+    now = ngx_current_msec;
+
+    ms = (ngx_msec_int_t) (now - lb->last);
+
+    if (ms <= 0) {
+        return lb->tokens;
+    }
+
+    /* the bucket holds a second of the rate */
+
+    if (ms >= 1000) {
+        lb->tokens = ctx->rate;
+
+    } else {
+        lb->tokens += ctx->rate * ms / 1000;
+
+        if (lb->tokens > ctx->rate) {
+            lb->tokens = ctx->rate;
+        }
+    }
+
+    lb->last = now;
+
+    return lb->tokens;
+}
+
+
+static void
+ngx_http_limit_bandwidth_wait(ngx_http_limit_bandwidth_request_t *lr,
+    off_t want)
+{
+    ngx_http_limit_bandwidth_ctx_t  *ctx;
+
+    ctx = lr->ctx;
+
+    lr->want = want;
+
+    if (!lr->waiting) {
+        ngx_queue_insert_tail(&ctx->waiting, &lr->queue);
+        lr->waiting = 1;
+    }
+
+    if (!ctx->event.timer_set) {
+        ctx->event.log = ngx_cycle->log;
+        ngx_add_timer(&ctx->event, NGX_HTTP_LIMIT_BANDWIDTH_TICK);
+    }
+}
+
+
+static void
+ngx_http_limit_bandwidth_wake(ngx_event_t *ev)
+{
+    off_t                                min, tokens;
+    ngx_queue_t                         *q, *next;
+    ngx_event_t                         *wev;
+    ngx_http_limit_bandwidth_ctx_t      *ctx;
+    ngx_http_limit_bandwidth_request_t  *lr;
+
+    ctx = ev->data;
+
+    /*
+     * the writers are woken up in the order they started to wait,
+     * and the tokens they wait for are reserved so that the writers
+     * which have not waited cannot take them first
+     */
+
+    for (q = ngx_queue_head(&ctx->waiting);
+         q != ngx_queue_sentinel(&ctx->waiting);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+
+        lr = ngx_queue_data(q, ngx_http_limit_bandwidth_request_t, queue);
+
+        min = ngx_http_limit_bandwidth_min(ctx, lr->want);
+
+        ngx_shmtx_lock(&ctx->shpool->mutex);
+
+        tokens = ngx_http_limit_bandwidth_refill(ctx, lr->node);
+
+        if (tokens < min) {
+            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            continue;
+        }
+
+        lr->node->tokens -= min;
+
+        ngx_shmtx_unlock(&ctx->shpool->mutex);
+
+        lr->reserved += min;
+
+        ngx_queue_remove(q);
+        lr->waiting = 0;
+
+        /* the writer handles the wakeup as the delay timer expiration */
+
+        wev = lr->request->connection->write;
+        wev->timedout = 1;
+
+        ngx_post_event(wev, &ngx_posted_events);
+    }
+
+    if (!ngx_queue_empty(&ctx->waiting)) {
+        ngx_add_timer(ev, NGX_HTTP_LIMIT_BANDWIDTH_TICK);
+    }
+}
+
+
+static void
+ngx_http_limit_bandwidth_cleanup(void *data)
+{
+    ngx_http_limit_bandwidth_request_t  *lr = data;
+
+    ngx_http_limit_bandwidth_ctx_t  *ctx;
+
+    ctx = lr->ctx;
+
+    if (lr->waiting) {
+        ngx_queue_remove(&lr->queue);
+        lr->waiting = 0;
+    }
+
+    ngx_shmtx_lock(&ctx->shpool->mutex);
+
+    lr->node->tokens += lr->reserved;
+
+    if (lr->node->tokens > ctx->rate) {
+        lr->node->tokens = ctx->rate;
+    }
+
+    lr->node->conns--;
+
+    ngx_shmtx_unlock(&ctx->shpool->mutex);
+}
+
+
+static void
+ngx_http_limit_bandwidth_expire(ngx_http_limit_bandwidth_ctx_t *ctx,
+    ngx_uint_t n)
+{
+    ngx_msec_int_t                    ms;
+    ngx_queue_t                      *q;
+    ngx_rbtree_node_t                *node;
+    ngx_http_limit_bandwidth_node_t  *lb;
+
+    /*
+     * n == 1 deletes one or two idle entries
+     * n == 0 deletes oldest entry by force
+     *        and one or two idle entries
+     */
+
+    while (n < 3) {
+
+        if (ngx_queue_empty(&ctx->sh->queue)) {
+            return;
+        }
+
+        q = ngx_queue_last(&ctx->sh->queue);
+
+        lb = ngx_queue_data(q, ngx_http_limit_bandwidth_node_t, queue);
+
+        if (lb->conns) {
+            return;
+        }
+
+        if (n++ != 0) {
+
+            /* the bucket of an idle entry is full again after a second */
+
+            ms = (ngx_msec_int_t) (ngx_current_msec - lb->last);
+
+            if (ms < 1000) {
+                return;
+            }
+        }
+
+        ngx_queue_remove(q);
+
+        node = (ngx_rbtree_node_t *)
+                   ((u_char *) lb - offsetof(ngx_rbtree_node_t, color));
+
+        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+
+        ngx_slab_free_locked(ctx->shpool, node);
+    }
+}
+
+
+static void
+ngx_http_limit_bandwidth_rbtree_insert_value(ngx_rbtree_node_t *temp,
+    ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel)
+{
+    ngx_rbtree_node_t                **p;
+    ngx_http_limit_bandwidth_node_t   *lbn, *lbnt;
+
+    for ( ;; ) {
+
+        if (node->key < temp->key) {
+
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+
+            lbn = (ngx_http_limit_bandwidth_node_t *) &node->color;
+            lbnt = (ngx_http_limit_bandwidth_node_t *) &temp->color;
+
+            p = (ngx_memn2cmp(lbn->data, lbnt->data, lbn->len, lbnt->len) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel) {
+            break;
+        }
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_int_t
+ngx_http_limit_bandwidth_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_limit_bandwidth_ctx_t  *octx = data;
+
+    size_t                           len;
+    ngx_http_limit_bandwidth_ctx_t  *ctx;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        if (ngx_strcmp(ctx->var.data, octx->var.data) != 0) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_bandwidth \"%V\" uses the \"%V\" variable "
+                          "while previously it used the \"%V\" variable",
+                          &shm_zone->shm.name, &ctx->var, &octx->var);
+            return NGX_ERROR;
+        }
+
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool,
+                             sizeof(ngx_http_limit_bandwidth_shctx_t));
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
+                    ngx_http_limit_bandwidth_rbtree_insert_value);
+
+    ngx_queue_init(&ctx->sh->queue);
+
+    len = sizeof(" in limit_bandwidth zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in limit_bandwidth zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_limit_bandwidth_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_bandwidth_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_bandwidth_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    conf->shm_zone = NGX_CONF_UNSET_PTR;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_limit_bandwidth_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_limit_bandwidth_conf_t *prev = parent;
+    ngx_http_limit_bandwidth_conf_t *conf = child;
+
+    ngx_conf_merge_ptr_value(conf->shm_zone, prev->shm_zone, NULL);
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_bandwidth_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    u_char                          *p;
+    off_t                            rate;
+    ssize_t                          size;
+    ngx_str_t                       *value, name, s;
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                  *shm_zone;
+    ngx_http_limit_bandwidth_ctx_t  *ctx;
+
+    value = cf->args->elts;
+
+    ctx = NULL;
+    size = 0;
+    rate = 0;
+    name.len = 0;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "zone=", 5) == 0) {
+
+            name.data = value[i].data + 5;
+
+            p = (u_char *) ngx_strchr(name.data, ':');
+
+            if (p == NULL) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            name.len = p - name.data;
+
+            s.data = p + 1;
+            s.len = value[i].data + value[i].len - s.data;
+
+            size = ngx_parse_size(&s);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "rate=", 5) == 0) {
+
+            s.len = value[i].len - 5;
+            s.data = value[i].data + 5;
+
+            rate = ngx_parse_offset(&s);
+            if (rate <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid rate \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (value[i].data[0] == '$') {
+
+            value[i].len--;
+            value[i].data++;
+
+            ctx = ngx_pcalloc(cf->pool,
+                              sizeof(ngx_http_limit_bandwidth_ctx_t));
+            if (ctx == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->index = ngx_http_get_variable_index(cf, &value[i]);
+            if (ctx->index == NGX_ERROR) {
+                return NGX_CONF_ERROR;
+            }
+
+            ctx->var = value[i];
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (name.len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"zone\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (rate == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"%V\" must have \"rate\" parameter",
+                           &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ctx == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no variable is defined for %V \"%V\"",
+                           &cmd->name, &name);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->rate = rate;
+
+    ngx_queue_init(&ctx->waiting);
+
+    ctx->event.handler = ngx_http_limit_bandwidth_wake;
+    ctx->event.data = ctx;
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size,
+                                     &ngx_http_limit_bandwidth_module);
+    if (shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (shm_zone->data) {
+        ctx = shm_zone->data;
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "%V \"%V\" is already bound to variable \"%V\"",
+                           &cmd->name, &name, &ctx->var);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = ngx_http_limit_bandwidth_init_zone;
+    shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_bandwidth(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_bandwidth_conf_t  *lbcf = conf;
+
+    ngx_str_t  *value, s;
+
+    if (lbcf->shm_zone != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        lbcf->shm_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+    if (ngx_strncmp(value[1].data, "zone=", 5) != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    s.len = value[1].len - 5;
+    s.data = value[1].data + 5;
+
+    lbcf->shm_zone = ngx_shared_memory_add(cf, &s, 0,
+                                           &ngx_http_limit_bandwidth_module);
+    if (lbcf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (lbcf->shm_zone->data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "unknown limit_bandwidth_zone \"%V\"", &s);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
@@ -0,0 +1,25 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#ifndef _NGX_HTTP_LIMIT_BANDWIDTH_H_INCLUDED_
+#define _NGX_HTTP_LIMIT_BANDWIDTH_H_INCLUDED_
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+ngx_int_t ngx_http_limit_bandwidth_acquire(ngx_http_request_t *r,
+    off_t size, off_t *limit);
+void ngx_http_limit_bandwidth_release(ngx_http_request_t *r, off_t sent);
+
+
+extern ngx_module_t  ngx_http_limit_bandwidth_module;
+
+
+#endif /* _NGX_HTTP_LIMIT_BANDWIDTH_H_INCLUDED_ */
@@ -23,29 +23,114 @@ typedef struct {
 } ngx_http_limit_req_node_t;
 
 
+/*
+ * with the sliding window "last" is the start of the current window,
+ * and "excess" keeps the numbers of requests in the previous and
+ * the current windows in its high and low halves
+ */
+
+#define NGX_HTTP_LIMIT_REQ_HALF      (sizeof(ngx_uint_t) * 4)
+#define NGX_HTTP_LIMIT_REQ_MASK                                               \
+    (((ngx_uint_t) 1 << NGX_HTTP_LIMIT_REQ_HALF) - 1)
+
+
+/*
+ * a zone is split into shards chosen by the key hash, each shard has
+ * its own tree, queue and lock, the slab pool mutex is only taken
+ * to allocate and free the nodes
+ */
+
 typedef struct {
     ngx_rbtree_t                  rbtree;
     ngx_rbtree_node_t             sentinel;
     ngx_queue_t                   queue;
+#if (NGX_HAVE_ATOMIC_OPS)
+    ngx_shmtx_sh_t                lock;
+    ngx_shmtx_t                   mutex;
+#endif
 } ngx_http_limit_req_shctx_t;
 
 
 typedef struct {
-    ngx_http_limit_req_shctx_t  *sh;
+    ngx_http_limit_req_shctx_t **sh;
+    ngx_uint_t                   nshards;
     ngx_slab_pool_t             *shpool;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   rate;
+    /* the sliding window length, 0 for the leaky bucket */
+    ngx_msec_t                   window;
     ngx_int_t                    index;
     ngx_str_t                    var;
     ngx_http_limit_req_node_t   *node;
+    ngx_http_limit_req_shctx_t  *shard;
+    ngx_shm_zone_t              *shm_zone;
+    /* deltas accounted by the worker since the last synchronization */
+    ngx_buf_t                   *sync;
+    u_char                     **sync_slots;
 } ngx_http_limit_req_ctx_t;
 
 
+#if (NGX_HAVE_ATOMIC_OPS)
+
+#define ngx_http_limit_req_mutex(ctx, shard)  (&(shard)->mutex)
+#define ngx_http_limit_req_alloc(ctx, size)                                   \
+    ngx_slab_alloc((ctx)->shpool, size)
+#define ngx_http_limit_req_free(ctx, p)                                       \
+    ngx_slab_free((ctx)->shpool, p)
+
+#else
+
+/* without atomic operations all the shards share the slab pool mutex */
+
+#define ngx_http_limit_req_mutex(ctx, shard)  (&(ctx)->shpool->mutex)
+#define ngx_http_limit_req_alloc(ctx, size)                                   \
+    ngx_slab_alloc_locked((ctx)->shpool, size)
+#define ngx_http_limit_req_free(ctx, p)                                       \
+    ngx_slab_free_locked((ctx)->shpool, p)
+
+#endif
+
+
+/*
+ * the zones marked with the "sync" parameter exchange the accounted
+ * requests with the peers: each worker aggregates the requests per key
+ * and periodically sends frames to every peer, a frame is
+ *
+ *     4 bytes   the length of the rest of the frame
+ *     1 byte    the zone name length
+ *     n bytes   the zone name
+ *
+ * followed by records of a 2 byte key length, a 2 byte number of requests
+ * and the key, all integers are in network byte order
+ */
+
+#define NGX_HTTP_LIMIT_REQ_SYNC_SLOTS    64
+#define NGX_HTTP_LIMIT_REQ_SYNC_TIMEOUT  5000
+
+
+typedef struct {
+    ngx_addr_t                   addr;
+    ngx_peer_connection_t        peer;
+    ngx_buf_t                   *buffer;
+    ngx_msec_t                   retry;
+} ngx_http_limit_req_sync_peer_t;
+
+
+typedef struct {
+    /* arrays of ngx_shm_zone_t * and ngx_http_limit_req_sync_peer_t */
+    ngx_array_t                  zones;
+    ngx_array_t                  peers;
+    ngx_msec_t                   interval;
+    size_t                       buffer_size;
+} ngx_http_limit_req_main_conf_t;
+
+
 typedef struct {
     ngx_shm_zone_t              *shm_zone;
     /* integer value, 1 corresponds to 0.001 r/s */
     ngx_uint_t                   burst;
-    ngx_uint_t                   nodelay; /* unsigned  nodelay:1 */
+    /* the part of the burst passed without a delay */
+    ngx_uint_t                   delay;
 } ngx_http_limit_req_limit_t;
 
 
@@ -58,12 +143,42 @@ typedef struct {
 
 static void ngx_http_limit_req_delay(ngx_http_request_t *r);
 static ngx_int_t ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
-    ngx_uint_t hash, u_char *data, size_t len, ngx_uint_t *ep,
-    ngx_uint_t account);
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account);
 static ngx_msec_t ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits,
     ngx_uint_t n, ngx_uint_t *ep, ngx_http_limit_req_limit_t **limit);
-static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+static ngx_int_t ngx_http_limit_req_excess(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr, ngx_msec_t now);
+static void ngx_http_limit_req_commit(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr, ngx_msec_t now, ngx_int_t excess,
     ngx_uint_t n);
+static ngx_http_limit_req_node_t *ngx_http_limit_req_create_node(
+    ngx_http_limit_req_ctx_t *ctx, ngx_http_limit_req_shctx_t *shard,
+    ngx_uint_t hash, u_char *data, size_t len);
+static void ngx_http_limit_req_expire_shards(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *shard);
+static void ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t n);
+
+static void ngx_http_limit_req_sync_record(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr);
+static void ngx_http_limit_req_sync_handler(ngx_event_t *ev);
+static void ngx_http_limit_req_sync_send(ngx_http_limit_req_sync_peer_t *sp);
+static ngx_int_t ngx_http_limit_req_sync_known_peer(
+    ngx_http_limit_req_main_conf_t *lmcf, ngx_connection_t *c);
+static void ngx_http_limit_req_sync_write_handler(ngx_event_t *wev);
+static void ngx_http_limit_req_sync_peer_read_handler(ngx_event_t *rev);
+static void ngx_http_limit_req_sync_close_peer(
+    ngx_http_limit_req_sync_peer_t *sp);
+static void ngx_http_limit_req_sync_init_connection(ngx_connection_t *c);
+static void ngx_http_limit_req_sync_read_handler(ngx_event_t *rev);
+static ngx_int_t ngx_http_limit_req_sync_frame(ngx_connection_t *c,
+    ngx_http_limit_req_main_conf_t *lmcf, u_char *p, size_t len);
+static void ngx_http_limit_req_sync_apply(ngx_http_limit_req_ctx_t *ctx,
+    u_char *data, size_t len, ngx_uint_t n);
+
+static void *ngx_http_limit_req_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_limit_req_init_main_conf(ngx_conf_t *cf, void *conf);
 
 static void *ngx_http_limit_req_create_conf(ngx_conf_t *cf);
 static char *ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent,
@@ -72,7 +187,12 @@ static char *ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 static char *ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_limit_req_sync_listen(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
+static char *ngx_http_limit_req_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 static ngx_int_t ngx_http_limit_req_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_limit_req_init_process(ngx_cycle_t *cycle);
 
 
 static ngx_conf_enum_t  ngx_http_limit_req_log_levels[] = {
@@ -87,14 +207,42 @@ static ngx_conf_enum_t  ngx_http_limit_req_log_levels[] = {
 static ngx_command_t  ngx_http_limit_req_commands[] = {
 
     { ngx_string("limit_req_zone"),
-      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE3,
+      NGX_HTTP_MAIN_CONF|NGX_CONF_2MORE,
       ngx_http_limit_req_zone,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("limit_req_sync_listen"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_req_sync_listen,
+      NGX_HTTP_MAIN_CONF_OFFSET,
       0,
+      NULL },
+
+    { ngx_string("limit_req_sync_peer"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_limit_req_sync_peer,
+      NGX_HTTP_MAIN_CONF_OFFSET,
       0,
       NULL },
 
+    { ngx_string("limit_req_sync_interval"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_limit_req_main_conf_t, interval),
+      NULL },
+
+    { ngx_string("limit_req_sync_buffer_size"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_limit_req_main_conf_t, buffer_size),
+      NULL },
+
     { ngx_string("limit_req"),
-      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1234,
       ngx_http_limit_req,
       NGX_HTTP_LOC_CONF_OFFSET,
       0,
@@ -115,8 +263,8 @@ static ngx_http_module_t  ngx_http_limit_req_module_ctx = {
     NULL,                                  /* preconfiguration */
     ngx_http_limit_req_init,               /* postconfiguration */
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    ngx_http_limit_req_create_main_conf,   /* create main configuration */
+    ngx_http_limit_req_init_main_conf,     /* init main configuration */
 
     NULL,                                  /* create server configuration */
     NULL,                                  /* merge server configuration */
@@ -133,7 +281,7 @@ ngx_module_t  ngx_http_limit_req_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_limit_req_init_process,       /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -142,6 +290,9 @@ ngx_module_t  ngx_http_limit_req_module = {
 };
 
 
+static ngx_event_t  ngx_http_limit_req_sync_event;
+
+
 static ngx_int_t
 ngx_http_limit_req_handler(ngx_http_request_t *r)
 {
@@ -153,6 +304,7 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
     ngx_http_variable_value_t   *vv;
     ngx_http_limit_req_ctx_t    *ctx;
     ngx_http_limit_req_conf_t   *lrcf;
+    ngx_http_limit_req_shctx_t  *shard;
     ngx_http_limit_req_limit_t  *limit, *limits;
 
     if (r->main->limit_req_set) {
@@ -198,12 +350,15 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
 
         hash = ngx_crc32_short(vv->data, len);
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        shard = ctx->sh[hash % ctx->nshards];
 
-        rc = ngx_http_limit_req_lookup(limit, hash, vv->data, len, &excess,
+        ngx_shmtx_lock(ngx_http_limit_req_mutex(ctx, shard));
+
+        rc = ngx_http_limit_req_lookup(limit, shard, hash, vv->data, len,
+                                       &excess,
                                        (n == lrcf->limits.nelts - 1));
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_shmtx_unlock(ngx_http_limit_req_mutex(ctx, shard));
 
         ngx_log_debug4(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "limit_req[%ui]: %i %ui.%03ui",
@@ -236,11 +391,11 @@ ngx_http_limit_req_handler(ngx_http_request_t *r)
                 continue;
             }
 
-            ngx_shmtx_lock(&ctx->shpool->mutex);
+            ngx_shmtx_lock(ngx_http_limit_req_mutex(ctx, ctx->shard));
 
             ctx->node->count--;
 
-            ngx_shmtx_unlock(&ctx->shpool->mutex);
+            ngx_shmtx_unlock(ngx_http_limit_req_mutex(ctx, ctx->shard));
 
             ctx->node = NULL;
         }
@@ -351,14 +506,13 @@ ngx_http_limit_req_rbtree_insert_value(ngx_rbtree_node_t *temp,
 
 
 static ngx_int_t
-ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
-    u_char *data, size_t len, ngx_uint_t *ep, ngx_uint_t account)
+ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len, ngx_uint_t *ep, ngx_uint_t account)
 {
-    size_t                      size;
     ngx_int_t                   rc, excess;
     ngx_time_t                 *tp;
     ngx_msec_t                  now;
-    ngx_msec_int_t              ms;
     ngx_rbtree_node_t          *node, *sentinel;
     ngx_http_limit_req_ctx_t   *ctx;
     ngx_http_limit_req_node_t  *lr;
@@ -368,8 +522,8 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     ctx = limit->shm_zone->data;
 
-    node = ctx->sh->rbtree.root;
-    sentinel = ctx->sh->rbtree.sentinel;
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
 
     while (node != sentinel) {
 
@@ -391,15 +545,9 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
         if (rc == 0) {
             ngx_queue_remove(&lr->queue);
-            ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-
-            ms = (ngx_msec_int_t) (now - lr->last);
-
-            excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
+            ngx_queue_insert_head(&shard->queue, &lr->queue);
 
-            if (excess < 0) {
-                excess = 0;
-            }
+            excess = ngx_http_limit_req_excess(ctx, lr, now);
 
             *ep = excess;
 
@@ -408,14 +556,17 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
             }
 
             if (account) {
-                lr->excess = excess;
-                lr->last = now;
+                ngx_http_limit_req_commit(ctx, lr, now, excess, 1);
+
+                ngx_http_limit_req_sync_record(ctx, lr);
+
                 return NGX_OK;
             }
 
             lr->count++;
 
             ctx->node = lr;
+            ctx->shard = shard;
 
             return NGX_AGAIN;
         }
@@ -425,20 +576,148 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     *ep = 0;
 
+    lr = ngx_http_limit_req_create_node(ctx, shard, hash, data, len);
+    if (lr == NULL) {
+        return NGX_ERROR;
+    }
+
+    if (account) {
+        lr->last = now;
+        lr->count = 0;
+
+        ngx_http_limit_req_commit(ctx, lr, now, 0, 1);
+
+        ngx_http_limit_req_sync_record(ctx, lr);
+
+        return NGX_OK;
+    }
+
+    lr->last = 0;
+    lr->count = 1;
+
+    ctx->node = lr;
+    ctx->shard = shard;
+
+    return NGX_AGAIN;
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_excess(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr, ngx_msec_t now)
+{
+    uint64_t        prev, cur;
+    ngx_int_t       excess;
+    ngx_msec_int_t  ms;
+
+    ms = (ngx_msec_int_t) (now - lr->last);
+
+    if (ctx->window == 0) {
+        excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
+
+        return (excess < 0) ? 0 : excess;
+    }
+
+    /*
+     * the number of requests in the window ending now is estimated
+     * as the current window requests and the previous window requests
+     * in proportion to the part of the previous window still covered
+     */
+
+    if (ms < 0) {
+        ms = 0;
+    }
+
+    prev = lr->excess >> NGX_HTTP_LIMIT_REQ_HALF;
+    cur = lr->excess & NGX_HTTP_LIMIT_REQ_MASK;
+
+    if ((ngx_msec_t) ms >= 2 * ctx->window) {
+        return 0;
+    }
+
+    if ((ngx_msec_t) ms >= ctx->window) {
+        prev = cur;
+        cur = 0;
+        ms -= ctx->window;
+    }
+
+    excess = (ngx_int_t) (prev * 1000 * (ctx->window - ms) / ctx->window
+                          + cur * 1000 + 1000
+                          - (uint64_t) ctx->rate * ctx->window / 1000);
+
+    return (excess < 0) ? 0 : excess;
+}
+
+
+static void
+ngx_http_limit_req_commit(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr, ngx_msec_t now, ngx_int_t excess,
+    ngx_uint_t n)
+{
+    ngx_uint_t      prev, cur;
+    ngx_msec_int_t  ms;
+
+    if (ctx->window == 0) {
+        lr->excess = excess + (n - 1) * 1000;
+        lr->last = now;
+        return;
+    }
+
+    ms = (ngx_msec_int_t) (now - lr->last);
+
+    prev = lr->excess >> NGX_HTTP_LIMIT_REQ_HALF;
+    cur = lr->excess & NGX_HTTP_LIMIT_REQ_MASK;
+
+    if (ms < 0 || (ngx_msec_t) ms >= 2 * ctx->window) {
+        prev = 0;
+        cur = 0;
+        lr->last = now;
+
+    } else if ((ngx_msec_t) ms >= ctx->window) {
+        prev = cur;
+        cur = 0;
+        lr->last += ctx->window;
+    }
+
+    cur += n;
+
+    if (cur > NGX_HTTP_LIMIT_REQ_MASK) {
+        cur = NGX_HTTP_LIMIT_REQ_MASK;
+    }
+
+    lr->excess = prev << NGX_HTTP_LIMIT_REQ_HALF | cur;
+}
+
+
+static ngx_http_limit_req_node_t *
+ngx_http_limit_req_create_node(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t hash, u_char *data,
+    size_t len)
+{
+    size_t                      size;
+    ngx_rbtree_node_t          *node;
+    ngx_http_limit_req_node_t  *lr;
+
     size = offsetof(ngx_rbtree_node_t, color)
            + offsetof(ngx_http_limit_req_node_t, data)
            + len;
 
-    ngx_http_limit_req_expire(ctx, 1);
+    ngx_http_limit_req_expire(ctx, shard, 1);
 
-    node = ngx_slab_alloc_locked(ctx->shpool, size);
+    node = ngx_http_limit_req_alloc(ctx, size);
 
     if (node == NULL) {
-        ngx_http_limit_req_expire(ctx, 0);
+        ngx_http_limit_req_expire(ctx, shard, 0);
+
+        node = ngx_http_limit_req_alloc(ctx, size);
 
-        node = ngx_slab_alloc_locked(ctx->shpool, size);
         if (node == NULL) {
-            return NGX_ERROR;
+            ngx_http_limit_req_expire_shards(ctx, shard);
+
+            node = ngx_http_limit_req_alloc(ctx, size);
+            if (node == NULL) {
+                return NULL;
+            }
         }
     }
 
@@ -446,27 +725,16 @@ ngx_http_limit_req_lookup(ngx_http_limit_req_limit_t *limit, ngx_uint_t hash,
 
     lr = (ngx_http_limit_req_node_t *) &node->color;
 
-    lr->len = (u_char) len;
+    lr->len = (u_short) len;
     lr->excess = 0;
 
     ngx_memcpy(lr->data, data, len);
 
-    ngx_rbtree_insert(&ctx->sh->rbtree, node);
-
-    ngx_queue_insert_head(&ctx->sh->queue, &lr->queue);
-
-    if (account) {
-        lr->last = now;
-        lr->count = 0;
-        return NGX_OK;
-    }
-
-    lr->last = 0;
-    lr->count = 1;
+    ngx_rbtree_insert(&shard->rbtree, node);
 
-    ctx->node = lr;
+    ngx_queue_insert_head(&shard->queue, &lr->queue);
 
-    return NGX_AGAIN;
+    return lr;
 }
 
 
@@ -477,18 +745,17 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
     ngx_int_t                   excess;
     ngx_time_t                 *tp;
     ngx_msec_t                  now, delay, max_delay;
-    ngx_msec_int_t              ms;
     ngx_http_limit_req_ctx_t   *ctx;
     ngx_http_limit_req_node_t  *lr;
 
     excess = *ep;
 
-    if (excess == 0 || (*limit)->nodelay) {
+    if ((ngx_uint_t) excess <= (*limit)->delay) {
         max_delay = 0;
 
     } else {
         ctx = (*limit)->shm_zone->data;
-        max_delay = excess * 1000 / ctx->rate;
+        max_delay = (excess - (*limit)->delay) * 1000 / ctx->rate;
     }
 
     while (n--) {
@@ -499,32 +766,29 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
             continue;
         }
 
-        ngx_shmtx_lock(&ctx->shpool->mutex);
+        ngx_shmtx_lock(ngx_http_limit_req_mutex(ctx, ctx->shard));
 
         tp = ngx_timeofday();
 
         now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
-        ms = (ngx_msec_int_t) (now - lr->last);
 
-        excess = lr->excess - ctx->rate * ngx_abs(ms) / 1000 + 1000;
+        excess = ngx_http_limit_req_excess(ctx, lr, now);
 
-        if (excess < 0) {
-            excess = 0;
-        }
+        ngx_http_limit_req_commit(ctx, lr, now, excess, 1);
 
-        lr->last = now;
-        lr->excess = excess;
         lr->count--;
 
-        ngx_shmtx_unlock(&ctx->shpool->mutex);
+        ngx_http_limit_req_sync_record(ctx, lr);
+
+        ngx_shmtx_unlock(ngx_http_limit_req_mutex(ctx, ctx->shard));
 
         ctx->node = NULL;
 
-        if (limits[n].nodelay) {
+        if ((ngx_uint_t) excess <= limits[n].delay) {
             continue;
         }
 
-        delay = excess * 1000 / ctx->rate;
+        delay = (excess - limits[n].delay) * 1000 / ctx->rate;
 
         if (delay > max_delay) {
             max_delay = delay;
@@ -537,8 +801,51 @@ ngx_http_limit_req_account(ngx_http_limit_req_limit_t *limits, ngx_uint_t n,
 }
 
 
+/*
+ * the slab pool is shared by all the shards, so when the current shard
+ * has nothing to evict, the others are forced to free their oldest nodes;
+ * as the current shard is locked, the locks of the others are only tried
+ * to not deadlock with a worker evicting in the opposite direction
+ */
+
+static void
+ngx_http_limit_req_expire_shards(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *shard)
+{
+    ngx_uint_t                   i;
+    ngx_http_limit_req_shctx_t  *sh;
+
+    for (i = 0; i < ctx->nshards; i++) {
+        sh = ctx->sh[i];
+
+        if (sh == shard) {
+            continue;
+        }
+
+#if (NGX_HAVE_ATOMIC_OPS)
+
+        if (!ngx_shmtx_trylock(&sh->mutex)) {
+            continue;
+        }
+
+        ngx_http_limit_req_expire(ctx, sh, 0);
+
+        ngx_shmtx_unlock(&sh->mutex);
+
+#else
+
+        /* the slab pool mutex shared by the shards is already locked */
+
+        ngx_http_limit_req_expire(ctx, sh, 0);
+
+#endif
+    }
+}
+
+
 static void
-ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
+ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_shctx_t *shard, ngx_uint_t n)
 {
     ngx_int_t                   excess;
     ngx_time_t                 *tp;
@@ -560,11 +867,11 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
 
     while (n < 3) {
 
-        if (ngx_queue_empty(&ctx->sh->queue)) {
+        if (ngx_queue_empty(&shard->queue)) {
             return;
         }
 
-        q = ngx_queue_last(&ctx->sh->queue);
+        q = ngx_queue_last(&shard->queue);
 
         lr = ngx_queue_data(q, ngx_http_limit_req_node_t, queue);
 
@@ -587,10 +894,17 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
                 return;
             }
 
-            excess = lr->excess - ctx->rate * ms / 1000;
+            if (ctx->window) {
+                if ((ngx_msec_t) ms < 2 * ctx->window) {
+                    return;
+                }
 
-            if (excess > 0) {
-                return;
+            } else {
+                excess = lr->excess - ctx->rate * ms / 1000;
+
+                if (excess > 0) {
+                    return;
+                }
             }
         }
 
@@ -599,132 +913,824 @@ ngx_http_limit_req_expire(ngx_http_limit_req_ctx_t *ctx, ngx_uint_t n)
         node = (ngx_rbtree_node_t *)
                    ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-        ngx_rbtree_delete(&ctx->sh->rbtree, node);
+        ngx_rbtree_delete(&shard->rbtree, node);
 
-        ngx_slab_free_locked(ctx->shpool, node);
+        ngx_http_limit_req_free(ctx, node);
     }
 }
 
 
-static ngx_int_t
-ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+static void
+ngx_http_limit_req_sync_record(ngx_http_limit_req_ctx_t *ctx,
+    ngx_http_limit_req_node_t *lr)
 {
-    ngx_http_limit_req_ctx_t  *octx = data;
-
-    size_t                     len;
-    ngx_http_limit_req_ctx_t  *ctx;
-
-    ctx = shm_zone->data;
-
-    if (octx) {
-        if (ngx_strcmp(ctx->var.data, octx->var.data) != 0) {
-            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
-                          "limit_req \"%V\" uses the \"%V\" variable "
-                          "while previously it used the \"%V\" variable",
-                          &shm_zone->shm.name, &ctx->var, &octx->var);
-            return NGX_ERROR;
-        }
+    u_char             *p, **slot;
+    ngx_buf_t          *b;
+    ngx_uint_t          n;
+    ngx_event_t        *ev;
+    ngx_rbtree_node_t  *node;
 
-        ctx->sh = octx->sh;
-        ctx->shpool = octx->shpool;
+    b = ctx->sync;
 
-        return NGX_OK;
+    if (b == NULL) {
+        return;
     }
 
-    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    node = (ngx_rbtree_node_t *)
+               ((u_char *) lr - offsetof(ngx_rbtree_node_t, color));
 
-    if (shm_zone->shm.exists) {
-        ctx->sh = ctx->shpool->data;
+    slot = &ctx->sync_slots[node->key % NGX_HTTP_LIMIT_REQ_SYNC_SLOTS];
 
-        return NGX_OK;
-    }
+    p = *slot;
 
-    ctx->sh = ngx_slab_alloc(ctx->shpool, sizeof(ngx_http_limit_req_shctx_t));
-    if (ctx->sh == NULL) {
-        return NGX_ERROR;
+    if (p
+        && (ngx_uint_t) (p[0] << 8 | p[1]) == lr->len
+        && ngx_memcmp(p + 4, lr->data, lr->len) == 0)
+    {
+        n = p[2] << 8 | p[3];
+
+        if (n < 0xffff) {
+            n++;
+            p[2] = (u_char) (n >> 8);
+            p[3] = (u_char) n;
+            return;
+        }
     }
 
-    ctx->shpool->data = ctx->sh;
+    if ((size_t) (b->end - b->last) < 4 + (size_t) lr->len) {
 
-    ngx_rbtree_init(&ctx->sh->rbtree, &ctx->sh->sentinel,
-                    ngx_http_limit_req_rbtree_insert_value);
+        /* the deltas are lost until the buffer is sent */
 
-    ngx_queue_init(&ctx->sh->queue);
+        ev = &ngx_http_limit_req_sync_event;
 
-    len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
+        ngx_post_event(ev, &ngx_posted_events);
 
-    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
-    if (ctx->shpool->log_ctx == NULL) {
-        return NGX_ERROR;
+        return;
     }
 
-    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req zone \"%V\"%Z",
-                &shm_zone->shm.name);
+    p = b->last;
 
-    return NGX_OK;
+    *p++ = (u_char) (lr->len >> 8);
+    *p++ = (u_char) lr->len;
+    *p++ = 0;
+    *p++ = 1;
+
+    b->last = ngx_cpymem(p, lr->data, lr->len);
+
+    *slot = p - 4;
 }
 
 
-static void *
-ngx_http_limit_req_create_conf(ngx_conf_t *cf)
+static void
+ngx_http_limit_req_sync_handler(ngx_event_t *ev)
 {
-    ngx_http_limit_req_conf_t  *conf;
+    u_char                          *p;
+    size_t                           size;
+    ngx_buf_t                       *b;
+    ngx_uint_t                       i, n;
+    ngx_shm_zone_t                 **zones;
+    ngx_http_limit_req_ctx_t        *ctx;
+    ngx_http_limit_req_sync_peer_t  *sp;
+    ngx_http_limit_req_main_conf_t  *lmcf;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_conf_t));
-    if (conf == NULL) {
-        return NULL;
-    }
+    lmcf = ev->data;
 
-    /*
-     * set by ngx_pcalloc():
-     *
-     *     conf->limits.elts = NULL;
-     */
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0, "limit_req sync");
 
-    conf->limit_log_level = NGX_CONF_UNSET_UINT;
+    zones = lmcf->zones.elts;
+    sp = lmcf->peers.elts;
 
-    return conf;
-}
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
 
+        if (ctx->sync->pos == ctx->sync->last) {
+            continue;
+        }
 
-static char *
-ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent, void *child)
-{
-    ngx_http_limit_req_conf_t *prev = parent;
-    ngx_http_limit_req_conf_t *conf = child;
+        size = 1 + zones[i]->shm.name.len + (ctx->sync->last - ctx->sync->pos);
 
-    if (conf->limits.elts == NULL) {
-        conf->limits = prev->limits;
-    }
+        for (n = 0; n < lmcf->peers.nelts; n++) {
+            b = sp[n].buffer;
 
-    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
-                              NGX_LOG_ERR);
+            if ((size_t) (b->end - b->last) < 4 + size) {
 
-    conf->delay_log_level = (conf->limit_log_level == NGX_LOG_INFO) ?
-                                NGX_LOG_INFO : conf->limit_log_level + 1;
+                if (b->pos == b->start
+                    || (size_t) (b->end - b->start) - (b->last - b->pos)
+                       < 4 + size)
+                {
+                    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                                   "limit_req sync to %V is late",
+                                   &sp[n].addr.name);
+                    continue;
+                }
 
-    return NGX_CONF_OK;
-}
+                b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+                b->pos = b->start;
+            }
 
+            p = b->last;
 
-static char *
-ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
-{
-    u_char                    *p;
-    size_t                     len;
-    ssize_t                    size;
-    ngx_str_t                 *value, name, s;
-    ngx_int_t                  rate, scale;
-    ngx_uint_t                 i;
-    ngx_shm_zone_t            *shm_zone;
-    ngx_http_limit_req_ctx_t  *ctx;
+            *p++ = (u_char) (size >> 24);
+            *p++ = (u_char) (size >> 16);
+            *p++ = (u_char) (size >> 8);
+            *p++ = (u_char) size;
+            *p++ = (u_char) zones[i]->shm.name.len;
 
-    value = cf->args->elts;
+            p = ngx_cpymem(p, zones[i]->shm.name.data,
+                           zones[i]->shm.name.len);
 
-    ctx = NULL;
-    size = 0;
-    rate = 1;
+            b->last = ngx_cpymem(p, ctx->sync->pos,
+                                 ctx->sync->last - ctx->sync->pos);
+        }
+
+        ctx->sync->last = ctx->sync->pos;
+
+        ngx_memzero(ctx->sync_slots,
+                    NGX_HTTP_LIMIT_REQ_SYNC_SLOTS * sizeof(u_char *));
+    }
+
+    for (n = 0; n < lmcf->peers.nelts; n++) {
+        ngx_http_limit_req_sync_send(&sp[n]);
+    }
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    ngx_add_timer(ev, lmcf->interval);
+}
+
+
+static void
+ngx_http_limit_req_sync_send(ngx_http_limit_req_sync_peer_t *sp)
+{
+    ssize_t            n;
+    ngx_int_t          rc;
+    ngx_buf_t         *b;
+    ngx_connection_t  *c;
+
+    b = sp->buffer;
+
+    if (b->pos == b->last) {
+        return;
+    }
+
+    c = sp->peer.connection;
+
+    if (c == NULL) {
+
+        if ((ngx_msec_int_t) (sp->retry - ngx_current_msec) > 0) {
+            b->pos = b->start;
+            b->last = b->start;
+            return;
+        }
+
+        sp->peer.sockaddr = sp->addr.sockaddr;
+        sp->peer.socklen = sp->addr.socklen;
+        sp->peer.name = &sp->addr.name;
+        sp->peer.get = ngx_event_get_peer;
+        sp->peer.log = ngx_cycle->log;
+        sp->peer.log_error = NGX_ERROR_ERR;
+
+        rc = ngx_event_connect_peer(&sp->peer);
+
+        if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+            sp->retry = ngx_current_msec + NGX_HTTP_LIMIT_REQ_SYNC_TIMEOUT;
+            b->pos = b->start;
+            b->last = b->start;
+            return;
+        }
+
+        c = sp->peer.connection;
+
+        c->data = sp;
+        c->idle = 1;
+        c->read->handler = ngx_http_limit_req_sync_peer_read_handler;
+        c->write->handler = ngx_http_limit_req_sync_write_handler;
+
+        if (rc == NGX_AGAIN) {
+            ngx_add_timer(c->write, NGX_HTTP_LIMIT_REQ_SYNC_TIMEOUT);
+            return;
+        }
+    }
+
+    if (c->write->timer_set) {
+        /* connecting */
+        return;
+    }
+
+    n = c->send(c, b->pos, b->last - b->pos);
+
+    if (n == NGX_ERROR) {
+        ngx_http_limit_req_sync_close_peer(sp);
+        return;
+    }
+
+    if (n > 0) {
+        b->pos += n;
+
+        if (b->pos == b->last) {
+            b->pos = b->start;
+            b->last = b->start;
+        }
+    }
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_limit_req_sync_close_peer(sp);
+    }
+}
+
+
+static void
+ngx_http_limit_req_sync_write_handler(ngx_event_t *wev)
+{
+    ngx_connection_t                *c;
+    ngx_http_limit_req_sync_peer_t  *sp;
+
+    c = wev->data;
+    sp = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, wev->log, NGX_ETIMEDOUT,
+                      "limit_req sync peer %V timed out", &sp->addr.name);
+        ngx_http_limit_req_sync_close_peer(sp);
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    ngx_http_limit_req_sync_send(sp);
+}
+
+
+static void
+ngx_http_limit_req_sync_peer_read_handler(ngx_event_t *rev)
+{
+    u_char                           buf[1];
+    ssize_t                          n;
+    ngx_connection_t                *c;
+    ngx_http_limit_req_sync_peer_t  *sp;
+
+    c = rev->data;
+    sp = c->data;
+
+    if (c->close) {
+        ngx_http_limit_req_sync_close_peer(sp);
+        return;
+    }
+
+    /* the peers never send anything, so only a close is expected */
+
+    n = c->recv(c, buf, 1);
+
+    if (n == NGX_AGAIN) {
+        if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+            ngx_http_limit_req_sync_close_peer(sp);
+        }
+
+        return;
+    }
+
+    ngx_http_limit_req_sync_close_peer(sp);
+}
+
+
+static void
+ngx_http_limit_req_sync_close_peer(ngx_http_limit_req_sync_peer_t *sp)
+{
+    ngx_close_connection(sp->peer.connection);
+
+    sp->peer.connection = NULL;
+    sp->retry = ngx_current_msec + NGX_HTTP_LIMIT_REQ_SYNC_TIMEOUT;
+
+    /* the rest of a partially sent frame cannot be resent */
+
+    sp->buffer->pos = sp->buffer->start;
+    sp->buffer->last = sp->buffer->start;
+}
+
+
+static void
+ngx_http_limit_req_sync_init_connection(ngx_connection_t *c)
+{
+    ngx_buf_t                       *b;
+    ngx_http_limit_req_main_conf_t  *lmcf;
+
+    lmcf = c->listening->servers;
+
+    c->log->action = "synchronizing limit_req zones";
+
+    if (ngx_http_limit_req_sync_known_peer(lmcf, c) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "connection from %V is not a limit_req_sync_peer",
+                      &c->addr_text);
+        ngx_close_connection(c);
+        ngx_destroy_pool(c->pool);
+        return;
+    }
+
+    b = ngx_create_temp_buf(c->pool, lmcf->buffer_size);
+    if (b == NULL) {
+        ngx_close_connection(c);
+        ngx_destroy_pool(c->pool);
+        return;
+    }
+
+    c->data = b;
+    c->idle = 1;
+
+    c->read->handler = ngx_http_limit_req_sync_read_handler;
+    c->write->handler = ngx_http_empty_handler;
+
+    ngx_http_limit_req_sync_read_handler(c->read);
+}
+
+
+/* frames are accepted only from the addresses of the configured peers */
+
+static ngx_int_t
+ngx_http_limit_req_sync_known_peer(ngx_http_limit_req_main_conf_t *lmcf,
+    ngx_connection_t *c)
+{
+    ngx_uint_t                       i;
+    struct sockaddr_in              *sin, *psin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6             *sin6, *psin6;
+#endif
+    ngx_http_limit_req_sync_peer_t  *sp;
+
+    sp = lmcf->peers.elts;
+
+    for (i = 0; i < lmcf->peers.nelts; i++) {
+
+        if (sp[i].addr.sockaddr->sa_family != c->sockaddr->sa_family) {
+            continue;
+        }
+
+        switch (c->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+        case AF_INET6:
+            sin6 = (struct sockaddr_in6 *) c->sockaddr;
+            psin6 = (struct sockaddr_in6 *) sp[i].addr.sockaddr;
+
+            if (ngx_memcmp(&sin6->sin6_addr, &psin6->sin6_addr, 16) == 0) {
+                return NGX_OK;
+            }
+
+            break;
+#endif
+
+        case AF_INET:
+            sin = (struct sockaddr_in *) c->sockaddr;
+            psin = (struct sockaddr_in *) sp[i].addr.sockaddr;
+
+            if (sin->sin_addr.s_addr == psin->sin_addr.s_addr) {
+                return NGX_OK;
+            }
+
+            break;
+        }
+    }
+
+    return NGX_DECLINED;
+}
+
+
+static void
+ngx_http_limit_req_sync_read_handler(ngx_event_t *rev)
+{
+    u_char                          *p;
+    size_t                           len;
+    ssize_t                          n;
+    ngx_buf_t                       *b;
+    ngx_pool_t                      *pool;
+    ngx_connection_t                *c;
+    ngx_http_limit_req_main_conf_t  *lmcf;
+
+    c = rev->data;
+    b = c->data;
+    lmcf = c->listening->servers;
+
+    while (!c->close) {
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                break;
+            }
+
+            return;
+        }
+
+        if (n == NGX_ERROR || n == 0) {
+            break;
+        }
+
+        b->last += n;
+
+        while (b->last - b->pos >= 4) {
+            p = b->pos;
+
+            len = (size_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+
+            if (len > (size_t) (b->end - b->start) - 4) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "limit_req sync frame is too large");
+                goto failed;
+            }
+
+            if ((size_t) (b->last - p) < 4 + len) {
+                break;
+            }
+
+            if (ngx_http_limit_req_sync_frame(c, lmcf, p + 4, len) != NGX_OK) {
+                goto failed;
+            }
+
+            b->pos += 4 + len;
+        }
+
+        b->last = ngx_movemem(b->start, b->pos, b->last - b->pos);
+        b->pos = b->start;
+    }
+
+failed:
+
+    pool = c->pool;
+
+    ngx_close_connection(c);
+    ngx_destroy_pool(pool);
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_sync_frame(ngx_connection_t *c,
+    ngx_http_limit_req_main_conf_t *lmcf, u_char *p, size_t len)
+{
+    u_char           *last;
+    size_t            klen;
+    ngx_str_t         name;
+    ngx_uint_t        i, n;
+    ngx_shm_zone_t  **zones;
+
+    last = p + len;
+
+    if (len == 0 || (size_t) p[0] + 1 > len) {
+        goto invalid;
+    }
+
+    name.len = p[0];
+    name.data = p + 1;
+
+    p += 1 + name.len;
+
+    zones = lmcf->zones.elts;
+
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        if (zones[i]->shm.name.len == name.len
+            && ngx_strncmp(zones[i]->shm.name.data, name.data, name.len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (i == lmcf->zones.nelts) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "limit_req sync for unknown zone \"%V\"", &name);
+        return NGX_OK;
+    }
+
+    while (p < last) {
+
+        if (last - p < 4) {
+            goto invalid;
+        }
+
+        klen = p[0] << 8 | p[1];
+        n = p[2] << 8 | p[3];
+
+        p += 4;
+
+        if (klen == 0 || n == 0 || (size_t) (last - p) < klen) {
+            goto invalid;
+        }
+
+        ngx_http_limit_req_sync_apply(zones[i]->data, p, klen, n);
+
+        p += klen;
+    }
+
+    return NGX_OK;
+
+invalid:
+
+    ngx_log_error(NGX_LOG_ERR, c->log, 0, "invalid limit_req sync frame");
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_limit_req_sync_apply(ngx_http_limit_req_ctx_t *ctx, u_char *data,
+    size_t len, ngx_uint_t n)
+{
+    uint32_t                     hash;
+    ngx_int_t                    rc, excess;
+    ngx_time_t                  *tp;
+    ngx_msec_t                   now;
+    ngx_rbtree_node_t           *node, *sentinel;
+    ngx_http_limit_req_node_t   *lr;
+    ngx_http_limit_req_shctx_t  *shard;
+
+    hash = ngx_crc32_short(data, len);
+
+    shard = ctx->sh[hash % ctx->nshards];
+
+    tp = ngx_timeofday();
+    now = (ngx_msec_t) (tp->sec * 1000 + tp->msec);
+
+    ngx_shmtx_lock(ngx_http_limit_req_mutex(ctx, shard));
+
+    node = shard->rbtree.root;
+    sentinel = shard->rbtree.sentinel;
+
+    lr = NULL;
+
+    while (node != sentinel) {
+
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        lr = (ngx_http_limit_req_node_t *) &node->color;
+
+        rc = ngx_memn2cmp(data, lr->data, len, (size_t) lr->len);
+
+        if (rc == 0) {
+            break;
+        }
+
+        lr = NULL;
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    if (lr == NULL) {
+        lr = ngx_http_limit_req_create_node(ctx, shard, hash, data, len);
+
+        if (lr == NULL) {
+            ngx_shmtx_unlock(ngx_http_limit_req_mutex(ctx, shard));
+            return;
+        }
+
+        /* the first request of a new node is not an excess */
+
+        lr->last = now;
+        lr->count = 0;
+
+        ngx_http_limit_req_commit(ctx, lr, now, 0, n);
+
+        ngx_shmtx_unlock(ngx_http_limit_req_mutex(ctx, shard));
+        return;
+    }
+
+    /* the requests accepted by the peer are accounted as if they came here */
+
+    excess = ngx_http_limit_req_excess(ctx, lr, now);
+
+    ngx_http_limit_req_commit(ctx, lr, now, excess, n);
+
+    ngx_shmtx_unlock(ngx_http_limit_req_mutex(ctx, shard));
+}
+
+
+static ngx_int_t
+ngx_http_limit_req_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_limit_req_ctx_t  *octx = data;
+
+    size_t                       len;
+    ngx_uint_t                   i;
+    ngx_http_limit_req_ctx_t    *ctx;
+    ngx_http_limit_req_shctx_t  *shard;
+
+    ctx = shm_zone->data;
+
+    if (octx) {
+        if (ngx_strcmp(ctx->var.data, octx->var.data) != 0) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses the \"%V\" variable "
+                          "while previously it used the \"%V\" variable",
+                          &shm_zone->shm.name, &ctx->var, &octx->var);
+            return NGX_ERROR;
+        }
+
+        if ((ctx->window == 0) != (octx->window == 0)) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses the %s algorithm "
+                          "while previously it used the %s algorithm",
+                          &shm_zone->shm.name,
+                          ctx->window ? "sliding window" : "leaky bucket",
+                          octx->window ? "sliding window" : "leaky bucket");
+            return NGX_ERROR;
+        }
+
+        if (ctx->nshards != octx->nshards) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "limit_req \"%V\" uses %ui shards "
+                          "while previously it used %ui shards",
+                          &shm_zone->shm.name, ctx->nshards, octx->nshards);
+            return NGX_ERROR;
+        }
+
+        ctx->sh = octx->sh;
+        ctx->shpool = octx->shpool;
+
+        return NGX_OK;
+    }
+
+    ctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        ctx->sh = ctx->shpool->data;
+
+        return NGX_OK;
+    }
+
+    len = ctx->nshards * sizeof(ngx_http_limit_req_shctx_t *);
+
+    ctx->sh = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ctx->shpool->data = ctx->sh;
+
+    /* the shards are allocated separately to not share cache lines */
+
+    for (i = 0; i < ctx->nshards; i++) {
+        shard = ngx_slab_alloc(ctx->shpool,
+                               sizeof(ngx_http_limit_req_shctx_t));
+        if (shard == NULL) {
+            return NGX_ERROR;
+        }
+
+        ngx_memzero(shard, sizeof(ngx_http_limit_req_shctx_t));
+
+        ngx_rbtree_init(&shard->rbtree, &shard->sentinel,
+                        ngx_http_limit_req_rbtree_insert_value);
+
+        ngx_queue_init(&shard->queue);
+
+#if (NGX_HAVE_ATOMIC_OPS)
+        if (ngx_shmtx_create(&shard->mutex, &shard->lock, NULL) != NGX_OK) {
+            return NGX_ERROR;
+        }
+#endif
+
+        ctx->sh[i] = shard;
+    }
+
+    len = sizeof(" in limit_req zone \"\"") + shm_zone->shm.name.len;
+
+    ctx->shpool->log_ctx = ngx_slab_alloc(ctx->shpool, len);
+    if (ctx->shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(ctx->shpool->log_ctx, " in limit_req zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_limit_req_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_req_main_conf_t  *lmcf;
+
+    lmcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_main_conf_t));
+    if (lmcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&lmcf->zones, cf->pool, 4, sizeof(ngx_shm_zone_t *))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    if (ngx_array_init(&lmcf->peers, cf->pool, 4,
+                       sizeof(ngx_http_limit_req_sync_peer_t))
+        != NGX_OK)
+    {
+        return NULL;
+    }
+
+    lmcf->interval = NGX_CONF_UNSET_MSEC;
+    lmcf->buffer_size = NGX_CONF_UNSET_SIZE;
+
+    return lmcf;
+}
+
+
+static char *
+ngx_http_limit_req_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lmcf = conf;
+
+    ngx_conf_init_msec_value(lmcf->interval, 100);
+    ngx_conf_init_size_value(lmcf->buffer_size, 65536);
+
+    if (lmcf->buffer_size < 1024) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"limit_req_sync_buffer_size\" must be "
+                           "at least 1k");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_limit_req_create_conf(ngx_conf_t *cf)
+{
+    ngx_http_limit_req_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_limit_req_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->limits.elts = NULL;
+     */
+
+    conf->limit_log_level = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_limit_req_merge_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_limit_req_conf_t *prev = parent;
+    ngx_http_limit_req_conf_t *conf = child;
+
+    if (conf->limits.elts == NULL) {
+        conf->limits = prev->limits;
+    }
+
+    ngx_conf_merge_uint_value(conf->limit_log_level, prev->limit_log_level,
+                              NGX_LOG_ERR);
+
+    conf->delay_log_level = (conf->limit_log_level == NGX_LOG_INFO) ?
+                                NGX_LOG_INFO : conf->limit_log_level + 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lmcf = conf;
+
+    u_char                    *p;
+    size_t                     len;
+    ssize_t                    size;
+    ngx_str_t                 *value, name, s;
+    ngx_int_t                  rate, scale, shards;
+    ngx_uint_t                 i, sync, window;
+    ngx_shm_zone_t            *shm_zone, **zone;
+    ngx_http_limit_req_ctx_t  *ctx;
+
+    value = cf->args->elts;
+
+    ctx = NULL;
+    size = 0;
+    rate = 1;
     scale = 1;
+    shards = 1;
+    sync = 0;
+    window = 0;
     name.len = 0;
 
     for (i = 1; i < cf->args->nelts; i++) {
@@ -787,6 +1793,45 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "shards=", 7) == 0) {
+
+            shards = ngx_atoi(value[i].data + 7, value[i].len - 7);
+            if (shards <= 0 || shards > 256) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid shards \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "sync") == 0) {
+            sync = 1;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "algorithm=", 10) == 0) {
+
+            s.len = value[i].len - 10;
+            s.data = value[i].data + 10;
+
+            if (s.len == 12 && ngx_strncmp(s.data, "leaky_bucket", 12) == 0) {
+                window = 0;
+                continue;
+            }
+
+            if (s.len == 14
+                && ngx_strncmp(s.data, "sliding_window", 14) == 0)
+            {
+                window = 1;
+                continue;
+            }
+
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid algorithm \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
         if (value[i].data[0] == '$') {
 
             value[i].len--;
@@ -827,6 +1872,11 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 
     ctx->rate = rate * 1000 / scale;
+    ctx->nshards = shards;
+
+    /* the window is a second for the "r/s" rates and a minute for "r/m" */
+
+    ctx->window = window ? scale * 1000 : 0;
 
     shm_zone = ngx_shared_memory_add(cf, &name, size,
                                      &ngx_http_limit_req_module);
@@ -846,6 +1896,121 @@ ngx_http_limit_req_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     shm_zone->init = ngx_http_limit_req_init_zone;
     shm_zone->data = ctx;
 
+    ctx->shm_zone = shm_zone;
+
+    if (sync) {
+        if (name.len > 255) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "the name of the synchronized zone \"%V\" "
+                               "is too long", &name);
+            return NGX_CONF_ERROR;
+        }
+
+        zone = ngx_array_push(&lmcf->zones);
+        if (zone == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        *zone = shm_zone;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req_sync_listen(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lmcf = conf;
+
+    ngx_str_t        *value;
+    ngx_url_t         u;
+    ngx_listening_t  *ls;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+    u.listen = 1;
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"%V\" directive",
+                               u.err, &u.url, &cmd->name);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    ls = ngx_create_listening(cf, u.sockaddr, u.socklen);
+    if (ls == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ls->addr_ntop = 1;
+    ls->handler = ngx_http_limit_req_sync_init_connection;
+    ls->pool_size = 256;
+    ls->servers = lmcf;
+
+    ls->logp = &cf->cycle->new_log;
+    ls->log.data = &ls->addr_text;
+    ls->log.handler = ngx_accept_log_error;
+
+    /* detect the peers gone without closing the connection */
+
+    ls->keepalive = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_limit_req_sync_peer(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_limit_req_main_conf_t *lmcf = conf;
+
+    ngx_str_t                       *value;
+    ngx_url_t                        u;
+    ngx_uint_t                       i;
+    ngx_http_limit_req_sync_peer_t  *sp;
+
+    value = cf->args->elts;
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    u.url = value[1];
+
+    if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+        if (u.err) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "%s in \"%V\" of the \"%V\" directive",
+                               u.err, &u.url, &cmd->name);
+        }
+
+        return NGX_CONF_ERROR;
+    }
+
+    if (u.no_port) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "no port in \"%V\" of the \"%V\" directive",
+                           &u.url, &cmd->name);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < u.naddrs; i++) {
+        sp = ngx_array_push(&lmcf->peers);
+        if (sp == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(sp, sizeof(ngx_http_limit_req_sync_peer_t));
+
+        sp->addr = u.addrs[i];
+    }
+
     return NGX_CONF_OK;
 }
 
@@ -855,7 +2020,7 @@ ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_limit_req_conf_t  *lrcf = conf;
 
-    ngx_int_t                    burst;
+    ngx_int_t                    burst, delay;
     ngx_str_t                   *value, s;
     ngx_uint_t                   i, nodelay;
     ngx_shm_zone_t              *shm_zone;
@@ -865,6 +2030,7 @@ ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     shm_zone = NULL;
     burst = 0;
+    delay = 0;
     nodelay = 0;
 
     for (i = 1; i < cf->args->nelts; i++) {
@@ -895,6 +2061,18 @@ ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "delay=", 6) == 0) {
+
+            delay = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (delay <= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid delay \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "nodelay", 7) == 0) {
             nodelay = 1;
             continue;
@@ -943,7 +2121,7 @@ ngx_http_limit_req(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
     limit->shm_zone = shm_zone;
     limit->burst = burst * 1000;
-    limit->nodelay = nodelay;
+    limit->delay = nodelay ? limit->burst : (ngx_uint_t) delay * 1000;
 
     return NGX_CONF_OK;
 }
@@ -966,3 +2144,67 @@ ngx_http_limit_req_init(ngx_conf_t *cf)
 
     return NGX_OK;
 }
+
+
+static ngx_int_t
+ngx_http_limit_req_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                       i;
+    ngx_shm_zone_t                 **zones;
+    ngx_http_limit_req_ctx_t        *ctx;
+    ngx_http_limit_req_sync_peer_t  *sp;
+    ngx_http_limit_req_main_conf_t  *lmcf;
+
+    /* the cache manager and cache loader do not handle requests */
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    lmcf = ngx_http_cycle_get_module_main_conf(cycle,
+                                               ngx_http_limit_req_module);
+
+    if (lmcf == NULL
+        || lmcf->zones.nelts == 0
+        || lmcf->peers.nelts == 0)
+    {
+        return NGX_OK;
+    }
+
+    zones = lmcf->zones.elts;
+
+    for (i = 0; i < lmcf->zones.nelts; i++) {
+        ctx = zones[i]->data;
+
+        ctx->sync = ngx_create_temp_buf(cycle->pool, lmcf->buffer_size - 5
+                                                   - zones[i]->shm.name.len);
+        if (ctx->sync == NULL) {
+            return NGX_ERROR;
+        }
+
+        ctx->sync_slots = ngx_pcalloc(cycle->pool,
+                             NGX_HTTP_LIMIT_REQ_SYNC_SLOTS * sizeof(u_char *));
+        if (ctx->sync_slots == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    sp = lmcf->peers.elts;
+
+    for (i = 0; i < lmcf->peers.nelts; i++) {
+        sp[i].buffer = ngx_create_temp_buf(cycle->pool, lmcf->buffer_size);
+        if (sp[i].buffer == NULL) {
+            return NGX_ERROR;
+        }
+    }
+
+    ngx_http_limit_req_sync_event.handler = ngx_http_limit_req_sync_handler;
+    ngx_http_limit_req_sync_event.data = lmcf;
+    ngx_http_limit_req_sync_event.log = cycle->log;
+
+    ngx_add_timer(&ngx_http_limit_req_sync_event, lmcf->interval);
+
+    return NGX_OK;
+}
@@ -16,6 +16,38 @@ typedef struct {
 } ngx_http_map_conf_t;
 
 
+/* the number of keys in the only include to write the binary base */
+
+#define NGX_HTTP_MAP_BINARY_MIN_ENTRIES  100000
+
+
+typedef struct {
+    u_char                      MAPHSH[6];
+    u_char                      version;
+    u_char                      ptr_size;
+    uint32_t                    endianness;
+    uint32_t                    crc32;
+    uint32_t                    size;
+    uint32_t                    has_default;
+    uint32_t                    default_len;
+} ngx_http_map_header_t;
+
+
+/*
+ * a binary map base is a hash of the exact keys: the header is followed
+ * by size + 1 offsets of the buckets, a bucket is a run of the elements;
+ * the default value set in the included file follows the last bucket;
+ * the checksum covers the offsets only, so the buckets are paged in
+ * lazily as the lookups reach them
+ */
+
+typedef struct {
+    uint32_t                    len;
+    uint32_t                    vlen;
+    u_char                      data[1];        /* key and value */
+} ngx_http_map_elt_t;
+
+
 typedef struct {
     ngx_hash_keys_arrays_t      keys;
 
@@ -26,8 +58,18 @@ typedef struct {
 #endif
 
     ngx_http_variable_value_t  *default_value;
+    ngx_http_variable_value_t  *include_default;
     ngx_conf_t                 *cf;
-    ngx_uint_t                  hostnames;      /* unsigned  hostnames:1 */
+
+    u_char                     *base;
+    ngx_str_t                   include_name;
+    ngx_uint_t                  includes;
+    ngx_uint_t                  entries;
+
+    unsigned                    hostnames:1;
+    unsigned                    outside_entries:1;
+    unsigned                    allow_binary_include:1;
+    unsigned                    binary_include:1;
 } ngx_http_map_conf_ctx_t;
 
 
@@ -35,6 +77,7 @@ typedef struct {
     ngx_http_map_t              map;
     ngx_http_complex_value_t    value;
     ngx_http_variable_value_t  *default_value;
+    u_char                     *base;
     ngx_uint_t                  hostnames;      /* unsigned  hostnames:1 */
 } ngx_http_map_ctx_t;
 
@@ -44,6 +87,15 @@ static int ngx_libc_cdecl ngx_http_map_cmp_dns_wildcards(const void *one,
 static void *ngx_http_map_create_conf(ngx_conf_t *cf);
 static char *ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static char *ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf);
+static ngx_http_variable_value_t *ngx_http_map_find_binary(u_char *base,
+    ngx_str_t *match, ngx_http_variable_value_t *vv);
+static char *ngx_http_map_include(ngx_conf_t *cf, ngx_command_t *dummy,
+    void *conf, ngx_http_map_conf_ctx_t *ctx, ngx_str_t *name);
+static ngx_int_t ngx_http_map_include_binary_base(ngx_conf_t *cf,
+    ngx_http_map_conf_ctx_t *ctx, ngx_str_t *name);
+static void ngx_http_map_unmap_binary_base(void *data);
+static void ngx_http_map_create_binary_base(ngx_http_map_conf_ctx_t *ctx,
+    ngx_pool_t *pool);
 
 
 static ngx_command_t  ngx_http_map_commands[] = {
@@ -104,6 +156,12 @@ ngx_module_t  ngx_http_map_module = {
 };
 
 
+static ngx_http_map_header_t  ngx_http_map_header = {
+    { 'M', 'A', 'P', 'H', 'S', 'H' }, 2, sizeof(void *), 0x12345678,
+    0, 0, 0, 0
+};
+
+
 static ngx_int_t
 ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     uintptr_t data)
@@ -111,7 +169,7 @@ ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
     ngx_http_map_ctx_t  *map = (ngx_http_map_ctx_t *) data;
 
     ngx_str_t                   val;
-    ngx_http_variable_value_t  *value;
+    ngx_http_variable_value_t  *value, vv;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http map started");
@@ -124,7 +182,12 @@ ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
         val.len--;
     }
 
-    value = ngx_http_map_find(r, &map->map, &val);
+    if (map->base) {
+        value = ngx_http_map_find_binary(map->base, &val, &vv);
+
+    } else {
+        value = ngx_http_map_find(r, &map->map, &val);
+    }
 
     if (value == NULL) {
         value = map->default_value;
@@ -147,6 +210,61 @@ ngx_http_map_variable(ngx_http_request_t *r, ngx_http_variable_value_t *v,
 }
 
 
+static ngx_http_variable_value_t *
+ngx_http_map_find_binary(u_char *base, ngx_str_t *match,
+    ngx_http_variable_value_t *vv)
+{
+    u_char                 *p, *last;
+    uint32_t               *buckets;
+    ngx_uint_t              i, key;
+    ngx_http_map_elt_t     *elt;
+    ngx_http_map_header_t  *header;
+
+    header = (ngx_http_map_header_t *) base;
+    buckets = (uint32_t *) (base + sizeof(ngx_http_map_header_t));
+
+    key = 0;
+
+    for (i = 0; i < match->len; i++) {
+        key = ngx_hash(key, ngx_tolower(match->data[i]));
+    }
+
+    key %= header->size;
+
+    p = base + buckets[key];
+    last = base + buckets[key + 1];
+
+    while (p < last) {
+        elt = (ngx_http_map_elt_t *) p;
+
+        if (elt->len != match->len) {
+            goto next;
+        }
+
+        for (i = 0; i < match->len; i++) {
+            if (ngx_tolower(match->data[i]) != elt->data[i]) {
+                goto next;
+            }
+        }
+
+        vv->len = elt->vlen;
+        vv->data = elt->data + elt->len;
+        vv->valid = 1;
+        vv->no_cacheable = 0;
+        vv->not_found = 0;
+
+        return vv;
+
+    next:
+
+        p += ngx_align(offsetof(ngx_http_map_elt_t, data)
+                       + elt->len + elt->vlen, sizeof(uint32_t));
+    }
+
+    return NULL;
+}
+
+
 static void *
 ngx_http_map_create_conf(ngx_conf_t *cf)
 {
@@ -225,6 +343,8 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
         return NGX_CONF_ERROR;
     }
 
+    ngx_memzero(&ctx, sizeof(ngx_http_map_conf_ctx_t));
+
     ctx.keys.pool = cf->pool;
     ctx.keys.temp_pool = pool;
 
@@ -256,9 +376,8 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     }
 #endif
 
-    ctx.default_value = NULL;
     ctx.cf = &save;
-    ctx.hostnames = 0;
+    ctx.allow_binary_include = 1;
 
     save = *cf;
     cf->pool = pool;
@@ -279,6 +398,7 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
                                              &ngx_http_variable_null_value;
 
     map->hostnames = ctx.hostnames;
+    map->base = ctx.base;
 
     hash.key = ngx_hash_key_lc;
     hash.max_size = mcf->hash_max_size;
@@ -347,6 +467,18 @@ ngx_http_map_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
 #endif
 
+    if (ctx.allow_binary_include
+        && !ctx.binary_include
+        && !ctx.outside_entries
+        && !ctx.hostnames
+        && ctx.entries > NGX_HTTP_MAP_BINARY_MIN_ENTRIES
+        && ctx.includes == 1
+        && ctx.keys.keys.nelts == ctx.entries
+        && ctx.var_values.nelts == 0)
+    {
+        ngx_http_map_create_binary_base(&ctx, pool);
+    }
+
     ngx_destroy_pool(pool);
 
     return rv;
@@ -391,7 +523,7 @@ ngx_http_map(ngx_conf_t *cf, ngx_command_t *dummy, void *conf)
     }
 
     if (ngx_strcmp(value[0].data, "include") == 0) {
-        return ngx_conf_include(cf, dummy, conf);
+        return ngx_http_map_include(cf, dummy, conf, ctx, &value[1]);
     }
 
     if (value[1].data[0] == '$') {
@@ -495,6 +627,16 @@ found:
         return NGX_CONF_OK;
     }
 
+    if (ctx->binary_include) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "binary map base \"%s\" cannot be mixed with usual entries",
+            ctx->include_name.data);
+        return NGX_CONF_ERROR;
+    }
+
+    ctx->entries++;
+    ctx->outside_entries = 1;
+
 #if (NGX_PCRE)
 
     if (value[0].len && value[0].data[0] == '~') {
@@ -558,3 +700,356 @@ found:
 
     return NGX_CONF_ERROR;
 }
+
+
+static char *
+ngx_http_map_include(ngx_conf_t *cf, ngx_command_t *dummy, void *conf,
+    ngx_http_map_conf_ctx_t *ctx, ngx_str_t *name)
+{
+    char                       *rv;
+    ngx_str_t                   file;
+    ngx_http_variable_value_t  *dv;
+
+    if (strpbrk((char *) name->data, "*?[") != NULL) {
+        ctx->allow_binary_include = 0;
+        return ngx_conf_include(cf, dummy, conf);
+    }
+
+    file.len = name->len + 4;
+    file.data = ngx_pnalloc(ctx->keys.temp_pool, name->len + 5);
+    if (file.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_sprintf(file.data, "%V.bin%Z", name);
+
+    if (ngx_conf_full_name(cf->cycle, &file, 1) != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, cf->log, 0, "include %s", file.data);
+
+    switch (ngx_http_map_include_binary_base(cf, ctx, &file)) {
+    case NGX_OK:
+        return NGX_CONF_OK;
+    case NGX_ERROR:
+        return NGX_CONF_ERROR;
+    default:
+        break;
+    }
+
+    file.len -= 4;
+    file.data[file.len] = '\0';
+
+    ctx->include_name = file;
+
+    if (ctx->outside_entries) {
+        ctx->allow_binary_include = 0;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_CORE, cf->log, 0, "include %s", file.data);
+
+    dv = ctx->default_value;
+
+    rv = ngx_conf_parse(cf, &file);
+
+    if (dv == NULL && ctx->default_value) {
+        ctx->include_default = ctx->default_value;
+    }
+
+    ctx->includes++;
+    ctx->outside_entries = 0;
+
+    return rv;
+}
+
+
+static ngx_int_t
+ngx_http_map_include_binary_base(ngx_conf_t *cf, ngx_http_map_conf_ctx_t *ctx,
+    ngx_str_t *name)
+{
+    u_char                     *base, ch;
+    time_t                      mtime;
+    size_t                      size, start;
+    uint32_t                    crc32, *buckets;
+    ngx_int_t                   rc;
+    ngx_file_info_t             fi;
+    ngx_pool_cleanup_t         *cln;
+    ngx_file_mapping_t         *fm;
+    ngx_http_map_header_t      *header;
+    ngx_http_variable_value_t  *vv;
+
+    fm = ngx_palloc(ctx->keys.pool, sizeof(ngx_file_mapping_t));
+    if (fm == NULL) {
+        return NGX_ERROR;
+    }
+
+    fm->name = name->data;
+    fm->log = cf->log;
+
+    if (ngx_open_file_mapping(fm) != NGX_OK) {
+        return NGX_DECLINED;
+    }
+
+    if (ctx->outside_entries) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "binary map base \"%s\" cannot be mixed with usual entries",
+            name->data);
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    if (ctx->binary_include) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+            "second binary map base \"%s\" cannot be mixed with \"%s\"",
+            name->data, ctx->include_name.data);
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    if (ngx_fd_info(fm->fd, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_fd_info_n " \"%s\" failed", name->data);
+        goto failed;
+    }
+
+    size = fm->size;
+    mtime = ngx_file_mtime(&fi);
+
+    ch = name->data[name->len - 4];
+    name->data[name->len - 4] = '\0';
+
+    if (ngx_file_info(name->data, &fi) == NGX_FILE_ERROR) {
+        ngx_conf_log_error(NGX_LOG_CRIT, cf, ngx_errno,
+                           ngx_file_info_n " \"%s\" failed", name->data);
+        goto failed;
+    }
+
+    name->data[name->len - 4] = ch;
+
+    if (mtime < ngx_file_mtime(&fi)) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "stale binary map base \"%s\"", name->data);
+        goto failed;
+    }
+
+    base = fm->addr;
+    header = (ngx_http_map_header_t *) base;
+
+    if (size < sizeof(ngx_http_map_header_t)
+        || ngx_memcmp(&ngx_http_map_header, header, 12) != 0
+        || header->size == 0)
+    {
+        goto incompatible;
+    }
+
+    start = sizeof(ngx_http_map_header_t)
+            + (header->size + 1) * sizeof(uint32_t);
+
+    buckets = (uint32_t *) (base + sizeof(ngx_http_map_header_t));
+
+    if (size < start
+        || buckets[0] != start
+        || buckets[header->size] > size
+        || size - buckets[header->size] != header->default_len)
+    {
+        goto incompatible;
+    }
+
+    crc32 = ngx_crc32_long(base + sizeof(ngx_http_map_header_t),
+                           start - sizeof(ngx_http_map_header_t));
+
+    if (crc32 != header->crc32) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "CRC32 mismatch in binary map base \"%s\"",
+                           name->data);
+        goto failed;
+    }
+
+    if (header->has_default) {
+
+        if (ctx->default_value) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "duplicate default map parameter");
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        vv = ngx_pcalloc(ctx->keys.pool, sizeof(ngx_http_variable_value_t));
+        if (vv == NULL) {
+            rc = NGX_ERROR;
+            goto done;
+        }
+
+        vv->len = header->default_len;
+        vv->data = base + buckets[header->size];
+        vv->valid = 1;
+
+        ctx->default_value = vv;
+    }
+
+    cln = ngx_pool_cleanup_add(ctx->keys.pool, 0);
+    if (cln == NULL) {
+        rc = NGX_ERROR;
+        goto done;
+    }
+
+    cln->handler = ngx_http_map_unmap_binary_base;
+    cln->data = fm;
+
+    ngx_conf_log_error(NGX_LOG_NOTICE, cf, 0,
+                       "using binary map base \"%s\"", name->data);
+
+    ctx->include_name = *name;
+    ctx->binary_include = 1;
+    ctx->base = base;
+
+    return NGX_OK;
+
+incompatible:
+
+    ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                       "incompatible binary map base \"%s\"", name->data);
+
+failed:
+
+    rc = NGX_DECLINED;
+
+done:
+
+    ngx_close_file_mapping(fm);
+
+    return rc;
+}
+
+
+static void
+ngx_http_map_unmap_binary_base(void *data)
+{
+    ngx_file_mapping_t  *fm = data;
+
+    ngx_close_file_mapping(fm);
+}
+
+
+static void
+ngx_http_map_create_binary_base(ngx_http_map_conf_ctx_t *ctx,
+    ngx_pool_t *pool)
+{
+    u_char                     *p, *name;
+    size_t                      len;
+    uint32_t                   *buckets, *offsets;
+    ngx_uint_t                  i, k, size;
+    ngx_hash_key_t             *keys;
+    ngx_file_mapping_t          fm;
+    ngx_http_map_elt_t         *elt;
+    ngx_http_map_header_t      *header;
+    ngx_http_variable_value_t  *vv;
+
+    keys = ctx->keys.keys.elts;
+    size = ctx->keys.keys.nelts;
+
+    offsets = ngx_pcalloc(pool, (size + 1) * sizeof(uint32_t));
+    if (offsets == NULL) {
+        return;
+    }
+
+    /* the sizes of the buckets */
+
+    for (i = 0; i < size; i++) {
+        vv = keys[i].value;
+        k = keys[i].key_hash % size;
+
+        offsets[k + 1] += ngx_align(offsetof(ngx_http_map_elt_t, data)
+                                    + keys[i].key.len + vv->len,
+                                    sizeof(uint32_t));
+    }
+
+    offsets[0] = sizeof(ngx_http_map_header_t)
+                 + (size + 1) * sizeof(uint32_t);
+
+    for (i = 1; i <= size; i++) {
+        offsets[i] += offsets[i - 1];
+    }
+
+    name = ngx_pnalloc(pool, ctx->include_name.len + 5);
+    if (name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(name, "%V.bin%Z", &ctx->include_name);
+
+    /*
+     * the base is written under a temporary name and then renamed over
+     * the old one, as the old base may still be mapped by old workers
+     */
+
+    fm.name = ngx_pnalloc(pool, ctx->include_name.len + 16);
+    if (fm.name == NULL) {
+        return;
+    }
+
+    ngx_sprintf(fm.name, "%V.bin.%010uD%Z", &ctx->include_name,
+                (uint32_t) ngx_next_temp_number(0));
+
+    vv = ctx->include_default;
+
+    fm.size = offsets[size] + (vv ? vv->len : 0);
+    fm.log = ctx->keys.pool->log;
+
+    ngx_log_error(NGX_LOG_NOTICE, fm.log, 0,
+                  "creating binary map base \"%s\"", name);
+
+    if (ngx_create_file_mapping(&fm) != NGX_OK) {
+        (void) ngx_delete_file(fm.name);
+        return;
+    }
+
+    header = fm.addr;
+    *header = ngx_http_map_header;
+    header->size = (uint32_t) size;
+
+    if (vv) {
+        header->has_default = 1;
+        header->default_len = (uint32_t) vv->len;
+
+        ngx_memcpy((u_char *) fm.addr + offsets[size], vv->data, vv->len);
+    }
+
+    buckets = (uint32_t *) ((u_char *) fm.addr
+                            + sizeof(ngx_http_map_header_t));
+
+    ngx_memcpy(buckets, offsets, (size + 1) * sizeof(uint32_t));
+
+    for (i = 0; i < size; i++) {
+        vv = keys[i].value;
+        k = keys[i].key_hash % size;
+
+        p = (u_char *) fm.addr + offsets[k];
+
+        elt = (ngx_http_map_elt_t *) p;
+        elt->len = (uint32_t) keys[i].key.len;
+        elt->vlen = (uint32_t) vv->len;
+
+        p = ngx_cpymem(elt->data, keys[i].key.data, keys[i].key.len);
+        ngx_memcpy(p, vv->data, vv->len);
+
+        len = ngx_align(offsetof(ngx_http_map_elt_t, data)
+                        + keys[i].key.len + vv->len, sizeof(uint32_t));
+
+        offsets[k] += (uint32_t) len;
+    }
+
+    header->crc32 = ngx_crc32_long((u_char *) buckets,
+                                   (size + 1) * sizeof(uint32_t));
+
+    ngx_close_file_mapping(&fm);
+
+    if (ngx_rename_file(fm.name, name) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, fm.log, ngx_errno,
+                      ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                      fm.name, name);
+
+        (void) ngx_delete_file(fm.name);
+    }
+}
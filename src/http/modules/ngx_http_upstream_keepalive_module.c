@@ -10,12 +10,23 @@
 #include <ngx_http.h>
 
 
+#define NGX_HTTP_UPSTREAM_KEEPALIVE_PREWARM_INTERVAL  1000
+
+
 typedef struct {
     ngx_uint_t                         max_cached;
 
+    ngx_msec_t                         timeout;
+    ngx_uint_t                         requests;
+    ngx_uint_t                         max_per_peer;
+    ngx_uint_t                         prewarm;
+
     ngx_queue_t                        cache;
     ngx_queue_t                        free;
 
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_event_t                        prewarm_event;
+
     ngx_http_upstream_init_pt          original_init_upstream;
     ngx_http_upstream_init_peer_pt     original_init_peer;
 
@@ -51,6 +62,8 @@ typedef struct {
     socklen_t                          socklen;
     u_char                             sockaddr[NGX_SOCKADDRLEN];
 
+    ngx_uint_t                         connecting;   /* unsigned:1 */
+
 } ngx_http_upstream_keepalive_cache_t;
 
 
@@ -64,6 +77,16 @@ static void ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc,
 static void ngx_http_upstream_keepalive_dummy_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev);
 static void ngx_http_upstream_keepalive_close(ngx_connection_t *c);
+static ngx_queue_t *ngx_http_upstream_keepalive_peer_item(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen, ngx_uint_t *n);
+
+static ngx_int_t ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle);
+static void ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_keepalive_prewarm_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peer_t *peer);
+static void ngx_http_upstream_keepalive_connect_handler(ngx_event_t *ev);
 
 
 #if (NGX_HTTP_SSL)
@@ -87,6 +110,34 @@ static ngx_command_t  ngx_http_upstream_keepalive_commands[] = {
       0,
       NULL },
 
+    { ngx_string("keepalive_timeout"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, timeout),
+      NULL },
+
+    { ngx_string("keepalive_requests"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, requests),
+      NULL },
+
+    { ngx_string("keepalive_per_peer"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, max_per_peer),
+      NULL },
+
+    { ngx_string("keepalive_prewarm"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      offsetof(ngx_http_upstream_keepalive_srv_conf_t, prewarm),
+      NULL },
+
       ngx_null_command
 };
 
@@ -113,7 +164,7 @@ ngx_module_t  ngx_http_upstream_keepalive_module = {
     NGX_HTTP_MODULE,                       /* module type */
     NULL,                                  /* init master */
     NULL,                                  /* init module */
-    NULL,                                  /* init process */
+    ngx_http_upstream_keepalive_init_process, /* init process */
     NULL,                                  /* init thread */
     NULL,                                  /* exit thread */
     NULL,                                  /* exit process */
@@ -144,6 +195,17 @@ ngx_http_upstream_init_keepalive(ngx_conf_t *cf,
 
     us->peer.init = ngx_http_upstream_init_keepalive_peer;
 
+    ngx_conf_init_msec_value(kcf->timeout, 60000);
+    ngx_conf_init_uint_value(kcf->requests, 100);
+    ngx_conf_init_uint_value(kcf->max_per_peer, 0);
+    ngx_conf_init_uint_value(kcf->prewarm, 0);
+
+    /* prewarming needs the list of servers of a round robin based balancer */
+
+    if (kcf->prewarm && us->servers) {
+        kcf->peers = us->peer.data;
+    }
+
     /* allocate cache items and add to free queue */
 
     cached = ngx_pcalloc(cf->pool,
@@ -241,6 +303,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
         c = item->connection;
 
+        if (item->connecting) {
+            continue;
+        }
+
         if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) pc->sockaddr,
                          item->socklen, pc->socklen)
             == 0)
@@ -251,6 +317,10 @@ ngx_http_upstream_get_keepalive_peer(ngx_peer_connection_t *pc, void *data)
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                            "get keepalive peer: using connection %p", c);
 
+            if (c->read->timer_set) {
+                ngx_del_timer(c->read);
+            }
+
             c->idle = 0;
             c->log = pc->log;
             c->read->log = pc->log;
@@ -275,6 +345,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_http_upstream_keepalive_peer_data_t  *kp = data;
     ngx_http_upstream_keepalive_cache_t      *item;
 
+    ngx_uint_t            n;
     ngx_queue_t          *q;
     ngx_connection_t     *c;
     ngx_http_upstream_t  *u;
@@ -308,6 +379,10 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         goto invalid;
     }
 
+    if (++c->requests >= kp->conf->requests) {
+        goto invalid;
+    }
+
     if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
         goto invalid;
     }
@@ -315,9 +390,24 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free keepalive peer: saving connection %p", c);
 
-    if (ngx_queue_empty(&kp->conf->free)) {
+    q = NULL;
+
+    if (kp->conf->max_per_peer) {
 
+        /* the least recently used connection to the peer */
+
+        q = ngx_http_upstream_keepalive_peer_item(kp->conf, pc->sockaddr,
+                                                  pc->socklen, &n);
+        if (n < kp->conf->max_per_peer) {
+            q = NULL;
+        }
+    }
+
+    if (q == NULL && ngx_queue_empty(&kp->conf->free)) {
         q = ngx_queue_last(&kp->conf->cache);
+    }
+
+    if (q) {
         ngx_queue_remove(q);
 
         item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
@@ -332,6 +422,7 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
     }
 
     item->connection = c;
+    item->connecting = 0;
     ngx_queue_insert_head(&kp->conf->cache, q);
 
     pc->connection = NULL;
@@ -343,6 +434,8 @@ ngx_http_upstream_free_keepalive_peer(ngx_peer_connection_t *pc, void *data,
         ngx_del_timer(c->write);
     }
 
+    ngx_add_timer(c->read, kp->conf->timeout);
+
     c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
     c->read->handler = ngx_http_upstream_keepalive_close_handler;
 
@@ -389,7 +482,7 @@ ngx_http_upstream_keepalive_close_handler(ngx_event_t *ev)
 
     c = ev->data;
 
-    if (c->close) {
+    if (c->close || ev->timedout) {
         goto close;
     }
 
@@ -440,6 +533,274 @@ ngx_http_upstream_keepalive_close(ngx_connection_t *c)
 }
 
 
+static ngx_queue_t *
+ngx_http_upstream_keepalive_peer_item(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf, struct sockaddr *sockaddr,
+    socklen_t socklen, ngx_uint_t *n)
+{
+    ngx_queue_t                          *q, *last;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    /*
+     * counts cached connections to the peer and returns
+     * the least recently used one
+     */
+
+    *n = 0;
+    last = NULL;
+
+    for (q = ngx_queue_head(&kcf->cache);
+         q != ngx_queue_sentinel(&kcf->cache);
+         q = ngx_queue_next(q))
+    {
+        item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+        if (ngx_memn2cmp((u_char *) &item->sockaddr, (u_char *) sockaddr,
+                         item->socklen, socklen)
+            == 0)
+        {
+            (*n)++;
+            last = q;
+        }
+    }
+
+    return last;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                               i;
+    ngx_event_t                             *ev;
+    ngx_http_upstream_srv_conf_t           **uscfp;
+    ngx_http_upstream_main_conf_t           *umcf;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    /* the cache manager and cache loader do not serve requests */
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->srv_conf == NULL) {
+            continue;
+        }
+
+        kcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                          ngx_http_upstream_keepalive_module);
+
+        if (kcf->original_init_upstream == NULL || kcf->peers == NULL) {
+            continue;
+        }
+
+        /* the peers may have been moved to a shared zone */
+
+        kcf->peers = uscfp[i]->peer.data;
+
+        ev = &kcf->prewarm_event;
+
+        ev->handler = ngx_http_upstream_keepalive_prewarm_handler;
+        ev->data = kcf;
+        ev->log = cycle->log;
+
+        ngx_add_timer(ev, 1);
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_prewarm_handler(ngx_event_t *ev)
+{
+    ngx_uint_t                               i, n;
+    ngx_http_upstream_rr_peer_t             *peer;
+    ngx_http_upstream_rr_peers_t            *peers;
+    ngx_http_upstream_keepalive_srv_conf_t  *kcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive prewarm handler");
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    kcf = ev->data;
+    peers = kcf->peers;
+
+    /* backup servers are not prewarmed */
+
+    for (i = 0; i < peers->number; i++) {
+        peer = &peers->peer[i];
+
+        if (peer->down) {
+            continue;
+        }
+
+        if (peer->max_fails
+            && peer->fails >= peer->max_fails
+            && ngx_time() - peer->checked <= peer->fail_timeout)
+        {
+            continue;
+        }
+
+        (void) ngx_http_upstream_keepalive_peer_item(kcf, peer->sockaddr,
+                                                     peer->socklen, &n);
+
+        while (n < kcf->prewarm
+               && (kcf->max_per_peer == 0 || n < kcf->max_per_peer)
+               && !ngx_queue_empty(&kcf->free))
+        {
+            if (ngx_http_upstream_keepalive_prewarm_connect(kcf, peer)
+                != NGX_OK)
+            {
+                break;
+            }
+
+            n++;
+        }
+    }
+
+    ngx_add_timer(ev, NGX_HTTP_UPSTREAM_KEEPALIVE_PREWARM_INTERVAL);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_keepalive_prewarm_connect(
+    ngx_http_upstream_keepalive_srv_conf_t *kcf,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    ngx_int_t                             rc;
+    ngx_queue_t                          *q;
+    ngx_connection_t                     *c;
+    ngx_peer_connection_t                 pc;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    ngx_memzero(&pc, sizeof(ngx_peer_connection_t));
+
+    pc.sockaddr = peer->sockaddr;
+    pc.socklen = peer->socklen;
+    pc.name = &peer->name;
+    pc.get = ngx_event_get_peer;
+    pc.log = ngx_cycle->log;
+    pc.log_error = NGX_ERROR_INFO;
+
+    rc = ngx_event_connect_peer(&pc);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN) {
+        return NGX_ERROR;
+    }
+
+    c = pc.connection;
+
+    c->pool = ngx_create_pool(128, ngx_cycle->log);
+    if (c->pool == NULL) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "keepalive prewarm connection %p to %V", c, pc.name);
+
+    q = ngx_queue_head(&kcf->free);
+    ngx_queue_remove(q);
+
+    item = ngx_queue_data(q, ngx_http_upstream_keepalive_cache_t, queue);
+
+    item->connection = c;
+    item->socklen = pc.socklen;
+    ngx_memcpy(&item->sockaddr, pc.sockaddr, pc.socklen);
+
+    ngx_queue_insert_head(&kcf->cache, q);
+
+    c->data = item;
+    c->idle = 1;
+
+    c->read->handler = ngx_http_upstream_keepalive_close_handler;
+
+    if (rc == NGX_AGAIN) {
+        item->connecting = 1;
+
+        c->write->handler = ngx_http_upstream_keepalive_connect_handler;
+        ngx_add_timer(c->write, NGX_HTTP_UPSTREAM_KEEPALIVE_PREWARM_INTERVAL);
+
+        return NGX_OK;
+    }
+
+    item->connecting = 0;
+
+    c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
+    ngx_add_timer(c->read, kcf->timeout);
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_keepalive_connect_handler(ngx_event_t *ev)
+{
+    int                                   err;
+    socklen_t                             len;
+    ngx_connection_t                     *c;
+    ngx_http_upstream_keepalive_cache_t  *item;
+
+    c = ev->data;
+    item = c->data;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "keepalive prewarm connect handler");
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "upstream timed out while prewarming connection");
+        goto close;
+    }
+
+    err = 0;
+    len = sizeof(int);
+
+    if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+        err = ngx_socket_errno;
+    }
+
+    if (err) {
+        (void) ngx_connection_error(c, err, "connect() failed");
+        goto close;
+    }
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    item->connecting = 0;
+
+    c->write->handler = ngx_http_upstream_keepalive_dummy_handler;
+    ngx_add_timer(c->read, item->conf->timeout);
+
+    return;
+
+close:
+
+    ngx_http_upstream_keepalive_close(c);
+
+    ngx_queue_remove(&item->queue);
+    ngx_queue_insert_head(&item->conf->free, &item->queue);
+}
+
+
 #if (NGX_HTTP_SSL)
 
 static ngx_int_t
@@ -477,11 +838,16 @@ ngx_http_upstream_keepalive_create_conf(ngx_conf_t *cf)
     /*
      * set by ngx_pcalloc():
      *
+     *     conf->peers = NULL;
      *     conf->original_init_upstream = NULL;
      *     conf->original_init_peer = NULL;
      */
 
     conf->max_cached = 1;
+    conf->timeout = NGX_CONF_UNSET_MSEC;
+    conf->requests = NGX_CONF_UNSET_UINT;
+    conf->max_per_peer = NGX_CONF_UNSET_UINT;
+    conf->prewarm = NGX_CONF_UNSET_UINT;
 
     return conf;
 }
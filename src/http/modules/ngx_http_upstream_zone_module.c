@@ -0,0 +1,1783 @@
+
+/*
+ * Copyright (C) Igor Sysoev
+ * Copyright (C) Nginx, Inc.
+ */
+
+
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+
+
+#define NGX_HTTP_UPSTREAM_ZONE_SERVERS  16
+
+#define NGX_HTTP_UPSTREAM_ZONE_RESOLVE_POLL   1000
+#define NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY  10
+
+
+/* a name of a server with the "resolve" parameter, in the zone */
+
+typedef struct {
+    ngx_http_upstream_server_t    *server;
+    time_t                         valid; // 下次解析时间，所有worker共享
+} ngx_http_upstream_zone_host_t;
+
+
+typedef struct {
+    ngx_uint_t                     servers;
+
+    ngx_http_upstream_zone_host_t *hosts;
+    ngx_uint_t                     nhosts;
+
+    ngx_resolver_t                *resolver;
+    ngx_msec_t                     resolver_timeout;
+} ngx_http_upstream_zone_srv_conf_t;
+
+
+typedef struct {
+    u_char                         sockaddr[NGX_SOCKADDRLEN];
+    socklen_t                      socklen;
+    ngx_uint_t                     weight;
+} ngx_http_upstream_zone_addr_t;
+
+
+typedef struct {
+    ngx_event_t                    event;
+    ngx_http_upstream_srv_conf_t  *uscf;
+    ngx_http_upstream_zone_host_t *host;
+    ngx_resolver_t                *resolver;
+    ngx_msec_t                     timeout;
+
+    /* ngx_http_upstream_zone_addr_t, collected from A, AAAA or SRV */
+    ngx_array_t                    addrs;
+    time_t                         valid;
+} ngx_http_upstream_zone_resolve_t;
+
+
+typedef struct {
+    ngx_str_t                      upstream;
+    ngx_str_t                      server;
+    ngx_int_t                      id;
+    ngx_int_t                      weight;
+    ngx_int_t                      max_fails;
+    ngx_int_t                      max_conns;
+    time_t                         fail_timeout;
+
+    unsigned                       add:1;
+    unsigned                       remove:1;
+    unsigned                       up:1;
+    unsigned                       down:1;
+    unsigned                       drain:1;
+    unsigned                       backup:1;
+
+    ngx_uint_t                     status;
+    char                          *err;
+} ngx_http_upstream_conf_op_t;
+
+
+#define NGX_HTTP_UPSTREAM_CONF_LINE_LEN                                       \
+    (sizeof("server  weight= max_fails= fail_timeout=s max_conns= backup"     \
+            " drain; # id= conns=\n") - 1                                    \
+     + NGX_SOCKADDR_STRLEN + 6 * NGX_INT_T_LEN)
+
+
+static ngx_int_t ngx_http_upstream_conf_handler(ngx_http_request_t *r);
+static ngx_int_t ngx_http_upstream_conf_parse(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_conf_op_t *op);
+static ngx_int_t ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_conf_op_t *op,
+    ngx_url_t *u);
+static ngx_int_t ngx_http_upstream_conf_modify(
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_conf_op_t *op);
+static u_char *ngx_http_upstream_conf_list(u_char *p,
+    ngx_http_upstream_rr_peers_t *peers, ngx_int_t id);
+static ngx_int_t ngx_http_upstream_conf_send(ngx_http_request_t *r,
+    ngx_uint_t status, u_char *text, size_t len);
+static void ngx_http_upstream_zone_update_peers(
+    ngx_http_upstream_rr_peers_t *peers);
+static ngx_http_upstream_rr_peer_t *ngx_http_upstream_zone_alloc_peer(
+    ngx_http_upstream_rr_peers_t *peers, struct sockaddr *sockaddr,
+    socklen_t socklen, ngx_str_t *name);
+static void ngx_http_upstream_zone_remove_peer(
+    ngx_http_upstream_rr_peer_t *peer);
+
+static void ngx_http_upstream_zone_resolve_timer(ngx_event_t *ev);
+static ngx_int_t ngx_http_upstream_zone_resolve(
+    ngx_http_upstream_zone_resolve_t *zr, ngx_str_t *name, ngx_int_t type);
+static void ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx);
+static ngx_int_t ngx_http_upstream_zone_add_addr(
+    ngx_http_upstream_zone_resolve_t *zr, struct sockaddr *sockaddr,
+    socklen_t socklen, ngx_uint_t weight);
+static void ngx_http_upstream_zone_update_host(
+    ngx_http_upstream_zone_resolve_t *zr);
+static ngx_uint_t ngx_http_upstream_zone_peer_addr(
+    ngx_http_upstream_rr_peer_t *peer, ngx_http_upstream_zone_addr_t *addr);
+
+static ngx_int_t ngx_http_upstream_zone_init(ngx_conf_t *cf);
+static void *ngx_http_upstream_zone_create_srv_conf(ngx_conf_t *cf);
+static char *ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static ngx_int_t ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone,
+    void *data);
+static ngx_http_upstream_rr_peers_t *ngx_http_upstream_zone_copy_peers(
+    ngx_slab_pool_t *shpool, ngx_http_upstream_rr_peers_t *peers,
+    ngx_uint_t servers);
+static ngx_int_t ngx_http_upstream_zone_init_hosts(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_srv_conf_t *uscf,
+    ngx_http_upstream_zone_srv_conf_t *uzcf);
+static ngx_int_t ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle);
+
+
+static ngx_command_t  ngx_http_upstream_zone_commands[] = {
+
+    { ngx_string("zone"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE123,
+      ngx_http_upstream_zone,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("upstream_conf"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS,
+      ngx_http_upstream_conf,
+      0,
+      0,
+      NULL },
+
+      ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_upstream_zone_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_upstream_zone_init,           /* postconfiguration */
+
+    NULL,                                  /* create main configuration */
+    NULL,                                  /* init main configuration */
+
+    ngx_http_upstream_zone_create_srv_conf, /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    NULL,                                  /* create location configuration */
+    NULL                                   /* merge location configuration */
+};
+
+// upstream 子模块，将upstream的peers放到共享内存中，所有worker共享状态，
+// 并通过upstream_conf接口在运行时增删改server
+ngx_module_t  ngx_http_upstream_zone_module = {
+    NGX_MODULE_V1,
+    &ngx_http_upstream_zone_module_ctx,    /* module context */
+    ngx_http_upstream_zone_commands,       /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_upstream_zone_init_process,   /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init(ngx_conf_t *cf)
+{
+    ngx_uint_t                          i, j;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_upstream_server_t         *server;
+    ngx_http_upstream_srv_conf_t      **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_zone_srv_conf_t  *uzcf;
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->servers == NULL || uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        server = uscfp[i]->servers->elts;
+
+        for (j = 0; j < uscfp[i]->servers->nelts; j++) {
+
+            if (!server[j].resolve) {
+                continue;
+            }
+
+            /* names are resolved with the resolver of the http{} level */
+
+            if (clcf->resolver == NULL
+                || clcf->resolver->udp_connections.nelts == 0)
+            {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "no resolver defined to resolve \"%V\" "
+                              "in upstream \"%V\" in %s:%ui",
+                              &server[j].host, &uscfp[i]->host,
+                              uscfp[i]->file_name, uscfp[i]->line);
+                return NGX_ERROR;
+            }
+
+            uzcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_upstream_zone_module);
+
+            uzcf->resolver = clcf->resolver;
+            uzcf->resolver_timeout = clcf->resolver_timeout;
+
+            /* the http{} level configuration is not merged */
+
+            if (uzcf->resolver_timeout == NGX_CONF_UNSET_MSEC) {
+                uzcf->resolver_timeout = 30000;
+            }
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+static void *
+ngx_http_upstream_zone_create_srv_conf(ngx_conf_t *cf)
+{
+    ngx_http_upstream_zone_srv_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_zone_srv_conf_t));
+    if (conf == NULL) {
+        return NULL;
+    }
+
+    /*
+     * set by ngx_pcalloc():
+     *
+     *     conf->hosts = NULL;
+     *     conf->nhosts = 0;
+     *     conf->resolver = NULL;
+     *     conf->resolver_timeout = 0;
+     */
+
+    conf->servers = NGX_CONF_UNSET_UINT;
+
+    return conf;
+}
+
+
+static char *
+ngx_http_upstream_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_zone_srv_conf_t *uzcf = conf;
+
+    ssize_t                         size;
+    ngx_int_t                       n;
+    ngx_str_t                      *value, s;
+    ngx_uint_t                      i;
+    ngx_http_upstream_srv_conf_t   *uscf;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    uscf = ngx_http_conf_get_module_srv_conf(cf, ngx_http_upstream_module);
+
+    if (uscf->shm_zone) {
+        return "is duplicate";
+    }
+
+    umcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_upstream_module);
+
+    value = cf->args->elts;
+
+    if (value[1].len == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone name \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    size = 0;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "servers=", 8) == 0) {
+
+            s.len = value[i].len - 8;
+            s.data = value[i].data + 8;
+
+            n = ngx_atoi(s.data, s.len);
+
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid parameter \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            uzcf->servers = n;
+
+            continue;
+        }
+
+        if (i == 2) {
+            size = ngx_parse_size(&value[i]);
+
+            if (size == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid zone size \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            if (size < (ssize_t) (8 * ngx_pagesize)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "zone \"%V\" is too small", &value[1]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    /* a zone may be shared by several upstreams */
+
+    uscf->shm_zone = ngx_shared_memory_add(cf, &value[1], size,
+                                           &ngx_http_upstream_module);
+    if (uscf->shm_zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    uscf->shm_zone->init = ngx_http_upstream_init_zone;
+    uscf->shm_zone->data = umcf;
+
+    /* peers are copied anew on each reload */
+
+    uscf->shm_zone->noreuse = 1;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_conf(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_core_loc_conf_t  *clcf;
+
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_upstream_conf_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    size_t                              len;
+    ngx_uint_t                          i;
+    ngx_slab_pool_t                    *shpool;
+    ngx_http_upstream_rr_peers_t       *peers;
+    ngx_http_upstream_srv_conf_t       *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_zone_srv_conf_t  *uzcf;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+    umcf = shm_zone->data;
+
+    len = sizeof(" in upstream zone \"\"") + shm_zone->shm.name.len;
+
+    shpool->log_ctx = ngx_slab_alloc(shpool, len);
+    if (shpool->log_ctx == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_sprintf(shpool->log_ctx, " in upstream zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone != shm_zone || uscf->peer.data == NULL) {
+            continue;
+        }
+
+        uzcf = ngx_http_conf_upstream_srv_conf(uscf,
+                                               ngx_http_upstream_zone_module);
+
+        peers = ngx_http_upstream_zone_copy_peers(shpool, uscf->peer.data,
+                                                  uzcf->servers);
+        if (peers == NULL) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "upstream zone \"%V\" is too small for "
+                          "upstream \"%V\"", &shm_zone->shm.name, &uscf->host);
+            return NGX_ERROR;
+        }
+
+        ngx_http_upstream_zone_update_peers(peers);
+
+        uscf->peer.data = peers;
+
+        if (ngx_http_upstream_zone_init_hosts(shpool, uscf, uzcf) != NGX_OK) {
+            ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                          "upstream zone \"%V\" is too small for "
+                          "upstream \"%V\"", &shm_zone->shm.name, &uscf->host);
+            return NGX_ERROR;
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * each set of peers gets a fixed number of slots so that servers added
+ * at runtime never move the array; the address storage of a slot is
+ * allocated once and is reused by the servers later placed in the slot,
+ * hence names referenced by requests still in flight stay valid;
+ * requests keep a copy of the name for logging
+ */
+
+static ngx_http_upstream_rr_peers_t *
+ngx_http_upstream_zone_copy_peers(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_rr_peers_t *peers, ngx_uint_t servers)
+{
+    size_t                         size;
+    ngx_uint_t                     i, n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *copy;
+
+    if (servers == NGX_CONF_UNSET_UINT) {
+        n = ngx_max(2 * peers->number, NGX_HTTP_UPSTREAM_ZONE_SERVERS);
+
+    } else {
+        n = ngx_max(peers->number, servers);
+    }
+
+    size = sizeof(ngx_http_upstream_rr_peers_t)
+           + sizeof(ngx_http_upstream_rr_peer_t) * (n - 1);
+
+    copy = ngx_slab_alloc(shpool, size);
+    if (copy == NULL) {
+        return NULL;
+    }
+
+    ngx_memzero(copy, size);
+
+    ngx_memcpy(copy, peers, sizeof(ngx_http_upstream_rr_peers_t)
+               + sizeof(ngx_http_upstream_rr_peer_t) * (peers->number - 1));
+
+    copy->capacity = n;
+    copy->shpool = shpool;
+
+    /* cached connections are local to a process */
+
+    copy->cached = NULL;
+    copy->last_cached = 0;
+
+    for (i = 0; i < n; i++) {
+        peer = &copy->peer[i];
+
+        peer->sockaddr = ngx_slab_alloc(shpool, NGX_SOCKADDRLEN);
+        if (peer->sockaddr == NULL) {
+            return NULL;
+        }
+
+        size = NGX_SOCKADDR_STRLEN;
+
+        if (i < peers->number && peers->peer[i].name.len > size) {
+            size = peers->peer[i].name.len;
+        }
+
+        peer->name.data = ngx_slab_alloc(shpool, size);
+        if (peer->name.data == NULL) {
+            return NULL;
+        }
+
+        if (i >= peers->number) {
+            peer->removed = 1;
+            peer->down = 1;
+            continue;
+        }
+
+        ngx_memcpy(peer->sockaddr, peers->peer[i].sockaddr, peer->socklen);
+        ngx_memcpy(peer->name.data, peers->peer[i].name.data, peer->name.len);
+
+#if (NGX_HTTP_SSL)
+        peer->ssl_session = NULL;
+#endif
+    }
+
+    if (peers->next) {
+        copy->next = ngx_http_upstream_zone_copy_peers(shpool, peers->next,
+                                                       servers);
+        if (copy->next == NULL) {
+            return NULL;
+        }
+    }
+
+    return copy;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_hosts(ngx_slab_pool_t *shpool,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_zone_srv_conf_t *uzcf)
+{
+    ngx_uint_t                   i, n;
+    ngx_http_upstream_server_t  *server;
+
+    uzcf->hosts = NULL;
+    uzcf->nhosts = 0;
+
+    if (uscf->servers == NULL) {
+        return NGX_OK;
+    }
+
+    server = uscf->servers->elts;
+
+    n = 0;
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+        if (server[i].resolve) {
+            n++;
+        }
+    }
+
+    if (n == 0) {
+        return NGX_OK;
+    }
+
+    uzcf->hosts = ngx_slab_alloc(shpool,
+                                 n * sizeof(ngx_http_upstream_zone_host_t));
+    if (uzcf->hosts == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < uscf->servers->nelts; i++) {
+        if (!server[i].resolve) {
+            continue;
+        }
+
+        /* the names are resolved again as soon as workers start */
+
+        uzcf->hosts[uzcf->nhosts].server = &server[i];
+        uzcf->hosts[uzcf->nhosts].valid = 0;
+        uzcf->nhosts++;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_zone_update_peers(ngx_http_upstream_rr_peers_t *peers)
+{
+    ngx_uint_t                     i, n, w, number;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *set;
+
+    for (set = peers; set; set = set->next) {
+
+        n = 0;
+        w = 0;
+        number = 0;
+
+        for (i = 0; i < set->capacity; i++) {
+            peer = &set->peer[i];
+
+            if (peer->removed) {
+                continue;
+            }
+
+            n++;
+            w += peer->weight;
+            number = i + 1;
+        }
+
+        /* removed slots past the last server are not iterated */
+
+        set->number = number ? number : 1;
+        set->total_weight = w;
+        set->weighted = (w != n);
+        set->single = (set == peers && set->next == NULL
+                       && n == 1 && set->number == 1);
+    }
+}
+
+
+static ngx_http_upstream_rr_peer_t *
+ngx_http_upstream_zone_alloc_peer(ngx_http_upstream_rr_peers_t *peers,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_str_t *name)
+{
+    u_char                       *data;
+    ngx_uint_t                    i;
+    struct sockaddr              *sa;
+    ngx_http_upstream_rr_peer_t  *peer;
+
+    /*
+     * called with the peers locked; a slot is reused once requests
+     * to the server removed from it are over
+     */
+
+    for (i = 0; i < peers->capacity; i++) {
+        peer = &peers->peer[i];
+
+        if (!peer->removed || peer->conns) {
+            continue;
+        }
+
+        sa = peer->sockaddr;
+        data = peer->name.data;
+
+        ngx_memzero(peer, sizeof(ngx_http_upstream_rr_peer_t));
+
+        peer->sockaddr = sa;
+        peer->socklen = socklen;
+        ngx_memcpy(peer->sockaddr, sockaddr, socklen);
+
+        peer->name.data = data;
+        peer->name.len = ngx_min(name->len, NGX_SOCKADDR_STRLEN);
+        ngx_memcpy(peer->name.data, name->data, peer->name.len);
+
+        return peer;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_upstream_zone_remove_peer(ngx_http_upstream_rr_peer_t *peer)
+{
+    /* the slot is kept while requests to the server are in flight */
+
+    peer->removed = 1;
+    peer->down = 1;
+    peer->drain = 0;
+    peer->weight = 0;
+    peer->effective_weight = 0;
+    peer->current_weight = 0;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_init_process(ngx_cycle_t *cycle)
+{
+    ngx_uint_t                          i, j;
+    ngx_event_t                        *ev;
+    ngx_http_upstream_srv_conf_t      **uscfp;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_zone_resolve_t   *zr;
+    ngx_http_upstream_zone_srv_conf_t  *uzcf;
+
+    /* the cache manager and cache loader do not use upstreams */
+
+    if (ngx_process != NGX_PROCESS_WORKER
+        && ngx_process != NGX_PROCESS_SINGLE)
+    {
+        return NGX_OK;
+    }
+
+    umcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_upstream_module);
+
+    if (umcf == NULL) {
+        return NGX_OK;
+    }
+
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->shm_zone == NULL) {
+            continue;
+        }
+
+        uzcf = ngx_http_conf_upstream_srv_conf(uscfp[i],
+                                               ngx_http_upstream_zone_module);
+
+        for (j = 0; j < uzcf->nhosts; j++) {
+
+            zr = ngx_pcalloc(cycle->pool,
+                             sizeof(ngx_http_upstream_zone_resolve_t));
+            if (zr == NULL) {
+                return NGX_ERROR;
+            }
+
+            zr->uscf = uscfp[i];
+            zr->host = &uzcf->hosts[j];
+            zr->resolver = uzcf->resolver;
+            zr->timeout = uzcf->resolver_timeout;
+
+            if (ngx_array_init(&zr->addrs, cycle->pool, 4,
+                               sizeof(ngx_http_upstream_zone_addr_t))
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+
+            ev = &zr->event;
+
+            ev->handler = ngx_http_upstream_zone_resolve_timer;
+            ev->data = zr;
+            ev->log = cycle->log;
+
+            ngx_add_timer(ev, 1);
+        }
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * every worker polls the names, the one that finds a name expired
+ * resolves it, while the others see the expiry time moved forward
+ */
+
+static void
+ngx_http_upstream_zone_resolve_timer(ngx_event_t *ev)
+{
+    time_t                             now;
+    ngx_http_upstream_server_t        *server;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_zone_resolve_t  *zr;
+
+    zr = ev->data;
+
+    if (ngx_exiting) {
+        return;
+    }
+
+    peers = zr->uscf->peer.data;
+    server = zr->host->server;
+    now = ngx_time();
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    if (now < zr->host->valid) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+        goto next;
+    }
+
+    /* a worker exited while resolving will be replaced after the lease */
+
+    zr->host->valid = now + zr->timeout / 1000 + 1;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    zr->addrs.nelts = 0;
+    zr->valid = 0;
+
+    if (server->service.len) {
+        if (ngx_http_upstream_zone_resolve(zr, &server->service,
+                                           NGX_RESOLVE_SRV)
+            == NGX_OK)
+        {
+            return;
+        }
+
+    } else {
+        if (ngx_http_upstream_zone_resolve(zr, &server->host, NGX_RESOLVE_A)
+            == NGX_OK)
+        {
+            return;
+        }
+    }
+
+next:
+
+    ngx_add_timer(ev, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_POLL);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_resolve(ngx_http_upstream_zone_resolve_t *zr,
+    ngx_str_t *name, ngx_int_t type)
+{
+    ngx_resolver_ctx_t  *ctx;
+
+    ctx = ngx_resolve_start(zr->resolver, NULL);
+
+    if (ctx == NULL || ctx == NGX_NO_RESOLVER) {
+        ngx_log_error(NGX_LOG_ALERT, zr->event.log, 0,
+                      "upstream \"%V\": could not start resolving %V",
+                      &zr->uscf->host, name);
+        return NGX_ERROR;
+    }
+
+    ctx->name = *name;
+    ctx->type = type;
+    ctx->handler = ngx_http_upstream_zone_resolve_handler;
+    ctx->data = zr;
+    ctx->timeout = zr->timeout;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, zr->event.log, 0,
+                   "upstream zone resolve %V type:%i", &ctx->name, type);
+
+    /* the handler is called from ngx_resolve_name() for cached names */
+
+    return ngx_resolve_name(ctx);
+}
+
+
+static void
+ngx_http_upstream_zone_resolve_handler(ngx_resolver_ctx_t *ctx)
+{
+    time_t                             valid;
+    ngx_int_t                          type;
+    ngx_uint_t                         i, j, priority;
+    struct sockaddr_in                 sin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6                sin6;
+#endif
+    ngx_resolver_srv_name_t           *srv;
+    ngx_http_upstream_server_t        *server;
+    ngx_http_upstream_rr_peers_t      *peers;
+    ngx_http_upstream_zone_resolve_t  *zr;
+
+    zr = ctx->data;
+    server = zr->host->server;
+    peers = zr->uscf->peer.data;
+    type = ctx->type;
+
+    /* a name without addresses of one type may have addresses of another */
+
+    if (ctx->state && ctx->state != NGX_RESOLVE_NXDOMAIN) {
+        ngx_log_error(NGX_LOG_ERR, zr->event.log, 0,
+                      "upstream \"%V\": %V could not be resolved (%i: %s), "
+                      "keeping the previous addresses",
+                      &zr->uscf->host, &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        ngx_resolve_name_done(ctx);
+
+        valid = ngx_time() + NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY;
+
+        ngx_http_upstream_rr_peers_lock(peers);
+        goto done;
+    }
+
+    if (ctx->state == NGX_OK) {
+
+        if (zr->valid == 0 || ctx->valid < zr->valid) {
+            zr->valid = ctx->valid;
+        }
+
+        ngx_memzero(&sin, sizeof(struct sockaddr_in));
+        sin.sin_family = AF_INET;
+
+        switch (type) {
+
+        case NGX_RESOLVE_SRV:
+
+            /* only the records of the most preferred priority are used */
+
+            priority = 0x10000;
+
+            for (i = 0; i < ctx->nsrvs; i++) {
+                srv = &ctx->srvs[i];
+
+                if (srv->naddrs && srv->priority < priority) {
+                    priority = srv->priority;
+                }
+            }
+
+            for (i = 0; i < ctx->nsrvs; i++) {
+                srv = &ctx->srvs[i];
+
+                if (srv->priority != priority) {
+                    continue;
+                }
+
+                sin.sin_port = htons(srv->port);
+
+                for (j = 0; j < srv->naddrs; j++) {
+                    sin.sin_addr.s_addr = srv->addrs[j];
+
+                    if (ngx_http_upstream_zone_add_addr(zr,
+                                              (struct sockaddr *) &sin,
+                                              sizeof(struct sockaddr_in),
+                                              srv->weight ? srv->weight : 1)
+                        != NGX_OK)
+                    {
+                        goto failed;
+                    }
+                }
+            }
+
+            break;
+
+#if (NGX_HAVE_INET6)
+        case NGX_RESOLVE_AAAA:
+
+            ngx_memzero(&sin6, sizeof(struct sockaddr_in6));
+            sin6.sin6_family = AF_INET6;
+            sin6.sin6_port = htons(server->port);
+
+            for (i = 0; i < ctx->naddrs; i++) {
+                sin6.sin6_addr = ctx->addrs6[i];
+
+                if (ngx_http_upstream_zone_add_addr(zr,
+                                                 (struct sockaddr *) &sin6,
+                                                 sizeof(struct sockaddr_in6),
+                                                 server->weight)
+                    != NGX_OK)
+                {
+                    goto failed;
+                }
+            }
+
+            break;
+#endif
+
+        default: /* NGX_RESOLVE_A */
+
+            sin.sin_port = htons(server->port);
+
+            for (i = 0; i < ctx->naddrs; i++) {
+                sin.sin_addr.s_addr = ctx->addrs[i];
+
+                if (ngx_http_upstream_zone_add_addr(zr,
+                                                 (struct sockaddr *) &sin,
+                                                 sizeof(struct sockaddr_in),
+                                                 server->weight)
+                    != NGX_OK)
+                {
+                    goto failed;
+                }
+            }
+
+            break;
+        }
+    }
+
+    if (type == NGX_RESOLVE_A && zr->resolver->ipv6) {
+
+        ngx_resolve_name_done(ctx);
+
+        if (ngx_http_upstream_zone_resolve(zr, &server->host,
+                                           NGX_RESOLVE_AAAA)
+            == NGX_OK)
+        {
+            return;
+        }
+
+        valid = ngx_time() + NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY;
+
+        ngx_http_upstream_rr_peers_lock(peers);
+        goto done;
+    }
+
+    if (zr->addrs.nelts == 0) {
+        ngx_log_error(NGX_LOG_ERR, zr->event.log, 0,
+                      "upstream \"%V\": %V could not be resolved (%i: %s), "
+                      "keeping the previous addresses",
+                      &zr->uscf->host, &ctx->name, ctx->state,
+                      ngx_resolver_strerror(ctx->state));
+
+        ngx_resolve_name_done(ctx);
+
+        valid = ngx_time() + NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY;
+
+        ngx_http_upstream_rr_peers_lock(peers);
+        goto done;
+    }
+
+    ngx_resolve_name_done(ctx);
+
+    valid = ngx_max(zr->valid, ngx_time()) + 1;
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    ngx_http_upstream_zone_update_host(zr);
+
+    goto done;
+
+failed:
+
+    ngx_resolve_name_done(ctx);
+
+    valid = ngx_time() + NGX_HTTP_UPSTREAM_ZONE_RESOLVE_RETRY;
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+done:
+
+    zr->host->valid = valid;
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (!ngx_exiting) {
+        ngx_add_timer(&zr->event, NGX_HTTP_UPSTREAM_ZONE_RESOLVE_POLL);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_zone_add_addr(ngx_http_upstream_zone_resolve_t *zr,
+    struct sockaddr *sockaddr, socklen_t socklen, ngx_uint_t weight)
+{
+    ngx_uint_t                      i;
+    ngx_http_upstream_zone_addr_t  *addr;
+
+    addr = zr->addrs.elts;
+
+    /* several SRV records may point to the same address */
+
+    for (i = 0; i < zr->addrs.nelts; i++) {
+        if (addr[i].socklen == socklen
+            && ngx_memcmp(addr[i].sockaddr, sockaddr, socklen) == 0)
+        {
+            return NGX_OK;
+        }
+    }
+
+    addr = ngx_array_push(&zr->addrs);
+    if (addr == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memcpy(addr->sockaddr, sockaddr, socklen);
+    addr->socklen = socklen;
+    addr->weight = weight;
+
+    return NGX_OK;
+}
+
+
+/*
+ * addresses that are still returned keep their peers along with
+ * the failure and connection accounting, the rest are swapped
+ * under the lock so that no worker sees a partial list
+ */
+
+static void
+ngx_http_upstream_zone_update_host(ngx_http_upstream_zone_resolve_t *zr)
+{
+    u_char                          text[NGX_SOCKADDR_STRLEN];
+    ngx_str_t                       name, *host;
+    ngx_uint_t                      i, j, changed;
+    ngx_http_upstream_server_t     *server;
+    ngx_http_upstream_rr_peer_t    *peer;
+    ngx_http_upstream_rr_peers_t   *peers, *set;
+    ngx_http_upstream_zone_addr_t  *addr;
+
+    server = zr->host->server;
+    peers = zr->uscf->peer.data;
+    host = server->service.len ? &server->service : &server->host;
+
+    set = server->backup ? peers->next : peers;
+
+    addr = zr->addrs.elts;
+    changed = 0;
+
+    for (i = 0; i < set->number; i++) {
+        peer = &set->peer[i];
+
+        if (peer->removed || peer->server != server) {
+            continue;
+        }
+
+        for (j = 0; j < zr->addrs.nelts; j++) {
+            if (ngx_http_upstream_zone_peer_addr(peer, &addr[j])) {
+                break;
+            }
+        }
+
+        if (j == zr->addrs.nelts) {
+            ngx_http_upstream_zone_remove_peer(peer);
+            changed = 1;
+            continue;
+        }
+
+        /* SRV records may change the weight of an address */
+
+        if (peer->weight != (ngx_int_t) addr[j].weight) {
+            peer->weight = addr[j].weight;
+            peer->effective_weight = addr[j].weight;
+            peer->current_weight = 0;
+            changed = 1;
+        }
+    }
+
+    for (j = 0; j < zr->addrs.nelts; j++) {
+
+        for (i = 0; i < set->number; i++) {
+            peer = &set->peer[i];
+
+            if (!peer->removed
+                && peer->server == server
+                && ngx_http_upstream_zone_peer_addr(peer, &addr[j]))
+            {
+                break;
+            }
+        }
+
+        if (i < set->number) {
+            continue;
+        }
+
+        name.data = text;
+        name.len = ngx_sock_ntop((struct sockaddr *) addr[j].sockaddr, text,
+                                 NGX_SOCKADDR_STRLEN, 1);
+
+        peer = ngx_http_upstream_zone_alloc_peer(set,
+                                          (struct sockaddr *) addr[j].sockaddr,
+                                          addr[j].socklen, &name);
+        if (peer == NULL) {
+            ngx_log_error(NGX_LOG_ERR, zr->event.log, 0,
+                          "upstream \"%V\": no free server slots for %V "
+                          "of %V", &zr->uscf->host, &name, host);
+            continue;
+        }
+
+        peer->server = server;
+        peer->weight = addr[j].weight;
+        peer->effective_weight = addr[j].weight;
+        peer->max_fails = server->max_fails;
+        peer->fail_timeout = server->fail_timeout;
+        peer->max_conns = server->max_conns;
+        peer->conns_limit = server->max_conns;
+        peer->down = server->down;
+
+        changed = 1;
+    }
+
+    if (changed) {
+        ngx_http_upstream_zone_update_peers(peers);
+
+        ngx_log_error(NGX_LOG_NOTICE, zr->event.log, 0,
+                      "upstream \"%V\": addresses of %V changed, %ui now",
+                      &zr->uscf->host, host, zr->addrs.nelts);
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_zone_peer_addr(ngx_http_upstream_rr_peer_t *peer,
+    ngx_http_upstream_zone_addr_t *addr)
+{
+    struct sockaddr_in   *sin, *asin;
+#if (NGX_HAVE_INET6)
+    struct sockaddr_in6  *sin6, *asin6;
+#endif
+
+    if (peer->sockaddr->sa_family
+        != ((struct sockaddr *) addr->sockaddr)->sa_family)
+    {
+        return 0;
+    }
+
+    switch (peer->sockaddr->sa_family) {
+
+#if (NGX_HAVE_INET6)
+    case AF_INET6:
+        sin6 = (struct sockaddr_in6 *) peer->sockaddr;
+        asin6 = (struct sockaddr_in6 *) addr->sockaddr;
+
+        return (sin6->sin6_port == asin6->sin6_port
+                && ngx_memcmp(&sin6->sin6_addr, &asin6->sin6_addr, 16) == 0);
+#endif
+
+    case AF_INET:
+        sin = (struct sockaddr_in *) peer->sockaddr;
+        asin = (struct sockaddr_in *) addr->sockaddr;
+
+        return (sin->sin_addr.s_addr == asin->sin_addr.s_addr
+                && sin->sin_port == asin->sin_port);
+
+    default:
+        return 0;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_handler(ngx_http_request_t *r)
+{
+    size_t                          len;
+    u_char                         *p;
+    ngx_int_t                       rc, id;
+    ngx_buf_t                      *b;
+    ngx_url_t                       u;
+    ngx_uint_t                      i, status;
+    ngx_http_upstream_conf_op_t     op;
+    ngx_http_upstream_rr_peers_t   *peers, *set;
+    ngx_http_upstream_srv_conf_t   *uscf, **uscfp;
+    ngx_http_upstream_main_conf_t  *umcf;
+
+    if (r->method != NGX_HTTP_GET && r->method != NGX_HTTP_HEAD) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
+
+    rc = ngx_http_discard_request_body(r);
+
+    if (rc != NGX_OK) {
+        return rc;
+    }
+
+    ngx_memzero(&op, sizeof(ngx_http_upstream_conf_op_t));
+
+    if (ngx_http_arg(r, (u_char *) "upstream", 8, &op.upstream) != NGX_OK
+        || op.upstream.len == 0)
+    {
+        op.err = "upstream name required";
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                           (u_char *) op.err,
+                                           ngx_strlen(op.err));
+    }
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    uscf = NULL;
+    uscfp = umcf->upstreams.elts;
+
+    for (i = 0; i < umcf->upstreams.nelts; i++) {
+
+        if (uscfp[i]->host.len != op.upstream.len
+            || ngx_strncasecmp(uscfp[i]->host.data, op.upstream.data,
+                               op.upstream.len)
+               != 0)
+        {
+            continue;
+        }
+
+        uscf = uscfp[i];
+
+        if (uscf->shm_zone) {
+            break;
+        }
+    }
+
+    if (uscf == NULL) {
+        op.err = "upstream not found";
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_NOT_FOUND,
+                                           (u_char *) op.err,
+                                           ngx_strlen(op.err));
+    }
+
+    if (uscf->shm_zone == NULL || uscf->peer.data == NULL) {
+        op.err = "upstream is not in a shared zone";
+        return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                           (u_char *) op.err,
+                                           ngx_strlen(op.err));
+    }
+
+    status = ngx_http_upstream_conf_parse(r, uscf, &op);
+
+    if (status != NGX_HTTP_OK) {
+        return ngx_http_upstream_conf_send(r, status, (u_char *) op.err,
+                                           ngx_strlen(op.err));
+    }
+
+    ngx_memzero(&u, sizeof(ngx_url_t));
+
+    if (op.add) {
+        u.url = op.server;
+        u.default_port = 80;
+
+        if (ngx_parse_url(r->pool, &u) != NGX_OK) {
+            op.err = u.err ? u.err : "invalid server address";
+            return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                               (u_char *) op.err,
+                                               ngx_strlen(op.err));
+        }
+
+        if (u.naddrs != 1 || u.addrs[0].name.len > NGX_SOCKADDR_STRLEN) {
+            op.err = "invalid server address";
+            return ngx_http_upstream_conf_send(r, NGX_HTTP_BAD_REQUEST,
+                                               (u_char *) op.err,
+                                               ngx_strlen(op.err));
+        }
+    }
+
+    peers = uscf->peer.data;
+
+    len = 0;
+
+    for (set = peers; set; set = set->next) {
+        len += set->capacity * NGX_HTTP_UPSTREAM_CONF_LINE_LEN;
+    }
+
+    b = ngx_create_temp_buf(r->pool, len);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_http_upstream_rr_peers_lock(peers);
+
+    if (op.add) {
+        id = ngx_http_upstream_conf_add(r, peers, &op, &u);
+
+    } else if (op.id != NGX_CONF_UNSET) {
+        id = ngx_http_upstream_conf_modify(peers, &op);
+
+    } else {
+        id = NGX_CONF_UNSET;
+    }
+
+    if ((op.add || op.id != NGX_CONF_UNSET) && id == NGX_ERROR) {
+        ngx_http_upstream_rr_peers_unlock(peers);
+
+        return ngx_http_upstream_conf_send(r, op.status, (u_char *) op.err,
+                                           ngx_strlen(op.err));
+    }
+
+    ngx_http_upstream_zone_update_peers(peers);
+
+    /* the remaining servers are listed after a removal */
+
+    p = ngx_http_upstream_conf_list(b->last, peers,
+                                    op.remove ? NGX_CONF_UNSET : id);
+
+    ngx_http_upstream_rr_peers_unlock(peers);
+
+    if (op.remove) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upstream \"%V\" server id=%i removed",
+                      &uscf->host, id);
+
+    } else if (id != NGX_CONF_UNSET) {
+        ngx_log_error(NGX_LOG_NOTICE, r->connection->log, 0,
+                      "upstream \"%V\" %*s",
+                      &uscf->host, (size_t) (p - b->last - 1), b->last);
+    }
+
+    return ngx_http_upstream_conf_send(r, NGX_HTTP_OK, b->last, p - b->last);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_parse(ngx_http_request_t *r,
+    ngx_http_upstream_srv_conf_t *uscf, ngx_http_upstream_conf_op_t *op)
+{
+    u_char     *dst, *src, *last;
+    ngx_int_t   n;
+    ngx_str_t   value;
+
+    op->id = NGX_CONF_UNSET;
+    op->weight = NGX_CONF_UNSET;
+    op->max_fails = NGX_CONF_UNSET;
+    op->max_conns = NGX_CONF_UNSET;
+    op->fail_timeout = NGX_CONF_UNSET;
+
+    op->add = (ngx_http_arg(r, (u_char *) "add", 3, &value) == NGX_OK);
+    op->remove = (ngx_http_arg(r, (u_char *) "remove", 6, &value) == NGX_OK);
+    op->up = (ngx_http_arg(r, (u_char *) "up", 2, &value) == NGX_OK);
+    op->down = (ngx_http_arg(r, (u_char *) "down", 4, &value) == NGX_OK);
+    op->drain = (ngx_http_arg(r, (u_char *) "drain", 5, &value) == NGX_OK);
+    op->backup = (ngx_http_arg(r, (u_char *) "backup", 6, &value) == NGX_OK);
+
+    if (ngx_http_arg(r, (u_char *) "id", 2, &value) == NGX_OK) {
+        op->id = ngx_atoi(value.data, value.len);
+
+        if (op->id == NGX_ERROR) {
+            op->err = "invalid server id";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "weight", 6, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_WEIGHT)) {
+            op->err = "weight is not supported by the balancer";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        op->weight = ngx_atoi(value.data, value.len);
+
+        if (op->weight == NGX_ERROR || op->weight == 0) {
+            op->err = "invalid weight";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "max_fails", 9, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_FAILS)) {
+            op->err = "max_fails is not supported by the balancer";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        op->max_fails = ngx_atoi(value.data, value.len);
+
+        if (op->max_fails == NGX_ERROR) {
+            op->err = "invalid max_fails";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "max_conns", 9, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_CONNS)) {
+            op->err = "max_conns is not supported by the balancer";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        op->max_conns = ngx_atoi(value.data, value.len);
+
+        if (op->max_conns == NGX_ERROR) {
+            op->err = "invalid max_conns";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if (ngx_http_arg(r, (u_char *) "fail_timeout", 12, &value) == NGX_OK) {
+
+        if (!(uscf->flags & NGX_HTTP_UPSTREAM_FAIL_TIMEOUT)) {
+            op->err = "fail_timeout is not supported by the balancer";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        op->fail_timeout = ngx_parse_time(&value, 1);
+
+        if (op->fail_timeout == (time_t) NGX_ERROR) {
+            op->err = "invalid fail_timeout";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    }
+
+    if ((op->down || op->drain) && !(uscf->flags & NGX_HTTP_UPSTREAM_DOWN)) {
+        op->err = "down is not supported by the balancer";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (op->backup && !(uscf->flags & NGX_HTTP_UPSTREAM_BACKUP)) {
+        op->err = "backup is not supported by the balancer";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (op->up + op->down + op->drain > 1) {
+        op->err = "conflicting server state";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (op->add) {
+
+        if (op->remove || op->up || op->drain || op->id != NGX_CONF_UNSET) {
+            op->err = "invalid parameters for a new server";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        if (ngx_http_arg(r, (u_char *) "server", 6, &value) != NGX_OK
+            || value.len == 0)
+        {
+            op->err = "server address required";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        dst = ngx_pnalloc(r->pool, value.len);
+        if (dst == NULL) {
+            op->err = "internal error";
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        op->server.data = dst;
+        src = value.data;
+
+        ngx_unescape_uri(&dst, &src, value.len, NGX_UNESCAPE_URI);
+
+        op->server.len = dst - op->server.data;
+
+        /* names would be resolved synchronously in a worker */
+
+        if (op->server.len > 5
+            && ngx_strncasecmp(op->server.data, (u_char *) "unix:", 5) == 0)
+        {
+            return NGX_HTTP_OK;
+        }
+
+        if (op->server.data[0] == '[') {
+            return NGX_HTTP_OK;
+        }
+
+        last = ngx_strlchr(op->server.data, op->server.data + op->server.len,
+                           ':');
+        if (last == NULL) {
+            last = op->server.data + op->server.len;
+        }
+
+        n = last - op->server.data;
+
+        if (ngx_inet_addr(op->server.data, n) == INADDR_NONE) {
+            op->err = "server address must be an IP address";
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        return NGX_HTTP_OK;
+    }
+
+    if (op->id == NGX_CONF_UNSET
+        && (op->remove || op->up || op->down || op->drain || op->backup
+            || op->weight != NGX_CONF_UNSET
+            || op->max_fails != NGX_CONF_UNSET
+            || op->max_conns != NGX_CONF_UNSET
+            || op->fail_timeout != NGX_CONF_UNSET))
+    {
+        op->err = "server id required";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    if (op->backup && op->id != NGX_CONF_UNSET) {
+        op->err = "backup cannot be changed for an existing server";
+        return NGX_HTTP_BAD_REQUEST;
+    }
+
+    return NGX_HTTP_OK;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_add(ngx_http_request_t *r,
+    ngx_http_upstream_rr_peers_t *peers, ngx_http_upstream_conf_op_t *op,
+    ngx_url_t *u)
+{
+    ngx_uint_t                     i, n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *set;
+
+    /* called with the peers locked */
+
+    for (set = peers; set; set = set->next) {
+
+        for (i = 0; i < set->number; i++) {
+            peer = &set->peer[i];
+
+            if (!peer->removed
+                && peer->socklen == u->addrs[0].socklen
+                && ngx_memcmp(peer->sockaddr, u->addrs[0].sockaddr,
+                              peer->socklen)
+                   == 0)
+            {
+                op->status = NGX_HTTP_CONFLICT;
+                op->err = "server already exists";
+                return NGX_ERROR;
+            }
+        }
+    }
+
+    set = op->backup ? peers->next : peers;
+
+    if (set == NULL) {
+        op->status = NGX_HTTP_BAD_REQUEST;
+        op->err = "upstream has no backup servers";
+        return NGX_ERROR;
+    }
+
+    peer = ngx_http_upstream_zone_alloc_peer(set, u->addrs[0].sockaddr,
+                                             u->addrs[0].socklen,
+                                             &u->addrs[0].name);
+    if (peer == NULL) {
+        op->status = NGX_HTTP_INSUFFICIENT_STORAGE;
+        op->err = "no free server slots in upstream";
+        return NGX_ERROR;
+    }
+
+    peer->weight = (op->weight != NGX_CONF_UNSET) ? op->weight : 1;
+    peer->effective_weight = peer->weight;
+    peer->max_fails = (op->max_fails != NGX_CONF_UNSET) ? op->max_fails : 1;
+    peer->fail_timeout = (op->fail_timeout != NGX_CONF_UNSET)
+                         ? op->fail_timeout : 10;
+    peer->max_conns = (op->max_conns != NGX_CONF_UNSET) ? op->max_conns : 0;
+    peer->conns_limit = peer->max_conns;
+    peer->down = op->down;
+
+    /* backup servers are numbered after the primary slots */
+
+    n = peer - set->peer;
+
+    if (set != peers) {
+        n += peers->capacity;
+    }
+
+    return n;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_modify(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_conf_op_t *op)
+{
+    ngx_uint_t                     id;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *set;
+
+    /* called with the peers locked */
+
+    id = op->id;
+    set = peers;
+
+    if (id >= peers->capacity && peers->next) {
+        id -= peers->capacity;
+        set = peers->next;
+    }
+
+    if (id >= set->capacity || set->peer[id].removed) {
+        op->status = NGX_HTTP_NOT_FOUND;
+        op->err = "server not found";
+        return NGX_ERROR;
+    }
+
+    peer = &set->peer[id];
+
+    if (op->remove) {
+        ngx_http_upstream_zone_remove_peer(peer);
+        return op->id;
+    }
+
+    if (op->weight != NGX_CONF_UNSET) {
+        peer->weight = op->weight;
+        peer->effective_weight = op->weight;
+        peer->current_weight = 0;
+    }
+
+    if (op->max_fails != NGX_CONF_UNSET) {
+        peer->max_fails = op->max_fails;
+    }
+
+    if (op->fail_timeout != NGX_CONF_UNSET) {
+        peer->fail_timeout = op->fail_timeout;
+    }
+
+    if (op->max_conns != NGX_CONF_UNSET) {
+        peer->max_conns = op->max_conns;
+        peer->conns_limit = op->max_conns;
+        peer->samples = 0;
+    }
+
+    if (op->up) {
+        peer->down = 0;
+        peer->drain = 0;
+        peer->fails = 0;
+    }
+
+    if (op->down) {
+        peer->down = 1;
+        peer->drain = 0;
+    }
+
+    if (op->drain) {
+
+        /* no new requests, those in flight and cached ones complete */
+
+        peer->down = 1;
+        peer->drain = 1;
+    }
+
+    return op->id;
+}
+
+
+static u_char *
+ngx_http_upstream_conf_list(u_char *p, ngx_http_upstream_rr_peers_t *peers,
+    ngx_int_t id)
+{
+    ngx_uint_t                     i, n;
+    ngx_http_upstream_rr_peer_t   *peer;
+    ngx_http_upstream_rr_peers_t  *set;
+
+    /* called with the peers locked */
+
+    n = 0;
+
+    for (set = peers; set; set = set->next) {
+
+        for (i = 0; i < set->number; i++) {
+            peer = &set->peer[i];
+
+            if (peer->removed
+                || (id != NGX_CONF_UNSET && (ngx_uint_t) id != n + i))
+            {
+                continue;
+            }
+
+            p = ngx_sprintf(p, "server %V", &peer->name);
+
+            if (peer->weight != 1) {
+                p = ngx_sprintf(p, " weight=%i", peer->weight);
+            }
+
+            if (peer->max_fails != 1) {
+                p = ngx_sprintf(p, " max_fails=%ui", peer->max_fails);
+            }
+
+            if (peer->fail_timeout != 10) {
+                p = ngx_sprintf(p, " fail_timeout=%Ts", peer->fail_timeout);
+            }
+
+            if (peer->max_conns) {
+                p = ngx_sprintf(p, " max_conns=%ui", peer->max_conns);
+            }
+
+            if (set != peers) {
+                p = ngx_cpymem(p, " backup", sizeof(" backup") - 1);
+            }
+
+            if (peer->drain) {
+                p = ngx_cpymem(p, " drain", sizeof(" drain") - 1);
+
+            } else if (peer->down) {
+                p = ngx_cpymem(p, " down", sizeof(" down") - 1);
+            }
+
+            p = ngx_sprintf(p, "; # id=%ui conns=%ui\n", n + i, peer->conns);
+        }
+
+        n += set->capacity;
+    }
+
+    return p;
+}
+
+
+static ngx_int_t
+ngx_http_upstream_conf_send(ngx_http_request_t *r, ngx_uint_t status,
+    u_char *text, size_t len)
+{
+    ngx_int_t     rc;
+    ngx_buf_t    *b;
+    ngx_chain_t   out;
+
+    ngx_str_set(&r->headers_out.content_type, "text/plain");
+
+    r->headers_out.status = status;
+
+    if (r->method == NGX_HTTP_HEAD || len == 0) {
+        r->headers_out.content_length_n = 0;
+        r->header_only = 1;
+
+        return ngx_http_send_header(r);
+    }
+
+    /* error messages are sent without the trailing newline */
+
+    b = ngx_create_temp_buf(r->pool, len + 1);
+    if (b == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    b->last = ngx_cpymem(b->last, text, len);
+
+    if (status != NGX_HTTP_OK) {
+        *b->last++ = LF;
+    }
+
+    b->last_buf = (r == r->main) ? 1 : 0;
+
+    out.buf = b;
+    out.next = NULL;
+
+    r->headers_out.content_length_n = b->last - b->pos;
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        return rc;
+    }
+
+    return ngx_http_output_filter(r, &out);
+}
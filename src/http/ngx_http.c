@@ -10,6 +10,18 @@
 #include <ngx_http.h>
 
 
+typedef struct ngx_http_location_trie_build_s  ngx_http_location_trie_build_t;
+
+struct ngx_http_location_trie_build_s {
+    ngx_http_location_trie_build_t  *next;
+    ngx_http_location_trie_build_t  *children;
+    ngx_http_location_queue_t       *lq;
+    u_char                          *name;
+    size_t                           len;
+    ngx_uint_t                       nchildren;
+};
+
+
 static char *ngx_http_block(ngx_conf_t *cf, ngx_command_t *cmd, void *conf);
 static ngx_int_t ngx_http_init_phases(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf);
@@ -41,11 +53,8 @@ static ngx_int_t ngx_http_cmp_locations(const ngx_queue_t *one,
     const ngx_queue_t *two);
 static ngx_int_t ngx_http_join_exact_locations(ngx_conf_t *cf,
     ngx_queue_t *locations);
-static void ngx_http_create_locations_list(ngx_queue_t *locations,
-    ngx_queue_t *q);
-static ngx_http_location_tree_node_t *
-    ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
-    size_t prefix);
+static ngx_http_location_trie_t *ngx_http_create_locations_trie(
+    ngx_conf_t *cf, ngx_queue_t *locations);
 
 static ngx_int_t ngx_http_optimize_servers(ngx_conf_t *cf,
     ngx_http_core_main_conf_t *cmcf, ngx_array_t *ports);
@@ -54,6 +63,10 @@ static ngx_int_t ngx_http_server_names(ngx_conf_t *cf,
 static ngx_int_t ngx_http_cmp_conf_addrs(const void *one, const void *two);
 static int ngx_libc_cdecl ngx_http_cmp_dns_wildcards(const void *one,
     const void *two);
+#if (NGX_PCRE)
+static ngx_int_t ngx_http_regex_compile_multi(ngx_conf_t *cf,
+    ngx_regex_elt_t *elts, ngx_uint_t n, ngx_regex_t **re);
+#endif
 
 static ngx_int_t ngx_http_init_listening(ngx_conf_t *cf,
     ngx_http_conf_port_t *port);
@@ -680,6 +693,7 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     ngx_uint_t                   r;
     ngx_queue_t                 *regex;
+    ngx_regex_elt_t             *re;
 #endif
 
     locations = pclcf->locations;
@@ -789,6 +803,24 @@ ngx_http_init_locations(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
         *clcfp = NULL;
 
         ngx_queue_split(locations, regex, &tail);
+
+        if (r > 1) {
+            re = ngx_palloc(cf->temp_pool, r * sizeof(ngx_regex_elt_t));
+            if (re == NULL) {
+                return NGX_ERROR;
+            }
+
+            for (n = 0; n < r; n++) {
+                re[n].regex = pclcf->regex_locations[n]->regex->regex;
+                re[n].name = pclcf->regex_locations[n]->name.data;
+            }
+
+            if (ngx_http_regex_compile_multi(cf, re, r, &pclcf->regex_multi)
+                != NGX_OK)
+            {
+                return NGX_ERROR;
+            }
+        }
     }
 
 #endif
@@ -832,9 +864,7 @@ ngx_http_init_static_location_trees(ngx_conf_t *cf,
         return NGX_ERROR;
     }
 
-    ngx_http_create_locations_list(locations, ngx_queue_head(locations));
-
-    pclcf->static_locations = ngx_http_create_locations_tree(cf, locations, 0);
+    pclcf->static_locations = ngx_http_create_locations_trie(cf, locations);
     if (pclcf->static_locations == NULL) {
         return NGX_ERROR;
     }
@@ -882,8 +912,6 @@ ngx_http_add_location(ngx_conf_t *cf, ngx_queue_t **locations,
     lq->file_name = cf->conf_file->file.name.data;
     lq->line = cf->conf_file->line;
 
-    ngx_queue_init(&lq->list);
-
     ngx_queue_insert_tail(*locations, &lq->queue);
 
     return NGX_OK;
@@ -1001,140 +1029,185 @@ ngx_http_join_exact_locations(ngx_conf_t *cf, ngx_queue_t *locations)
 }
 
 
-static void
-ngx_http_create_locations_list(ngx_queue_t *locations, ngx_queue_t *q)
+/*
+ * the trie nodes are stored in breadth-first order, so the children of
+ * a node are contiguous, and the first bytes of their names are kept
+ * in the separate "keys" array to find a child with a single scan
+ */
+
+static ngx_http_location_trie_t *
+ngx_http_create_locations_trie(ngx_conf_t *cf, ngx_queue_t *locations)
 {
-    u_char                     *name;
-    size_t                      len;
-    ngx_queue_t                *x, tail;
-    ngx_http_location_queue_t  *lq, *lx;
+    u_char                           *p, *name;
+    size_t                            len, size;
+    ngx_uint_t                        i, n, nodes, last;
+    ngx_queue_t                      *q;
+    ngx_http_location_trie_t         *trie;
+    ngx_http_location_queue_t        *lq;
+    ngx_http_location_trie_node_t    *node;
+    ngx_http_location_trie_build_t    root, *bn, *child, *split, **pp, **queue;
 
-    if (q == ngx_queue_last(locations)) {
-        return;
-    }
+    ngx_memzero(&root, sizeof(ngx_http_location_trie_build_t));
 
-    lq = (ngx_http_location_queue_t *) q;
+    nodes = 1;
+    size = 0;
 
-    if (lq->inclusive == NULL) {
-        ngx_http_create_locations_list(locations, ngx_queue_next(q));
-        return;
-    }
+    for (q = ngx_queue_head(locations);
+         q != ngx_queue_sentinel(locations);
+         q = ngx_queue_next(q))
+    {
+        lq = (ngx_http_location_queue_t *) q;
 
-    len = lq->name->len;
-    name = lq->name->data;
+        name = lq->name->data;
+        len = lq->name->len;
+        bn = &root;
 
-    for (x = ngx_queue_next(q);
-         x != ngx_queue_sentinel(locations);
-         x = ngx_queue_next(x))
-    {
-        lx = (ngx_http_location_queue_t *) x;
+        for ( ;; ) {
 
-        if (len > lx->name->len
-            || (ngx_strncmp(name, lx->name->data, len) != 0))
-        {
-            break;
-        }
-    }
+            if (len == 0) {
+                if (bn->lq == NULL) {
+                    bn->lq = lq;
+                }
 
-    q = ngx_queue_next(q);
+                break;
+            }
 
-    if (q == x) {
-        ngx_http_create_locations_list(locations, x);
-        return;
-    }
+            for (pp = &bn->children; *pp; pp = &(*pp)->next) {
+                if (ngx_http_location_trie_key((*pp)->name[0])
+                    >= ngx_http_location_trie_key(name[0]))
+                {
+                    break;
+                }
+            }
 
-    ngx_queue_split(locations, q, &tail);
-    ngx_queue_add(&lq->list, &tail);
+            child = *pp;
 
-    if (x == ngx_queue_sentinel(locations)) {
-        ngx_http_create_locations_list(&lq->list, ngx_queue_head(&lq->list));
-        return;
-    }
+            if (child == NULL
+                || ngx_http_location_trie_key(child->name[0])
+                   != ngx_http_location_trie_key(name[0]))
+            {
+                child = ngx_pcalloc(cf->temp_pool,
+                                    sizeof(ngx_http_location_trie_build_t));
+                if (child == NULL) {
+                    return NULL;
+                }
 
-    ngx_queue_split(&lq->list, x, &tail);
-    ngx_queue_add(locations, &tail);
+                child->next = *pp;
+                child->lq = lq;
+                child->name = name;
+                child->len = len;
 
-    ngx_http_create_locations_list(&lq->list, ngx_queue_head(&lq->list));
+                *pp = child;
 
-    ngx_http_create_locations_list(locations, x);
-}
+                bn->nchildren++;
+                nodes++;
+                size += len;
 
+                break;
+            }
 
-/*
- * to keep cache locality for left leaf nodes, allocate nodes in following
- * order: node, left subtree, right subtree, inclusive subtree
- */
+            for (n = 1; n < len && n < child->len; n++) {
+                if (ngx_http_location_trie_key(name[n])
+                    != ngx_http_location_trie_key(child->name[n]))
+                {
+                    break;
+                }
+            }
 
-static ngx_http_location_tree_node_t *
-ngx_http_create_locations_tree(ngx_conf_t *cf, ngx_queue_t *locations,
-    size_t prefix)
-{
-    size_t                          len;
-    ngx_queue_t                    *q, tail;
-    ngx_http_location_queue_t      *lq;
-    ngx_http_location_tree_node_t  *node;
+            if (n < child->len) {
 
-    q = ngx_queue_middle(locations);
+                /* split the child name */
 
-    lq = (ngx_http_location_queue_t *) q;
-    len = lq->name->len - prefix;
+                split = ngx_pcalloc(cf->temp_pool,
+                                    sizeof(ngx_http_location_trie_build_t));
+                if (split == NULL) {
+                    return NULL;
+                }
 
-    node = ngx_palloc(cf->pool,
-                      offsetof(ngx_http_location_tree_node_t, name) + len);
-    if (node == NULL) {
-        return NULL;
-    }
+                split->next = child->next;
+                split->children = child;
+                split->nchildren = 1;
+                split->name = child->name;
+                split->len = n;
 
-    node->left = NULL;
-    node->right = NULL;
-    node->tree = NULL;
-    node->exact = lq->exact;
-    node->inclusive = lq->inclusive;
+                child->next = NULL;
+                child->name += n;
+                child->len -= n;
 
-    node->auto_redirect = (u_char) ((lq->exact && lq->exact->auto_redirect)
-                           || (lq->inclusive && lq->inclusive->auto_redirect));
+                *pp = split;
+                child = split;
 
-    node->len = (u_char) len;
-    ngx_memcpy(node->name, &lq->name->data[prefix], len);
+                nodes++;
+            }
 
-    ngx_queue_split(locations, q, &tail);
+            bn = child;
+            name += n;
+            len -= n;
+        }
+    }
 
-    if (ngx_queue_empty(locations)) {
-        /*
-         * ngx_queue_split() insures that if left part is empty,
-         * then right one is empty too
-         */
-        goto inclusive;
+    trie = ngx_palloc(cf->pool, sizeof(ngx_http_location_trie_t));
+    if (trie == NULL) {
+        return NULL;
     }
 
-    node->left = ngx_http_create_locations_tree(cf, locations, prefix);
-    if (node->left == NULL) {
+    trie->nodes = ngx_palloc(cf->pool,
+                             nodes * sizeof(ngx_http_location_trie_node_t));
+    if (trie->nodes == NULL) {
         return NULL;
     }
 
-    ngx_queue_remove(q);
+    trie->keys = ngx_pnalloc(cf->pool, nodes);
+    if (trie->keys == NULL) {
+        return NULL;
+    }
 
-    if (ngx_queue_empty(&tail)) {
-        goto inclusive;
+    p = ngx_pnalloc(cf->pool, size);
+    if (p == NULL) {
+        return NULL;
     }
 
-    node->right = ngx_http_create_locations_tree(cf, &tail, prefix);
-    if (node->right == NULL) {
+    queue = ngx_palloc(cf->temp_pool,
+                       nodes * sizeof(ngx_http_location_trie_build_t *));
+    if (queue == NULL) {
         return NULL;
     }
 
-inclusive:
+    queue[0] = &root;
+    last = 1;
 
-    if (ngx_queue_empty(&lq->list)) {
-        return node;
-    }
+    for (i = 0; i < nodes; i++) {
+        bn = queue[i];
+        node = &trie->nodes[i];
 
-    node->tree = ngx_http_create_locations_tree(cf, &lq->list, prefix + len);
-    if (node->tree == NULL) {
-        return NULL;
+        if (bn->lq) {
+            node->exact = bn->lq->exact;
+            node->inclusive = bn->lq->inclusive;
+
+        } else {
+            node->exact = NULL;
+            node->inclusive = NULL;
+        }
+
+        node->auto_redirect = ((node->exact && node->exact->auto_redirect)
+                               || (node->inclusive
+                                   && node->inclusive->auto_redirect));
+
+        node->name = p;
+        node->len = bn->len;
+        p = ngx_cpymem(p, bn->name, bn->len);
+
+        trie->keys[i] = bn->len ? ngx_http_location_trie_key(bn->name[0]) : 0;
+
+        node->child = last;
+        node->nchildren = bn->nchildren;
+
+        for (child = bn->children; child; child = child->next) {
+            queue[last++] = child;
+        }
     }
 
-    return node;
+    return trie;
 }
 
 
@@ -1352,6 +1425,7 @@ ngx_http_add_address(ngx_conf_t *cf, ngx_http_core_srv_conf_t *cscf,
 #if (NGX_PCRE)
     addr->nregex = 0;
     addr->regex = NULL;
+    addr->regex_multi = NULL;
 #endif
     addr->default_server = cscf;
     addr->servers.elts = NULL;
@@ -1458,6 +1532,7 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
     ngx_http_core_srv_conf_t  **cscfp;
 #if (NGX_PCRE)
     ngx_uint_t                  regex, i;
+    ngx_regex_elt_t            *re;
 
     regex = 0;
 #endif
@@ -1590,6 +1665,26 @@ ngx_http_server_names(ngx_conf_t *cf, ngx_http_core_main_conf_t *cmcf,
         }
     }
 
+    if (regex == 1) {
+        return NGX_OK;
+    }
+
+    re = ngx_palloc(cf->temp_pool, regex * sizeof(ngx_regex_elt_t));
+    if (re == NULL) {
+        return NGX_ERROR;
+    }
+
+    for (i = 0; i < regex; i++) {
+        re[i].regex = addr->regex[i].regex->regex;
+        re[i].name = addr->regex[i].name.data;
+    }
+
+    if (ngx_http_regex_compile_multi(cf, re, regex, &addr->regex_multi)
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
 #endif
 
     return NGX_OK;
@@ -1602,6 +1697,53 @@ failed:
 }
 
 
+#if (NGX_PCRE)
+
+static ngx_int_t
+ngx_http_regex_compile_multi(ngx_conf_t *cf, ngx_regex_elt_t *elts,
+    ngx_uint_t n, ngx_regex_t **re)
+{
+    ngx_int_t                   rc;
+    ngx_regex_compile_t         rcm;
+    ngx_http_core_main_conf_t  *cmcf;
+    u_char                      errstr[NGX_MAX_CONF_ERRSTR];
+
+    cmcf = ngx_http_cycle_get_module_main_conf(cf->cycle, ngx_http_core_module);
+
+    if (!cmcf->regex_combine) {
+        *re = NULL;
+        return NGX_OK;
+    }
+
+    ngx_memzero(&rcm, sizeof(ngx_regex_compile_t));
+
+    rcm.pool = cf->pool;
+    rcm.err.len = NGX_MAX_CONF_ERRSTR;
+    rcm.err.data = errstr;
+
+    rc = ngx_regex_compile_multi(&rcm, elts, n);
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (rc == NGX_DECLINED) {
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, cf->log, 0,
+                       "%ui regexes starting with \"%s\" are not combined",
+                       n, elts[0].name);
+
+        *re = NULL;
+        return NGX_OK;
+    }
+
+    *re = rcm.regex;
+
+    return NGX_OK;
+}
+
+#endif
+
+
 static ngx_int_t
 ngx_http_cmp_conf_addrs(const void *one, const void *two)
 {
@@ -1849,6 +1991,7 @@ ngx_http_add_addrs(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_multi = addr[i].regex_multi;
 #endif
     }
 
@@ -1910,6 +2053,7 @@ ngx_http_add_addrs6(ngx_conf_t *cf, ngx_http_port_t *hport,
 #if (NGX_PCRE)
         vn->nregex = addr[i].nregex;
         vn->regex = addr[i].regex;
+        vn->regex_multi = addr[i].regex_multi;
 #endif
     }
 
@@ -23,7 +23,7 @@ typedef struct {
 
 static ngx_int_t ngx_http_core_find_location(ngx_http_request_t *r);
 static ngx_int_t ngx_http_core_find_static_location(ngx_http_request_t *r,
-    ngx_http_location_tree_node_t *node);
+    ngx_http_location_trie_t *trie);
 
 static ngx_int_t ngx_http_core_preconfiguration(ngx_conf_t *cf);
 static void *ngx_http_core_create_main_conf(ngx_conf_t *cf);
@@ -221,6 +221,17 @@ static ngx_command_t  ngx_http_core_commands[] = {
       offsetof(ngx_http_core_main_conf_t, server_names_hash_bucket_size),
       NULL },
 
+#if (NGX_PCRE)
+
+    { ngx_string("regex_combine"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_core_main_conf_t, regex_combine),
+      NULL },
+
+#endif
+
     { ngx_string("server"),
       NGX_HTTP_MAIN_CONF|NGX_CONF_BLOCK|NGX_CONF_NOARGS,
       ngx_http_core_server,
@@ -841,7 +852,8 @@ ngx_http_handler(ngx_http_request_t *r)
             break;
         }
 
-        r->lingering_close = (r->headers_in.content_length_n > 0);
+        r->lingering_close = (r->headers_in.content_length_n > 0
+                              || r->headers_in.chunked);
         r->phase_handler = 0;
 
     } else {
@@ -1572,7 +1584,30 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
     if (noregex == 0 && pclcf->regex_locations) {
 
-        for (clcfp = pclcf->regex_locations; *clcfp; clcfp++) {
+        clcfp = pclcf->regex_locations;
+
+        if (pclcf->regex_multi) {
+
+            /* find the first matching location in one pass */
+
+            n = ngx_regex_exec_multi(pclcf->regex_multi, &r->uri,
+                                     r->connection->log);
+
+            if (n == NGX_DECLINED) {
+                return rc;
+            }
+
+            /*
+             * on an error the locations are tested one by one,
+             * the error has been already logged
+             */
+
+            if (n != NGX_ERROR) {
+                clcfp += n;
+            }
+        }
+
+        for ( /* void */ ; *clcfp; clcfp++) {
 
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                            "test location: ~ \"%V\"", &(*clcfp)->name);
@@ -1611,79 +1646,91 @@ ngx_http_core_find_location(ngx_http_request_t *r)
 
 static ngx_int_t
 ngx_http_core_find_static_location(ngx_http_request_t *r,
-    ngx_http_location_tree_node_t *node)
+    ngx_http_location_trie_t *trie)
 {
-    u_char     *uri;
-    size_t      len, n;
-    ngx_int_t   rc, rv;
+    u_char                         *uri, *key, *keys;
+    size_t                          len;
+    ngx_int_t                       rv;
+    ngx_uint_t                      i;
+    ngx_http_location_trie_node_t  *node, *child;
+
+    if (trie == NULL) {
+        return NGX_DECLINED;
+    }
 
     len = r->uri.len;
     uri = r->uri.data;
 
     rv = NGX_DECLINED;
+    node = trie->nodes;
 
     for ( ;; ) {
 
-        if (node == NULL) {
-            return rv;
-        }
-
-        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "test location: \"%*s\"", node->len, node->name);
-
-        n = (len <= (size_t) node->len) ? len : node->len;
-
-        rc = ngx_filename_cmp(uri, node->name, n);
-
-        if (rc != 0) {
-            node = (rc < 0) ? node->left : node->right;
-
-            continue;
-        }
+        if (len == 0) {
 
-        if (len > (size_t) node->len) {
+            if (node->exact) {
+                r->loc_conf = node->exact->loc_conf;
+                return NGX_OK;
+            }
 
             if (node->inclusive) {
-
                 r->loc_conf = node->inclusive->loc_conf;
-                rv = NGX_AGAIN;
+                return NGX_AGAIN;
+            }
 
-                node = node->tree;
-                uri += n;
-                len -= n;
+            for (i = 0; i < node->nchildren; i++) {
+                child = &trie->nodes[node->child + i];
 
-                continue;
+                if (child->len == 1 && child->auto_redirect) {
+                    r->loc_conf = (child->exact) ? child->exact->loc_conf:
+                                                   child->inclusive->loc_conf;
+                    return NGX_DONE;
+                }
             }
 
-            /* exact only */
-
-            node = node->right; // 请求uri长度并loc的长
+            return rv;
+        }
 
-            continue;
+        if (node->inclusive) {
+            r->loc_conf = node->inclusive->loc_conf;
+            rv = NGX_AGAIN;
         }
 
-        if (len == (size_t) node->len) {
+        keys = &trie->keys[node->child];
 
-            if (node->exact) { // 精确定位
-                r->loc_conf = node->exact->loc_conf;
-                return NGX_OK;
+        key = ngx_strlchr(keys, keys + node->nchildren,
+                          ngx_http_location_trie_key(*uri));
 
-            } else {
-                r->loc_conf = node->inclusive->loc_conf;
-                return NGX_AGAIN;
-            }
+        if (key == NULL) {
+            return rv;
         }
 
-        /* len < node->len */
+        node = &trie->nodes[key - trie->keys];
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "test location: \"%*s\"", (size_t) node->len,
+                       node->name);
+
+        if (len < (size_t) node->len) {
 
-        if (len + 1 == (size_t) node->len && node->auto_redirect) {
+            if (len + 1 == (size_t) node->len
+                && node->auto_redirect
+                && ngx_filename_cmp(uri, node->name, len) == 0)
+            {
+                r->loc_conf = (node->exact) ? node->exact->loc_conf:
+                                              node->inclusive->loc_conf;
+                return NGX_DONE;
+            }
+
+            return rv;
+        }
 
-            r->loc_conf = (node->exact) ? node->exact->loc_conf:
-                                          node->inclusive->loc_conf;
-            rv = NGX_DONE;
+        if (ngx_filename_cmp(uri, node->name, node->len) != 0) {
+            return rv;
         }
 
-        node = node->left;
+        uri += node->len;
+        len -= node->len;
     }
 }
 
@@ -3296,6 +3343,8 @@ ngx_http_core_create_main_conf(ngx_conf_t *cf)
     cmcf->variables_hash_max_size = NGX_CONF_UNSET_UINT;
     cmcf->variables_hash_bucket_size = NGX_CONF_UNSET_UINT;
 
+    cmcf->regex_combine = NGX_CONF_UNSET;
+
     return cmcf;
 }
 
@@ -3328,6 +3377,8 @@ ngx_http_core_init_main_conf(ngx_conf_t *cf, void *conf)
     cmcf->variables_hash_bucket_size =
                ngx_align(cmcf->variables_hash_bucket_size, ngx_cacheline_size);
 
+    ngx_conf_init_value(cmcf->regex_combine, 0);
+
     if (cmcf->ncaptures) {
         cmcf->ncaptures = (cmcf->ncaptures + 1) * 3;
     }
@@ -3467,6 +3518,7 @@ ngx_http_core_create_loc_conf(ngx_conf_t *cf)
      *     clcf->try_files = NULL;
      *     clcf->client_body_path = NULL;
      *     clcf->regex = NULL;
+     *     clcf->regex_multi = NULL;
      *     clcf->exact_match = 0;
      *     clcf->auto_redirect = 0;
      *     clcf->alias = 0;
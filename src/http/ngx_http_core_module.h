@@ -49,7 +49,7 @@
 #define NGX_HTTP_KEEPALIVE_DISABLE_SAFARI  0x0008
 
 
-typedef struct ngx_http_location_tree_node_s  ngx_http_location_tree_node_t;
+typedef struct ngx_http_location_trie_s  ngx_http_location_trie_t;
 typedef struct ngx_http_core_loc_conf_s  ngx_http_core_loc_conf_t;
 
 
@@ -176,6 +176,8 @@ typedef struct {
 
     ngx_uint_t                 try_files;       /* unsigned  try_files:1 */
 
+    ngx_flag_t                 regex_combine;
+
     ngx_http_phase_t           phases[NGX_HTTP_LOG_PHASE + 1]; // 11 个 phase，每个phase可以注册多个handler
 } ngx_http_core_main_conf_t;
 
@@ -265,6 +267,7 @@ typedef struct {
 #if (NGX_PCRE)
     ngx_uint_t                 nregex;
     ngx_http_server_name_t    *regex;
+    ngx_regex_t               *regex_multi;
 #endif
 
     /* the default server configuration for this address:port */
@@ -322,9 +325,10 @@ struct ngx_http_core_loc_conf_s {
 #endif
 #endif
 
-    ngx_http_location_tree_node_t   *static_locations;
+    ngx_http_location_trie_t        *static_locations;
 #if (NGX_PCRE)
     ngx_http_core_loc_conf_t       **regex_locations;
+    ngx_regex_t                     *regex_multi;
 #endif
 
     /* pointer to the modules' loc_conf */
@@ -446,24 +450,35 @@ typedef struct {
     ngx_str_t                       *name;
     u_char                          *file_name;
     ngx_uint_t                       line;
-    ngx_queue_t                      list;
 } ngx_http_location_queue_t;
 
 
-struct ngx_http_location_tree_node_s {
-    ngx_http_location_tree_node_t   *left;
-    ngx_http_location_tree_node_t   *right;
-    ngx_http_location_tree_node_t   *tree;
-
+typedef struct {
     ngx_http_core_loc_conf_t        *exact;
     ngx_http_core_loc_conf_t        *inclusive;
 
-    u_char                           auto_redirect;
-    u_char                           len;
-    u_char                           name[1];
+    u_char                          *name;
+    uint32_t                         child;
+
+    unsigned                         len:16;
+    unsigned                         nchildren:15;
+    unsigned                         auto_redirect:1;
+} ngx_http_location_trie_node_t;
+
+
+struct ngx_http_location_trie_s {
+    ngx_http_location_trie_node_t   *nodes;
+    u_char                          *keys;
 };
 
 
+#if (NGX_HAVE_CASELESS_FILESYSTEM)
+#define ngx_http_location_trie_key(c)  ngx_tolower(c)
+#else
+#define ngx_http_location_trie_key(c)  (c)
+#endif
+
+
 void ngx_http_core_run_phases(ngx_http_request_t *r);
 ngx_int_t ngx_http_core_generic_phase(ngx_http_request_t *r,
     ngx_http_phase_handler_t *ph);
@@ -11,11 +11,50 @@
 #include <ngx_md5.h>
 
 
+#define NGX_HTTP_FILE_CACHE_PREFETCH_LINE     4096
+#define NGX_HTTP_FILE_CACHE_PREFETCH_CONNS    256
+#define NGX_HTTP_FILE_CACHE_PREFETCH_TIMEOUT  60000
+#define NGX_HTTP_FILE_CACHE_PREFETCH_REPORT   10000
+
+
+struct ngx_http_file_cache_prefetch_s {
+    ngx_file_t                       file;
+    ngx_buf_t                       *buf;
+
+    ngx_uint_t                       active;
+    ngx_uint_t                       requests;
+    ngx_uint_t                       failed;
+    ngx_msec_t                       last_report;
+
+    unsigned                         file_eof:1;
+    unsigned                         eof:1;
+    unsigned                         skip:1;
+};
+
+
+typedef struct {
+    ngx_peer_connection_t            peer;
+    ngx_buf_t                       *request;
+    ngx_buf_t                       *response;
+    ngx_uint_t                       status;
+    ngx_pool_t                      *pool;
+    ngx_http_file_cache_t           *cache;
+} ngx_http_file_cache_prefetch_request_t;
+
+
 static ngx_int_t ngx_http_file_cache_lock(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 static void ngx_http_file_cache_lock_wait_handler(ngx_event_t *ev);
 static ngx_int_t ngx_http_file_cache_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
+static void ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary,
+    size_t len, u_char *hash);
+static void ngx_http_file_cache_vary_header(ngx_http_request_t *r,
+    ngx_md5_t *md5, ngx_str_t *name);
+static ngx_int_t ngx_http_file_cache_reopen(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
+static ngx_int_t ngx_http_file_cache_update_variant(ngx_http_request_t *r,
+    ngx_http_cache_t *c);
 static ssize_t ngx_http_file_cache_aio_read(ngx_http_request_t *r,
     ngx_http_cache_t *c);
 #if (NGX_HAVE_FILE_AIO)
@@ -45,6 +84,18 @@ static ngx_int_t ngx_http_file_cache_add(ngx_http_file_cache_t *cache,
     ngx_http_cache_t *c);
 static ngx_int_t ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx,
     ngx_str_t *path);
+static ngx_msec_t ngx_http_file_cache_prefetch(void *data);
+static ngx_int_t ngx_http_file_cache_prefetch_line(
+    ngx_http_file_cache_prefetch_t *pf, ngx_str_t *line);
+static ngx_int_t ngx_http_file_cache_prefetch_request(
+    ngx_http_file_cache_t *cache, ngx_str_t *line);
+static void ngx_http_file_cache_prefetch_write_handler(ngx_event_t *wev);
+static void ngx_http_file_cache_prefetch_read_handler(ngx_event_t *rev);
+static void ngx_http_file_cache_prefetch_dummy_handler(ngx_event_t *ev);
+static void ngx_http_file_cache_prefetch_close(
+    ngx_http_file_cache_prefetch_request_t *pr);
+static void ngx_http_file_cache_prefetch_done(
+    ngx_http_file_cache_prefetch_request_t *pr, ngx_uint_t ok);
 
 
 ngx_str_t  ngx_http_cache_status[] = {
@@ -102,6 +153,10 @@ ngx_http_file_cache_init(ngx_shm_zone_t *shm_zone, void *data)
             cache->path->loader = NULL;
         }
 
+        /* the cache is only prefetched when it is started afresh */
+
+        cache->path->prefetch = NULL;
+
         return NGX_OK;
     }
 
@@ -232,6 +287,8 @@ ngx_http_file_cache_create_key(ngx_http_request_t *r)
 
     ngx_crc32_final(c->crc32);
     ngx_md5_final(c->key, &md5);
+
+    ngx_memcpy(c->main, c->key, NGX_HTTP_CACHE_KEY_LEN);
 }
 
 
@@ -252,7 +309,7 @@ ngx_http_file_cache_open(ngx_http_request_t *r)
         return NGX_AGAIN;
     }
 
-    if (c->buf) {
+    if (c->reading) {
         return ngx_http_file_cache_read(r, c);
     }
 
@@ -498,6 +555,12 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
 
     h = (ngx_http_file_cache_header_t *) c->buf->pos;
 
+    if (h->version != NGX_HTTP_CACHE_VERSION) {
+        ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                      "cache file \"%s\" version mismatch", c->file.name.data);
+        return NGX_DECLINED;
+    }
+
     if (h->crc32 != c->crc32) {
         ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
                       "cache file \"%s\" has md5 collision", c->file.name.data);
@@ -511,6 +574,23 @@ ngx_http_file_cache_read(ngx_http_request_t *r, ngx_http_cache_t *c)
         return NGX_DECLINED;
     }
 
+    if (h->vary_len > NGX_HTTP_CACHE_VARY_LEN) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary length",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    if (h->vary_len) {
+        ngx_http_file_cache_vary(r, h->vary, h->vary_len, c->variant);
+
+        if (ngx_memcmp(c->variant, h->variant, NGX_HTTP_CACHE_KEY_LEN) != 0) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http file cache vary mismatch");
+            return ngx_http_file_cache_reopen(r, c);
+        }
+    }
+
     c->buf->last += n;
 
     c->valid_sec = h->valid_sec;
@@ -589,9 +669,12 @@ ngx_http_file_cache_aio_read(ngx_http_request_t *r, ngx_http_cache_t *c)
     n = ngx_file_aio_read(&c->file, c->buf->pos, c->body_start, 0, r->pool);
 
     if (n != NGX_AGAIN) {
+        c->reading = 0;
         return n;
     }
 
+    c->reading = 1;
+
     c->file.aio->data = r;
     c->file.aio->handler = ngx_http_cache_aio_event_handler;
 
@@ -628,6 +711,196 @@ ngx_http_cache_aio_event_handler(ngx_event_t *ev)
 #endif
 
 
+static void
+ngx_http_file_cache_vary(ngx_http_request_t *r, u_char *vary, size_t len,
+    u_char *hash)
+{
+    u_char     *p, *last;
+    ngx_str_t   name;
+    ngx_md5_t   md5;
+    u_char      buf[NGX_HTTP_CACHE_VARY_LEN];
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache vary: \"%*s\"", len, vary);
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, r->cache->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    ngx_strlow(buf, vary, len);
+
+    p = buf;
+    last = buf + len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == ',')) {
+            p++;
+        }
+
+        name.data = p;
+
+        while (p < last && *p != ',' && *p != ' ') {
+            p++;
+        }
+
+        name.len = p - name.data;
+
+        if (name.len == 0) {
+            break;
+        }
+
+        ngx_md5_update(&md5, name.data, name.len);
+        ngx_md5_update(&md5, (u_char *) ":", sizeof(":") - 1);
+
+        ngx_http_file_cache_vary_header(r, &md5, &name);
+
+        ngx_md5_update(&md5, (u_char *) CRLF, sizeof(CRLF) - 1);
+    }
+
+    ngx_md5_final(hash, &md5);
+}
+
+
+static void
+ngx_http_file_cache_vary_header(ngx_http_request_t *r, ngx_md5_t *md5,
+    ngx_str_t *name)
+{
+    size_t            len;
+    u_char           *p, *start, *last;
+    ngx_uint_t        i, multiple, normalize;
+    ngx_list_part_t  *part;
+    ngx_table_elt_t  *header;
+
+    multiple = 0;
+    normalize = 0;
+
+    /*
+     * values of the content negotiation headers are normalized,
+     * so that "gzip,deflate" and "gzip, deflate" select the same variant
+     */
+
+    if ((name->len == sizeof("Accept-Charset") - 1
+         && ngx_strncasecmp(name->data, (u_char *) "Accept-Charset",
+                            sizeof("Accept-Charset") - 1) == 0)
+        || (name->len == sizeof("Accept-Encoding") - 1
+            && ngx_strncasecmp(name->data, (u_char *) "Accept-Encoding",
+                               sizeof("Accept-Encoding") - 1) == 0)
+        || (name->len == sizeof("Accept-Language") - 1
+            && ngx_strncasecmp(name->data, (u_char *) "Accept-Language",
+                               sizeof("Accept-Language") - 1) == 0))
+    {
+        normalize = 1;
+    }
+
+    part = &r->headers_in.headers.part;
+    header = part->elts;
+
+    for (i = 0; /* void */ ; i++) {
+
+        if (i >= part->nelts) {
+            if (part->next == NULL) {
+                break;
+            }
+
+            part = part->next;
+            header = part->elts;
+            i = 0;
+        }
+
+        if (header[i].hash == 0) {
+            continue;
+        }
+
+        if (header[i].key.len != name->len) {
+            continue;
+        }
+
+        if (ngx_strncasecmp(header[i].key.data, name->data, name->len) != 0) {
+            continue;
+        }
+
+        if (!normalize) {
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, header[i].value.data, header[i].value.len);
+
+            multiple = 1;
+
+            continue;
+        }
+
+        p = header[i].value.data;
+        last = p + header[i].value.len;
+
+        while (p < last) {
+
+            while (p < last && (*p == ' ' || *p == ',')) {
+                p++;
+            }
+
+            start = p;
+
+            while (p < last && *p != ',' && *p != ' ') {
+                p++;
+            }
+
+            len = p - start;
+
+            if (len == 0) {
+                break;
+            }
+
+            if (multiple) {
+                ngx_md5_update(md5, (u_char *) ",", sizeof(",") - 1);
+            }
+
+            ngx_md5_update(md5, start, len);
+
+            multiple = 1;
+        }
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_reopen(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    ngx_http_file_cache_t  *cache;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http file cache reopen");
+
+    if (c->secondary) {
+        ngx_log_error(NGX_LOG_CRIT, r->connection->log, 0,
+                      "cache file \"%s\" has incorrect vary hash",
+                      c->file.name.data);
+        return NGX_DECLINED;
+    }
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    /* the variant is looked up under the secondary key */
+
+    c->secondary = 1;
+    c->file.name.len = 0;
+    c->body_start = c->buf->end - c->buf->start;
+
+    ngx_memcpy(c->key, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+
+    return ngx_http_file_cache_open(r);
+}
+
+
 static ngx_int_t
 ngx_http_file_cache_exists(ngx_http_file_cache_t *cache, ngx_http_cache_t *c)
 {
@@ -860,7 +1133,7 @@ ngx_http_file_cache_rbtree_insert_value(ngx_rbtree_node_t *temp,
 }
 
 
-void
+ngx_int_t
 ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 {
     ngx_http_file_cache_header_t  *h = (ngx_http_file_cache_header_t *) buf;
@@ -875,6 +1148,9 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
 
     c = r->cache;
 
+    ngx_memzero(h, sizeof(ngx_http_file_cache_header_t));
+
+    h->version = NGX_HTTP_CACHE_VERSION;
     h->valid_sec = c->valid_sec;
     h->last_modified = c->last_modified;
     h->date = c->date;
@@ -883,6 +1159,23 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
     h->header_start = (u_short) c->header_start;
     h->body_start = (u_short) c->body_start;
 
+    if (c->vary.len) {
+        if (c->vary.len > NGX_HTTP_CACHE_VARY_LEN) {
+            /* should not happen */
+            c->vary.len = NGX_HTTP_CACHE_VARY_LEN;
+        }
+
+        h->vary_len = (u_char) c->vary.len;
+        ngx_memcpy(h->vary, c->vary.data, c->vary.len);
+
+        ngx_http_file_cache_vary(r, c->vary.data, c->vary.len, c->variant);
+        ngx_memcpy(h->variant, c->variant, NGX_HTTP_CACHE_KEY_LEN);
+    }
+
+    if (ngx_http_file_cache_update_variant(r, c) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
     p = buf + sizeof(ngx_http_file_cache_header_t);
 
     p = ngx_cpymem(p, ngx_http_file_cache_key, sizeof(ngx_http_file_cache_key));
@@ -893,6 +1186,71 @@ ngx_http_file_cache_set_header(ngx_http_request_t *r, u_char *buf)
     }
 
     *p = LF;
+
+    return NGX_OK;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_update_variant(ngx_http_request_t *r, ngx_http_cache_t *c)
+{
+    size_t                  body_start;
+    ngx_int_t               rc;
+    ngx_uint_t              exists;
+    ngx_http_file_cache_t  *cache;
+
+    if (!c->secondary) {
+        return NGX_OK;
+    }
+
+    if (c->vary.len
+        && ngx_memcmp(c->variant, c->key, NGX_HTTP_CACHE_KEY_LEN) == 0)
+    {
+        return NGX_OK;
+    }
+
+    /*
+     * the response no longer varies the way the cached one did,
+     * so it is stored under the primary key again
+     */
+
+    cache = c->file_cache;
+
+    ngx_shmtx_lock(&cache->shpool->mutex);
+
+    c->node->count--;
+    c->node->updating = 0;
+    c->node = NULL;
+
+    ngx_shmtx_unlock(&cache->shpool->mutex);
+
+    c->secondary = 0;
+    c->file.name.len = 0;
+
+    ngx_memcpy(c->key, c->main, NGX_HTTP_CACHE_KEY_LEN);
+
+    /*
+     * the node is only looked up or created here, the response being
+     * stored keeps its own layout
+     */
+
+    body_start = c->body_start;
+    exists = c->exists;
+
+    rc = ngx_http_file_cache_exists(cache, c);
+
+    c->body_start = body_start;
+    c->exists = exists;
+
+    if (rc == NGX_ERROR) {
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_file_cache_name(r, cache->path) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
 }
 
 
@@ -935,7 +1293,16 @@ ngx_http_file_cache_update(ngx_http_request_t *r, ngx_temp_file_t *tf)
     ext.delete_file = 1;
     ext.log = r->connection->log;
 
+#if (NGX_HAVE_O_TMPFILE)
+    if (tf->unnamed) {
+        rc = ngx_ext_link_file(tf->file.fd, &c->file.name, &ext);
+
+    } else {
+        rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+    }
+#else
     rc = ngx_ext_rename_file(&tf->file.name, &c->file.name, &ext);
+#endif
 
     if (rc == NGX_OK) {
 
@@ -1068,7 +1435,7 @@ ngx_http_file_cache_free(ngx_http_cache_t *c, ngx_temp_file_t *tf)
     c->updating = 0;
 
     if (c->temp_file) {
-        if (tf && tf->file.fd != NGX_INVALID_FILE) {
+        if (tf && tf->file.fd != NGX_INVALID_FILE && !tf->unnamed) {
             ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->file.log, 0,
                            "http file cache incomplete: \"%s\"",
                            tf->file.name.data);
@@ -1460,6 +1827,16 @@ ngx_http_file_cache_add_file(ngx_tree_ctx_t *ctx, ngx_str_t *name)
         return NGX_ERROR;
     }
 
+    if (ngx_strncmp(name->data + name->len - (sizeof(NGX_EXT_LINK_SUFFIX) - 1),
+                    NGX_EXT_LINK_SUFFIX, sizeof(NGX_EXT_LINK_SUFFIX) - 1)
+        == 0)
+    {
+        ngx_log_error(NGX_LOG_NOTICE, ctx->log, 0,
+                      "stale temporary cache file \"%s\" is deleted",
+                      name->data);
+        return NGX_ERROR;
+    }
+
     if (ctx->size < (off_t) sizeof(ngx_http_file_cache_header_t)) {
         ngx_log_error(NGX_LOG_CRIT, ctx->log, 0,
                       "cache file \"%s\" is too small", name->data);
@@ -1558,6 +1935,566 @@ ngx_http_file_cache_delete_file(ngx_tree_ctx_t *ctx, ngx_str_t *path)
 }
 
 
+static ngx_msec_t
+ngx_http_file_cache_prefetch(void *data)
+{
+    ngx_http_file_cache_t  *cache = data;
+
+    ngx_int_t                        rc;
+    ngx_str_t                        line;
+    ngx_uint_t                       n, conns;
+    ngx_msec_t                       delay;
+    ngx_http_file_cache_prefetch_t  *pf;
+
+    pf = cache->prefetch;
+
+    if (pf == NULL) {
+        pf = ngx_pcalloc(ngx_cycle->pool,
+                         sizeof(ngx_http_file_cache_prefetch_t));
+        if (pf == NULL) {
+            return 0;
+        }
+
+        pf->buf = ngx_create_temp_buf(ngx_cycle->pool,
+                                      NGX_HTTP_FILE_CACHE_PREFETCH_LINE);
+        if (pf->buf == NULL) {
+            return 0;
+        }
+
+        pf->file.name = cache->prefetch_file;
+        pf->file.log = ngx_cycle->log;
+
+        pf->file.fd = ngx_open_file(pf->file.name.data, NGX_FILE_RDONLY,
+                                    NGX_FILE_OPEN, 0);
+
+        if (pf->file.fd == NGX_INVALID_FILE) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          ngx_open_file_n " \"%s\" failed",
+                          pf->file.name.data);
+            return 0;
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache prefetch: %V from \"%V\"",
+                      &cache->path->name, &pf->file.name);
+
+        pf->last_report = ngx_current_msec;
+
+        cache->prefetch = pf;
+    }
+
+    if (cache->prefetch_rate >= 1000) {
+        n = cache->prefetch_rate / 1000;
+        delay = 1;
+
+    } else {
+        n = 1;
+        delay = 1000 / cache->prefetch_rate;
+    }
+
+    conns = ngx_min(cache->prefetch_rate, NGX_HTTP_FILE_CACHE_PREFETCH_CONNS);
+
+    while (n && !pf->eof && pf->active < conns) {
+
+        rc = ngx_http_file_cache_prefetch_line(pf, &line);
+
+        if (rc == NGX_ERROR || rc == NGX_DONE) {
+            pf->eof = 1;
+            break;
+        }
+
+        rc = ngx_http_file_cache_prefetch_request(cache, &line);
+
+        if (rc == NGX_ERROR) {
+            break;
+        }
+
+        if (rc == NGX_OK) {
+            n--;
+        }
+    }
+
+    if (pf->eof && pf->active == 0) {
+
+        if (ngx_close_file(pf->file.fd) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                          ngx_close_file_n " \"%s\" failed",
+                          pf->file.name.data);
+        }
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache prefetch: %V done, "
+                      "%ui requests, %ui failed",
+                      &cache->path->name, pf->requests, pf->failed);
+
+        return 0;
+    }
+
+    if (ngx_current_msec - pf->last_report
+        >= NGX_HTTP_FILE_CACHE_PREFETCH_REPORT)
+    {
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http file cache prefetch: %V %O bytes of list read, "
+                      "%ui requests, %ui failed, %ui active",
+                      &cache->path->name, pf->file.offset,
+                      pf->requests, pf->failed, pf->active);
+
+        pf->last_report = ngx_current_msec;
+    }
+
+    return delay;
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_prefetch_line(ngx_http_file_cache_prefetch_t *pf,
+    ngx_str_t *line)
+{
+    u_char     *p;
+    size_t      len;
+    ssize_t     n;
+    ngx_buf_t  *b;
+
+    b = pf->buf;
+
+    for ( ;; ) {
+
+        p = ngx_strlchr(b->pos, b->last, LF);
+
+        if (p) {
+            line->data = b->pos;
+            line->len = p - b->pos;
+
+            b->pos = p + 1;
+
+            if (pf->skip) {
+                pf->skip = 0;
+                continue;
+            }
+
+            return NGX_OK;
+        }
+
+        if (pf->file_eof) {
+
+            if (b->pos == b->last || pf->skip) {
+                return NGX_DONE;
+            }
+
+            line->data = b->pos;
+            line->len = b->last - b->pos;
+
+            b->pos = b->last;
+
+            return NGX_OK;
+        }
+
+        len = b->last - b->pos;
+
+        if (len == (size_t) (b->end - b->start)) {
+            ngx_log_error(NGX_LOG_WARN, ngx_cycle->log, 0,
+                          "too long line in prefetch list \"%V\" "
+                          "at offset %O, ignored",
+                          &pf->file.name, pf->file.offset - (off_t) len);
+            pf->skip = 1;
+            len = 0;
+        }
+
+        b->last = ngx_movemem(b->start, b->pos, len);
+        b->pos = b->start;
+
+        n = ngx_read_file(&pf->file, b->last, b->end - b->last,
+                          pf->file.offset);
+
+        if (n == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+
+        if (n == 0) {
+            pf->file_eof = 1;
+        }
+
+        b->last += n;
+    }
+}
+
+
+static ngx_int_t
+ngx_http_file_cache_prefetch_request(ngx_http_file_cache_t *cache,
+    ngx_str_t *line)
+{
+    size_t                                  len;
+    u_char                                 *p, *last, *start;
+    ngx_int_t                               rc;
+    ngx_str_t                               host, uri;
+    ngx_pool_t                             *pool;
+    ngx_connection_t                       *c;
+    ngx_http_file_cache_prefetch_request_t *pr;
+
+    /*
+     * the first field that starts with "/" or "http://" is requested,
+     * so both plain lists of URIs and access logs can be replayed
+     */
+
+    uri.len = 0;
+    host = cache->prefetch_host;
+
+    p = line->data;
+    last = p + line->len;
+
+    if (p < last && *p == '#') {
+        return NGX_DECLINED;
+    }
+
+    while (p < last) {
+
+        while (p < last && (*p == ' ' || *p == '\t' || *p == '"')) {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last
+               && *p != ' ' && *p != '\t' && *p != '"' && *p != CR)
+        {
+            p++;
+        }
+
+        len = p - start;
+
+        if (len == 0) {
+            break;
+        }
+
+        if (*start == '/') {
+            uri.data = start;
+            uri.len = len;
+            break;
+        }
+
+        if (len > sizeof("http://") - 1
+            && ngx_strncasecmp(start, (u_char *) "http://",
+                               sizeof("http://") - 1) == 0)
+        {
+            host.data = start + sizeof("http://") - 1;
+            uri.data = ngx_strlchr(host.data, p, '/');
+
+            if (uri.data) {
+                host.len = uri.data - host.data;
+                uri.len = p - uri.data;
+
+            } else {
+                host.len = p - host.data;
+                ngx_str_set(&uri, "/");
+            }
+
+            break;
+        }
+    }
+
+    if (uri.len == 0 || host.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    pool = ngx_create_pool(1024, ngx_cycle->log);
+    if (pool == NULL) {
+        return NGX_ERROR;
+    }
+
+    pr = ngx_pcalloc(pool, sizeof(ngx_http_file_cache_prefetch_request_t));
+    if (pr == NULL) {
+        goto failed;
+    }
+
+    len = sizeof("GET ") - 1 + uri.len + sizeof(" HTTP/1.0" CRLF) - 1
+          + sizeof("Host: ") - 1 + host.len + sizeof(CRLF) - 1
+          + sizeof("User-Agent: nginx cache prefetch" CRLF) - 1
+          + sizeof(CRLF) - 1;
+
+    pr->request = ngx_create_temp_buf(pool, len);
+    if (pr->request == NULL) {
+        goto failed;
+    }
+
+    p = pr->request->last;
+
+    p = ngx_cpymem(p, "GET ", sizeof("GET ") - 1);
+    p = ngx_copy(p, uri.data, uri.len);
+    p = ngx_cpymem(p, " HTTP/1.0" CRLF "Host: ",
+                   sizeof(" HTTP/1.0" CRLF "Host: ") - 1);
+    p = ngx_copy(p, host.data, host.len);
+    p = ngx_cpymem(p, CRLF "User-Agent: nginx cache prefetch" CRLF CRLF,
+                   sizeof(CRLF "User-Agent: nginx cache prefetch" CRLF CRLF)
+                   - 1);
+
+    pr->request->last = p;
+
+    pr->response = ngx_create_temp_buf(pool, ngx_pagesize);
+    if (pr->response == NULL) {
+        goto failed;
+    }
+
+    pr->cache = cache;
+    pr->pool = pool;
+
+    pr->peer.sockaddr = cache->prefetch_addr->sockaddr;
+    pr->peer.socklen = cache->prefetch_addr->socklen;
+    pr->peer.name = &cache->prefetch_addr->name;
+    pr->peer.get = ngx_event_get_peer;
+    pr->peer.log = ngx_cycle->log;
+    pr->peer.log_error = NGX_ERROR_ERR;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http file cache prefetch: \"%V\" \"%V\"", &host, &uri);
+
+    cache->prefetch->active++;
+    cache->prefetch->requests++;
+
+    rc = ngx_event_connect_peer(&pr->peer);
+
+    if (rc == NGX_ERROR || rc == NGX_BUSY || rc == NGX_DECLINED) {
+        if (pr->peer.connection) {
+            ngx_close_connection(pr->peer.connection);
+        }
+
+        ngx_http_file_cache_prefetch_done(pr, 0);
+        return NGX_OK;
+    }
+
+    c = pr->peer.connection;
+
+    c->data = pr;
+    c->pool = pool;
+    c->log = ngx_cycle->log;
+    c->read->log = c->log;
+    c->write->log = c->log;
+
+    c->write->handler = ngx_http_file_cache_prefetch_write_handler;
+    c->read->handler = ngx_http_file_cache_prefetch_read_handler;
+
+    if (rc == NGX_AGAIN) {
+        ngx_add_timer(c->write, NGX_HTTP_FILE_CACHE_PREFETCH_TIMEOUT);
+        return NGX_OK;
+    }
+
+    ngx_http_file_cache_prefetch_write_handler(c->write);
+
+    return NGX_OK;
+
+failed:
+
+    ngx_destroy_pool(pool);
+
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_file_cache_prefetch_write_handler(ngx_event_t *wev)
+{
+    ssize_t                                  n, size;
+    ngx_buf_t                               *b;
+    ngx_connection_t                        *c;
+    ngx_http_file_cache_prefetch_request_t  *pr;
+
+    c = wev->data;
+    pr = c->data;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "http file cache prefetch: %V timed out",
+                      pr->peer.name);
+        ngx_http_file_cache_prefetch_close(pr);
+        return;
+    }
+
+    b = pr->request;
+
+    size = b->last - b->pos;
+
+    n = c->send(c, b->pos, size);
+
+    if (n == NGX_ERROR) {
+        ngx_http_file_cache_prefetch_close(pr);
+        return;
+    }
+
+    if (n > 0) {
+        b->pos += n;
+    }
+
+    if (b->pos < b->last) {
+
+        if (ngx_handle_write_event(wev, 0) != NGX_OK) {
+            ngx_http_file_cache_prefetch_close(pr);
+            return;
+        }
+
+        ngx_add_timer(wev, NGX_HTTP_FILE_CACHE_PREFETCH_TIMEOUT);
+
+        return;
+    }
+
+    if (wev->timer_set) {
+        ngx_del_timer(wev);
+    }
+
+    wev->handler = ngx_http_file_cache_prefetch_dummy_handler;
+
+    ngx_add_timer(c->read, NGX_HTTP_FILE_CACHE_PREFETCH_TIMEOUT);
+
+    if (c->read->ready) {
+        ngx_http_file_cache_prefetch_read_handler(c->read);
+        return;
+    }
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_http_file_cache_prefetch_close(pr);
+    }
+}
+
+
+static void
+ngx_http_file_cache_prefetch_read_handler(ngx_event_t *rev)
+{
+    u_char                                  *p;
+    ssize_t                                  n;
+    ngx_buf_t                               *b;
+    ngx_uint_t                               status;
+    ngx_connection_t                        *c;
+    ngx_http_file_cache_prefetch_request_t  *pr;
+
+    c = rev->data;
+    pr = c->data;
+
+    if (rev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "http file cache prefetch: %V timed out",
+                      pr->peer.name);
+        ngx_http_file_cache_prefetch_close(pr);
+        return;
+    }
+
+    b = pr->response;
+
+    for ( ;; ) {
+
+        if (b->last == b->end) {
+            b->last = b->start;
+        }
+
+        n = c->recv(c, b->last, b->end - b->last);
+
+        if (n == NGX_AGAIN) {
+
+            if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+                ngx_http_file_cache_prefetch_close(pr);
+                return;
+            }
+
+            ngx_add_timer(rev, NGX_HTTP_FILE_CACHE_PREFETCH_TIMEOUT);
+
+            return;
+        }
+
+        if (n == NGX_ERROR) {
+            ngx_http_file_cache_prefetch_close(pr);
+            return;
+        }
+
+        if (n == 0) {
+            break;
+        }
+
+        if (pr->status == 0 && b->pos == b->start) {
+
+            /* "HTTP/1.x NNN" */
+
+            b->last += n;
+
+            if (b->last - b->start < 12) {
+                continue;
+            }
+
+            p = b->start;
+            status = 0;
+
+            if (ngx_strncmp(p, "HTTP/1.", 7) == 0
+                && p[8] == ' '
+                && p[9] >= '1' && p[9] <= '5'
+                && p[10] >= '0' && p[10] <= '9'
+                && p[11] >= '0' && p[11] <= '9')
+            {
+                status = (p[9] - '0') * 100 + (p[10] - '0') * 10
+                         + (p[11] - '0');
+            }
+
+            if (status == 0) {
+                ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                              "http file cache prefetch: %V sent "
+                              "invalid response", pr->peer.name);
+                ngx_http_file_cache_prefetch_close(pr);
+                return;
+            }
+
+            pr->status = status;
+
+            /* the rest of the response is discarded */
+
+            b->last = b->start;
+
+            continue;
+        }
+
+        b->last = b->start;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http file cache prefetch status: %ui", pr->status);
+
+    ngx_close_connection(c);
+
+    ngx_http_file_cache_prefetch_done(pr, pr->status >= NGX_HTTP_OK
+                                          && pr->status
+                                             < NGX_HTTP_BAD_REQUEST);
+}
+
+
+static void
+ngx_http_file_cache_prefetch_dummy_handler(ngx_event_t *ev)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http file cache prefetch dummy handler");
+}
+
+
+static void
+ngx_http_file_cache_prefetch_close(ngx_http_file_cache_prefetch_request_t *pr)
+{
+    ngx_close_connection(pr->peer.connection);
+
+    ngx_http_file_cache_prefetch_done(pr, 0);
+}
+
+
+static void
+ngx_http_file_cache_prefetch_done(ngx_http_file_cache_prefetch_request_t *pr,
+    ngx_uint_t ok)
+{
+    ngx_http_file_cache_prefetch_t  *pf;
+
+    pf = pr->cache->prefetch;
+
+    pf->active--;
+
+    if (!ok) {
+        pf->failed++;
+    }
+
+    ngx_destroy_pool(pr->pool);
+}
+
+
 time_t
 ngx_http_file_cache_valid(ngx_array_t *cache_valid, ngx_uint_t status)
 {
@@ -1594,7 +2531,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_str_t               s, name, *value;
     ngx_int_t               loader_files;
     ngx_msec_t              loader_sleep, loader_threshold;
+    ngx_int_t               prefetch_rate;
     ngx_uint_t              i, n;
+    ngx_url_t               u;
+    ngx_str_t               prefetch_file, prefetch_address;
     ngx_http_file_cache_t  *cache;
 
     cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_file_cache_t));
@@ -1612,6 +2552,10 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     loader_sleep = 50;
     loader_threshold = 200;
 
+    prefetch_rate = 10;
+    ngx_str_null(&prefetch_file);
+    ngx_str_set(&prefetch_address, "127.0.0.1:80");
+
     name.len = 0;
     size = 0;
     max_size = NGX_MAX_OFF_T_VALUE;
@@ -1766,6 +2710,38 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "prefetch=", 9) == 0) {
+
+            prefetch_file.len = value[i].len - 9;
+            prefetch_file.data = value[i].data + 9;
+
+            if (ngx_conf_full_name(cf->cycle, &prefetch_file, 1) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "prefetch_address=", 17) == 0) {
+
+            prefetch_address.len = value[i].len - 17;
+            prefetch_address.data = value[i].data + 17;
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "prefetch_rate=", 14) == 0) {
+
+            prefetch_rate = ngx_atoi(value[i].data + 14, value[i].len - 14);
+            if (prefetch_rate == NGX_ERROR || prefetch_rate == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid prefetch_rate value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            continue;
+        }
+
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
                            "invalid parameter \"%V\"", &value[i]);
         return NGX_CONF_ERROR;
@@ -1787,6 +2763,29 @@ ngx_http_file_cache_set_slot(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     cache->loader_sleep = loader_sleep;
     cache->loader_threshold = loader_threshold;
 
+    if (prefetch_file.len) {
+        ngx_memzero(&u, sizeof(ngx_url_t));
+
+        u.url = prefetch_address;
+        u.default_port = 80;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            if (u.err) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "%s in prefetch_address \"%V\"",
+                                   u.err, &u.url);
+            }
+
+            return NGX_CONF_ERROR;
+        }
+
+        cache->path->prefetch = ngx_http_file_cache_prefetch;
+        cache->prefetch_file = prefetch_file;
+        cache->prefetch_addr = &u.addrs[0];
+        cache->prefetch_host = u.host;
+        cache->prefetch_rate = prefetch_rate;
+    }
+
     if (ngx_add_path(cf, &cache->path) != NGX_OK) {
         return NGX_CONF_ERROR;
     }
@@ -33,6 +33,214 @@ static uint32_t  usual[] = {
 };
 
 
+#if (NGX_HAVE_X86_SIMD)
+
+#include <immintrin.h>
+
+/*
+ * the fast paths skip the runs of bytes, which the state machines
+ * handle without changing the state, 16 or 32 bytes at a time;
+ * they never read past the end of the buffer and leave the tail
+ * shorter than a vector to the state machines
+ */
+
+/* the bytes of the URI, which are not "usual" */
+
+static const char  ngx_http_parse_uri_special[16] = {
+    '\0', LF, CR, ' ', '#', '%', '+', '.', '/', '?'
+#if (NGX_WIN32)
+    , '\\'
+#endif
+};
+
+#if (NGX_WIN32)
+#define NGX_HTTP_PARSE_URI_SPECIAL   11
+#else
+#define NGX_HTTP_PARSE_URI_SPECIAL   10
+#endif
+
+/* the bytes of the URI after "?" or "%", which change the state */
+
+static const char  ngx_http_parse_args_special[16] = {
+    '\0', LF, CR, ' ', '#'
+};
+
+#define NGX_HTTP_PARSE_ARGS_SPECIAL   5
+
+/* the bytes ending the run of a header value */
+
+static const char  ngx_http_parse_value_special[16] = {
+    '\0', LF, CR, ' '
+};
+
+#define NGX_HTTP_PARSE_VALUE_SPECIAL  4
+
+/* the ranges of the header name bytes hashed without a lookup */
+
+static const char  ngx_http_parse_name_ranges[16] = {
+    'A', 'Z', 'a', 'z', '0', '9', '-', '-'
+};
+
+
+static u_char *ngx_http_parse_skip_sse42(u_char *p, u_char *last,
+    const char *set, int n);
+static u_char *ngx_http_parse_skip_name_sse42(u_char *p, u_char *last);
+static u_char *ngx_http_parse_skip_avx2(u_char *p, u_char *last,
+    const char *set, int n);
+static u_char *ngx_http_parse_skip_name_avx2(u_char *p, u_char *last);
+
+
+#define ngx_http_parse_skip(p, last, set, n)                                  \
+    ((ngx_cpu_features & NGX_CPU_AVX2)                                        \
+         ? ngx_http_parse_skip_avx2(p, last, set, n)                          \
+         : ngx_http_parse_skip_sse42(p, last, set, n))
+
+#define ngx_http_parse_skip_name(p, last)                                     \
+    ((ngx_cpu_features & NGX_CPU_AVX2)                                        \
+         ? ngx_http_parse_skip_name_avx2(p, last)                             \
+         : ngx_http_parse_skip_name_sse42(p, last))
+
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_skip_sse42(u_char *p, u_char *last, const char *set, int n)
+{
+    int      i;
+    __m128i  s, v;
+
+    s = _mm_loadu_si128((__m128i *) set);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        i = _mm_cmpestri(s, n, v, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_EQUAL_ANY
+                         |_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+__attribute__((target("sse4.2")))
+static u_char *
+ngx_http_parse_skip_name_sse42(u_char *p, u_char *last)
+{
+    int      i;
+    __m128i  s, v;
+
+    s = _mm_loadu_si128((__m128i *) ngx_http_parse_name_ranges);
+
+    while (last - p >= 16) {
+        v = _mm_loadu_si128((__m128i *) p);
+
+        i = _mm_cmpestri(s, 8, v, 16,
+                         _SIDD_UBYTE_OPS|_SIDD_CMP_RANGES
+                         |_SIDD_NEGATIVE_POLARITY|_SIDD_LEAST_SIGNIFICANT);
+
+        if (i != 16) {
+            return p + i;
+        }
+
+        p += 16;
+    }
+
+    return p;
+}
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_parse_skip_avx2(u_char *p, u_char *last, const char *set, int n)
+{
+    int       i;
+    __m256i   s[16], v, m;
+    uint32_t  mask;
+
+    if (last - p < 32) {
+        return ngx_http_parse_skip_sse42(p, last, set, n);
+    }
+
+    for (i = 0; i < n; i++) {
+        s[i] = _mm256_set1_epi8(set[i]);
+    }
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        m = _mm256_cmpeq_epi8(v, s[0]);
+
+        for (i = 1; i < n; i++) {
+            m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, s[i]));
+        }
+
+        mask = (uint32_t) _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return ngx_http_parse_skip_sse42(p, last, set, n);
+}
+
+
+__attribute__((target("avx2")))
+static u_char *
+ngx_http_parse_skip_name_avx2(u_char *p, u_char *last)
+{
+    __m256i   v, l, m, sp, a, z, d0, d9, h;
+    uint32_t  mask;
+
+    if (last - p < 32) {
+        return ngx_http_parse_skip_name_sse42(p, last);
+    }
+
+    sp = _mm256_set1_epi8(0x20);
+    a = _mm256_set1_epi8('a' - 1);
+    z = _mm256_set1_epi8('z' + 1);
+    d0 = _mm256_set1_epi8('0' - 1);
+    d9 = _mm256_set1_epi8('9' + 1);
+    h = _mm256_set1_epi8('-');
+
+    while (last - p >= 32) {
+        v = _mm256_loadu_si256((__m256i *) p);
+
+        /* the signed comparisons leave the bytes above 0x7f out */
+
+        l = _mm256_or_si256(v, sp);
+
+        m = _mm256_and_si256(_mm256_cmpgt_epi8(l, a),
+                             _mm256_cmpgt_epi8(z, l));
+
+        m = _mm256_or_si256(m, _mm256_and_si256(_mm256_cmpgt_epi8(v, d0),
+                                                _mm256_cmpgt_epi8(d9, v)));
+
+        m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, h));
+
+        mask = ~(uint32_t) _mm256_movemask_epi8(m);
+
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+
+        p += 32;
+    }
+
+    return ngx_http_parse_skip_name_sse42(p, last);
+}
+
+#endif
+
+
 #if (NGX_HAVE_LITTLE_ENDIAN && NGX_HAVE_NONALIGNED)
 
 #define ngx_str3_cmp(m, c0, c1, c2, c3)                                       \
@@ -538,6 +746,13 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_check_uri:
 
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+#if (NGX_HAVE_X86_SIMD)
+                if (ngx_cpu_features & NGX_CPU_SSE42) {
+                    p = ngx_http_parse_skip(p + 1, b->last,
+                                            ngx_http_parse_uri_special,
+                                            NGX_HTTP_PARSE_URI_SPECIAL) - 1;
+                }
+#endif
                 break;
             }
 
@@ -623,6 +838,13 @@ ngx_http_parse_request_line(ngx_http_request_t *r, ngx_buf_t *b)
         case sw_uri:
 
             if (usual[ch >> 5] & (1 << (ch & 0x1f))) {
+#if (NGX_HAVE_X86_SIMD)
+                if (ngx_cpu_features & NGX_CPU_SSE42) {
+                    p = ngx_http_parse_skip(p + 1, b->last,
+                                            ngx_http_parse_args_special,
+                                            NGX_HTTP_PARSE_ARGS_SPECIAL) - 1;
+                }
+#endif
                 break;
             }
 
@@ -823,6 +1045,9 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
     ngx_uint_t allow_underscores)
 {
     u_char      c, ch, *p;
+#if (NGX_HAVE_X86_SIMD)
+    u_char     *last;
+#endif
     ngx_uint_t  hash, i;
     enum {
         sw_start = 0,
@@ -900,6 +1125,24 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 hash = ngx_hash(hash, c);
                 r->lowcase_header[i++] = c;
                 i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+
+#if (NGX_HAVE_X86_SIMD)
+                if (ngx_cpu_features & NGX_CPU_SSE42) {
+
+                    /* hash the run of letters, digits and "-" at once */
+
+                    last = ngx_http_parse_skip_name(p + 1, b->last);
+
+                    for (p++; p < last; p++) {
+                        c = lowcase[*p];
+                        hash = ngx_hash(hash, c);
+                        r->lowcase_header[i++] = c;
+                        i &= (NGX_HTTP_LC_HEADER_LEN - 1);
+                    }
+
+                    p--;
+                }
+#endif
                 break;
             }
 
@@ -994,6 +1237,15 @@ ngx_http_parse_header_line(ngx_http_request_t *r, ngx_buf_t *b,
                 goto done;
             case '\0':
                 return NGX_HTTP_PARSE_INVALID_HEADER;
+#if (NGX_HAVE_X86_SIMD)
+            default:
+                if (ngx_cpu_features & NGX_CPU_SSE42) {
+                    p = ngx_http_parse_skip(p + 1, b->last,
+                                            ngx_http_parse_value_special,
+                                            NGX_HTTP_PARSE_VALUE_SPECIAL) - 1;
+                }
+                break;
+#endif
             }
             break;
 
@@ -1818,3 +2070,267 @@ ngx_http_split_args(ngx_http_request_t *r, ngx_str_t *uri, ngx_str_t *args)
         args->len = 0;
     }
 }
+
+
+ngx_int_t
+ngx_http_parse_chunked(ngx_http_request_t *r, ngx_buf_t *b,
+    ngx_http_chunked_t *ctx)
+{
+    u_char     *pos, ch, c;
+    ngx_int_t   rc;
+    enum {
+        sw_chunk_start = 0,
+        sw_chunk_size,
+        sw_chunk_extension,
+        sw_chunk_extension_almost_done,
+        sw_chunk_data,
+        sw_after_data,
+        sw_after_data_almost_done,
+        sw_last_chunk_extension,
+        sw_last_chunk_extension_almost_done,
+        sw_trailer,
+        sw_trailer_almost_done,
+        sw_trailer_header,
+        sw_trailer_header_almost_done
+    } state;
+
+    state = ctx->state;
+
+    if (state == sw_chunk_data && ctx->size == 0) {
+        state = sw_after_data;
+    }
+
+    rc = NGX_AGAIN;
+
+    for (pos = b->pos; pos < b->last; pos++) {
+
+        ch = *pos;
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http chunked byte: %02Xd s:%d", ch, state);
+
+        switch (state) {
+
+        case sw_chunk_start:
+            if (ch >= '0' && ch <= '9') {
+                state = sw_chunk_size;
+                ctx->size = ch - '0';
+                break;
+            }
+
+            c = (u_char) (ch | 0x20);
+
+            if (c >= 'a' && c <= 'f') {
+                state = sw_chunk_size;
+                ctx->size = c - 'a' + 10;
+                break;
+            }
+
+            goto invalid;
+
+        case sw_chunk_size:
+            if (ctx->size > NGX_MAX_OFF_T_VALUE / 16) {
+                goto invalid;
+            }
+
+            if (ch >= '0' && ch <= '9') {
+                ctx->size = ctx->size * 16 + (ch - '0');
+                break;
+            }
+
+            c = (u_char) (ch | 0x20);
+
+            if (c >= 'a' && c <= 'f') {
+                ctx->size = ctx->size * 16 + (c - 'a' + 10);
+                break;
+            }
+
+            if (ctx->size == 0) {
+
+                switch (ch) {
+                case CR:
+                    state = sw_last_chunk_extension_almost_done;
+                    break;
+                case LF:
+                    state = sw_trailer;
+                    break;
+                case ';':
+                case ' ':
+                case '\t':
+                    state = sw_last_chunk_extension;
+                    break;
+                default:
+                    goto invalid;
+                }
+
+                break;
+            }
+
+            switch (ch) {
+            case CR:
+                state = sw_chunk_extension_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_data;
+                break;
+            case ';':
+            case ' ':
+            case '\t':
+                state = sw_chunk_extension;
+                break;
+            default:
+                goto invalid;
+            }
+
+            break;
+
+        case sw_chunk_extension:
+            switch (ch) {
+            case CR:
+                state = sw_chunk_extension_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_data;
+            }
+            break;
+
+        case sw_chunk_extension_almost_done:
+            if (ch == LF) {
+                state = sw_chunk_data;
+                break;
+            }
+            goto invalid;
+
+        case sw_chunk_data:
+            rc = NGX_OK;
+            goto data;
+
+        case sw_after_data:
+            switch (ch) {
+            case CR:
+                state = sw_after_data_almost_done;
+                break;
+            case LF:
+                state = sw_chunk_start;
+            }
+            break;
+
+        case sw_after_data_almost_done:
+            if (ch == LF) {
+                state = sw_chunk_start;
+                break;
+            }
+            goto invalid;
+
+        case sw_last_chunk_extension:
+            switch (ch) {
+            case CR:
+                state = sw_last_chunk_extension_almost_done;
+                break;
+            case LF:
+                state = sw_trailer;
+            }
+            break;
+
+        case sw_last_chunk_extension_almost_done:
+            if (ch == LF) {
+                state = sw_trailer;
+                break;
+            }
+            goto invalid;
+
+        case sw_trailer:
+            switch (ch) {
+            case CR:
+                state = sw_trailer_almost_done;
+                break;
+            case LF:
+                goto done;
+            default:
+                state = sw_trailer_header;
+            }
+            break;
+
+        case sw_trailer_almost_done:
+            if (ch == LF) {
+                goto done;
+            }
+            goto invalid;
+
+        case sw_trailer_header:
+            switch (ch) {
+            case CR:
+                state = sw_trailer_header_almost_done;
+                break;
+            case LF:
+                state = sw_trailer;
+            }
+            break;
+
+        case sw_trailer_header_almost_done:
+            if (ch == LF) {
+                state = sw_trailer;
+                break;
+            }
+            goto invalid;
+
+        }
+    }
+
+data:
+
+    ctx->state = state;
+    b->pos = pos;
+
+    if (ctx->size > NGX_MAX_OFF_T_VALUE - 5) {
+        goto invalid;
+    }
+
+    switch (state) {
+
+    case sw_chunk_start:
+        ctx->length = 3 /* "0" LF LF */;
+        break;
+    case sw_chunk_size:
+        ctx->length = 2 /* LF LF */
+                      + (ctx->size ? ctx->size + 4 /* LF "0" LF LF */ : 0);
+        break;
+    case sw_chunk_extension:
+    case sw_chunk_extension_almost_done:
+        ctx->length = 1 /* LF */ + ctx->size + 4 /* LF "0" LF LF */;
+        break;
+    case sw_chunk_data:
+        ctx->length = ctx->size + 4 /* LF "0" LF LF */;
+        break;
+    case sw_after_data:
+    case sw_after_data_almost_done:
+        ctx->length = 4 /* LF "0" LF LF */;
+        break;
+    case sw_last_chunk_extension:
+    case sw_last_chunk_extension_almost_done:
+        ctx->length = 2 /* LF LF */;
+        break;
+    case sw_trailer:
+    case sw_trailer_almost_done:
+        ctx->length = 1 /* LF */;
+        break;
+    case sw_trailer_header:
+    case sw_trailer_header_almost_done:
+        ctx->length = 2 /* LF LF */;
+        break;
+
+    }
+
+    return rc;
+
+done:
+
+    ctx->state = 0;
+    b->pos = pos + 1;
+
+    return NGX_DONE;
+
+invalid:
+
+    return NGX_ERROR;
+}
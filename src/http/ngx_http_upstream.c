@@ -19,6 +19,74 @@ static ngx_int_t ngx_http_upstream_cache_status(ngx_http_request_t *r,
     ngx_http_variable_value_t *v, uintptr_t data);
 #endif
 
+struct ngx_http_upstream_hedging_s {
+    ngx_event_t                      event;
+    ngx_msec_t                       start;
+
+    /*
+     * the first attempt while the hedged one is in progress,
+     * with the balancer state of its own
+     */
+    ngx_peer_connection_t            peer;
+    ngx_uint_t                       state;
+    time_t                           response_sec;
+    ngx_uint_t                       response_msec;
+};
+
+
+struct ngx_http_upstream_queued_s {
+    ngx_queue_t                      queue;
+    ngx_event_t                      event;
+    ngx_http_request_t              *request;
+    ngx_uint_t                       waiting;  /* unsigned  waiting:1; */
+};
+
+
+#define NGX_HTTP_UPSTREAM_QUEUE_POLL  100
+
+
+typedef struct {
+    ngx_str_node_t                   sn;
+    ngx_rbtree_t                    *tree;
+    ngx_pool_t                      *pool;
+    ngx_uint_t                       count;
+
+    /* followers attached to the request */
+    ngx_queue_t                      waiting;
+
+    /* the upstream response header and the body copied so far */
+    ngx_str_t                        header;
+    ngx_chain_t                     *out;
+    ngx_chain_t                    **last;
+    size_t                           size;
+    size_t                           max_size;
+
+    ngx_event_pipe_input_filter_pt   input_filter;
+
+    unsigned                         done:1;
+    unsigned                         error:1;
+
+    /* the node is removed from the tree, no more followers join */
+    unsigned                         closed:1;
+} ngx_http_upstream_collapse_node_t;
+
+
+struct ngx_http_upstream_collapse_s {
+    ngx_http_upstream_collapse_node_t  *node;
+    ngx_http_request_t                 *request;
+
+    ngx_queue_t                         queue;
+    ngx_event_t                         event;
+
+    /* the next body link to be sent by a follower */
+    ngx_chain_t                       **next;
+
+    unsigned                            leader:1;
+    unsigned                            waiting:1;
+    unsigned                            header_sent:1;
+};
+
+
 static void ngx_http_upstream_init_request(ngx_http_request_t *r);
 static void ngx_http_upstream_resolve_handler(ngx_resolver_ctx_t *ctx);
 static void ngx_http_upstream_rd_check_broken_connection(ngx_http_request_t *r);
@@ -27,12 +95,47 @@ static void ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ngx_event_t *ev);
 static void ngx_http_upstream_connect(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_queue_request(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_queue_handler(ngx_event_t *ev);
+static void ngx_http_upstream_queue_poll_handler(ngx_event_t *ev);
+static void ngx_http_upstream_queue_wake(ngx_http_upstream_srv_conf_t *uscf);
+static void ngx_http_upstream_queue_remove(ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_start(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse_filter(ngx_event_pipe_t *p,
+    ngx_buf_t *buf);
+static void ngx_http_upstream_collapse_finalize(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_done(
+    ngx_http_upstream_collapse_node_t *node, ngx_uint_t error);
+static void ngx_http_upstream_collapse_close(
+    ngx_http_upstream_collapse_node_t *node);
+static void ngx_http_upstream_collapse_wake(
+    ngx_http_upstream_collapse_node_t *node);
+static ngx_uint_t ngx_http_upstream_collapse_busy(ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_handler(ngx_event_t *ev);
+static void ngx_http_upstream_collapse_write_handler(ngx_http_request_t *r);
+static void ngx_http_upstream_collapse_send(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_int_t ngx_http_upstream_collapse_send_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_fallback(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_collapse_remove(
+    ngx_http_upstream_collapse_t *cl);
+static void ngx_http_upstream_collapse_cleanup(void *data);
 static ngx_int_t ngx_http_upstream_reinit(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_request(ngx_http_request_t *r,
-    ngx_http_upstream_t *u);
+    ngx_http_upstream_t *u, ngx_uint_t do_write);
+static ngx_int_t ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write);
 static void ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_read_request_handler(ngx_http_request_t *r);
 static void ngx_http_upstream_process_header(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static ngx_int_t ngx_http_upstream_test_next(ngx_http_request_t *r,
@@ -46,6 +149,17 @@ static void ngx_http_upstream_process_body_in_memory(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_send_response(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_upgrade(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r);
+static void ngx_http_upstream_upgraded_write_downstream(ngx_http_request_t *r);
+static void ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write);
+static void ngx_http_upstream_upgraded_free(ngx_http_upstream_t *u);
 static void
     ngx_http_upstream_process_non_buffered_downstream(ngx_http_request_t *r);
 static void
@@ -65,6 +179,17 @@ static void ngx_http_upstream_store(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
 static void ngx_http_upstream_dummy_handler(ngx_http_request_t *r,
     ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_init(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_peer_handler(ngx_event_t *ev);
+static void ngx_http_upstream_hedge_switch(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static void ngx_http_upstream_hedge_close(ngx_http_request_t *r,
+    ngx_http_upstream_t *u);
+static ngx_msec_t ngx_http_upstream_hedge_bound(ngx_uint_t i);
+static void ngx_http_upstream_hedge_record(ngx_http_upstream_hedge_t *hedge,
+    ngx_msec_t ms);
 static void ngx_http_upstream_next(ngx_http_request_t *r,
     ngx_http_upstream_t *u, ngx_uint_t ft_type);
 static void ngx_http_upstream_cleanup(void *data);
@@ -92,6 +217,8 @@ static ngx_int_t ngx_http_upstream_process_buffering(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_process_charset(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
+static ngx_int_t ngx_http_upstream_process_vary(ngx_http_request_t *r,
+    ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t ngx_http_upstream_process_connection(ngx_http_request_t *r,
     ngx_table_elt_t *h, ngx_uint_t offset);
 static ngx_int_t
@@ -133,6 +260,10 @@ static ngx_int_t ngx_http_upstream_response_length_variable(
 static char *ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char *ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+static char *ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+static char *ngx_http_upstream_adaptive_conns(ngx_conf_t *cf,
+    ngx_command_t *cmd, void *conf);
 
 static void *ngx_http_upstream_create_main_conf(ngx_conf_t *cf);
 static char *ngx_http_upstream_init_main_conf(ngx_conf_t *cf, void *conf);
@@ -259,6 +390,10 @@ ngx_http_upstream_header_t  ngx_http_upstream_headers_in[] = {
                  ngx_http_upstream_process_transfer_encoding, 0,
                  ngx_http_upstream_ignore_header_line, 0, 0 },
 
+    { ngx_string("Vary"),
+                 ngx_http_upstream_process_vary, 0,
+                 ngx_http_upstream_copy_header_line, 0, 0 },
+
 #if (NGX_HTTP_GZIP)
     { ngx_string("Content-Encoding"),
                  ngx_http_upstream_process_header_line,
@@ -286,6 +421,20 @@ static ngx_command_t  ngx_http_upstream_commands[] = {
       0,
       NULL },
 
+    { ngx_string("queue"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_TAKE12,
+      ngx_http_upstream_queue,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("adaptive_conns"),
+      NGX_HTTP_UPS_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE12,
+      ngx_http_upstream_adaptive_conns,
+      NGX_HTTP_SRV_CONF_OFFSET,
+      0,
+      NULL },
+
       ngx_null_command
 };
 
@@ -378,6 +527,7 @@ ngx_conf_bitmask_t  ngx_http_upstream_ignore_headers_masks[] = {
     { ngx_string("Expires"), NGX_HTTP_UPSTREAM_IGN_EXPIRES },
     { ngx_string("Cache-Control"), NGX_HTTP_UPSTREAM_IGN_CACHE_CONTROL },
     { ngx_string("Set-Cookie"), NGX_HTTP_UPSTREAM_IGN_SET_COOKIE },
+    { ngx_string("Vary"), NGX_HTTP_UPSTREAM_IGN_VARY },
     { ngx_null_string, 0 }
 };
 
@@ -453,6 +603,7 @@ static void
 ngx_http_upstream_init_request(ngx_http_request_t *r)
 {
     ngx_str_t                      *host;
+    ngx_int_t                       rc;
     ngx_uint_t                      i;
     ngx_resolver_ctx_t             *ctx, temp;
     ngx_http_cleanup_t             *cln;
@@ -470,8 +621,6 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 #if (NGX_HTTP_CACHE)
 
     if (u->conf->cache) {
-        ngx_int_t  rc;
-
         rc = ngx_http_upstream_cache(r, u);
 
         if (rc == NGX_BUSY) {
@@ -500,6 +649,19 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
         r->write_event_handler = ngx_http_upstream_wr_check_broken_connection;
     }
 
+    if (u->conf->collapse_lengths && !u->collapsed) {
+        rc = ngx_http_upstream_collapse(r, u);
+
+        if (rc == NGX_DONE) {
+            return;
+        }
+
+        if (rc == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+    }
+
     if (r->request_body) {
         u->request_bufs = r->request_body->bufs;
     }
@@ -518,8 +680,11 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
     u->output.pool = r->pool;
     u->output.bufs.num = 1;
     u->output.bufs.size = clcf->client_body_buffer_size;
-    u->output.output_filter = ngx_chain_writer;
-    u->output.filter_ctx = &u->writer;
+
+    if (u->output.output_filter == NULL) {
+        u->output.output_filter = ngx_chain_writer;
+        u->output.filter_ctx = &u->writer;
+    }
 
     u->writer.pool = r->pool;
 
@@ -641,6 +806,8 @@ ngx_http_upstream_init_request(ngx_http_request_t *r)
 
 found:
 
+    u->upstream = uscf;
+
     if (uscf->peer.init(r, uscf) != NGX_OK) { // init函数默认为 ngx_http_upstream_init_round_robin_peer
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -989,7 +1156,7 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             }
         }
 
-        if (!u->cacheable) {
+        if (!u->cacheable && !ngx_http_upstream_collapse_busy(u)) {
             ngx_http_upstream_finalize_request(r, u,
                                                NGX_HTTP_CLIENT_CLOSED_REQUEST);
         }
@@ -1012,7 +1179,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
             ev->error = 1;
         }
 
-        if (!u->cacheable && u->peer.connection) {
+        if (!u->cacheable && !ngx_http_upstream_collapse_busy(u)
+            && u->peer.connection)
+        {
             ngx_log_error(NGX_LOG_INFO, ev->log, ev->kq_errno,
                           "kevent() reported that client prematurely closed "
                           "connection, so upstream connection is closed too");
@@ -1075,7 +1244,9 @@ ngx_http_upstream_check_broken_connection(ngx_http_request_t *r,
     ev->eof = 1;
     c->error = 1;
 
-    if (!u->cacheable && u->peer.connection) {
+    if (!u->cacheable && !ngx_http_upstream_collapse_busy(u)
+        && u->peer.connection)
+    {
         ngx_log_error(NGX_LOG_INFO, ev->log, err,
                       "client prematurely closed connection, "
                       "so upstream connection is closed too");
@@ -1099,6 +1270,7 @@ static void
 ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
     ngx_int_t          rc;
+    ngx_str_t         *name;
     ngx_time_t        *tp;
     ngx_connection_t  *c;
 
@@ -1131,6 +1303,43 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                    "http upstream connect: %i", rc);
 
+    if (u->peer.name && u->upstream && u->upstream->shm_zone) {
+
+        /*
+         * a slot of a zone is reused as soon as the peer is freed,
+         * so the name is copied to be logged as $upstream_addr
+         */
+
+        name = ngx_palloc(r->pool, sizeof(ngx_str_t) + u->peer.name->len);
+        if (name == NULL) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        name->len = u->peer.name->len;
+        name->data = (u_char *) name + sizeof(ngx_str_t);
+        ngx_memcpy(name->data, u->peer.name->data, name->len);
+
+        u->peer.name = name;
+    }
+
+    if (rc != NGX_OK && rc != NGX_AGAIN && rc != NGX_DONE
+        && u->hedging && u->hedging->peer.connection)
+    {
+        /* no hedged attempt, keep waiting for the first one */
+
+        u->state->peer = u->peer.name;
+
+        if (rc != NGX_BUSY) {
+            u->peer.free(&u->peer, u->peer.data,
+                         rc == NGX_DECLINED ? NGX_PEER_FAILED : 0);
+        }
+
+        ngx_http_upstream_hedge_switch(r, u);
+        return;
+    }
+
     if (rc == NGX_ERROR) {
         ngx_http_upstream_finalize_request(r, u,
                                            NGX_HTTP_INTERNAL_SERVER_ERROR);
@@ -1140,6 +1349,11 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     u->state->peer = u->peer.name;
 
     if (rc == NGX_BUSY) {
+
+        if (ngx_http_upstream_queue_request(r, u) == NGX_OK) {
+            return;
+        }
+
         ngx_log_error(NGX_LOG_ERR, r->connection->log, 0, "no live upstreams");
         ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_NOLIVE);
         return;
@@ -1152,6 +1366,16 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     /* rc == NGX_OK || rc == NGX_AGAIN */
 
+    if (u->queued) {
+        if (u->queued->event.timer_set) {
+            ngx_del_timer(&u->queued->event);
+        }
+
+        /* there may be more free peers */
+
+        ngx_http_upstream_queue_wake(u->upstream);
+    }
+
     c = u->peer.connection;
 
     c->data = r;
@@ -1224,6 +1448,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
     }
 
     u->request_sent = 0;
+    u->request_body_sent = 0;
 
     if (rc == NGX_AGAIN) {
         ngx_add_timer(c->write, u->conf->connect_timeout); // 设置连接upstream超时
@@ -1239,7 +1464,7 @@ ngx_http_upstream_connect(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
 #endif
 
-    ngx_http_upstream_send_request(r, u);
+    ngx_http_upstream_send_request(r, u, 1);
 }
 
 
@@ -1302,7 +1527,7 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
         c->write->handler = ngx_http_upstream_handler;
         c->read->handler = ngx_http_upstream_handler;
 
-        ngx_http_upstream_send_request(r, u);
+        ngx_http_upstream_send_request(r, u, 1);
 
         return;
     }
@@ -1315,207 +1540,1270 @@ ngx_http_upstream_ssl_handshake(ngx_connection_t *c)
 
 
 static ngx_int_t
-ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_queue_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
 {
-    ngx_chain_t  *cl;
-
-    if (u->reinit_request(r) != NGX_OK) {
-        return NGX_ERROR;
-    }
-
-    u->keepalive = 0;
+    ngx_http_upstream_queued_t    *qd;
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
-    u->headers_in.content_length_n = -1;
+    uscf = u->upstream;
 
-    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
-                      sizeof(ngx_table_elt_t))
-        != NGX_OK)
-    {
-        return NGX_ERROR;
+    if (uscf == NULL || uscf->queue_max == 0) {
+        return NGX_DECLINED;
     }
 
-    /* reinit the request chain */
+    qd = u->queued;
 
-    for (cl = u->request_bufs; cl; cl = cl->next) {
-        cl->buf->pos = cl->buf->start;
-        cl->buf->file_pos = 0;
-    }
+    if (qd == NULL) {
 
-    /* reinit the subrequest's ngx_output_chain() context */
+        if (uscf->queue_len >= uscf->queue_max) {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                          "upstream queue is full");
+            return NGX_DECLINED;
+        }
 
-    if (r->request_body && r->request_body->temp_file
-        && r != r->main && u->output.buf)
-    {
-        u->output.free = ngx_alloc_chain_link(r->pool);
-        if (u->output.free == NULL) {
-            return NGX_ERROR;
+        qd = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_queued_t));
+        if (qd == NULL) {
+            return NGX_DECLINED;
         }
 
-        u->output.free->buf = u->output.buf;
-        u->output.free->next = NULL;
+        qd->event.handler = ngx_http_upstream_queue_handler;
+        qd->event.data = qd;
+        qd->event.log = r->connection->log;
+        qd->request = r;
 
-        u->output.buf->pos = u->output.buf->start;
-        u->output.buf->last = u->output.buf->start;
-    }
+        u->queued = qd;
 
-    u->output.buf = NULL;
-    u->output.in = NULL;
-    u->output.busy = NULL;
+        ngx_queue_insert_tail(&uscf->queue, &qd->queue);
 
-    /* reinit u->buffer */
+    } else {
 
-    u->buffer.pos = u->buffer.start;
+        /* a request woken up earlier keeps its place */
 
-#if (NGX_HTTP_CACHE)
+        ngx_queue_insert_head(&uscf->queue, &qd->queue);
+    }
 
-    if (r->cache) {
-        u->buffer.pos += r->cache->header_start;
+    qd->waiting = 1;
+    uscf->queue_len++;
+
+    if (!qd->event.timer_set) {
+        ngx_add_timer(&qd->event, uscf->queue_timeout);
     }
 
-#endif
+    /*
+     * with a shared zone peers are also freed by other worker processes,
+     * so the queue is polled
+     */
 
-    u->buffer.last = u->buffer.pos;
+    if (uscf->shm_zone && !uscf->queue_event.timer_set) {
+        ngx_add_timer(&uscf->queue_event, NGX_HTTP_UPSTREAM_QUEUE_POLL);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream queued, waiting: %ui", uscf->queue_len);
 
     return NGX_OK;
 }
 
 
 static void
-ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_queue_handler(ngx_event_t *ev)
 {
-    ngx_int_t          rc;
-    ngx_connection_t  *c;
-
-    c = u->peer.connection;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
-                   "http upstream send request");
+    ngx_connection_t            *c;
+    ngx_http_request_t          *r;
+    ngx_http_log_ctx_t          *ctx;
+    ngx_http_upstream_t         *u;
+    ngx_http_upstream_queued_t  *qd;
+
+    qd = ev->data;
+    r = qd->request;
+    u = r->upstream;
+    c = r->connection;
 
-    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
-        return;
-    }
+    ctx = c->log->data;
+    ctx->current_request = r;
 
-    c->log->action = "sending request to upstream";
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, NGX_ETIMEDOUT,
+                      "upstream queue timed out");
 
-    // 向upstream发送数据
-    rc = ngx_output_chain(&u->output, u->request_sent ? NULL : u->request_bufs);
+        u->state->status = NGX_HTTP_BAD_GATEWAY;
 
-    u->request_sent = 1;
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_BAD_GATEWAY);
 
-    if (rc == NGX_ERROR) {
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        ngx_http_run_posted_requests(c);
         return;
     }
 
-    // 重置写超时计时器
-    if (c->write->timer_set) {
-        ngx_del_timer(c->write);
-    }
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream queue wake up");
 
-    if (rc == NGX_AGAIN) {
-        ngx_add_timer(c->write, u->conf->send_timeout);
+    /* the state of the queued attempt is reused */
 
-        if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    r->upstream_states->nelts--;
+    u->state = NULL;
 
-        return;
-    }
+    /* balancing starts afresh, backup servers may have been selected */
 
-    /* rc == NGX_OK */
-    if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
-        if (ngx_tcp_push(c->fd) == NGX_ERROR) {
-            ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
-                          ngx_tcp_push_n " failed");
-            ngx_http_upstream_finalize_request(r, u,
-                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
-            return;
-        }
+    u->peer.data = NULL;
 
-        c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
+    if (u->upstream->peer.init(r, u->upstream) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        ngx_http_run_posted_requests(c);
+        return;
     }
-    // 发送请求完毕，开始读响应，设置读请求超时
 
-    // 发送request到upstream完成，开始读取upstream的响应
+    ngx_http_upstream_connect(r, u);
 
-    ngx_add_timer(c->read, u->conf->read_timeout);
+    ngx_http_run_posted_requests(c);
+}
 
-#if 1
-    if (c->read->ready) {
 
-        /* post aio operation */
+static void
+ngx_http_upstream_queue_poll_handler(ngx_event_t *ev)
+{
+    ngx_http_upstream_srv_conf_t  *uscf;
 
-        /*
-         * TODO comment
-         * although we can post aio operation just in the end
-         * of ngx_http_upstream_connect() CHECK IT !!!
-         * it's better to do here because we postpone header buffer allocation
-         */
+    uscf = ev->data;
 
-        ngx_http_upstream_process_header(r, u);
+    if (uscf->queue_len == 0) {
         return;
     }
-#endif
 
-    u->write_event_handler = ngx_http_upstream_dummy_handler;
+    ngx_http_upstream_queue_wake(uscf);
 
-    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
-        ngx_http_upstream_finalize_request(r, u,
-                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
-        return;
-    }
+    ngx_add_timer(ev, NGX_HTTP_UPSTREAM_QUEUE_POLL);
 }
 
-// 与upstream连接的socket可写时候回调
+
 static void
-ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
-    ngx_http_upstream_t *u)
+ngx_http_upstream_queue_wake(ngx_http_upstream_srv_conf_t *uscf)
 {
-    ngx_connection_t  *c;
-
-    c = u->peer.connection;
-
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream send request handler");
-
-    if (c->write->timedout) { // 向upstream写超时
-        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
-        return;
-    }
-
-#if (NGX_HTTP_SSL)
+    ngx_event_t                 *ev;
+    ngx_queue_t                 *q;
+    ngx_http_upstream_queued_t  *qd;
 
-    if (u->ssl && c->ssl == NULL) {
-        ngx_http_upstream_ssl_init_connection(r, u, c);
+    if (uscf->queue_len == 0) {
         return;
     }
 
-#endif
-
-    if (u->header_sent) {
-        u->write_event_handler = ngx_http_upstream_dummy_handler;
+    q = ngx_queue_head(&uscf->queue);
+    qd = ngx_queue_data(q, ngx_http_upstream_queued_t, queue);
 
-        (void) ngx_handle_write_event(c->write, 0);
+    ngx_queue_remove(q);
+    qd->waiting = 0;
+    uscf->queue_len--;
 
-        return;
-    }
+    ev = &qd->event;
 
-    ngx_http_upstream_send_request(r, u);
+    ngx_post_event(ev, &ngx_posted_events);
 }
 
-// upstream返回响应可读之后，回调解析upstream的http头
+
 static void
-ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
+ngx_http_upstream_queue_remove(ngx_http_upstream_t *u)
 {
-    ssize_t            n;
-    ngx_int_t          rc;
-    ngx_connection_t  *c;
+    ngx_event_t                 *ev;
+    ngx_http_upstream_queued_t  *qd;
 
-    c = u->peer.connection;
+    qd = u->queued;
+
+    if (qd->waiting) {
+        ngx_queue_remove(&qd->queue);
+        qd->waiting = 0;
+        u->upstream->queue_len--;
+    }
+
+    ev = &qd->event;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    uint32_t                            hash;
+    ngx_str_t                           key;
+    ngx_pool_t                         *pool;
+    ngx_event_t                        *ev;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_http_upstream_collapse_t       *cl;
+    ngx_http_upstream_main_conf_t      *umcf;
+    ngx_http_upstream_collapse_node_t  *node;
+
+    if (r->method != NGX_HTTP_GET
+        || u->store
+        || r->request_body_no_buffering
+        || r->headers_in.upgrade)
+    {
+        return NGX_DECLINED;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    /* cacheable requests are already serialized by the cache lock */
+
+    if (r->cache) {
+        return NGX_DECLINED;
+    }
+
+#endif
+
+    if (ngx_http_script_run(r, &key, u->conf->collapse_lengths->elts, 0,
+                            u->conf->collapse_values->elts)
+        == NULL)
+    {
+        return NGX_ERROR;
+    }
+
+    if (key.len == 0) {
+        return NGX_DECLINED;
+    }
+
+    cl = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_collapse_t));
+    if (cl == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln = ngx_pool_cleanup_add(r->pool, 0);
+    if (cln == NULL) {
+        return NGX_ERROR;
+    }
+
+    cln->handler = ngx_http_upstream_collapse_cleanup;
+    cln->data = cl;
+
+    cl->request = r;
+
+    umcf = ngx_http_get_module_main_conf(r, ngx_http_upstream_module);
+
+    hash = ngx_crc32_long(key.data, key.len);
+
+    node = (ngx_http_upstream_collapse_node_t *)
+               ngx_str_rbtree_lookup(&umcf->collapse, &key, hash);
+
+    if (node == NULL) {
+
+        /*
+         * the body is kept in a pool of its own, followers may still
+         * be sending it when the leader request is already freed
+         */
+
+        pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log);
+        if (pool == NULL) {
+            return NGX_ERROR;
+        }
+
+        node = ngx_pcalloc(pool, sizeof(ngx_http_upstream_collapse_node_t));
+        if (node == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_ERROR;
+        }
+
+        node->sn.str.data = ngx_pstrdup(pool, &key);
+        if (node->sn.str.data == NULL) {
+            ngx_destroy_pool(pool);
+            return NGX_ERROR;
+        }
+
+        node->sn.str.len = key.len;
+        node->sn.node.key = hash;
+
+        node->tree = &umcf->collapse;
+        node->pool = pool;
+        node->count = 1;
+        node->last = &node->out;
+        node->max_size = u->conf->collapse_max_size;
+
+        ngx_queue_init(&node->waiting);
+
+        ngx_rbtree_insert(&umcf->collapse, &node->sn.node);
+
+        cl->node = node;
+        cl->leader = 1;
+
+        u->collapse = cl;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream collapse leader: \"%V\"", &key);
+
+        return NGX_OK;
+    }
+
+    node->count++;
+
+    cl->node = node;
+    cl->next = &node->out;
+
+    cl->event.handler = ngx_http_upstream_collapse_handler;
+    cl->event.data = cl;
+    cl->event.log = r->connection->log;
+
+    ngx_queue_insert_tail(&node->waiting, &cl->queue);
+    cl->waiting = 1;
+
+    u->collapse = cl;
+
+    ev = &cl->event;
+
+    if (node->header.len) {
+        ngx_post_event(ev, &ngx_posted_events);
+
+    } else {
+        ngx_add_timer(ev, u->conf->collapse_timeout);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse follower: \"%V\", count: %ui",
+                   &key, node->count);
+
+    return NGX_DONE;
+}
+
+
+static void
+ngx_http_upstream_collapse_start(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    size_t                              len;
+    ngx_event_pipe_t                   *p;
+    ngx_http_upstream_collapse_node_t  *node;
+
+    node = u->collapse->node;
+
+    if (node->done) {
+        return;
+    }
+
+    len = u->buffer.pos - u->buffer.start;
+
+    /*
+     * followers get exactly what was copied, so only responses
+     * known to fit in max_size are collapsed
+     */
+
+    if (len == 0
+        || u->headers_in.content_length_n == -1
+        || u->headers_in.content_length_n > (off_t) node->max_size)
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream collapse declined");
+
+        ngx_http_upstream_collapse_done(node, 1);
+        return;
+    }
+
+    node->header.data = ngx_pnalloc(node->pool, len);
+    if (node->header.data == NULL) {
+        ngx_http_upstream_collapse_done(node, 1);
+        return;
+    }
+
+    ngx_memcpy(node->header.data, u->buffer.start, len);
+    node->header.len = len;
+
+    /* the body is copied as the event pipe gets it from upstream */
+
+    p = u->pipe;
+
+    node->input_filter = p->input_filter;
+    p->input_filter = ngx_http_upstream_collapse_filter;
+
+    ngx_http_upstream_collapse_wake(node);
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse_filter(ngx_event_pipe_t *p, ngx_buf_t *buf)
+{
+    size_t                              size;
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_uint_t                          wake;
+    ngx_chain_t                        *cl, *ln, **ll;
+    ngx_http_request_t                 *r;
+    ngx_http_upstream_collapse_node_t  *node;
+
+    r = p->input_ctx;
+    node = r->upstream->collapse->node;
+
+    ll = p->in ? p->last_in : &p->in;
+
+    rc = node->input_filter(p, buf);
+
+    if (rc != NGX_OK || node->done) {
+        return rc;
+    }
+
+    wake = 0;
+
+    for (cl = *ll; cl; cl = cl->next) {
+
+        size = cl->buf->last - cl->buf->pos;
+
+        if (size == 0) {
+            continue;
+        }
+
+        if (node->size + size > node->max_size && !node->closed) {
+            ngx_log_error(NGX_LOG_WARN, p->log, 0,
+                          "collapsed upstream response is bigger "
+                          "than %uz bytes", node->max_size);
+
+            /*
+             * the followers already attached get the rest of the response,
+             * new requests fetch it on their own
+             */
+
+            ngx_http_upstream_collapse_close(node);
+        }
+
+        b = ngx_create_temp_buf(node->pool, size);
+        if (b == NULL) {
+            ngx_http_upstream_collapse_done(node, 1);
+            return rc;
+        }
+
+        b->last = ngx_cpymem(b->pos, cl->buf->pos, size);
+
+        ln = ngx_alloc_chain_link(node->pool);
+        if (ln == NULL) {
+            ngx_http_upstream_collapse_done(node, 1);
+            return rc;
+        }
+
+        ln->buf = b;
+        ln->next = NULL;
+
+        *node->last = ln;
+        node->last = &ln->next;
+        node->size += size;
+
+        wake = 1;
+    }
+
+    if (wake) {
+        ngx_http_upstream_collapse_wake(node);
+    }
+
+    return rc;
+}
+
+
+static void
+ngx_http_upstream_collapse_finalize(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_uint_t                          error;
+    ngx_event_pipe_t                   *p;
+    ngx_http_upstream_collapse_t       *cl;
+    ngx_http_upstream_collapse_node_t  *node;
+
+    cl = u->collapse;
+    node = cl->node;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (cl->leader) {
+
+        p = u->pipe;
+        error = 1;
+
+        if (node->header.len
+            && (p->upstream_done || (p->upstream_eof && !p->upstream_error))
+            && u->headers_in.content_length_n == (off_t) node->size)
+        {
+            error = 0;
+        }
+
+        ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http upstream collapse done: %uz bytes, error: %ui",
+                       node->size, error);
+
+        ngx_http_upstream_collapse_done(node, error);
+
+    } else if (cl->header_sent) {
+
+        /* the body may still be referenced by the busy buffers */
+
+        ngx_http_upstream_collapse_remove(cl);
+        return;
+    }
+
+    ngx_http_upstream_collapse_cleanup(cl);
+}
+
+
+static void
+ngx_http_upstream_collapse_done(ngx_http_upstream_collapse_node_t *node,
+    ngx_uint_t error)
+{
+    if (node->done) {
+        return;
+    }
+
+    node->done = 1;
+    node->error = error;
+
+    ngx_http_upstream_collapse_close(node);
+
+    ngx_http_upstream_collapse_wake(node);
+}
+
+
+static void
+ngx_http_upstream_collapse_close(ngx_http_upstream_collapse_node_t *node)
+{
+    if (node->closed) {
+        return;
+    }
+
+    node->closed = 1;
+
+    ngx_rbtree_delete(node->tree, &node->sn.node);
+}
+
+
+static void
+ngx_http_upstream_collapse_wake(ngx_http_upstream_collapse_node_t *node)
+{
+    ngx_queue_t                   *q;
+    ngx_event_t                   *ev;
+    ngx_http_upstream_collapse_t  *cl;
+
+    for (q = ngx_queue_head(&node->waiting);
+         q != ngx_queue_sentinel(&node->waiting);
+         q = ngx_queue_next(q))
+    {
+        cl = ngx_queue_data(q, ngx_http_upstream_collapse_t, queue);
+        ev = &cl->event;
+
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+}
+
+
+static ngx_uint_t
+ngx_http_upstream_collapse_busy(ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_collapse_node_t  *node;
+
+    /*
+     * the leader goes on reading the response for its followers
+     * even if its own client has gone
+     */
+
+    if (u->collapse == NULL || !u->collapse->leader) {
+        return 0;
+    }
+
+    node = u->collapse->node;
+
+    return node && node->header.len && !node->done
+           && !ngx_queue_empty(&node->waiting);
+}
+
+
+static void
+ngx_http_upstream_collapse_handler(ngx_event_t *ev)
+{
+    ngx_connection_t              *c;
+    ngx_http_request_t            *r;
+    ngx_http_log_ctx_t            *ctx;
+    ngx_http_upstream_t           *u;
+    ngx_http_upstream_collapse_t  *cl;
+
+    cl = ev->data;
+    r = cl->request;
+    u = r->upstream;
+    c = r->connection;
+
+    ctx = c->log->data;
+    ctx->current_request = r;
+
+    if (ev->timedout) {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream collapse timed out");
+
+        ngx_http_upstream_collapse_fallback(r, u);
+
+    } else {
+        ngx_http_upstream_collapse_send(r, u);
+    }
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_collapse_write_handler(ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream collapse write handler");
+
+    c->log->action = "sending to client";
+
+    if (c->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_collapse_send(r, u);
+}
+
+
+static void
+ngx_http_upstream_collapse_send(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_int_t                           rc;
+    ngx_buf_t                          *b;
+    ngx_chain_t                        *ln, *cl, *out, **ll;
+    ngx_connection_t                   *c;
+    ngx_http_core_loc_conf_t           *clcf;
+    ngx_http_upstream_collapse_t       *col;
+    ngx_http_upstream_collapse_node_t  *node;
+
+    col = u->collapse;
+    node = col->node;
+    c = r->connection;
+
+    if (!col->header_sent) {
+
+        if (node->error || (node->done && node->header.len == 0)) {
+            ngx_http_upstream_collapse_fallback(r, u);
+            return;
+        }
+
+        if (node->header.len == 0) {
+            return;
+        }
+
+        if (col->event.timer_set) {
+            ngx_del_timer(&col->event);
+        }
+
+        if (ngx_http_upstream_collapse_send_header(r, u) != NGX_OK) {
+            return;
+        }
+    }
+
+    /* the body is sent from the leader's buffers without copying */
+
+    out = NULL;
+    ll = &out;
+
+    for (ln = *col->next; ln; ln = ln->next) {
+
+        b = ngx_calloc_buf(r->pool);
+        if (b == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        b->pos = ln->buf->pos;
+        b->last = ln->buf->last;
+        b->memory = 1;
+
+        cl = ngx_alloc_chain_link(r->pool);
+        if (cl == NULL) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+
+        cl->buf = b;
+        cl->next = NULL;
+
+        *ll = cl;
+        ll = &cl->next;
+
+        col->next = &ln->next;
+    }
+
+    rc = ngx_http_output_filter(r, out);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    /* the body received before an error is still sent */
+
+    if (node->error) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "collapsed upstream request failed");
+
+        /* the response is truncated, the connection is not kept */
+
+        r->keepalive = 0;
+
+        ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+        return;
+    }
+
+    if (node->done) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (c->data == r) {
+        if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u, NGX_ERROR);
+            return;
+        }
+    }
+
+    if (c->write->active && !c->write->ready) {
+        ngx_add_timer(c->write, clcf->send_timeout);
+
+    } else if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_collapse_send_header(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_int_t                           rc;
+    ngx_http_upstream_collapse_t       *cl;
+    ngx_http_upstream_collapse_node_t  *node;
+
+    cl = u->collapse;
+    node = cl->node;
+
+    /* the leader's response header is processed as if it was received */
+
+    u->buffer.start = ngx_pnalloc(r->pool, node->header.len);
+    if (u->buffer.start == NULL) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_ERROR;
+    }
+
+    u->buffer.pos = u->buffer.start;
+    u->buffer.last = ngx_cpymem(u->buffer.start, node->header.data,
+                                node->header.len);
+    u->buffer.end = u->buffer.last;
+    u->buffer.temporary = 1;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_ERROR;
+    }
+
+    rc = u->process_header(r);
+
+    if (rc != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return NGX_ERROR;
+    }
+
+    if (ngx_http_upstream_process_headers(r, u) != NGX_OK) {
+        return NGX_DONE;
+    }
+
+    rc = ngx_http_send_header(r);
+
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return NGX_DONE;
+    }
+
+    cl->header_sent = 1;
+    u->header_sent = 1;
+
+    r->write_event_handler = ngx_http_upstream_collapse_write_handler;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_collapse_fallback(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream collapse fallback");
+
+    ngx_http_upstream_collapse_cleanup(u->collapse);
+
+    u->collapse = NULL;
+    u->collapsed = 1;
+
+    ngx_http_upstream_init_request(r);
+}
+
+
+static void
+ngx_http_upstream_collapse_remove(ngx_http_upstream_collapse_t *cl)
+{
+    ngx_event_t  *ev;
+
+    if (cl->waiting) {
+        ngx_queue_remove(&cl->queue);
+        cl->waiting = 0;
+    }
+
+    ev = &cl->event;
+
+    if (ev->timer_set) {
+        ngx_del_timer(ev);
+    }
+
+    if (ev->prev) {
+        ngx_delete_posted_event(ev);
+    }
+}
+
+
+static void
+ngx_http_upstream_collapse_cleanup(void *data)
+{
+    ngx_http_upstream_collapse_t  *cl = data;
+
+    ngx_http_upstream_collapse_node_t  *node;
+
+    node = cl->node;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (cl->leader) {
+        ngx_http_upstream_collapse_done(node, 1);
+
+    } else {
+        ngx_http_upstream_collapse_remove(cl);
+    }
+
+    cl->node = NULL;
+
+    if (--node->count == 0) {
+        ngx_destroy_pool(node->pool);
+    }
+}
+
+
+static ngx_int_t
+ngx_http_upstream_reinit(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_chain_t  *cl;
+
+    if (u->reinit_request(r) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    u->keepalive = 0;
+
+    ngx_memzero(&u->headers_in, sizeof(ngx_http_upstream_headers_in_t));
+    u->headers_in.content_length_n = -1;
+
+    if (ngx_list_init(&u->headers_in.headers, r->pool, 8,
+                      sizeof(ngx_table_elt_t))
+        != NGX_OK)
+    {
+        return NGX_ERROR;
+    }
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        r->cache->vary.len = 0;
+    }
+
+#endif
+
+    /* reinit the request chain */
+
+    for (cl = u->request_bufs; cl; cl = cl->next) {
+        cl->buf->pos = cl->buf->start;
+        cl->buf->file_pos = 0;
+    }
+
+    /* reinit the subrequest's ngx_output_chain() context */
+
+    if (r->request_body && r->request_body->temp_file
+        && r != r->main && u->output.buf)
+    {
+        u->output.free = ngx_alloc_chain_link(r->pool);
+        if (u->output.free == NULL) {
+            return NGX_ERROR;
+        }
+
+        u->output.free->buf = u->output.buf;
+        u->output.free->next = NULL;
+
+        u->output.buf->pos = u->output.buf->start;
+        u->output.buf->last = u->output.buf->start;
+    }
+
+    u->output.buf = NULL;
+    u->output.in = NULL;
+    u->output.busy = NULL;
+
+    /* reinit u->buffer */
+
+    u->buffer.pos = u->buffer.start;
+
+#if (NGX_HTTP_CACHE)
+
+    if (r->cache) {
+        u->buffer.pos += r->cache->header_start;
+    }
+
+#endif
+
+    u->buffer.last = u->buffer.pos;
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_upstream_send_request(ngx_http_request_t *r, ngx_http_upstream_t *u,
+    ngx_uint_t do_write)
+{
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream send request");
+
+    if (!u->request_sent && ngx_http_upstream_test_connect(c) != NGX_OK) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
+
+    c->log->action = "sending request to upstream";
+
+    // 向upstream发送数据
+    rc = ngx_http_upstream_send_request_body(r, u, do_write);
+
+    if (rc == NGX_ERROR) {
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_ERROR);
+        return;
+    }
+
+    if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+        ngx_http_upstream_finalize_request(r, u, rc);
+        return;
+    }
+
+    if (rc == NGX_AGAIN) {
+
+        // 重置写超时计时器
+        if (!c->write->ready) {
+            ngx_add_timer(c->write, u->conf->send_timeout);
+
+        } else if (c->write->timer_set) {
+            ngx_del_timer(c->write);
+        }
+
+        if (ngx_handle_write_event(c->write, u->conf->send_lowat) != NGX_OK) {
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        return;
+    }
+
+    /* rc == NGX_OK */
+
+    if (c->write->timer_set) {
+        ngx_del_timer(c->write);
+    }
+
+    if (c->tcp_nopush == NGX_TCP_NOPUSH_SET) {
+        if (ngx_tcp_push(c->fd) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, c->log, ngx_socket_errno,
+                          ngx_tcp_push_n " failed");
+            ngx_http_upstream_finalize_request(r, u,
+                                               NGX_HTTP_INTERNAL_SERVER_ERROR);
+            return;
+        }
+
+        c->tcp_nopush = NGX_TCP_NOPUSH_UNSET;
+    }
+
+    if (u->request_body_sent) {
+        return;
+    }
+
+    u->request_body_sent = 1;
+
+    /*
+     * an unbuffered request body may be sent completely after
+     * the response header has been already processed
+     */
+
+    if (u->header_sent) {
+        return;
+    }
+
+    // 发送请求完毕，开始读响应，设置读请求超时
+
+    // 发送request到upstream完成，开始读取upstream的响应
+
+    ngx_add_timer(c->read, u->conf->read_timeout);
+
+    if (u->conf->hedge && !u->hedged
+        && (r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))
+        && !r->request_body_no_buffering
+        && !r->headers_in.upgrade)
+    {
+        ngx_http_upstream_hedge_init(r, u);
+    }
+
+#if 1
+    if (c->read->ready) {
+
+        /* post aio operation */
+
+        /*
+         * TODO comment
+         * although we can post aio operation just in the end
+         * of ngx_http_upstream_connect() CHECK IT !!!
+         * it's better to do here because we postpone header buffer allocation
+         */
+
+        ngx_http_upstream_process_header(r, u);
+        return;
+    }
+#endif
+
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+
+    if (ngx_handle_write_event(c->write, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u,
+                                           NGX_HTTP_INTERNAL_SERVER_ERROR);
+        return;
+    }
+}
+
+
+/*
+ * with r->request_body_no_buffering the body is sent as it is being read:
+ * the client connection is read only when the previous part of the body
+ * has been passed to the upstream connection
+ */
+
+static ngx_int_t
+ngx_http_upstream_send_request_body(ngx_http_request_t *r,
+    ngx_http_upstream_t *u, ngx_uint_t do_write)
+{
+    int                        tcp_nodelay;
+    ngx_int_t                  rc;
+    ngx_chain_t               *out, *cl, *ln;
+    ngx_connection_t          *c;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request body");
+
+    if (!r->request_body_no_buffering) {
+
+        /* buffered request body */
+
+        if (!u->request_sent) {
+            u->request_sent = 1;
+            out = u->request_bufs;
+
+        } else {
+            out = NULL;
+        }
+
+        return ngx_output_chain(&u->output, out);
+    }
+
+    if (!u->request_sent) {
+        u->request_sent = 1;
+        out = u->request_bufs;
+
+        if (r->request_body->bufs) {
+            for (cl = out; cl->next; cl = cl->next) { /* void */ }
+            cl->next = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
+
+        c = u->peer.connection;
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (clcf->tcp_nodelay && c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            tcp_nodelay = 1;
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                return NGX_ERROR;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        r->read_event_handler = ngx_http_upstream_read_request_handler;
+
+    } else {
+        out = NULL;
+    }
+
+    for ( ;; ) {
+
+        if (do_write) {
+            rc = ngx_output_chain(&u->output, out);
+
+            if (rc == NGX_ERROR) {
+                return NGX_ERROR;
+            }
+
+            while (out) {
+                ln = out;
+                out = out->next;
+                ngx_free_chain(r->pool, ln);
+            }
+
+            if (rc == NGX_OK && !r->reading_body) {
+                break;
+            }
+        }
+
+        if (r->reading_body) {
+
+            /* read client request body */
+
+            rc = ngx_http_read_unbuffered_request_body(r);
+
+            if (rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+                return rc;
+            }
+
+            out = r->request_body->bufs;
+            r->request_body->bufs = NULL;
+        }
+
+        /* stop if there is nothing to send */
+
+        if (out == NULL) {
+            rc = NGX_AGAIN;
+            break;
+        }
+
+        do_write = 1;
+    }
+
+    if (!r->reading_body) {
+        if (!u->store && !r->post_action && !u->conf->ignore_client_abort) {
+            r->read_event_handler =
+                                  ngx_http_upstream_rd_check_broken_connection;
+        }
+    }
+
+    return rc;
+}
+
+
+// 与upstream连接的socket可写时候回调
+static void
+ngx_http_upstream_send_request_handler(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream send request handler");
+
+    if (c->write->timedout) { // 向upstream写超时
+        ngx_http_upstream_next(r, u, NGX_HTTP_UPSTREAM_FT_TIMEOUT);
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (u->ssl && c->ssl == NULL) {
+        ngx_http_upstream_ssl_init_connection(r, u, c);
+        return;
+    }
+
+#endif
+
+    if (u->header_sent) {
+        u->write_event_handler = ngx_http_upstream_dummy_handler;
+
+        (void) ngx_handle_write_event(c->write, 0);
+
+        return;
+    }
+
+    ngx_http_upstream_send_request(r, u, 1);
+}
+
+
+static void
+ngx_http_upstream_read_request_handler(ngx_http_request_t *r)
+{
+    ngx_connection_t     *c;
+    ngx_http_upstream_t  *u;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream read request handler");
+
+    if (c->read->timedout) {
+        c->timedout = 1;
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    ngx_http_upstream_send_request(r, u, 0);
+}
+
+
+// upstream返回响应可读之后，回调解析upstream的http头
+static void
+ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ssize_t            n;
+    ngx_int_t          rc;
+    ngx_connection_t  *c;
+
+    c = u->peer.connection;
 
     ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http upstream process header");
@@ -1596,6 +2884,17 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
         u->buffer.last += n; // 读取到n字节，调整last指针
 
+        if (u->hedging) {
+
+            /* the response has started, the other attempt is not needed */
+
+            if (u->hedging->event.timer_set) {
+                ngx_del_timer(&u->hedging->event);
+            }
+
+            ngx_http_upstream_hedge_close(r, u);
+        }
+
 #if 0
         u->valid_header_in = 0;
 
@@ -1634,6 +2933,11 @@ ngx_http_upstream_process_header(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     /* rc == NGX_OK */
 
+    if (u->hedging && u->conf->hedge->percentile) {
+        ngx_http_upstream_hedge_record(u->conf->hedge,
+                                       ngx_current_msec - u->hedging->start);
+    }
+
     if (u->headers_in.status_n > NGX_HTTP_SPECIAL_RESPONSE) {
 
         if (r->subrequest_in_memory) {
@@ -2100,6 +3404,11 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     u->header_sent = 1;
 
+    if (u->upgrade) {
+        ngx_http_upstream_upgrade(r, u);
+        return;
+    }
+
     if (r->request_body && r->request_body->temp_file) {
         ngx_pool_run_cleanup_file(r->pool, r->request_body->temp_file->file.fd);
         r->request_body->temp_file->file.fd = NGX_INVALID_FILE;
@@ -2107,6 +3416,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
 
     clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
 
+    if (u->collapse && !u->buffering) {
+        ngx_http_upstream_collapse_done(u->collapse->node, 1);
+    }
+
     if (!u->buffering) {
 
         if (u->input_filter == NULL) {
@@ -2230,7 +3543,10 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
             r->cache->date = now;
             r->cache->body_start = (u_short) (u->buffer.pos - u->buffer.start);
 
-            ngx_http_file_cache_set_header(r, u->buffer.start);
+            if (ngx_http_file_cache_set_header(r, u->buffer.start) != NGX_OK) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
 
         } else {
             u->cacheable = 0;
@@ -2275,6 +3591,26 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
     if (p->cacheable) {
         p->temp_file->persistent = 1;
 
+#if (NGX_HTTP_CACHE)
+
+        if (u->cacheable && !u->store) {
+
+            /*
+             * the response is written to an unnamed file in the cache
+             * directory and then linked in place, so no temporary file
+             * is left behind if the worker dies
+             */
+
+            p->temp_file->tmpfile_path = r->cache->file_cache->path;
+
+            if (u->headers_in.content_length_n > 0) {
+                p->temp_file->preallocate = r->cache->body_start
+                                           + u->headers_in.content_length_n;
+            }
+        }
+
+#endif
+
     } else {
         p->temp_file->log_level = NGX_LOG_WARN;
         p->temp_file->warn = "an upstream response is buffered "
@@ -2324,38 +3660,400 @@ ngx_http_upstream_send_response(ngx_http_request_t *r, ngx_http_upstream_t *u)
      */
     u->buffer.last = u->buffer.pos;
 
-    if (u->conf->cyclic_temp_file) {
+    if (u->conf->cyclic_temp_file) {
+
+        /*
+         * we need to disable the use of sendfile() if we use cyclic temp file
+         * because the writing a new data may interfere with sendfile()
+         * that uses the same kernel file pages (at least on FreeBSD)
+         */
+
+        p->cyclic_temp_file = 1;
+        c->sendfile = 0;
+
+    } else {
+        p->cyclic_temp_file = 0;
+    }
+
+    p->read_timeout = u->conf->read_timeout;
+    p->send_timeout = clcf->send_timeout;
+    p->send_lowat = clcf->send_lowat;
+
+    p->length = -1;
+
+    if (u->input_filter_init
+        && u->input_filter_init(p->input_ctx) != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    if (u->collapse) {
+        ngx_http_upstream_collapse_start(r, u);
+    }
+
+    u->read_event_handler = ngx_http_upstream_process_upstream;
+    r->write_event_handler = ngx_http_upstream_process_downstream;
+
+    ngx_http_upstream_process_upstream(r, u);
+}
+
+
+static void
+ngx_http_upstream_upgrade(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    int                        tcp_nodelay;
+    ngx_event_t               *ev;
+    ngx_connection_t          *c, *pc;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    pc = u->peer.connection;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    r->keepalive = 0;
+    c->log->action = "proxying upgraded connection";
+
+    u->read_event_handler = ngx_http_upstream_upgraded_read_upstream;
+    u->write_event_handler = ngx_http_upstream_upgraded_write_upstream;
+    r->read_event_handler = ngx_http_upstream_upgraded_read_downstream;
+    r->write_event_handler = ngx_http_upstream_upgraded_write_downstream;
+
+    if (clcf->tcp_nodelay) {
+        tcp_nodelay = 1;
+
+        if (c->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0, "tcp_nodelay");
+
+            if (setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(c, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            c->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+
+        if (pc->tcp_nodelay == NGX_TCP_NODELAY_UNSET) {
+            ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "tcp_nodelay");
+
+            if (setsockopt(pc->fd, IPPROTO_TCP, TCP_NODELAY,
+                           (const void *) &tcp_nodelay, sizeof(int)) == -1)
+            {
+                ngx_connection_error(pc, ngx_socket_errno,
+                                     "setsockopt(TCP_NODELAY) failed");
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            pc->tcp_nodelay = NGX_TCP_NODELAY_SET;
+        }
+    }
+
+    if (ngx_http_send_special(r, NGX_HTTP_FLUSH) == NGX_ERROR) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    /*
+     * the relay buffers are allocated on demand and are freed as soon as
+     * they are drained, so an idle upgraded connection holds no buffers;
+     * the response header buffer is not needed anymore too
+     */
+
+    if (u->buffer.pos == u->buffer.last) {
+        (void) ngx_pfree(r->pool, u->buffer.start);
+        ngx_memzero(&u->buffer, sizeof(ngx_buf_t));
+    }
+
+    /*
+     * the client side is processed from the posted event as the request
+     * may be finalized while the upstream side is processed
+     */
+
+    if (c->read->ready || r->header_in->pos != r->header_in->last) {
+        ev = c->read;
+        ngx_post_event(ev, &ngx_posted_events);
+    }
+
+    if (pc->read->ready || u->buffer.pos != u->buffer.last) {
+        ngx_http_upstream_process_upgraded(r, 1, 1);
+    }
+}
+
+
+static void
+ngx_http_upstream_upgraded_read_downstream(ngx_http_request_t *r)
+{
+    ngx_http_upstream_process_upgraded(r, 0, 0);
+}
+
+
+static void
+ngx_http_upstream_upgraded_write_downstream(ngx_http_request_t *r)
+{
+    ngx_http_upstream_process_upgraded(r, 1, 1);
+}
+
+
+static void
+ngx_http_upstream_upgraded_read_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_process_upgraded(r, 1, 0);
+}
+
+
+static void
+ngx_http_upstream_upgraded_write_upstream(ngx_http_request_t *r,
+    ngx_http_upstream_t *u)
+{
+    ngx_http_upstream_process_upgraded(r, 0, 1);
+}
+
+
+static void
+ngx_http_upstream_process_upgraded(ngx_http_request_t *r,
+    ngx_uint_t from_upstream, ngx_uint_t do_write)
+{
+    size_t                     size;
+    ssize_t                    n;
+    ngx_buf_t                 *b, *relay;
+    ngx_connection_t          *c, *downstream, *upstream, *dst, *src;
+    ngx_http_upstream_t       *u;
+    ngx_http_core_loc_conf_t  *clcf;
+
+    c = r->connection;
+    u = r->upstream;
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream process upgraded, fu:%ui", from_upstream);
+
+    downstream = c;
+    upstream = u->peer.connection;
+
+    if (downstream->write->timedout) {
+        c->timedout = 1;
+        ngx_connection_error(c, NGX_ETIMEDOUT, "client timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (upstream->read->timedout || upstream->write->timedout) {
+        ngx_connection_error(c, NGX_ETIMEDOUT, "upstream timed out");
+        ngx_http_upstream_finalize_request(r, u, NGX_HTTP_GATEWAY_TIME_OUT);
+        return;
+    }
+
+    /*
+     * the data read along with the response header and the data pipelined
+     * by the client after the request header are sent first, and only then
+     * the relay buffer is used
+     */
+
+    if (from_upstream) {
+        src = upstream;
+        dst = downstream;
+        b = &u->buffer;
+        relay = &u->from_upstream;
+
+    } else {
+        src = downstream;
+        dst = upstream;
+        b = r->header_in;
+        relay = &u->from_client;
+    }
+
+    if (b->pos == b->last) {
+        b = relay;
+
+    } else {
+        do_write = 1;
+    }
+
+    if (from_upstream && downstream->buffered) {
+
+        /* the response header is still buffered and goes first */
+
+        if (ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+            ngx_http_upstream_finalize_request(r, u, 0);
+            return;
+        }
+    }
+
+    for ( ;; ) {
+
+        if (do_write) {
+
+            size = b->last - b->pos;
+
+            if (size && dst->write->ready
+                && !(from_upstream && downstream->buffered))
+            {
+
+                n = dst->send(dst, b->pos, size);
+
+                if (n == NGX_ERROR) {
+                    ngx_http_upstream_finalize_request(r, u, 0);
+                    return;
+                }
+
+                if (n > 0) {
+                    b->pos += n;
+                }
+            }
+
+            if (b->pos == b->last && b != relay) {
+
+                if (b == &u->buffer) {
+                    (void) ngx_pfree(r->pool, b->start);
+                    ngx_memzero(b, sizeof(ngx_buf_t));
+                }
+
+                b = relay;
+            }
+
+            if (b->pos == b->last) {
+                b->pos = b->start;
+                b->last = b->start;
+            }
+        }
+
+        if (b != relay || !src->read->ready) {
+            break;
+        }
+
+        if (b->start == NULL) {
+            b->start = ngx_alloc(u->conf->buffer_size, c->log);
+            if (b->start == NULL) {
+                ngx_http_upstream_finalize_request(r, u, 0);
+                return;
+            }
+
+            b->pos = b->start;
+            b->last = b->start;
+            b->end = b->start + u->conf->buffer_size;
+            b->temporary = 1;
+            b->tag = u->output.tag;
+        }
+
+        size = b->end - b->last;
+
+        if (size == 0) {
+            break;
+        }
+
+        n = src->recv(src, b->last, size);
+
+        if (n == NGX_AGAIN || n == 0) {
+            break;
+        }
+
+        if (n > 0) {
+            if (from_upstream) {
+                u->state->response_length += n;
+            }
+
+            do_write = 1;
+            b->last += n;
+
+            continue;
+        }
+
+        if (n == NGX_ERROR) {
+            src->read->eof = 1;
+        }
+
+        break;
+    }
+
+    if (relay->start && relay->pos == relay->last) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream upgraded free: %p", relay->start);
+
+        ngx_free(relay->start);
+        ngx_memzero(relay, sizeof(ngx_buf_t));
+    }
+
+    if ((upstream->read->eof
+         && u->buffer.pos == u->buffer.last
+         && u->from_upstream.pos == u->from_upstream.last)
+        || (downstream->read->eof
+            && r->header_in->pos == r->header_in->last
+            && u->from_client.pos == u->from_client.last)
+        || (downstream->read->eof && upstream->read->eof))
+    {
+        ngx_log_debug0(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                       "http upstream upgraded done");
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (ngx_handle_write_event(upstream->write, u->conf->send_lowat)
+        != NGX_OK)
+    {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-        /*
-         * we need to disable the use of sendfile() if we use cyclic temp file
-         * because the writing a new data may interfere with sendfile()
-         * that uses the same kernel file pages (at least on FreeBSD)
-         */
+    if (upstream->write->active && !upstream->write->ready) {
+        ngx_add_timer(upstream->write, u->conf->send_timeout);
 
-        p->cyclic_temp_file = 1;
-        c->sendfile = 0;
+    } else if (upstream->write->timer_set) {
+        ngx_del_timer(upstream->write);
+    }
 
-    } else {
-        p->cyclic_temp_file = 0;
+    if (ngx_handle_read_event(upstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
     }
 
-    p->read_timeout = u->conf->read_timeout;
-    p->send_timeout = clcf->send_timeout;
-    p->send_lowat = clcf->send_lowat;
+    if (upstream->read->active && !upstream->read->ready) {
+        ngx_add_timer(upstream->read, u->conf->read_timeout);
 
-    p->length = -1;
+    } else if (upstream->read->timer_set) {
+        ngx_del_timer(upstream->read);
+    }
 
-    if (u->input_filter_init
-        && u->input_filter_init(p->input_ctx) != NGX_OK)
+    if (ngx_handle_write_event(downstream->write, clcf->send_lowat)
+        != NGX_OK)
     {
         ngx_http_upstream_finalize_request(r, u, 0);
         return;
     }
 
-    u->read_event_handler = ngx_http_upstream_process_upstream;
-    r->write_event_handler = ngx_http_upstream_process_downstream;
+    if (ngx_handle_read_event(downstream->read, 0) != NGX_OK) {
+        ngx_http_upstream_finalize_request(r, u, 0);
+        return;
+    }
 
-    ngx_http_upstream_process_upstream(r, u);
+    if (downstream->write->active && !downstream->write->ready) {
+        ngx_add_timer(downstream->write, clcf->send_timeout);
+
+    } else if (downstream->write->timer_set) {
+        ngx_del_timer(downstream->write);
+    }
+}
+
+
+static void
+ngx_http_upstream_upgraded_free(ngx_http_upstream_t *u)
+{
+    if (u->from_upstream.start) {
+        ngx_free(u->from_upstream.start);
+        ngx_memzero(&u->from_upstream, sizeof(ngx_buf_t));
+    }
+
+    if (u->from_client.start) {
+        ngx_free(u->from_client.start);
+        ngx_memzero(&u->from_client, sizeof(ngx_buf_t));
+    }
 }
 
 
@@ -2738,7 +4436,10 @@ ngx_http_upstream_process_request(ngx_http_request_t *r)
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
                        "http upstream downstream error");
 
-        if (!u->cacheable && !u->store && u->peer.connection) {
+        if (!u->cacheable && !u->store
+            && !ngx_http_upstream_collapse_busy(u)
+            && u->peer.connection)
+        {
             ngx_http_upstream_finalize_request(r, u, 0);
         }
     }
@@ -2818,15 +4519,364 @@ ngx_http_upstream_store(ngx_http_request_t *r, ngx_http_upstream_t *u)
                    "upstream stores \"%s\" to \"%s\"",
                    tf->file.name.data, path.data);
 
-    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
-}
+    (void) ngx_ext_rename_file(&tf->file.name, &path, &ext);
+}
+
+
+static void
+ngx_http_upstream_dummy_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream dummy handler");
+}
+
+
+static void
+ngx_http_upstream_hedge_init(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_uint_t                  i, n, target;
+    ngx_msec_t                  delay;
+    ngx_http_upstream_hedge_t  *hedge;
+
+    if (u->hedging == NULL) {
+        u->hedging = ngx_pcalloc(r->pool, sizeof(ngx_http_upstream_hedging_t));
+        if (u->hedging == NULL) {
+            return;
+        }
+
+        u->hedging->event.handler = ngx_http_upstream_hedge_handler;
+        u->hedging->event.data = r;
+        u->hedging->event.log = r->connection->log;
+    }
+
+    u->hedging->start = ngx_current_msec;
+
+    hedge = u->conf->hedge;
+
+    if (hedge->percentile == 0) {
+        delay = hedge->after;
+
+    } else {
+
+        /* too few samples yet */
+
+        if (hedge->total < 100) {
+            return;
+        }
+
+        target = (hedge->total * hedge->percentile + 99) / 100;
+
+        n = 0;
+
+        for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1; i++) {
+            n += hedge->counts[i];
+
+            if (n >= target) {
+                break;
+            }
+        }
+
+        delay = ngx_http_upstream_hedge_bound(i);
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http upstream hedge after %M", delay);
+
+    ngx_add_timer(&u->hedging->event, delay);
+}
+
+
+static void
+ngx_http_upstream_hedge_handler(ngx_event_t *ev)
+{
+    ngx_connection_t             *c;
+    ngx_http_request_t           *r;
+    ngx_http_log_ctx_t           *ctx;
+    ngx_int_t                     rc;
+    ngx_http_upstream_t          *u;
+    ngx_http_upstream_hedging_t  *h;
+
+    r = ev->data;
+    u = r->upstream;
+    c = r->connection;
+    h = u->hedging;
+
+    ctx = c->log->data;
+    ctx->current_request = r;
+
+    /* the response header has not started yet */
+
+    if (u->peer.connection == NULL
+        || u->read_event_handler != ngx_http_upstream_process_header
+        || u->buffer.last != u->buffer.pos)
+    {
+        return;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
+                   "http upstream hedge request, no response from %V",
+                   u->peer.name);
+
+    u->hedged = 1;
+
+    /*
+     * the first attempt is moved aside together with its balancer state
+     * and waits for its response, while the request is sent to a peer
+     * chosen by a new balancer state; each peer is freed with its own
+     * state when its attempt ends
+     */
+
+    h->peer = u->peer;
+    h->state = u->state
+               - (ngx_http_upstream_state_t *) r->upstream_states->elts;
+    h->response_sec = u->state->response_sec;
+    h->response_msec = u->state->response_msec;
+
+    u->peer.connection = NULL;
+    u->peer.data = NULL;
+
+    if (u->upstream) {
+        rc = u->upstream->peer.init(r, u->upstream);
+
+    } else {
+        rc = ngx_http_upstream_create_round_robin_peer(r, u->resolved);
+    }
+
+    if (rc != NGX_OK) {
+        u->peer = h->peer;
+        h->peer.connection = NULL;
+        return;
+    }
+
+    h->peer.connection->read->handler = ngx_http_upstream_hedge_peer_handler;
+    h->peer.connection->write->handler = ngx_http_upstream_hedge_peer_handler;
+
+    ngx_http_upstream_connect(r, u);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_upstream_hedge_peer_handler(ngx_event_t *ev)
+{
+    char                  buf[1];
+    ssize_t               n;
+    ngx_err_t             err;
+    ngx_connection_t     *c, *rc;
+    ngx_http_request_t   *r;
+    ngx_http_log_ctx_t   *ctx;
+    ngx_http_upstream_t  *u;
+
+    c = ev->data;
+    r = c->data;
+
+    u = r->upstream;
+    rc = r->connection;
+
+    ctx = rc->log->data;
+    ctx->current_request = r;
+
+    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http upstream hedge peer handler");
+
+    if (ev->write) {
+        (void) ngx_handle_write_event(ev, 0);
+        return;
+    }
+
+    if (ev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, ev->log, NGX_ETIMEDOUT,
+                      "hedged upstream %V timed out", u->hedging->peer.name);
+        goto close;
+    }
+
+    n = recv(c->fd, buf, 1, MSG_PEEK);
+
+    err = ngx_socket_errno;
+
+    if (n == -1 && err == NGX_EAGAIN) {
+        if (ngx_handle_read_event(ev, 0) != NGX_OK) {
+            goto close;
+        }
+
+        return;
+    }
+
+    if (n <= 0) {
+        ngx_log_error(NGX_LOG_INFO, ev->log, n == 0 ? 0 : err,
+                      "hedged upstream %V closed connection",
+                      u->hedging->peer.name);
+        goto close;
+    }
+
+    /* the first attempt has responded earlier, the hedged one is closed */
+
+    u->peer.free(&u->peer, u->peer.data, 0);
+
+    ngx_http_upstream_hedge_switch(r, u);
+
+    ngx_http_upstream_process_header(r, u);
+
+    ngx_http_run_posted_requests(rc);
+
+    return;
+
+close:
+
+    ngx_http_upstream_hedge_close(r, u);
+}
+
+
+static void
+ngx_http_upstream_hedge_switch(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_time_t                   *tp;
+    ngx_connection_t             *c;
+    ngx_http_upstream_hedging_t  *h;
+
+    /*
+     * the current attempt has been already freed by the caller,
+     * its connection is closed unless the balancer has kept it
+     */
+
+    h = u->hedging;
+    c = u->peer.connection;
+
+    if (c) {
+
+#if (NGX_HTTP_SSL)
+
+        if (c->ssl) {
+            c->ssl->no_wait_shutdown = 1;
+            (void) ngx_ssl_shutdown(c);
+        }
+#endif
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "close hedged http upstream connection: %d", c->fd);
+
+        if (c->pool) {
+            ngx_destroy_pool(c->pool);
+        }
+
+        ngx_close_connection(c);
+    }
+
+    tp = ngx_timeofday();
+    u->state->response_sec = tp->sec - u->state->response_sec;
+    u->state->response_msec = tp->msec - u->state->response_msec;
+
+    u->state = (ngx_http_upstream_state_t *) r->upstream_states->elts
+               + h->state;
+    u->state->response_sec = h->response_sec;
+    u->state->response_msec = h->response_msec;
+
+    u->peer = h->peer;
+
+    h->peer.connection = NULL;
+
+    c = u->peer.connection;
+
+    c->read->handler = ngx_http_upstream_handler;
+    c->write->handler = ngx_http_upstream_handler;
+
+    u->writer.connection = c;
+    u->request_sent = 1;
+
+    u->read_event_handler = ngx_http_upstream_process_header;
+    u->write_event_handler = ngx_http_upstream_dummy_handler;
+}
+
+
+static void
+ngx_http_upstream_hedge_close(ngx_http_request_t *r, ngx_http_upstream_t *u)
+{
+    ngx_time_t                   *tp;
+    ngx_connection_t             *c;
+    ngx_http_upstream_state_t    *state;
+    ngx_http_upstream_hedging_t  *h;
+
+    h = u->hedging;
+
+    if (h->peer.connection == NULL) {
+        return;
+    }
+
+    state = (ngx_http_upstream_state_t *) r->upstream_states->elts + h->state;
+
+    tp = ngx_timeofday();
+    state->response_sec = tp->sec - h->response_sec;
+    state->response_msec = tp->msec - h->response_msec;
+
+    h->peer.free(&h->peer, h->peer.data, 0);
+
+    c = h->peer.connection;
+
+    if (c == NULL) {
+        return;
+    }
+
+#if (NGX_HTTP_SSL)
+
+    if (c->ssl) {
+        c->ssl->no_wait_shutdown = 1;
+        (void) ngx_ssl_shutdown(c);
+    }
+#endif
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "close hedged http upstream connection: %d", c->fd);
+
+    if (c->pool) {
+        ngx_destroy_pool(c->pool);
+    }
+
+    ngx_close_connection(c);
+
+    h->peer.connection = NULL;
+}
+
+
+static ngx_msec_t
+ngx_http_upstream_hedge_bound(ngx_uint_t i)
+{
+    /* 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20, 24, ... milliseconds */
+
+    if (i < 4) {
+        return i + 1;
+    }
+
+    return (ngx_msec_t) (5 + i % 4) << (i / 4 - 1);
+}
+
+
+static void
+ngx_http_upstream_hedge_record(ngx_http_upstream_hedge_t *hedge,
+    ngx_msec_t ms)
+{
+    ngx_uint_t  i;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS - 1; i++) {
+        if (ms <= ngx_http_upstream_hedge_bound(i)) {
+            break;
+        }
+    }
+
+    hedge->counts[i]++;
+
+    if (++hedge->total < 1024) {
+        return;
+    }
 
+    /* older samples decay */
 
-static void
-ngx_http_upstream_dummy_handler(ngx_http_request_t *r, ngx_http_upstream_t *u)
-{
-    ngx_log_debug0(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http upstream dummy handler");
+    hedge->total = 0;
+
+    for (i = 0; i < NGX_HTTP_UPSTREAM_HEDGE_BUCKETS; i++) {
+        hedge->counts[i] /= 2;
+        hedge->total += hedge->counts[i];
+    }
 }
 
 
@@ -2853,12 +4903,36 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
         u->peer.free(&u->peer, u->peer.data, state);
     }
 
+    if (u->hedging) {
+
+        if (u->hedging->event.timer_set) {
+            ngx_del_timer(&u->hedging->event);
+        }
+
+        if (u->hedging->peer.connection) {
+
+            /*
+             * the hedged attempt has failed, but the first one
+             * is still in progress, so it is awaited instead
+             */
+
+            ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                          "hedged upstream request failed, waiting for %V",
+                          u->hedging->peer.name);
+
+            ngx_http_upstream_hedge_switch(r, u);
+            return;
+        }
+    }
+
     if (ft_type == NGX_HTTP_UPSTREAM_FT_TIMEOUT) {
         ngx_log_error(NGX_LOG_ERR, r->connection->log, NGX_ETIMEDOUT,
                       "upstream timed out");
     }
 
-    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR) {
+    if (u->peer.cached && ft_type == NGX_HTTP_UPSTREAM_FT_ERROR
+        && !(u->request_sent && r->request_body_no_buffering))
+    {
         status = 0;
 
         /* TODO: inform balancer instead */
@@ -2899,7 +4973,10 @@ ngx_http_upstream_next(ngx_http_request_t *r, ngx_http_upstream_t *u,
     if (status) {
         u->state->status = status;
 
-        if (u->peer.tries == 0 || !(u->conf->next_upstream & ft_type)) {
+        if (u->peer.tries == 0
+            || !(u->conf->next_upstream & ft_type)
+            || (u->request_sent && r->request_body_no_buffering))
+        {
 
 #if (NGX_HTTP_CACHE)
 
@@ -2998,6 +5075,26 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
         u->resolved->ctx = NULL;
     }
 
+    if (u->hedging) {
+        if (u->hedging->event.timer_set) {
+            ngx_del_timer(&u->hedging->event);
+        }
+
+        ngx_http_upstream_hedge_close(r, u);
+    }
+
+    if (u->queued) {
+        ngx_http_upstream_queue_remove(u);
+    }
+
+    if (u->collapse) {
+        ngx_http_upstream_collapse_finalize(r, u);
+    }
+
+    if (u->upgrade) {
+        ngx_http_upstream_upgraded_free(u);
+    }
+
     if (u->state && u->state->response_sec) {
         tp = ngx_timeofday();
         u->state->response_sec = tp->sec - u->state->response_sec;
@@ -3014,6 +5111,10 @@ ngx_http_upstream_finalize_request(ngx_http_request_t *r,
         u->peer.free(&u->peer, u->peer.data, 0);
     }
 
+    if (u->upstream && u->upstream->queue_len) {
+        ngx_http_upstream_queue_wake(u->upstream);
+    }
+
     if (u->peer.connection) {
 
 #if (NGX_HTTP_SSL)
@@ -3433,6 +5534,89 @@ ngx_http_upstream_process_charset(ngx_http_request_t *r, ngx_table_elt_t *h,
 }
 
 
+static ngx_int_t
+ngx_http_upstream_process_vary(ngx_http_request_t *r, ngx_table_elt_t *h,
+    ngx_uint_t offset)
+{
+    ngx_http_upstream_t  *u;
+#if (NGX_HTTP_CACHE)
+    size_t                len;
+    u_char               *p, *last, *start;
+    ngx_str_t            *vary;
+#endif
+
+    u = r->upstream;
+    u->headers_in.vary = h;
+
+#if (NGX_HTTP_CACHE)
+
+    if (u->conf->ignore_headers & NGX_HTTP_UPSTREAM_IGN_VARY) {
+        return NGX_OK;
+    }
+
+    if (r->cache == NULL) {
+        return NGX_OK;
+    }
+
+    vary = &r->cache->vary;
+
+    if (vary->len) {
+
+        /* the values of several "Vary" header lines are joined */
+
+        len = vary->len + sizeof(", ") - 1 + h->value.len;
+
+        p = ngx_pnalloc(r->pool, len);
+        if (p == NULL) {
+            return NGX_ERROR;
+        }
+
+        start = ngx_cpymem(p, vary->data, vary->len);
+        *start++ = ',';
+        *start++ = ' ';
+        ngx_memcpy(start, h->value.data, h->value.len);
+
+        vary->data = p;
+        vary->len = len;
+
+    } else {
+        *vary = h->value;
+    }
+
+    if (vary->len > NGX_HTTP_CACHE_VARY_LEN) {
+        u->cacheable = 0;
+        return NGX_OK;
+    }
+
+    /* a response with "Vary: *" cannot be selected from the cache */
+
+    p = vary->data;
+    last = p + vary->len;
+
+    while (p < last) {
+
+        while (p < last && (*p == ',' || *p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        start = p;
+
+        while (p < last && *p != ',' && *p != ' ' && *p != '\t') {
+            p++;
+        }
+
+        if (p - start == 1 && *start == '*') {
+            u->cacheable = 0;
+            break;
+        }
+    }
+
+#endif
+
+    return NGX_OK;
+}
+
+
 static ngx_int_t
 ngx_http_upstream_process_connection(ngx_http_request_t *r, ngx_table_elt_t *h,
     ngx_uint_t offset)
@@ -4129,7 +6313,8 @@ ngx_http_upstream(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy)
                                          |NGX_HTTP_UPSTREAM_MAX_FAILS
                                          |NGX_HTTP_UPSTREAM_FAIL_TIMEOUT
                                          |NGX_HTTP_UPSTREAM_DOWN
-                                         |NGX_HTTP_UPSTREAM_BACKUP);
+                                         |NGX_HTTP_UPSTREAM_BACKUP
+                                         |NGX_HTTP_UPSTREAM_MAX_CONNS);
     if (uscf == NULL) {
         return NGX_CONF_ERROR;
     }
@@ -4218,10 +6403,11 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
     ngx_http_upstream_srv_conf_t  *uscf = conf;
 
+    u_char                      *p;
     time_t                       fail_timeout;
-    ngx_str_t                   *value, s;
+    ngx_str_t                   *value, s, service;
     ngx_url_t                    u;
-    ngx_int_t                    weight, max_fails;
+    ngx_int_t                    weight, max_fails, max_conns;
     ngx_uint_t                   i;
     ngx_http_upstream_server_t  *us;
 
@@ -4259,6 +6445,8 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     weight = 1;
     max_fails = 1;
     fail_timeout = 10;
+    max_conns = 0;
+    ngx_str_null(&service);
 
     for (i = 2; i < cf->args->nelts; i++) {
 
@@ -4292,6 +6480,21 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strncmp(value[i].data, "max_conns=", 10) == 0) {
+
+            if (!(uscf->flags & NGX_HTTP_UPSTREAM_MAX_CONNS)) {
+                goto invalid;
+            }
+
+            max_conns = ngx_atoi(&value[i].data[10], value[i].len - 10);
+
+            if (max_conns == NGX_ERROR) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         if (ngx_strncmp(value[i].data, "fail_timeout=", 13) == 0) {
 
             if (!(uscf->flags & NGX_HTTP_UPSTREAM_FAIL_TIMEOUT)) {
@@ -4332,14 +6535,198 @@ ngx_http_upstream_server(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
             continue;
         }
 
+        if (ngx_strcmp(value[i].data, "resolve") == 0) {
+
+            /* addresses and unix sockets are never re-resolved */
+
+            if (u.family == AF_INET
+                && ngx_inet_addr(u.host.data, u.host.len) == INADDR_NONE)
+            {
+                us->resolve = 1;
+                us->host = u.host;
+                us->port = u.port;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "service=", 8) == 0) {
+
+            service.len = value[i].len - 8;
+            service.data = &value[i].data[8];
+
+            if (service.len == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
         goto invalid;
     }
 
+    if (service.len) {
+
+        if (!us->resolve) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "service upstream \"%V\" requires "
+                               "the \"resolve\" parameter and a name",
+                               &u.url);
+            return NGX_CONF_ERROR;
+        }
+
+        /* "service=http" is looked up as "_http._tcp.host" */
+
+        us->service.len = service.len + 1 + u.host.len;
+
+        if (service.data[0] != '_') {
+            us->service.len += sizeof("_._tcp") - 1;
+        }
+
+        us->service.data = ngx_pnalloc(cf->pool, us->service.len);
+        if (us->service.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        p = us->service.data;
+
+        if (service.data[0] != '_') {
+            *p++ = '_';
+            p = ngx_cpymem(p, service.data, service.len);
+            p = ngx_cpymem(p, "._tcp", sizeof("._tcp") - 1);
+
+        } else {
+            p = ngx_cpymem(p, service.data, service.len);
+        }
+
+        *p++ = '.';
+        ngx_memcpy(p, u.host.data, u.host.len);
+    }
+
     us->addrs = u.addrs;
     us->naddrs = u.naddrs;
     us->weight = weight;
     us->max_fails = max_fails;
     us->fail_timeout = fail_timeout;
+    us->max_conns = max_conns;
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+
+    return NGX_CONF_ERROR;
+}
+
+
+static char *
+ngx_http_upstream_queue(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t    n;
+    ngx_str_t   *value, s;
+    ngx_msec_t   timeout;
+
+    if (uscf->queue_max) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid queue size \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    timeout = 60000;
+
+    if (cf->args->nelts == 3) {
+
+        if (ngx_strncmp(value[2].data, "timeout=", 8) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.len = value[2].len - 8;
+        s.data = value[2].data + 8;
+
+        timeout = ngx_parse_time(&s, 0);
+
+        if (timeout == (ngx_msec_t) NGX_ERROR || timeout == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid timeout \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    uscf->queue_max = n;
+    uscf->queue_timeout = timeout;
+
+    ngx_queue_init(&uscf->queue);
+
+    uscf->queue_event.handler = ngx_http_upstream_queue_poll_handler;
+    uscf->queue_event.data = uscf;
+    uscf->queue_event.log = &cf->cycle->new_log;
+
+    return NGX_CONF_OK;
+}
+
+
+static char *
+ngx_http_upstream_adaptive_conns(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    ngx_http_upstream_srv_conf_t  *uscf = conf;
+
+    ngx_int_t    min, tolerance;
+    ngx_str_t   *value;
+    ngx_uint_t   i;
+
+    if (uscf->adaptive_min) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    min = 1;
+    tolerance = 2;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "min=", 4) == 0) {
+
+            min = ngx_atoi(value[i].data + 4, value[i].len - 4);
+
+            if (min == NGX_ERROR || min == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "tolerance=", 10) == 0) {
+
+            tolerance = ngx_atoi(value[i].data + 10, value[i].len - 10);
+
+            if (tolerance == NGX_ERROR || tolerance == 0) {
+                goto invalid;
+            }
+
+            continue;
+        }
+
+        goto invalid;
+    }
+
+    uscf->adaptive_min = min;
+    uscf->adaptive_tolerance = tolerance;
 
     return NGX_CONF_OK;
 
@@ -4549,6 +6936,64 @@ ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
 }
 
 
+char *
+ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf)
+{
+    char  *p = conf;
+
+    ngx_int_t                    n;
+    ngx_str_t                   *value;
+    ngx_http_upstream_hedge_t  **hedge;
+
+    hedge = (ngx_http_upstream_hedge_t **) (p + cmd->offset);
+
+    if (*hedge != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        *hedge = NULL;
+        return NGX_CONF_OK;
+    }
+
+    *hedge = ngx_pcalloc(cf->pool, sizeof(ngx_http_upstream_hedge_t));
+    if (*hedge == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (value[1].len > 1 && value[1].data[value[1].len - 1] == '%') {
+
+        n = ngx_atoi(value[1].data, value[1].len - 1);
+
+        if (n == NGX_ERROR || n == 0 || n > 99) {
+            goto invalid;
+        }
+
+        (*hedge)->percentile = n;
+
+        return NGX_CONF_OK;
+    }
+
+    (*hedge)->after = ngx_parse_time(&value[1], 0);
+
+    if ((*hedge)->after == (ngx_msec_t) NGX_ERROR || (*hedge)->after == 0) {
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid value \"%V\"", &value[1]);
+
+    return NGX_CONF_ERROR;
+}
+
+
 ngx_int_t
 ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
@@ -4678,6 +7123,9 @@ ngx_http_upstream_create_main_conf(ngx_conf_t *cf)
         return NULL;
     }
 
+    ngx_rbtree_init(&umcf->collapse, &umcf->collapse_sentinel,
+                    ngx_str_rbtree_insert_value);
+
     return umcf;
 }
 
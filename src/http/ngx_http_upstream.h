@@ -48,6 +48,10 @@
 #define NGX_HTTP_UPSTREAM_IGN_XA_LIMIT_RATE  0x00000040
 #define NGX_HTTP_UPSTREAM_IGN_XA_BUFFERING   0x00000080
 #define NGX_HTTP_UPSTREAM_IGN_XA_CHARSET     0x00000100
+#define NGX_HTTP_UPSTREAM_IGN_VARY           0x00000200
+
+
+#define NGX_HTTP_UPSTREAM_HEDGE_BUCKETS      64
 
 
 typedef struct {
@@ -63,10 +67,29 @@ typedef struct {
 } ngx_http_upstream_state_t;
 
 
+typedef struct {
+    ngx_msec_t                       after;
+    ngx_uint_t                       percentile;
+
+    /* response header times, local to a process */
+    ngx_uint_t                       total;
+    ngx_uint_t                       counts[NGX_HTTP_UPSTREAM_HEDGE_BUCKETS];
+} ngx_http_upstream_hedge_t;
+
+
+typedef struct ngx_http_upstream_hedging_s  ngx_http_upstream_hedging_t;
+typedef struct ngx_http_upstream_queued_s  ngx_http_upstream_queued_t;
+typedef struct ngx_http_upstream_collapse_s  ngx_http_upstream_collapse_t;
+
+
 typedef struct {
     ngx_hash_t                       headers_in_hash; //ngx_http_upstream_headers_in hash表
     ngx_array_t                      upstreams; // ngx_http_upstream_srv_conf_t 数组，保存配置文件中解析到的upstream
                                              /* ngx_http_upstream_srv_conf_t */
+
+    /* requests being collapsed, local to a process */
+    ngx_rbtree_t                     collapse;
+    ngx_rbtree_node_t                collapse_sentinel;
 } ngx_http_upstream_main_conf_t;
 
 typedef struct ngx_http_upstream_srv_conf_s  ngx_http_upstream_srv_conf_t;
@@ -90,9 +113,15 @@ typedef struct {
     ngx_uint_t                       weight;
     ngx_uint_t                       max_fails;
     time_t                           fail_timeout;
+    ngx_uint_t                       max_conns;
+
+    ngx_str_t                        host; // resolve参数，运行时重新解析
+    in_port_t                        port;
+    ngx_str_t                        service; // SRV记录的查询名
 
     unsigned                         down:1;
     unsigned                         backup:1;
+    unsigned                         resolve:1;
 } ngx_http_upstream_server_t;
 
 
@@ -102,6 +131,7 @@ typedef struct {
 #define NGX_HTTP_UPSTREAM_FAIL_TIMEOUT  0x0008
 #define NGX_HTTP_UPSTREAM_DOWN          0x0010
 #define NGX_HTTP_UPSTREAM_BACKUP        0x0020
+#define NGX_HTTP_UPSTREAM_MAX_CONNS     0x0100
 
 
 struct ngx_http_upstream_srv_conf_s {
@@ -117,6 +147,19 @@ struct ngx_http_upstream_srv_conf_s {
     ngx_uint_t                       line;
     in_port_t                        port;
     in_port_t                        default_port;
+
+    ngx_shm_zone_t                  *shm_zone;
+
+    ngx_uint_t                       adaptive_min; // adaptive_conns, 0 - off
+    ngx_uint_t                       adaptive_tolerance;
+
+    ngx_uint_t                       queue_max; // queue指令，0 - 不排队
+    ngx_msec_t                       queue_timeout;
+
+    /* requests waiting for a peer, local to a process */
+    ngx_queue_t                      queue;
+    ngx_uint_t                       queue_len;
+    ngx_event_t                      queue_event;
 };
 
 
@@ -145,6 +188,7 @@ typedef struct {
     ngx_uint_t                       next_upstream;
     ngx_uint_t                       store_access;
     ngx_flag_t                       buffering;
+    ngx_flag_t                       request_buffering;
     ngx_flag_t                       pass_request_headers; // 是否传递客户端的http头
     ngx_flag_t                       pass_request_body; // 是否传递body给upstream
 
@@ -177,6 +221,13 @@ typedef struct {
     ngx_array_t                     *store_lengths;
     ngx_array_t                     *store_values;
 
+    ngx_http_upstream_hedge_t       *hedge;
+
+    ngx_array_t                     *collapse_lengths;
+    ngx_array_t                     *collapse_values;
+    ngx_msec_t                       collapse_timeout;
+    size_t                           collapse_max_size;
+
     signed                           store:2;
     unsigned                         intercept_404:1;
     unsigned                         change_buffering:1;
@@ -225,6 +276,7 @@ typedef struct {
     ngx_table_elt_t                 *accept_ranges;
     ngx_table_elt_t                 *www_authenticate;
     ngx_table_elt_t                 *transfer_encoding;
+    ngx_table_elt_t                 *vary;
 
 #if (NGX_HTTP_GZIP)
     ngx_table_elt_t                 *content_encoding;
@@ -281,6 +333,9 @@ struct ngx_http_upstream_s {
     ngx_buf_t                        buffer; // upstream返回的数据缓存
     off_t                            length; // upstream返回http头部的Length
 
+    ngx_buf_t                        from_client;
+    ngx_buf_t                        from_upstream;
+
     ngx_chain_t                     *out_bufs; // 需要输出的buf，会先链接到busy_bufs尾部，由buffer得到
     ngx_chain_t                     *busy_bufs; // 即将要写到socket的内存块
     ngx_chain_t                     *free_bufs; // 空闲buf块链表
@@ -314,6 +369,12 @@ struct ngx_http_upstream_s {
 
     ngx_http_cleanup_pt             *cleanup;
 
+    ngx_http_upstream_hedging_t     *hedging;
+
+    ngx_http_upstream_srv_conf_t    *upstream;
+    ngx_http_upstream_queued_t      *queued;
+    ngx_http_upstream_collapse_t    *collapse;
+
     unsigned                         store:1;
     unsigned                         cacheable:1;
     unsigned                         accel:1;
@@ -326,7 +387,11 @@ struct ngx_http_upstream_s {
     unsigned                         keepalive:1;
 
     unsigned                         request_sent:1; // 是否已经开始向upstream发送数据
+    unsigned                         request_body_sent:1;
     unsigned                         header_sent:1;
+    unsigned                         hedged:1;
+    unsigned                         collapsed:1;
+    unsigned                         upgrade:1;
 };
 
 
@@ -354,6 +419,8 @@ char *ngx_http_upstream_bind_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
 char *ngx_http_upstream_param_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
     void *conf);
+char *ngx_http_upstream_hedge_set_slot(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
 ngx_int_t ngx_http_upstream_hide_headers_hash(ngx_conf_t *cf,
     ngx_http_upstream_conf_t *conf, ngx_http_upstream_conf_t *prev,
     ngx_str_t *default_hide_headers, ngx_hash_init_t *hash);
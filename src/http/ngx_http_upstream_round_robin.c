@@ -14,6 +14,8 @@ static ngx_int_t ngx_http_upstream_cmp_servers(const void *one,
     const void *two);
 static ngx_http_upstream_rr_peer_t *ngx_http_upstream_get_peer(
     ngx_http_upstream_rr_peer_data_t *rrp);
+static void ngx_http_upstream_adapt_conns(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t rtt, ngx_uint_t failed);
 
 #if (NGX_HTTP_SSL)
 
@@ -45,6 +47,16 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         w = 0;
 
         for (i = 0; i < us->servers->nelts; i++) {
+
+            if (server[i].resolve && us->shm_zone == NULL) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "resolving names at run time requires "
+                              "upstream \"%V\" in %s:%ui "
+                              "to be in shared memory",
+                              &us->host, us->file_name, us->line);
+                return NGX_ERROR;
+            }
+
             if (server[i].backup) {
                 continue;
             }
@@ -68,9 +80,12 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
         peers->single = (n == 1);
         peers->number = n;
+        peers->capacity = n;
         peers->weighted = (w != n);
         peers->total_weight = w;
         peers->name = &us->host;
+        peers->adaptive_min = us->adaptive_min;
+        peers->adaptive_tolerance = us->adaptive_tolerance;
 
         n = 0;
 
@@ -85,7 +100,10 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 peers->peer[n].name = server[i].addrs[j].name;
                 peers->peer[n].max_fails = server[i].max_fails;
                 peers->peer[n].fail_timeout = server[i].fail_timeout;
+                peers->peer[n].max_conns = server[i].max_conns;
+                peers->peer[n].conns_limit = server[i].max_conns;
                 peers->peer[n].down = server[i].down;
+                peers->peer[n].server = &server[i];
                 peers->peer[n].weight = server[i].weight;
                 peers->peer[n].effective_weight = server[i].weight;
                 peers->peer[n].current_weight = 0;
@@ -126,9 +144,12 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
         peers->single = 0;
         backup->single = 0;
         backup->number = n;
+        backup->capacity = n;
         backup->weighted = (w != n);
         backup->total_weight = w;
         backup->name = &us->host;
+        backup->adaptive_min = us->adaptive_min;
+        backup->adaptive_tolerance = us->adaptive_tolerance;
 
         n = 0;
 
@@ -146,7 +167,10 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
                 backup->peer[n].current_weight = 0;
                 backup->peer[n].max_fails = server[i].max_fails;
                 backup->peer[n].fail_timeout = server[i].fail_timeout;
+                backup->peer[n].max_conns = server[i].max_conns;
+                backup->peer[n].conns_limit = server[i].max_conns;
                 backup->peer[n].down = server[i].down;
+                backup->peer[n].server = &server[i];
                 n++;
             }
         }
@@ -196,6 +220,7 @@ ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
 
     peers->single = (n == 1);
     peers->number = n;
+    peers->capacity = n;
     peers->weighted = 0;
     peers->total_weight = n;
     peers->name = &us->host;
@@ -255,11 +280,15 @@ ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
 
     rrp->peers = us->peer.data;
     rrp->current = 0;
+    rrp->counted = 0;
+    rrp->saturated = 0;
+
+    /* servers may be added at runtime to peers in a shared zone */
 
-    n = rrp->peers->number;
+    n = rrp->peers->capacity;
 
-    if (rrp->peers->next && rrp->peers->next->number > n) {
-        n = rrp->peers->next->number;
+    if (rrp->peers->next && rrp->peers->next->capacity > n) {
+        n = rrp->peers->next->capacity;
     }
     // 小于32只需一个int记录所有rs状态
     if (n <= 8 * sizeof(uintptr_t)) { // 1bit表示一个peer
@@ -319,6 +348,7 @@ ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
 
     peers->single = (ur->naddrs == 1);
     peers->number = ur->naddrs;
+    peers->capacity = ur->naddrs;
     peers->name = &ur->host;
 
     if (ur->sockaddr) {
@@ -368,6 +398,8 @@ ngx_http_upstream_create_round_robin_peer(ngx_http_request_t *r,
 
     rrp->peers = peers;
     rrp->current = 0;
+    rrp->counted = 0;
+    rrp->saturated = 0;
 
     if (rrp->peers->number <= 8 * sizeof(uintptr_t)) {
         rrp->tried = &rrp->data;
@@ -434,9 +466,19 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
     pc->cached = 0;
     pc->connection = NULL;
 
+    ngx_http_upstream_rr_peers_lock(rrp->peers);
+
     if (rrp->peers->single) {
         peer = &rrp->peers->peer[0];
 
+        if (peer->down || ngx_http_upstream_rr_peer_saturated(peer)) {
+            ngx_http_upstream_rr_peers_unlock(rrp->peers);
+
+            pc->name = rrp->peers->name;
+
+            return NGX_BUSY;
+        }
+
     } else {
 
         /* there are several peers */
@@ -451,12 +493,15 @@ ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc, void *data)
                        "get rr peer, current: %ui %i",
                        rrp->current, peer->current_weight);
     }
+
+    ngx_http_upstream_rr_peer_acquire(rrp, peer);
+
     // 成功选取到一台非backup服务器
     pc->sockaddr = peer->sockaddr;
     pc->socklen = peer->socklen;
     pc->name = &peer->name;
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
     // tries == 1 表示尝试连接非backup后端服务器只剩最后一台，后面要尝试连接backup服务器
     if (pc->tries == 1 && rrp->peers->next) {
         pc->tries += rrp->peers->next->number;
@@ -470,7 +515,7 @@ failed:
 
     if (peers->next) {
 
-        /* ngx_unlock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_unlock(peers);
 
         ngx_log_debug0(NGX_LOG_DEBUG_HTTP, pc->log, 0, "backup servers");
 
@@ -478,7 +523,9 @@ failed:
         pc->tries = rrp->peers->number;
 
         // 设置backup服务器位图清0
-        n = rrp->peers->number / (8 * sizeof(uintptr_t)) + 1;
+        n = (rrp->peers->capacity + (8 * sizeof(uintptr_t) - 1))
+                / (8 * sizeof(uintptr_t));
+
         for (i = 0; i < n; i++) {
              rrp->tried[i] = 0;
         }
@@ -489,16 +536,21 @@ failed:
             return rc;
         }
 
-        /* ngx_lock_mutex(peers->mutex); */
+        ngx_http_upstream_rr_peers_lock(peers);
     }
 
-    /* all peers failed, mark them as live for quick recovery */
+    /*
+     * all peers failed, mark them as live for quick recovery;
+     * peers skipped because of max_conns are busy rather than failed
+     */
 
-    for (i = 0; i < peers->number; i++) {
-        peers->peer[i].fails = 0;
+    if (!rrp->saturated) {
+        for (i = 0; i < peers->number; i++) {
+            peers->peer[i].fails = 0;
+        }
     }
 
-    /* ngx_unlock_mutex(peers->mutex); */
+    ngx_http_upstream_rr_peers_unlock(peers);
 
     pc->name = peers->name;
 
@@ -543,6 +595,11 @@ ngx_http_upstream_get_peer(ngx_http_upstream_rr_peer_data_t *rrp)
             continue;
         }
 
+        if (ngx_http_upstream_rr_peer_saturated(peer)) {
+            rrp->saturated = 1;
+            continue;
+        }
+
         peer->current_weight += peer->effective_weight; // 增加当前权重
         total += peer->effective_weight;
 
@@ -587,24 +644,37 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
     ngx_log_debug2(NGX_LOG_DEBUG_HTTP, pc->log, 0,
                    "free rr peer %ui %ui", pc->tries, state);
 
+    peer = &rrp->peers->peer[rrp->current];
+
+    ngx_http_upstream_rr_peers_lock(rrp->peers);
+
+    if (rrp->counted) {
+        rrp->counted = 0;
+        peer->conns--;
+
+        if (peer->max_conns && rrp->peers->adaptive_min) {
+            ngx_http_upstream_adapt_conns(rrp->peers, peer,
+                                          ngx_current_msec - rrp->start,
+                                          state & NGX_PEER_FAILED);
+        }
+    }
+
     if (state == 0 && pc->tries == 0) {
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
         return;
     }
 
     /* TODO: NGX_PEER_KEEPALIVE */
 
     if (rrp->peers->single) {
+        ngx_http_upstream_rr_peers_unlock(rrp->peers);
         pc->tries = 0;
         return;
     }
 
-    peer = &rrp->peers->peer[rrp->current];
-
     if (state & NGX_PEER_FAILED) {
         now = ngx_time();
 
-        /* ngx_lock_mutex(rrp->peers->mutex); */
-
         peer->fails++;
         peer->accessed = now;
         peer->checked = now;
@@ -621,8 +691,6 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
             peer->effective_weight = 0;
         }
 
-        /* ngx_unlock_mutex(rrp->peers->mutex); */
-
     } else {
 
         /* mark peer live if check passed */
@@ -636,7 +704,82 @@ ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc, void *data,
         pc->tries--;
     }
 
-    /* ngx_unlock_mutex(rrp->peers->mutex); */
+    ngx_http_upstream_rr_peers_unlock(rrp->peers);
+}
+
+
+void
+ngx_http_upstream_rr_peer_acquire(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer)
+{
+    /* called with the peers locked */
+
+    peer->conns++;
+
+    rrp->counted = 1;
+    rrp->start = ngx_current_msec;
+}
+
+
+/*
+ * AIMD on the time connections to a peer are held: once per window of
+ * conns_limit responses the limit is increased by one while the smoothed
+ * time stays within adaptive_tolerance times the baseline, and is reduced
+ * proportionally to the latency gradient otherwise; errors reduce it
+ * by a quarter at once
+ */
+
+static void
+ngx_http_upstream_adapt_conns(ngx_http_upstream_rr_peers_t *peers,
+    ngx_http_upstream_rr_peer_t *peer, ngx_msec_t rtt, ngx_uint_t failed)
+{
+    ngx_uint_t  limit;
+
+    limit = peer->conns_limit;
+
+    if (failed) {
+        limit -= limit / 4;
+        goto done;
+    }
+
+    if (rtt == 0) {
+        rtt = 1;
+    }
+
+    if (peer->rtt_min == 0 || rtt < peer->rtt_min) {
+        peer->rtt_min = rtt;
+    }
+
+    peer->rtt = peer->rtt ? (7 * peer->rtt + rtt) / 8 : rtt;
+
+    if (++peer->samples < limit) {
+        return;
+    }
+
+    peer->samples = 0;
+
+    if (peer->rtt <= peer->rtt_min * peers->adaptive_tolerance) {
+        limit++;
+
+    } else {
+        limit = limit * peer->rtt_min * peers->adaptive_tolerance / peer->rtt;
+
+        /* let the baseline follow lasting latency changes */
+
+        peer->rtt_min += (peer->rtt - peer->rtt_min) / 64;
+    }
+
+done:
+
+    if (limit < peers->adaptive_min) {
+        limit = peers->adaptive_min;
+    }
+
+    if (limit > peer->max_conns) {
+        limit = peer->max_conns;
+    }
+
+    peer->conns_limit = limit;
 }
 
 
@@ -652,6 +795,11 @@ ngx_http_upstream_set_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_ssl_session_t            *ssl_session;
     ngx_http_upstream_rr_peer_t  *peer;
 
+    if (rrp->peers->shpool) {
+        /* sessions are local to a process */
+        return NGX_OK;
+    }
+
     peer = &rrp->peers->peer[rrp->current];
 
     /* TODO: threads only mutex */
@@ -680,6 +828,10 @@ ngx_http_upstream_save_round_robin_peer_session(ngx_peer_connection_t *pc,
     ngx_ssl_session_t            *old_ssl_session, *ssl_session;
     ngx_http_upstream_rr_peer_t  *peer;
 
+    if (rrp->peers->shpool) {
+        return;
+    }
+
     ssl_session = ngx_ssl_get_session(pc->connection);
 
     if (ssl_session == NULL) {
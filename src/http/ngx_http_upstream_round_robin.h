@@ -30,7 +30,19 @@ typedef struct {
     ngx_uint_t                      max_fails; // 默认0无限制
     time_t                          fail_timeout;
 
+    ngx_uint_t                      conns; // 当前活跃连接数
+    ngx_uint_t                      max_conns; // 默认0无限制
+    ngx_uint_t                      conns_limit; // 不超过max_conns
+
+    ngx_msec_t                      rtt; // 平滑后的连接占用时间
+    ngx_msec_t                      rtt_min;
+    ngx_uint_t                      samples;
+
     ngx_uint_t                      down;          /* unsigned  down:1; */
+    ngx_uint_t                      drain;         /* unsigned  drain:1; */
+    ngx_uint_t                      removed;       /* unsigned  removed:1; */
+
+    ngx_http_upstream_server_t     *server; // 配置中的server，运行时添加的为NULL
 
 #if (NGX_HTTP_SSL)
     ngx_ssl_session_t              *ssl_session;   /* local to a process */
@@ -42,13 +54,19 @@ typedef struct ngx_http_upstream_rr_peers_s  ngx_http_upstream_rr_peers_t;
 
 struct ngx_http_upstream_rr_peers_s {
     ngx_uint_t                      number; // peer长度
+    ngx_uint_t                      capacity; // peer数组长度，zone中可运行时增加
     ngx_uint_t                      last_cached; // cached最后元素位置
 
+    ngx_slab_pool_t                *shpool; // 由upstream zone指令设置
+
  /* ngx_mutex_t                    *mutex; */
     ngx_connection_t              **cached;
 
     ngx_uint_t                      total_weight;
 
+    ngx_uint_t                      adaptive_min;
+    ngx_uint_t                      adaptive_tolerance;
+
     unsigned                        single:1; // 只有一台非backup的rs
     unsigned                        weighted:1; // peer是否设置有weight
 
@@ -65,9 +83,30 @@ typedef struct {
     ngx_uint_t                      current; // peers->peer偏移下标
     uintptr_t                      *tried; // 位图，表示是否已经尝试连接过
     uintptr_t                       data;
+    ngx_uint_t                      counted; // current的conns已经加1
+    ngx_uint_t                      saturated; // 有peer因max_conns被跳过
+    ngx_msec_t                      start;
 } ngx_http_upstream_rr_peer_data_t;
 
 
+#define ngx_http_upstream_rr_peers_lock(peers)                                \
+    do {                                                                      \
+        if ((peers)->shpool) {                                                \
+            ngx_shmtx_lock(&(peers)->shpool->mutex);                          \
+        }                                                                     \
+    } while (0)
+
+#define ngx_http_upstream_rr_peers_unlock(peers)                              \
+    do {                                                                      \
+        if ((peers)->shpool) {                                                \
+            ngx_shmtx_unlock(&(peers)->shpool->mutex);                        \
+        }                                                                     \
+    } while (0)
+
+#define ngx_http_upstream_rr_peer_saturated(peer)                             \
+    ((peer)->max_conns && (peer)->conns >= (peer)->conns_limit)
+
+
 ngx_int_t ngx_http_upstream_init_round_robin(ngx_conf_t *cf,
     ngx_http_upstream_srv_conf_t *us);
 ngx_int_t ngx_http_upstream_init_round_robin_peer(ngx_http_request_t *r,
@@ -78,6 +117,8 @@ ngx_int_t ngx_http_upstream_get_round_robin_peer(ngx_peer_connection_t *pc,
     void *data);
 void ngx_http_upstream_free_round_robin_peer(ngx_peer_connection_t *pc,
     void *data, ngx_uint_t state);
+void ngx_http_upstream_rr_peer_acquire(ngx_http_upstream_rr_peer_data_t *rrp,
+    ngx_http_upstream_rr_peer_t *peer);
 
 #if (NGX_HTTP_SSL)
 ngx_int_t
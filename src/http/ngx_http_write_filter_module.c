@@ -53,6 +53,9 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_chain_t               *cl, *ln, **ll, *chain;
     ngx_connection_t          *c;
     ngx_http_core_loc_conf_t  *clcf;
+#if (NGX_HTTP_LIMIT_BANDWIDTH)
+    ngx_int_t                  rc;
+#endif
 
     c = r->connection;
 
@@ -230,6 +233,21 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
         limit = clcf->sendfile_max_chunk;
     }
 
+#if (NGX_HTTP_LIMIT_BANDWIDTH)
+
+    rc = ngx_http_limit_bandwidth_acquire(r, size, &limit);
+
+    if (rc == NGX_AGAIN) {
+        /* the limit_bandwidth module wakes the writer up */
+
+        c->write->delayed = 1;
+        c->buffered |= NGX_HTTP_WRITE_BUFFERED;
+
+        return NGX_AGAIN;
+    }
+
+#endif
+
     sent = c->sent;
 
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
@@ -240,6 +258,14 @@ ngx_http_write_filter(ngx_http_request_t *r, ngx_chain_t *in)
     ngx_log_debug1(NGX_LOG_DEBUG_HTTP, c->log, 0,
                    "http write filter %p", chain);
 
+#if (NGX_HTTP_LIMIT_BANDWIDTH)
+
+    if (rc == NGX_OK) {
+        ngx_http_limit_bandwidth_release(r, c->sent - sent);
+    }
+
+#endif
+
     if (chain == NGX_CHAIN_ERROR) {
         c->error = 1;
         return NGX_ERROR;
@@ -46,6 +46,7 @@ typedef int               ngx_err_t;
 #define NGX_EHOSTDOWN     EHOSTDOWN
 #define NGX_EHOSTUNREACH  EHOSTUNREACH
 #define NGX_ENOSYS        ENOSYS
+#define NGX_EOPNOTSUPP    EOPNOTSUPP
 #define NGX_ECANCELED     ECANCELED
 #define NGX_EILSEQ        EILSEQ
 #define NGX_ENOMOREFILES  0
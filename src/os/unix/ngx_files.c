@@ -146,6 +146,27 @@ ngx_open_tempfile(u_char *name, ngx_uint_t persistent, ngx_uint_t access)
 }
 
 
+#if (NGX_HAVE_O_TMPFILE)
+
+ngx_int_t
+ngx_link_unnamed_file(ngx_fd_t fd, u_char *to)
+{
+    u_char  path[sizeof("/proc/self/fd/") + NGX_INT_T_LEN];
+
+    /*
+     * linkat(AT_EMPTY_PATH) requires the CAP_DAC_READ_SEARCH capability,
+     * so the file is linked through its /proc descriptor link instead
+     */
+
+    (void) ngx_sprintf(path, "/proc/self/fd/%d%Z", fd);
+
+    return linkat(AT_FDCWD, (const char *) path, AT_FDCWD, (const char *) to,
+                  AT_SYMLINK_FOLLOW);
+}
+
+#endif
+
+
 #define NGX_IOVS  8
 
 ssize_t
@@ -306,6 +327,60 @@ failed:
 }
 
 
+/* a read-only mapping of an existing file, NGX_DECLINED if there is none */
+
+ngx_int_t
+ngx_open_file_mapping(ngx_file_mapping_t *fm)
+{
+    ngx_err_t        err;
+    ngx_file_info_t  fi;
+
+    fm->fd = ngx_open_file(fm->name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fm->fd == NGX_INVALID_FILE) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT) {
+            return NGX_DECLINED;
+        }
+
+        ngx_log_error(NGX_LOG_CRIT, fm->log, err,
+                      ngx_open_file_n " \"%s\" failed", fm->name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(fm->fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                      ngx_fd_info_n " \"%s\" failed", fm->name);
+        goto failed;
+    }
+
+    fm->size = (size_t) ngx_file_size(&fi);
+
+    if (fm->size == 0) {
+        ngx_log_error(NGX_LOG_CRIT, fm->log, 0,
+                      "empty file \"%s\" cannot be mapped", fm->name);
+        goto failed;
+    }
+
+    fm->addr = mmap(NULL, fm->size, PROT_READ, MAP_SHARED, fm->fd, 0);
+    if (fm->addr != MAP_FAILED) {
+        return NGX_OK;
+    }
+
+    ngx_log_error(NGX_LOG_CRIT, fm->log, ngx_errno,
+                  "mmap(%uz) \"%s\" failed", fm->size, fm->name);
+
+failed:
+
+    if (ngx_close_file(fm->fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, fm->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", fm->name);
+    }
+
+    return NGX_ERROR;
+}
+
+
 void
 ngx_close_file_mapping(ngx_file_mapping_t *fm)
 {
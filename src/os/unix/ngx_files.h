@@ -114,6 +114,27 @@ ngx_fd_t ngx_open_tempfile(u_char *name, ngx_uint_t persistent,
 #define ngx_open_tempfile_n      "open()"
 
 
+#if (NGX_HAVE_O_TMPFILE)
+
+#define ngx_open_unnamed_tempfile(dir, access)                               \
+    open((const char *) dir, O_TMPFILE|O_RDWR, access ? access : 0600)
+#define ngx_open_unnamed_tempfile_n  "open(O_TMPFILE)"
+
+ngx_int_t ngx_link_unnamed_file(ngx_fd_t fd, u_char *to);
+#define ngx_link_unnamed_file_n  "linkat()"
+
+#endif
+
+
+#if (NGX_HAVE_FALLOCATE)
+
+#define ngx_preallocate_file(fd, size)                                       \
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, size)
+#define ngx_preallocate_file_n   "fallocate()"
+
+#endif
+
+
 ssize_t ngx_read_file(ngx_file_t *file, u_char *buf, size_t size, off_t offset);
 #if (NGX_HAVE_PREAD)
 #define ngx_read_file_n          "pread()"
@@ -186,6 +207,7 @@ ngx_int_t ngx_set_file_time(u_char *name, ngx_fd_t fd, time_t s);
 
 
 ngx_int_t ngx_create_file_mapping(ngx_file_mapping_t *fm);
+ngx_int_t ngx_open_file_mapping(ngx_file_mapping_t *fm);
 void ngx_close_file_mapping(ngx_file_mapping_t *fm);
 
 
@@ -30,6 +30,7 @@ static ngx_thread_value_t ngx_worker_thread_cycle(void *data);
 static void ngx_cache_manager_process_cycle(ngx_cycle_t *cycle, void *data);
 static void ngx_cache_manager_process_handler(ngx_event_t *ev);
 static void ngx_cache_loader_process_handler(ngx_event_t *ev);
+static void ngx_cache_prefetch_process_handler(ngx_event_t *ev);
 
 
 ngx_uint_t    ngx_process; // 进程模式
@@ -76,6 +77,10 @@ static ngx_cache_manager_ctx_t  ngx_cache_loader_ctx = {
     ngx_cache_loader_process_handler, "cache loader process", 60000
 };
 
+static ngx_cache_manager_ctx_t  ngx_cache_prefetch_ctx = {
+    ngx_cache_prefetch_process_handler, "cache prefetch process", 1000
+};
+
 
 static ngx_cycle_t      ngx_exit_cycle;
 static ngx_log_t        ngx_exit_log;
@@ -398,12 +403,13 @@ ngx_start_worker_processes(ngx_cycle_t *cycle, ngx_int_t n, ngx_int_t type)
 static void
 ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 {
-    ngx_uint_t       i, manager, loader;
+    ngx_uint_t       i, manager, loader, prefetch;
     ngx_path_t     **path;
     ngx_channel_t    ch;
 
     manager = 0;
     loader = 0;
+    prefetch = 0;
 
     path = ngx_cycle->paths.elts;
     for (i = 0; i < ngx_cycle->paths.nelts; i++) {
@@ -415,6 +421,10 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
         if (path[i]->loader) {
             loader = 1;
         }
+
+        if (path[i]->prefetch) {
+            prefetch = 1;
+        }
     }
 
     if (manager == 0) {
@@ -432,20 +442,33 @@ ngx_start_cache_manager_processes(ngx_cycle_t *cycle, ngx_uint_t respawn)
 
     ngx_pass_open_channel(cycle, &ch);
 
-    if (loader == 0) {
-        return;
+    if (loader) {
+        ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
+                          &ngx_cache_loader_ctx, "cache loader process",
+                          respawn ? NGX_PROCESS_JUST_SPAWN
+                                  : NGX_PROCESS_NORESPAWN);
+
+        ch.command = NGX_CMD_OPEN_CHANNEL;
+        ch.pid = ngx_processes[ngx_process_slot].pid;
+        ch.slot = ngx_process_slot;
+        ch.fd = ngx_processes[ngx_process_slot].channel[0];
+
+        ngx_pass_open_channel(cycle, &ch);
     }
 
-    ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
-                      &ngx_cache_loader_ctx, "cache loader process",
-                      respawn ? NGX_PROCESS_JUST_SPAWN : NGX_PROCESS_NORESPAWN);
+    if (prefetch) {
+        ngx_spawn_process(cycle, ngx_cache_manager_process_cycle,
+                          &ngx_cache_prefetch_ctx, "cache prefetch process",
+                          respawn ? NGX_PROCESS_JUST_SPAWN
+                                  : NGX_PROCESS_NORESPAWN);
 
-    ch.command = NGX_CMD_OPEN_CHANNEL;
-    ch.pid = ngx_processes[ngx_process_slot].pid;
-    ch.slot = ngx_process_slot;
-    ch.fd = ngx_processes[ngx_process_slot].channel[0];
+        ch.command = NGX_CMD_OPEN_CHANNEL;
+        ch.pid = ngx_processes[ngx_process_slot].pid;
+        ch.slot = ngx_process_slot;
+        ch.fd = ngx_processes[ngx_process_slot].channel[0];
 
-    ngx_pass_open_channel(cycle, &ch);
+        ngx_pass_open_channel(cycle, &ch);
+    }
 }
 
 // 广播消息给所有进程
@@ -1405,3 +1428,40 @@ ngx_cache_loader_process_handler(ngx_event_t *ev)
 
     exit(0);
 }
+
+
+static void
+ngx_cache_prefetch_process_handler(ngx_event_t *ev)
+{
+    ngx_msec_t     next, n;
+    ngx_uint_t     i;
+    ngx_path_t   **path;
+    ngx_cycle_t   *cycle;
+
+    cycle = (ngx_cycle_t *) ngx_cycle;
+
+    next = 0;
+
+    path = cycle->paths.elts;
+    for (i = 0; i < cycle->paths.nelts; i++) {
+
+        if (path[i]->prefetch == NULL) {
+            continue;
+        }
+
+        n = path[i]->prefetch(path[i]->data);
+
+        if (n == 0) {
+            path[i]->prefetch = NULL;
+            continue;
+        }
+
+        next = (next == 0 || n < next) ? n : next;
+    }
+
+    if (next == 0) {
+        exit(0);
+    }
+
+    ngx_add_timer(ev, next);
+}